@@ -0,0 +1,880 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "CaptureCompressor.h"
+#include "GeminiPacket.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int LANES = FrameCodec::LANES;
+    const int BLOCK_FRAMES = FrameCodec::BLOCK_FRAMES;
+
+    inline int bitWidth(uint32_t value)
+    {
+        return value != 0 ? 32 - __builtin_clz(value) : 0;
+    }
+
+    inline uint16_t zigzag(int16_t value)
+    {
+        return (uint16_t) (((uint16_t) value << 1) ^ (uint16_t) (value >> 15));
+    }
+
+    inline int16_t unzigzag(uint16_t value)
+    {
+        return (int16_t) ((value >> 1) ^ (uint16_t) -(int16_t) (value & 1));
+    }
+
+    // ------------------------------------------------------------
+    //                       scalar kernels
+    // ------------------------------------------------------------
+
+    // bit plane k of the 16 lanes goes out as a little-endian uint16, lane 0 in bit 0
+    uint8_t* packScalar(const uint16_t* values, int width, uint8_t* out)
+    {
+        for (int k = 0; k < width; k++)
+        {
+            uint32_t plane = 0;
+
+            for (int lane = 0; lane < LANES; lane++)
+                plane |= (uint32_t) ((values[lane] >> k) & 1) << lane;
+
+            out[0] = (uint8_t) plane;
+            out[1] = (uint8_t) (plane >> 8);
+            out += 2;
+        }
+
+        return out;
+    }
+
+    const uint8_t* unpackScalar(const uint8_t* in, int width, uint16_t* values)
+    {
+        for (int lane = 0; lane < LANES; lane++)
+            values[lane] = 0;
+
+        for (int k = 0; k < width; k++)
+        {
+            const uint32_t plane = in[0] | (uint32_t) in[1] << 8;
+
+            for (int lane = 0; lane < LANES; lane++)
+                values[lane] |= (uint16_t) (((plane >> lane) & 1) << k);
+
+            in += 2;
+        }
+
+        return in;
+    }
+
+    size_t encodeScalar(const uint8_t* payload, int numChannels, int numSamples, int16_t* previous, uint8_t* out)
+    {
+        const int groups = (numChannels + LANES - 1) / LANES;
+        uint8_t* p = out;
+
+        for (int first = 0; first < numSamples; first += BLOCK_FRAMES)
+        {
+            const int frames = std::min(BLOCK_FRAMES, numSamples - first);
+
+            uint8_t* widths = p;
+            p += groups;
+
+            for (int g = 0; g < groups; g++)
+            {
+                const int lanes = std::min(LANES, numChannels - g * LANES);
+                int16_t* prev = previous + g * LANES;
+
+                uint16_t residuals[BLOCK_FRAMES][LANES] = {};
+                uint32_t any = 0;
+
+                for (int f = 0; f < frames; f++)
+                {
+                    const uint8_t* row = payload + 2 * ((size_t) (first + f) * numChannels + g * LANES);
+
+                    for (int lane = 0; lane < lanes; lane++)
+                    {
+                        int16_t sample;
+                        memcpy(&sample, row + 2 * lane, sizeof(sample));
+
+                        residuals[f][lane] = zigzag((int16_t) (sample - prev[lane]));
+                        any |= residuals[f][lane];
+                        prev[lane] = sample;
+                    }
+                }
+
+                const int width = bitWidth(any);
+                widths[g] = (uint8_t) width;
+
+                for (int f = 0; f < frames; f++)
+                    p = packScalar(residuals[f], width, p);
+            }
+        }
+
+        return (size_t) (p - out);
+    }
+
+    size_t decodeScalar(const uint8_t* in, size_t available, int numChannels, int numSamples, int16_t* previous, uint8_t* payload)
+    {
+        const int groups = (numChannels + LANES - 1) / LANES;
+        const uint8_t* p = in;
+        const uint8_t* end = in + available;
+
+        for (int first = 0; first < numSamples; first += BLOCK_FRAMES)
+        {
+            const int frames = std::min(BLOCK_FRAMES, numSamples - first);
+
+            if (end - p < groups)
+                return 0;
+
+            const uint8_t* widths = p;
+            p += groups;
+
+            for (int g = 0; g < groups; g++)
+            {
+                const int width = widths[g];
+
+                if (width > 16 || end - p < (ptrdiff_t) frames * 2 * width)
+                    return 0;
+
+                const int lanes = std::min(LANES, numChannels - g * LANES);
+                int16_t* prev = previous + g * LANES;
+
+                for (int f = 0; f < frames; f++)
+                {
+                    uint16_t residuals[LANES];
+                    p = unpackScalar(p, width, residuals);
+
+                    uint8_t* row = payload + 2 * ((size_t) (first + f) * numChannels + g * LANES);
+
+                    for (int lane = 0; lane < lanes; lane++)
+                    {
+                        prev[lane] = (int16_t) (prev[lane] + unzigzag(residuals[lane]));
+                        memcpy(row + 2 * lane, &prev[lane], sizeof(int16_t));
+                    }
+                }
+            }
+        }
+
+        return (size_t) (p - in);
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    // ------------------------------------------------------------
+    //                        AVX2 kernels
+    // ------------------------------------------------------------
+
+    __attribute__((target("avx2"), always_inline))
+    inline __m256i loadGroup(const uint8_t* row, int lanes)
+    {
+        if (lanes == LANES)
+            return _mm256_loadu_si256((const __m256i*) row);
+
+        int16_t padded[LANES] = {};
+        memcpy(padded, row, 2 * lanes);
+        return _mm256_loadu_si256((const __m256i*) padded);
+    }
+
+    __attribute__((target("avx2"), always_inline))
+    inline void storeGroup(uint8_t* row, int lanes, __m256i values)
+    {
+        if (lanes == LANES)
+        {
+            _mm256_storeu_si256((__m256i*) row, values);
+            return;
+        }
+
+        int16_t padded[LANES];
+        _mm256_storeu_si256((__m256i*) padded, values);
+        memcpy(row, padded, 2 * lanes);
+    }
+
+    __attribute__((target("avx2"), always_inline))
+    inline uint8_t* packAVX2(__m256i values, int width, uint8_t* out)
+    {
+        // two planes per pass: move bit k (and k + 1) to the sign of each lane, saturate to
+        // bytes and collect the signs; packs works within 128-bit halves, hence the shuffling
+        for (int k = 0; k < width; k += 2)
+        {
+            const __m256i low = _mm256_srai_epi16(_mm256_sll_epi16(values, _mm_cvtsi32_si128(15 - k)), 15);
+            const __m256i high = k + 1 < width
+                ? _mm256_srai_epi16(_mm256_sll_epi16(values, _mm_cvtsi32_si128(14 - k)), 15)
+                : low;
+
+            const uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_packs_epi16(low, high));
+
+            const uint32_t planeLow = (mask & 0xFF) | ((mask >> 8) & 0xFF00);
+            out[0] = (uint8_t) planeLow;
+            out[1] = (uint8_t) (planeLow >> 8);
+
+            if (k + 1 < width)
+            {
+                const uint32_t planeHigh = ((mask >> 8) & 0xFF) | ((mask >> 16) & 0xFF00);
+                out[2] = (uint8_t) planeHigh;
+                out[3] = (uint8_t) (planeHigh >> 8);
+            }
+
+            out += k + 1 < width ? 4 : 2;
+        }
+
+        return out;
+    }
+
+    __attribute__((target("avx2"), always_inline))
+    inline __m256i unpackAVX2(const uint8_t* in, int width)
+    {
+        const __m256i select = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+            1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, (short) (1 << 15));
+
+        __m256i values = _mm256_setzero_si256();
+
+        // most significant plane first, shifting the result up one bit per plane
+        for (int k = width - 1; k >= 0; k--)
+        {
+            const __m256i plane = _mm256_set1_epi16((short) (in[2 * k] | in[2 * k + 1] << 8));
+            const __m256i set = _mm256_cmpeq_epi16(_mm256_and_si256(plane, select), select);
+
+            values = _mm256_or_si256(_mm256_slli_epi16(values, 1), _mm256_srli_epi16(set, 15));
+        }
+
+        return values;
+    }
+
+    __attribute__((target("avx2")))
+    size_t encodeAVX2(const uint8_t* payload, int numChannels, int numSamples, int16_t* previous, uint8_t* out)
+    {
+        const int groups = (numChannels + LANES - 1) / LANES;
+        uint8_t* p = out;
+
+        for (int first = 0; first < numSamples; first += BLOCK_FRAMES)
+        {
+            const int frames = std::min(BLOCK_FRAMES, numSamples - first);
+
+            uint8_t* widths = p;
+            p += groups;
+
+            for (int g = 0; g < groups; g++)
+            {
+                const int lanes = std::min(LANES, numChannels - g * LANES);
+
+                __m256i prev = _mm256_loadu_si256((const __m256i*) (previous + g * LANES));
+                __m256i residuals[BLOCK_FRAMES];
+                __m256i any = _mm256_setzero_si256();
+
+                for (int f = 0; f < frames; f++)
+                {
+                    const __m256i sample = loadGroup(payload + 2 * ((size_t) (first + f) * numChannels + g * LANES), lanes);
+                    const __m256i delta = _mm256_sub_epi16(sample, prev);
+
+                    residuals[f] = _mm256_xor_si256(_mm256_slli_epi16(delta, 1), _mm256_srai_epi16(delta, 15));
+                    any = _mm256_or_si256(any, residuals[f]);
+                    prev = sample;
+                }
+
+                _mm256_storeu_si256((__m256i*) (previous + g * LANES), prev);
+
+                __m128i folded = _mm_or_si128(_mm256_castsi256_si128(any), _mm256_extracti128_si256(any, 1));
+                folded = _mm_or_si128(folded, _mm_srli_si128(folded, 8));
+                folded = _mm_or_si128(folded, _mm_srli_si128(folded, 4));
+                folded = _mm_or_si128(folded, _mm_srli_si128(folded, 2));
+
+                const int width = bitWidth((uint16_t) _mm_cvtsi128_si32(folded));
+                widths[g] = (uint8_t) width;
+
+                for (int f = 0; f < frames; f++)
+                    p = packAVX2(residuals[f], width, p);
+            }
+        }
+
+        return (size_t) (p - out);
+    }
+
+    __attribute__((target("avx2")))
+    size_t decodeAVX2(const uint8_t* in, size_t available, int numChannels, int numSamples, int16_t* previous, uint8_t* payload)
+    {
+        const int groups = (numChannels + LANES - 1) / LANES;
+        const uint8_t* p = in;
+        const uint8_t* end = in + available;
+        const __m256i one = _mm256_set1_epi16(1);
+
+        for (int first = 0; first < numSamples; first += BLOCK_FRAMES)
+        {
+            const int frames = std::min(BLOCK_FRAMES, numSamples - first);
+
+            if (end - p < groups)
+                return 0;
+
+            const uint8_t* widths = p;
+            p += groups;
+
+            for (int g = 0; g < groups; g++)
+            {
+                const int width = widths[g];
+
+                if (width > 16 || end - p < (ptrdiff_t) frames * 2 * width)
+                    return 0;
+
+                const int lanes = std::min(LANES, numChannels - g * LANES);
+                __m256i prev = _mm256_loadu_si256((const __m256i*) (previous + g * LANES));
+
+                for (int f = 0; f < frames; f++)
+                {
+                    const __m256i residual = unpackAVX2(p, width);
+                    p += 2 * width;
+
+                    const __m256i delta = _mm256_xor_si256(_mm256_srli_epi16(residual, 1),
+                        _mm256_sub_epi16(_mm256_setzero_si256(), _mm256_and_si256(residual, one)));
+
+                    prev = _mm256_add_epi16(prev, delta);
+                    storeGroup(payload + 2 * ((size_t) (first + f) * numChannels + g * LANES), lanes, prev);
+                }
+
+                _mm256_storeu_si256((__m256i*) (previous + g * LANES), prev);
+            }
+        }
+
+        return (size_t) (p - in);
+    }
+
+#endif
+
+    bool writeAll(int fd, const void* data, size_t size)
+    {
+        const uint8_t* p = (const uint8_t*) data;
+
+        while (size > 0)
+        {
+            const ssize_t written = write(fd, p, size);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return false;
+
+            p += written;
+            size -= (size_t) written;
+        }
+
+        return true;
+    }
+
+    /** True for a datagram FrameCodec can store: a valid int16 packet with nothing after its samples */
+    bool isPackable(const uint8_t* datagram, uint32_t length, GeminiPacket::Header& packet)
+    {
+        return GeminiPacket::parseHeader(datagram, length, packet) == GeminiPacket::ParseResult::OK
+            && packet.sample_format == GeminiPacket::INT16
+            && !GeminiPacket::hasDigitalInputs(packet)
+            && length == GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(packet);
+    }
+}
+
+// ------------------------------------------------------------
+//                          FrameCodec
+// ------------------------------------------------------------
+
+FrameCodec::FrameCodec()
+{
+    encodeKernel = &encodeScalar;
+    decodeKernel = &decodeScalar;
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        encodeKernel = &encodeAVX2;
+        decodeKernel = &decodeAVX2;
+        instructionSet = "AVX2";
+    }
+#endif
+}
+
+void FrameCodec::reset(int numChannels_)
+{
+    numChannels = numChannels_;
+    previous.assign((size_t) (numChannels + LANES - 1) / LANES * LANES, 0);
+}
+
+size_t FrameCodec::maxEncodedSize(int numChannels, int numSamples)
+{
+    const size_t groups = (size_t) (numChannels + LANES - 1) / LANES;
+    const size_t blocks = (size_t) (numSamples + BLOCK_FRAMES - 1) / BLOCK_FRAMES;
+
+    return blocks * groups + (size_t) numSamples * groups * 2 * 16;
+}
+
+size_t FrameCodec::encode(const uint8_t* payload, int numSamples, uint8_t* out)
+{
+    return encodeKernel(payload, numChannels, numSamples, previous.data(), out);
+}
+
+size_t FrameCodec::decode(const uint8_t* in, size_t available, int numSamples, uint8_t* payload)
+{
+    return decodeKernel(in, available, numChannels, numSamples, previous.data(), payload);
+}
+
+// ------------------------------------------------------------
+//                       CaptureCompressor
+// ------------------------------------------------------------
+
+CaptureCompressor::CaptureCompressor()
+{
+}
+
+CaptureCompressor::~CaptureCompressor()
+{
+    stop();
+}
+
+void CaptureCompressor::start(int numThreads)
+{
+    if (isRunning())
+        return;
+
+    stopping = false;
+
+    for (int i = 0; i < std::max(1, numThreads); i++)
+        workers.emplace_back(&CaptureCompressor::run, this);
+}
+
+void CaptureCompressor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopping = true;
+    }
+
+    queueChanged.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+
+    workers.clear();
+}
+
+void CaptureCompressor::enqueue(const std::string& rawPath)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        queue.push_back(rawPath);
+    }
+
+    pending.fetch_add(1, std::memory_order_relaxed);
+    queueChanged.notify_one();
+}
+
+std::string CaptureCompressor::getStatus() const
+{
+    const uint64_t raw = getRawBytes();
+    const uint64_t stored = getStoredBytes();
+
+    char line[160];
+    snprintf(line, sizeof(line), "compressed=%llu pending=%llu failed=%llu ratio=%.2f",
+        (unsigned long long) getSegments(), (unsigned long long) getPending(), (unsigned long long) getFailures(),
+        stored > 0 ? (double) raw / stored : 0.0);
+
+    return line;
+}
+
+void CaptureCompressor::run()
+{
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), WORKER_NICE);
+
+    while (true)
+    {
+        std::string rawPath;
+
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+
+            // drain before stopping, so no segment is left raw
+            if (queue.empty())
+                return;
+
+            rawPath = queue.front();
+            queue.pop_front();
+        }
+
+        // '<prefix>_<segment>.gcap' becomes '<prefix>_<segment>.gcapz'
+        std::string outPath = rawPath;
+        const size_t extension = outPath.rfind(CaptureFile::EXTENSION);
+
+        if (extension != std::string::npos)
+            outPath.erase(extension);
+
+        outPath += CompressedFile::EXTENSION;
+
+        Result result;
+
+        if (compressFile(rawPath, outPath, &result))
+        {
+            unlink(rawPath.c_str());
+
+            rawBytes.fetch_add(result.rawBytes, std::memory_order_relaxed);
+            storedBytes.fetch_add(result.storedBytes, std::memory_order_relaxed);
+            segments.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            failures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        pending.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+bool CaptureCompressor::compressFile(const std::string& rawPath, const std::string& outPath, Result* result)
+{
+    using namespace CompressedFile;
+
+    CaptureReader reader;
+
+    if (!reader.open(rawPath))
+    {
+        errno = errno != 0 ? errno : EINVAL;
+        return false;
+    }
+
+    const std::string partPath = outPath + ".part";
+    const int fd = ::open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return false;
+
+    const CaptureFile::FileHeader& raw = reader.getHeader();
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.headerSize = sizeof(header);
+    header.port = raw.port;
+    header.stream = raw.stream;
+    header.segment = raw.segment;
+    header.createdNs = raw.createdNs;
+    header.recordCount = reader.size();
+
+    bool ok = writeAll(fd, &header, sizeof(header));
+
+    uint64_t offset = sizeof(header);
+    std::vector<ChunkEntry> chunks;
+    std::vector<uint8_t> buffer;
+    FrameCodec codec;
+
+    for (uint64_t first = 0; ok && first < reader.size(); first += CHUNK_RECORDS)
+    {
+        const uint64_t last = std::min<uint64_t>(reader.size(), first + CHUNK_RECORDS);
+
+        buffer.clear();
+        codec.reset(0);
+
+        for (uint64_t i = first; i < last; i++)
+        {
+            CaptureFile::RecordHeader record;
+            const uint8_t* datagram = reader.getRecord(i, record);
+            GeminiPacket::Header packet;
+
+            const bool packable = isPackable(datagram, record.length, packet);
+
+            const size_t at = buffer.size();
+            const size_t bound = packable
+                ? GeminiPacket::HEADER_SIZE + FrameCodec::maxEncodedSize(packet.num_channels, packet.num_samples)
+                : record.length;
+
+            buffer.resize(at + sizeof(PackedRecord) + bound);
+            uint8_t* stored = buffer.data() + at + sizeof(PackedRecord);
+
+            PackedRecord packed;
+            packed.receiveNs = record.receiveNs;
+            packed.length = record.length;
+            packed.flags = record.flags;
+            packed.reserved = 0;
+
+            if (packable)
+            {
+                // a layout change restarts the prediction
+                if (packet.num_channels != codec.getNumChannels())
+                    codec.reset(packet.num_channels);
+
+                memcpy(stored, datagram, GeminiPacket::HEADER_SIZE);
+                packed.storedLength = (uint32_t) (GeminiPacket::HEADER_SIZE
+                    + codec.encode(datagram + GeminiPacket::HEADER_SIZE, packet.num_samples, stored + GeminiPacket::HEADER_SIZE));
+                packed.flags |= FLAG_PACKED;
+            }
+            else
+            {
+                memcpy(stored, datagram, record.length);
+                packed.storedLength = record.length;
+            }
+
+            memcpy(buffer.data() + at, &packed, sizeof(packed));
+            buffer.resize(at + sizeof(PackedRecord) + packed.storedLength);
+
+            header.rawBytes += record.length;
+        }
+
+        ChunkEntry entry;
+        entry.sampleNumber = reader.getEntry(first).sampleNumber;
+        entry.firstRecord = first;
+        entry.offset = offset;
+        entry.bytes = buffer.size();
+        chunks.push_back(entry);
+
+        ok = writeAll(fd, buffer.data(), buffer.size());
+        offset += buffer.size();
+    }
+
+    header.chunkIndexOffset = offset;
+    header.chunkCount = chunks.size();
+
+    ok = ok && writeAll(fd, chunks.data(), chunks.size() * sizeof(ChunkEntry))
+        && pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)
+        && fdatasync(fd) == 0;
+
+    const int savedErrno = errno;
+    ::close(fd);
+
+    // only a complete file takes the final name
+    if (!ok || rename(partPath.c_str(), outPath.c_str()) < 0)
+    {
+        const int failure = ok ? errno : savedErrno;
+        unlink(partPath.c_str());
+        errno = failure;
+        return false;
+    }
+
+    if (result != nullptr)
+    {
+        result->records = header.recordCount;
+        result->rawBytes = header.rawBytes;
+        result->storedBytes = offset + chunks.size() * sizeof(ChunkEntry);
+    }
+
+    return true;
+}
+
+// ------------------------------------------------------------
+//                       CompressedReader
+// ------------------------------------------------------------
+
+const uint8_t* CompressedReader::Chunk::getRecord(size_t i, CaptureFile::RecordHeader& record) const
+{
+    const uint64_t offset = index[i].offset;
+
+    memcpy(&record, data.data() + offset, sizeof(record));
+
+    return data.data() + offset + sizeof(record);
+}
+
+CompressedReader::~CompressedReader()
+{
+    close();
+}
+
+bool CompressedReader::open(const std::string& path)
+{
+    using namespace CompressedFile;
+
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+
+    if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(FileHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+        return false;
+
+    base = (uint8_t*) mapping;
+    fileSize = (size_t) info.st_size;
+    header = (const FileHeader*) base;
+
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION
+        || header->chunkIndexOffset > fileSize
+        || header->chunkCount > (fileSize - header->chunkIndexOffset) / sizeof(ChunkEntry))
+    {
+        close();
+        return false;
+    }
+
+    chunks = (const ChunkEntry*) (base + header->chunkIndexOffset);
+
+    // replay walks chunks front to back
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+void CompressedReader::close()
+{
+    if (base != nullptr)
+        munmap(base, fileSize);
+
+    base = nullptr;
+    fileSize = 0;
+    header = nullptr;
+    chunks = nullptr;
+}
+
+uint64_t CompressedReader::findChunk(uint64_t sampleNumber) const
+{
+    uint64_t low = 0;
+    uint64_t high = getChunkCount();
+
+    while (low < high)
+    {
+        const uint64_t middle = low + (high - low) / 2;
+
+        if (chunks[middle].sampleNumber < sampleNumber)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // the chunk before the first one starting at or after the sample may still hold it
+    return low > 0 ? low - 1 : 0;
+}
+
+bool CompressedReader::readChunk(uint64_t chunk, Chunk& out)
+{
+    using namespace CompressedFile;
+
+    out.data.clear();
+    out.index.clear();
+
+    if (chunk >= getChunkCount())
+        return false;
+
+    const ChunkEntry& entry = chunks[chunk];
+
+    if (entry.offset > header->chunkIndexOffset || entry.bytes > header->chunkIndexOffset - entry.offset)
+        return false;
+
+    out.firstRecord = entry.firstRecord;
+
+    const uint8_t* p = base + entry.offset;
+    const uint8_t* end = p + entry.bytes;
+    uint64_t lastSampleNumber = entry.sampleNumber;
+
+    codec.reset(0);
+
+    while (p < end)
+    {
+        PackedRecord packed;
+
+        if ((size_t) (end - p) < sizeof(packed))
+            return false;
+
+        memcpy(&packed, p, sizeof(packed));
+        p += sizeof(packed);
+
+        if (packed.storedLength > (size_t) (end - p) || packed.length > GeminiPacket::MAX_PACKET_SIZE)
+            return false;
+
+        const size_t at = out.data.size();
+        out.data.resize(at + CaptureFile::recordSize(packed.length), 0);
+
+        CaptureFile::RecordHeader record;
+        record.receiveNs = packed.receiveNs;
+        record.length = packed.length;
+        record.flags = packed.flags & ~FLAG_PACKED;
+        memcpy(out.data.data() + at, &record, sizeof(record));
+
+        uint8_t* datagram = out.data.data() + at + sizeof(record);
+
+        if ((packed.flags & FLAG_PACKED) != 0)
+        {
+            GeminiPacket::Header packet;
+
+            if (packed.storedLength < GeminiPacket::HEADER_SIZE)
+                return false;
+
+            memcpy(datagram, p, GeminiPacket::HEADER_SIZE);
+
+            if (GeminiPacket::parseHeader(datagram, packed.length, packet) != GeminiPacket::ParseResult::OK
+                || packed.length != GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(packet))
+                return false;
+
+            if (packet.num_channels != codec.getNumChannels())
+                codec.reset(packet.num_channels);
+
+            const size_t used = codec.decode(p + GeminiPacket::HEADER_SIZE, packed.storedLength - GeminiPacket::HEADER_SIZE,
+                packet.num_samples, datagram + GeminiPacket::HEADER_SIZE);
+
+            if (used != packed.storedLength - GeminiPacket::HEADER_SIZE)
+                return false;
+
+            lastSampleNumber = packet.sample_number;
+        }
+        else
+        {
+            GeminiPacket::Header packet;
+
+            if (packed.storedLength != packed.length)
+                return false;
+
+            memcpy(datagram, p, packed.length);
+
+            // same rule as the raw index: invalid datagrams repeat the previous sample number
+            if ((record.flags & CaptureFile::FLAG_INVALID) == 0
+                && GeminiPacket::parseHeader(datagram, packed.length, packet) == GeminiPacket::ParseResult::OK)
+                lastSampleNumber = packet.sample_number;
+        }
+
+        out.index.push_back({ lastSampleNumber, at });
+        p += packed.storedLength;
+    }
+
+    return true;
+}
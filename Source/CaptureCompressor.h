@@ -0,0 +1,326 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef CAPTURECOMPRESSOR_H_DEFINED
+#define CAPTURECOMPRESSOR_H_DEFINED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PacketCapture.h"
+
+namespace GeminiThreadNode {
+
+/**
+    On-disk format of a compressed capture segment.
+
+    A compressed segment holds the same records as the raw segment it was
+    made from, in the same order, grouped into chunks of CHUNK_RECORDS
+    records. Chunks decode independently, and the chunk index at the end
+    of the file carries the sample number and record number each chunk
+    starts at, so a reader can seek by either and only decode one chunk.
+
+        offset            contents
+        0                 FileHeader
+        64                PackedRecord + stored bytes, repeated, per chunk
+        chunkIndexOffset  ChunkEntry per chunk
+
+    Int16 packets whose length matches their header are stored as the
+    24-byte packet header followed by the FrameCodec encoding of the
+    payload, and flagged FLAG_PACKED. Everything else is stored verbatim.
+    All fields are little-endian.
+*/
+namespace CompressedFile {
+
+    const char MAGIC[8] = { 'G', 'M', 'N', 'I', 'C', 'P', 'Z', '1' };
+    const uint32_t VERSION = 1;
+    const char* const EXTENSION = ".gcapz";
+
+    /** Records per chunk; a second of 30-sample packets at 30 kHz */
+    const uint32_t CHUNK_RECORDS = 1024;
+
+    /** Record flag: the payload is FrameCodec-encoded. CaptureFile flags keep their meaning. */
+    const uint32_t FLAG_PACKED = 1 << 16;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint16_t port;
+        uint16_t stream;
+        uint32_t segment;
+        int64_t createdNs;      // of the raw segment
+        uint64_t rawBytes;      // datagram bytes of all records
+        uint64_t recordCount;
+        uint64_t chunkIndexOffset;
+        uint64_t chunkCount;
+    };
+
+    struct PackedRecord
+    {
+        int64_t receiveNs;
+        uint32_t length;        // of the original datagram
+        uint32_t flags;
+        uint32_t storedLength;  // bytes that follow
+        uint32_t reserved;
+    };
+
+    struct ChunkEntry
+    {
+        uint64_t sampleNumber;  // index sample number of the chunk's first record
+        uint64_t firstRecord;
+        uint64_t offset;        // of the chunk's first PackedRecord
+        uint64_t bytes;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "compressed file header must be 64 bytes");
+    static_assert(sizeof(PackedRecord) == 24, "packed record header must be 24 bytes");
+    static_assert(sizeof(ChunkEntry) == 32, "chunk index entry must be 32 bytes");
+}
+
+/**
+    Lossless coder for the int16 sample-major payload of Gemini packets.
+
+    Each channel is predicted from its previous sample, and the residuals
+    are zigzag-coded so small steps of either sign become small unsigned
+    values. Channels are then taken in groups of 16 and frames in blocks of
+    BLOCK_FRAMES; each group and block stores the bit width of its largest
+    residual, followed by that many 16-bit bit planes per frame. Bit planes
+    keep every group byte-aligned and let a whole group be packed or
+    unpacked with a few vector operations.
+
+    Prediction carries over from one packet to the next until reset(), so
+    the first frame of a packet costs no more than any other. The kernel
+    (AVX2 or scalar, which produce identical output) is picked once at
+    construction.
+*/
+class FrameCodec
+{
+public:
+    /** Channels per group */
+    static constexpr int LANES = 16;
+
+    /** Frames sharing one bit width per group */
+    static constexpr int BLOCK_FRAMES = 8;
+
+    /** Constructor */
+    FrameCodec();
+
+    /** Clears the prediction and sets the channel count of the packets that follow */
+    void reset(int numChannels);
+
+    /** Channel count given to the last reset() */
+    int getNumChannels() const { return numChannels; }
+
+    /** Largest encoding of a payload of numChannels x numSamples */
+    static size_t maxEncodedSize(int numChannels, int numSamples);
+
+    /** Encodes numSamples frames of int16 samples. 'out' must hold maxEncodedSize() bytes. Returns the bytes written. */
+    size_t encode(const uint8_t* payload, int numSamples, uint8_t* out);
+
+    /** Decodes numSamples frames into 'payload'. Returns the bytes of 'in' used, or 0 if they are malformed. */
+    size_t decode(const uint8_t* in, size_t available, int numSamples, uint8_t* payload);
+
+    /** Returns the name of the kernel in use */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /** Signatures of the kernels; 'previous' holds one value per channel, padded to whole groups */
+    typedef size_t (*EncodeFn)(const uint8_t* payload, int numChannels, int numSamples, int16_t* previous, uint8_t* out);
+    typedef size_t (*DecodeFn)(const uint8_t* in, size_t available, int numChannels, int numSamples, int16_t* previous, uint8_t* payload);
+
+private:
+    EncodeFn encodeKernel;
+    DecodeFn decodeKernel;
+    const char* instructionSet;
+
+    int numChannels = 0;
+    std::vector<int16_t> previous;
+};
+
+/**
+    Background pool that turns sealed raw capture segments into compressed
+    ones.
+
+    PacketCapture hands each segment to enqueue() once it is sealed. A
+    worker reads it back (usually still in the page cache), writes
+    '<segment>.gcapz' next to it through a temporary file, and removes the
+    raw segment once the compressed one is safely on disk. Workers run at
+    a lowered priority so they never compete with the receive threads.
+
+    enqueue() and the counters may be used from any thread.
+*/
+class CaptureCompressor
+{
+public:
+    /** Sizes of one compressed file */
+    struct Result
+    {
+        uint64_t records = 0;
+        uint64_t rawBytes = 0;      // datagram bytes in
+        uint64_t storedBytes = 0;   // file bytes out
+    };
+
+    /** Constructor */
+    CaptureCompressor();
+
+    /** Destructor. Finishes the queued segments. */
+    ~CaptureCompressor();
+
+    /** Starts 'numThreads' workers, if not already running */
+    void start(int numThreads);
+
+    /** Compresses whatever is queued, then stops the workers */
+    void stop();
+
+    /** True between start() and stop() */
+    bool isRunning() const { return !workers.empty(); }
+
+    /** Queues a sealed raw segment for compression */
+    void enqueue(const std::string& rawPath);
+
+    /**
+        Writes the compressed form of the raw segment at 'rawPath' to
+        'outPath'. Leaves the raw segment in place. Returns false, with
+        errno set, if either file could not be used.
+    */
+    static bool compressFile(const std::string& rawPath, const std::string& outPath, Result* result = nullptr);
+
+    /** Segments compressed */
+    uint64_t getSegments() const { return segments.load(std::memory_order_relaxed); }
+
+    /** Segments queued or being compressed */
+    uint64_t getPending() const { return pending.load(std::memory_order_relaxed); }
+
+    /** Datagram bytes of the segments compressed */
+    uint64_t getRawBytes() const { return rawBytes.load(std::memory_order_relaxed); }
+
+    /** File bytes written for them */
+    uint64_t getStoredBytes() const { return storedBytes.load(std::memory_order_relaxed); }
+
+    /** Segments left raw because compression failed */
+    uint64_t getFailures() const { return failures.load(std::memory_order_relaxed); }
+
+    /** Returns the counters and compression ratio as one line */
+    std::string getStatus() const;
+
+private:
+    /** Nice value of the workers */
+    static constexpr int WORKER_NICE = 10;
+
+    void run();
+
+    std::vector<std::thread> workers;
+    std::deque<std::string> queue;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    bool stopping = false;
+
+    std::atomic<uint64_t> segments { 0 };
+    std::atomic<uint64_t> pending { 0 };
+    std::atomic<uint64_t> rawBytes { 0 };
+    std::atomic<uint64_t> storedBytes { 0 };
+    std::atomic<uint64_t> failures { 0 };
+};
+
+/**
+    Read-only view of one compressed capture segment.
+
+    Records are decoded a chunk at a time into the same layout they have
+    in a raw segment, so callers can treat a decoded chunk like a small
+    raw segment.
+*/
+class CompressedReader
+{
+public:
+    /** A decoded chunk */
+    struct Chunk
+    {
+        uint64_t firstRecord = 0;
+
+        /** RecordHeader + datagram, padded to 8 bytes, per record, as in a raw segment */
+        std::vector<uint8_t> data;
+
+        /** Sample number and offset into 'data' of each record */
+        std::vector<CaptureFile::IndexEntry> index;
+
+        /** Records in the chunk */
+        size_t size() const { return index.size(); }
+
+        /** Reads record 'i' of the chunk. Returns the datagram and fills in its record header. */
+        const uint8_t* getRecord(size_t i, CaptureFile::RecordHeader& record) const;
+    };
+
+    /** Destructor */
+    ~CompressedReader();
+
+    /** Maps a compressed segment. Returns false if it is missing or not a compressed segment. */
+    bool open(const std::string& path);
+
+    /** Unmaps the file */
+    void close();
+
+    /** The segment's file header */
+    const CompressedFile::FileHeader& getHeader() const { return *header; }
+
+    /** Records in the segment */
+    uint64_t size() const { return header != nullptr ? header->recordCount : 0; }
+
+    /** Chunks in the segment */
+    uint64_t getChunkCount() const { return header != nullptr ? header->chunkCount : 0; }
+
+    /** Index entry of chunk 'chunk' */
+    const CompressedFile::ChunkEntry& getChunkEntry(uint64_t chunk) const { return chunks[chunk]; }
+
+    /**
+        Index of the chunk holding the first record whose sample number is
+        not below 'sampleNumber', give or take the near-sortedness noted
+        for CaptureReader::findSample(). Returns 0 for an empty segment.
+    */
+    uint64_t findChunk(uint64_t sampleNumber) const;
+
+    /** Decodes chunk 'chunk' into 'out'. Returns false if it is damaged. */
+    bool readChunk(uint64_t chunk, Chunk& out);
+
+    /** Name of the decoding kernel in use */
+    const char* getInstructionSet() const { return codec.getInstructionSet(); }
+
+private:
+    uint8_t* base = nullptr;
+    size_t fileSize = 0;
+    const CompressedFile::FileHeader* header = nullptr;
+    const CompressedFile::ChunkEntry* chunks = nullptr;
+
+    FrameCodec codec;
+};
+
+}
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "ChannelMonitor.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int VECTOR_CHANNELS = 8;
+    const size_t ARENA_ALIGNMENT = 64;
+
+    // Channel-outer, sample-inner: a channel's accumulators stay in registers
+    // for the whole packet and only the samples are read with a stride. The
+    // line-noise filters run once per packet, on the packet mean: averaging
+    // a packet's samples barely touches 50/60 Hz (publish() corrects the
+    // small loss) and the filters would otherwise dominate the cost.
+
+    template <bool FLOAT_INPUT>
+    void accumulateChannels(const void* src, float* dest, int firstChannel, int numSamples,
+                            float scale, float bias, const ChannelMonitor::Accumulators& acc)
+    {
+        const int stride = acc.numChannels;
+
+        for (int c = firstChannel; c < stride; c++)
+        {
+            int32_t low = acc.minimum[c];
+            int32_t high = acc.maximum[c];
+            int32_t clipped = acc.clipped[c];
+            const float reference = acc.reference[c];
+            float sum = 0;
+            float sumSquares = 0;
+            double a1 = acc.goertzel[0][c], a2 = acc.goertzel[1][c];
+            double b1 = acc.goertzel[2][c], b2 = acc.goertzel[3][c];
+
+            for (int f = 0; f < numSamples; f++)
+            {
+                const size_t i = (size_t) f * stride + c;
+                float x;
+                int32_t raw;
+
+                if constexpr (FLOAT_INPUT)
+                {
+                    x = (((const float*) src)[i] - bias) * scale;
+                    raw = (int32_t) lrintf(x);
+                }
+                else
+                {
+                    int16_t value;
+                    memcpy(&value, (const uint8_t*) src + 2 * i, sizeof(value));
+                    raw = value;
+                    x = (float) value;
+                    dest[i] = x * scale + bias;
+                }
+
+                low = std::min(low, raw);
+                high = std::max(high, raw);
+                clipped += (raw >= INT16_MAX || raw <= INT16_MIN);
+
+                const float d = x - reference;
+                sum += d;
+                sumSquares += d * d;
+            }
+
+            const double mean = sum * (1.0 / numSamples);
+
+            const double a0 = acc.coefficient[0] * a1 - a2 + mean;
+            a2 = a1;
+            a1 = a0;
+
+            const double b0 = acc.coefficient[1] * b1 - b2 + mean;
+            b2 = b1;
+            b1 = b0;
+
+            acc.minimum[c] = low;
+            acc.maximum[c] = high;
+            acc.clipped[c] = clipped;
+            acc.sum[c] += sum;
+            acc.sumSquares[c] += sumSquares;
+            acc.goertzel[0][c] = a1;
+            acc.goertzel[1][c] = a2;
+            acc.goertzel[2][c] = b1;
+            acc.goertzel[3][c] = b2;
+        }
+    }
+
+    template <bool FLOAT_INPUT>
+    void accumulateScalar(const void* src, float* dest, int numSamples, float scale, float bias, const ChannelMonitor::Accumulators& acc)
+    {
+        accumulateChannels<FLOAT_INPUT>(src, dest, 0, numSamples, scale, bias, acc);
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    /** One Goertzel step on four channels: s0 = coefficient * s1 - s2 + x */
+    __attribute__((target("avx2,fma")))
+    inline void goertzelStep(__m256d coefficient, __m256d x, __m256d& s1, __m256d& s2)
+    {
+        const __m256d s0 = _mm256_add_pd(_mm256_fmsub_pd(coefficient, s1, s2), x);
+        s2 = s1;
+        s1 = s0;
+    }
+
+    struct Scaling
+    {
+        __m256 scale;
+        __m256 bias;
+        __m256i top;        // one below the upper int16 rail
+        __m256i bottom;     // one above the lower rail
+    };
+
+    /** Decodes (or reloads) eight channels at sample index 'i' and updates every per-sample accumulator */
+    template <bool FLOAT_INPUT>
+    __attribute__((target("avx2,fma"), always_inline))
+    inline void accumulateFrame(const void* src, float* dest, size_t i, const Scaling& scaling, __m256 reference,
+                                __m256i& low, __m256i& high, __m256i& clipped, __m256& sum, __m256& sumSquares)
+    {
+        __m256 x;
+        __m256i raw;
+
+        if constexpr (FLOAT_INPUT)
+        {
+            x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps((const float*) src + i), scaling.bias), scaling.scale);
+            raw = _mm256_cvtps_epi32(x);
+        }
+        else
+        {
+            raw = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) ((const uint8_t*) src + 2 * i)));
+            x = _mm256_cvtepi32_ps(raw);
+            _mm256_storeu_ps(dest + i, _mm256_fmadd_ps(x, scaling.scale, scaling.bias));
+        }
+
+        low = _mm256_min_epi32(low, raw);
+        high = _mm256_max_epi32(high, raw);
+
+        // comparisons give -1 per lane, so subtracting counts
+        const __m256i rail = _mm256_or_si256(_mm256_cmpgt_epi32(raw, scaling.top), _mm256_cmpgt_epi32(scaling.bottom, raw));
+        clipped = _mm256_sub_epi32(clipped, rail);
+
+        const __m256 d = _mm256_sub_ps(x, reference);
+        sum = _mm256_add_ps(sum, d);
+        sumSquares = _mm256_fmadd_ps(d, d, sumSquares);
+    }
+
+    template <bool FLOAT_INPUT>
+    __attribute__((target("avx2,fma")))
+    void accumulateAVX2(const void* src, float* dest, int numSamples, float scale, float bias, const ChannelMonitor::Accumulators& acc)
+    {
+        const int stride = acc.numChannels;
+        const int vectorEnd = stride - stride % VECTOR_CHANNELS;
+
+        const Scaling scaling = { _mm256_set1_ps(scale), _mm256_set1_ps(bias),
+                                  _mm256_set1_epi32(INT16_MAX - 1), _mm256_set1_epi32(INT16_MIN + 1) };
+        const __m256d c50 = _mm256_set1_pd(acc.coefficient[0]);
+        const __m256d c60 = _mm256_set1_pd(acc.coefficient[1]);
+
+        for (int c = 0; c < vectorEnd; c += VECTOR_CHANNELS)
+        {
+            __m256i low = _mm256_load_si256((const __m256i*) (acc.minimum + c));
+            __m256i high = _mm256_load_si256((const __m256i*) (acc.maximum + c));
+            __m256i clipped = _mm256_load_si256((const __m256i*) (acc.clipped + c));
+            const __m256 reference = _mm256_load_ps(acc.reference + c);
+
+            __m256 sum = _mm256_setzero_ps();
+            __m256 sumSquares = _mm256_setzero_ps();
+
+            for (int f = 0; f < numSamples; f++)
+                accumulateFrame<FLOAT_INPUT>(src, dest, (size_t) f * stride + c, scaling, reference, low, high, clipped, sum, sumSquares);
+
+            _mm256_store_si256((__m256i*) (acc.minimum + c), low);
+            _mm256_store_si256((__m256i*) (acc.maximum + c), high);
+            _mm256_store_si256((__m256i*) (acc.clipped + c), clipped);
+
+            _mm256_store_pd(acc.sum + c, _mm256_add_pd(_mm256_load_pd(acc.sum + c), _mm256_cvtps_pd(_mm256_castps256_ps128(sum))));
+            _mm256_store_pd(acc.sum + c + 4, _mm256_add_pd(_mm256_load_pd(acc.sum + c + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(sum, 1))));
+            _mm256_store_pd(acc.sumSquares + c, _mm256_add_pd(_mm256_load_pd(acc.sumSquares + c), _mm256_cvtps_pd(_mm256_castps256_ps128(sumSquares))));
+            _mm256_store_pd(acc.sumSquares + c + 4, _mm256_add_pd(_mm256_load_pd(acc.sumSquares + c + 4), _mm256_cvtps_pd(_mm256_extractf128_ps(sumSquares, 1))));
+
+            const __m256 mean = _mm256_mul_ps(sum, _mm256_set1_ps(1.0f / numSamples));
+            const __m256d meanHalves[2] = { _mm256_cvtps_pd(_mm256_castps256_ps128(mean)), _mm256_cvtps_pd(_mm256_extractf128_ps(mean, 1)) };
+
+            for (int k = 0; k < 2; k++)
+            {
+                const __m256d coefficient = k == 0 ? c50 : c60;
+
+                for (int half = 0; half < 2; half++)
+                {
+                    double* s1 = acc.goertzel[2 * k] + c + 4 * half;
+                    double* s2 = acc.goertzel[2 * k + 1] + c + 4 * half;
+
+                    __m256d state1 = _mm256_load_pd(s1);
+                    __m256d state2 = _mm256_load_pd(s2);
+
+                    goertzelStep(coefficient, meanHalves[half], state1, state2);
+
+                    _mm256_store_pd(s1, state1);
+                    _mm256_store_pd(s2, state2);
+                }
+            }
+        }
+
+        accumulateChannels<FLOAT_INPUT>(src, dest, vectorEnd, numSamples, scale, bias, acc);
+    }
+
+#endif
+}
+
+const char* ChannelMonitor::getName(Status status)
+{
+    switch (status)
+    {
+    case Status::OK:
+        return "ok";
+    case Status::NOISY:
+        return "noisy";
+    case Status::LINE_NOISE:
+        return "line_noise";
+    case Status::CLIPPING:
+        return "clipping";
+    case Status::FLAT:
+        return "flat";
+    }
+
+    return "unknown";
+}
+
+ChannelMonitor::ChannelMonitor()
+{
+    decodeKernel = &accumulateScalar<false>;
+    floatKernel = &accumulateScalar<true>;
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        decodeKernel = &accumulateAVX2<false>;
+        floatKernel = &accumulateAVX2<true>;
+        instructionSet = "AVX2";
+    }
+#endif
+}
+
+ChannelMonitor::~ChannelMonitor()
+{
+    free(arena);
+}
+
+void ChannelMonitor::prepare(int numChannels_, int numSamples, float sampleRate_, float scale, float offset)
+{
+    numChannels = numChannels_;
+    sampleRate = sampleRate_;
+    stride = (numChannels + VECTOR_CHANNELS - 1) / VECTOR_CHANNELS * VECTOR_CHANNELS;
+    windowSamples = (int) std::ceil(sampleRate * WINDOW_SECONDS);
+
+    // decoded floats are (raw - offset) * scale; the float path undoes that
+    invScale = scale != 0.0f ? 1.0f / scale : 0.0f;
+    floatBias = -offset * scale;
+
+    const size_t floats = 4 * (size_t) stride * sizeof(float);     // reference, minimum, maximum, clipped
+    const size_t doubles = 6 * (size_t) stride * sizeof(double);   // sums and Goertzel states
+
+    free(arena);
+    arena = (uint8_t*) aligned_alloc(ARENA_ALIGNMENT, floats + doubles);
+
+    acc.numChannels = numChannels;
+    acc.reference = (float*) arena;
+    acc.minimum = (int32_t*) (acc.reference + stride);
+    acc.maximum = acc.minimum + stride;
+    acc.clipped = acc.maximum + stride;
+    acc.sum = (double*) (arena + floats);
+    acc.sumSquares = acc.sum + stride;
+
+    for (int k = 0; k < 4; k++)
+        acc.goertzel[k] = acc.sumSquares + (k + 1) * stride;
+
+    setPacketSamples(numSamples);
+
+    for (Snapshot& snapshot : snapshots)
+    {
+        snapshot = Snapshot();
+        snapshot.numChannels = numChannels;
+        snapshot.rms.assign(numChannels, 0.0f);
+        snapshot.line50.assign(numChannels, 0.0f);
+        snapshot.line60.assign(numChannels, 0.0f);
+        snapshot.minimum.assign(numChannels, 0);
+        snapshot.maximum.assign(numChannels, 0);
+        snapshot.clipped.assign(numChannels, 0);
+        snapshot.status.assign(numChannels, Status::OK);
+    }
+
+    sortScratch.assign(numChannels, 0.0f);
+
+    lineMixed = false;
+    middle.store(1);
+    back = 0;
+    front = 2;
+    windowsDone = 0;
+    samplesInWindow = 0;
+    windowStarted = false;
+}
+
+void ChannelMonitor::setPacketSamples(int numSamples)
+{
+    // the filters see one value per packet
+    const double lineHz[2] = { 50.0, 60.0 };
+    const double packetRate = sampleRate > 0 && numSamples > 0 ? sampleRate / numSamples : 0.0;
+
+    for (int k = 0; k < 2; k++)
+    {
+        const double omega = packetRate > 0 ? 2.0 * M_PI * lineHz[k] / packetRate : 0.0;
+        acc.coefficient[k] = 2.0 * std::cos(omega);
+
+        // gain of the packet average at the line frequency, 0 where a whole number of cycles fits in a packet
+        const double x = M_PI * lineHz[k] / (sampleRate > 0 ? sampleRate : 1.0);
+        lineGain[k] = numSamples > 1 && std::sin(x) != 0.0 ? std::sin(x * numSamples) / (numSamples * std::sin(x)) : 1.0;
+
+        lineUsable[k] = packetRate > 2.0 * lineHz[k] && std::abs(lineGain[k]) >= MIN_LINE_GAIN;
+    }
+
+    // the filter states so far were for the old packet rate
+    lineMixed = windowStarted && packetsInWindow > 0;
+    packetSamples = numSamples;
+}
+
+void ChannelMonitor::decodeInt16(const uint8_t* payload, float* dest, int numSamples, float scale, float bias)
+{
+    if (numSamples != packetSamples)
+        setPacketSamples(numSamples);
+
+    if (!windowStarted)
+        startWindow(payload, false);
+
+    decodeKernel(payload, dest, numSamples, scale, bias, acc);
+    advance(numSamples);
+}
+
+void ChannelMonitor::accumulate(const float* frames, int numSamples)
+{
+    if (numSamples != packetSamples)
+        setPacketSamples(numSamples);
+
+    if (!windowStarted)
+        startWindow(frames, true);
+
+    floatKernel(frames, nullptr, numSamples, invScale, floatBias, acc);
+    advance(numSamples);
+}
+
+void ChannelMonitor::startWindow(const void* src, bool floatInput)
+{
+    for (int c = 0; c < numChannels; c++)
+    {
+        if (floatInput)
+        {
+            acc.reference[c] = (((const float*) src)[c] - floatBias) * invScale;
+        }
+        else
+        {
+            int16_t value;
+            memcpy(&value, (const uint8_t*) src + 2 * c, sizeof(value));
+            acc.reference[c] = (float) value;
+        }
+
+        acc.minimum[c] = INT32_MAX;
+        acc.maximum[c] = INT32_MIN;
+        acc.clipped[c] = 0;
+        acc.sum[c] = 0;
+        acc.sumSquares[c] = 0;
+
+        for (int k = 0; k < 4; k++)
+            acc.goertzel[k][c] = 0;
+    }
+
+    samplesInWindow = 0;
+    packetsInWindow = 0;
+    lineMixed = false;
+    windowStarted = true;
+}
+
+void ChannelMonitor::advance(int numSamples)
+{
+    samplesInWindow += numSamples;
+    packetsInWindow++;
+
+    if (samplesInWindow >= windowSamples)
+        publish();
+}
+
+void ChannelMonitor::publish()
+{
+    Snapshot& snapshot = snapshots[back];
+    const double n = samplesInWindow;
+    const double packets = packetsInWindow;
+
+    for (int k = 0; k < 2; k++)
+        snapshot.lineValid[k] = lineUsable[k] && !lineMixed;
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        const double mean = acc.sum[c] / n;
+        const double variance = acc.sumSquares[c] / n - mean * mean;
+
+        snapshot.rms[c] = (float) std::sqrt(std::max(variance, 0.0));
+        snapshot.minimum[c] = acc.minimum[c];
+        snapshot.maximum[c] = acc.maximum[c];
+        snapshot.clipped[c] = (uint32_t) acc.clipped[c];
+
+        // |X|^2 from the final filter state; a sinusoid of amplitude 2|X|/N has an RMS of sqrt(2)|X|/N
+        float* line[2] = { &snapshot.line50[c], &snapshot.line60[c] };
+
+        for (int k = 0; k < 2; k++)
+        {
+            if (!snapshot.lineValid[k])
+            {
+                *line[k] = 0.0f;
+                continue;
+            }
+
+            const double s1 = acc.goertzel[2 * k][c];
+            const double s2 = acc.goertzel[2 * k + 1][c];
+            const double power = s1 * s1 + s2 * s2 - acc.coefficient[k] * s1 * s2;
+
+            *line[k] = (float) (std::sqrt(2.0 * std::max(power, 0.0)) / (packets * lineGain[k]));
+        }
+    }
+
+    std::copy(snapshot.rms.begin(), snapshot.rms.end(), sortScratch.begin());
+    std::nth_element(sortScratch.begin(), sortScratch.begin() + numChannels / 2, sortScratch.end());
+    snapshot.medianRms = numChannels > 0 ? sortScratch[numChannels / 2] : 0.0f;
+
+    for (int c = 0; c < numChannels; c++)
+    {
+        Status status = Status::OK;
+
+        if (snapshot.maximum[c] - snapshot.minimum[c] <= FLAT_PEAK_TO_PEAK)
+            status = Status::FLAT;
+        else if (snapshot.clipped[c] > 0)
+            status = Status::CLIPPING;
+        else if (std::max(snapshot.line50[c], snapshot.line60[c]) > LINE_NOISE_FRACTION * snapshot.rms[c])
+            status = Status::LINE_NOISE;
+        else if (snapshot.medianRms > 0 && snapshot.rms[c] > NOISY_FACTOR * snapshot.medianRms)
+            status = Status::NOISY;
+
+        snapshot.status[c] = status;
+    }
+
+    snapshot.window = ++windowsDone;
+    snapshot.windowSamples = samplesInWindow;
+
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+
+    windowStarted = false;
+}
+
+bool ChannelMonitor::getSnapshot(Snapshot& snapshot)
+{
+    if (middle.load(std::memory_order_acquire) & FRESH)
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+
+    if (snapshots[front].window == 0)
+        return false;
+
+    snapshot = snapshots[front];
+    return true;
+}
@@ -0,0 +1,201 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef CHANNELMONITOR_H_DEFINED
+#define CHANNELMONITOR_H_DEFINED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace GeminiThreadNode {
+
+/**
+    Per-channel signal quality, accumulated while the packets are decoded.
+
+    Over a window of about one second every channel collects its raw ADC
+    minimum and maximum, the number of samples at the int16 rails, the sum
+    and sum of squares (for the RMS about the mean) and two Goertzel filters
+    tuned to 50 and 60 Hz, fed with one mean per packet. A line frequency is
+    only reported while packets arrive at more than twice that rate and their
+    averaging keeps at least MIN_LINE_GAIN of it. All accumulators are
+    structure-of-arrays, one entry per channel padded to a whole vector, so
+    the fused kernel keeps
+    eight channels in registers while it walks down the samples of a packet.
+    The int16 -> float conversion happens in the same loop, so monitoring
+    needs no second pass over the data in the unsharded path.
+
+    At the end of each window the results are classified and published
+    through a triple buffer: the acquisition thread never waits, and
+    getSnapshot() always returns the latest complete window.
+*/
+class ChannelMonitor
+{
+public:
+    /** Peak-to-peak range, in ADC counts, at or below which a channel is flat */
+    static const int FLAT_PEAK_TO_PEAK = 2;
+
+    /** A channel whose RMS exceeds this multiple of the median RMS is noisy */
+    static constexpr float NOISY_FACTOR = 3.0f;
+
+    /** A channel whose 50 or 60 Hz RMS exceeds this fraction of its total RMS is dominated by line noise */
+    static constexpr float LINE_NOISE_FRACTION = 0.5f;
+
+    /** Smallest gain of the packet average at a line frequency that is still corrected for; below it that frequency is not reported */
+    static constexpr double MIN_LINE_GAIN = 0.5;
+
+    /** Window length, in seconds, rounded up to whole packets */
+    static constexpr double WINDOW_SECONDS = 1.0;
+
+    /** Health of one channel over the last window, worst first */
+    enum class Status : uint8_t
+    {
+        OK,
+        NOISY,
+        LINE_NOISE,
+        CLIPPING,
+        FLAT
+    };
+
+    /** Name used in status messages and JSON */
+    static const char* getName(Status status);
+
+    /** Results of one window, in ADC counts */
+    struct Snapshot
+    {
+        uint64_t window = 0;            // windows completed since prepare(); 0 means none yet
+        int numChannels = 0;
+        int windowSamples = 0;
+        float medianRms = 0;
+        std::vector<float> rms;
+        bool lineValid[2] = {};         // 50 and 60 Hz; the packet rate cannot resolve one that is false
+        std::vector<float> line50;      // RMS of the 50 Hz component, 0 unless lineValid[0]
+        std::vector<float> line60;
+        std::vector<int32_t> minimum;
+        std::vector<int32_t> maximum;
+        std::vector<uint32_t> clipped;  // samples at either int16 rail
+        std::vector<Status> status;
+    };
+
+    /** Constructor */
+    ChannelMonitor();
+
+    /** Destructor */
+    ~ChannelMonitor();
+
+    /** Sizes the accumulators for packets of 'numSamples' frames and starts a new window. Not real-time safe. */
+    void prepare(int numChannels, int numSamples, float sampleRate, float scale, float offset);
+
+    /** Turns accumulation on or off. Only call while acquisition is stopped. */
+    void setEnabled(bool enabled_) { enabled = enabled_; }
+
+    /** True if packets should be passed to the monitor */
+    bool isEnabled() const { return enabled && numChannels > 0; }
+
+    /** Returns the name of the accumulation kernel in use */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /**
+        Converts 'numSamples' frames of raw int16 samples into (raw * scale + bias)
+        floats, accumulating every sample on the way.
+    */
+    void decodeInt16(const uint8_t* payload, float* dest, int numSamples, float scale, float bias);
+
+    /**
+        Accumulates frames that were already decoded with the scale and offset
+        given to prepare(). Used when the shard threads decode; this is a
+        separate pass over the floats.
+    */
+    void accumulate(const float* frames, int numSamples);
+
+    /** Copies the latest complete window into 'snapshot'. Returns false if no window has completed. */
+    bool getSnapshot(Snapshot& snapshot);
+
+    /** Per-channel accumulators, each 'stride' entries long */
+    struct Accumulators
+    {
+        int numChannels = 0;
+        float* reference = nullptr;     // first raw value of the window, subtracted before summing
+        int32_t* minimum = nullptr;
+        int32_t* maximum = nullptr;
+        int32_t* clipped = nullptr;
+        double* sum = nullptr;
+        double* sumSquares = nullptr;
+        double* goertzel[4] = {};       // s1 and s2 of the 50 Hz filter, then of the 60 Hz filter
+        double coefficient[2] = {};
+    };
+
+    /** Signature of a fused decode-and-accumulate kernel */
+    typedef void (*AccumulateFn)(const void* src, float* dest, int numSamples, float scale, float bias, const Accumulators& acc);
+
+private:
+    /** Clears the accumulators and takes the window references from the first frame */
+    void startWindow(const void* src, bool floatInput);
+
+    /** Retunes the line-noise filters for packets of 'numSamples' frames; a window that saw another length reports no line noise */
+    void setPacketSamples(int numSamples);
+
+    /** Counts the samples just accumulated and publishes the window once it is full */
+    void advance(int numSamples);
+
+    /** Computes, classifies and publishes the finished window */
+    void publish();
+
+    AccumulateFn decodeKernel;
+    AccumulateFn floatKernel;
+    const char* instructionSet;
+
+    bool enabled = true;
+    int numChannels = 0;
+    int stride = 0;
+    int windowSamples = 0;
+    int samplesInWindow = 0;
+    int packetsInWindow = 0;
+    bool windowStarted = false;
+    float invScale = 1.0f;
+    float floatBias = 0.0f;
+    float sampleRate = 0.0f;
+    int packetSamples = 0;
+    double lineGain[2] = { 1.0, 1.0 };
+    bool lineUsable[2] = {};            // for the current packet length
+    bool lineMixed = false;             // the window saw more than one packet length
+
+    // one aligned block holding every accumulator array
+    uint8_t* arena = nullptr;
+    Accumulators acc;
+
+    // triple buffer: the producer fills 'back', swaps it with 'middle' and flags it fresh
+    static const int FRESH = 4;
+    Snapshot snapshots[3];
+    std::atomic<int> middle { 1 };
+    int back = 0;
+    int front = 2;
+    uint64_t windowsDone = 0;
+    std::vector<float> sortScratch;
+};
+
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <math.h>
+
+#include "ClockSync.h"
+
+using namespace GeminiThreadNode;
+
+ClockSync::ClockSync()
+{
+    reset(30000.0);
+}
+
+void ClockSync::reset(double nominalRate)
+{
+    nominalPeriod = nominalRate > 0 ? 1.0 / nominalRate : 1.0;
+    period = nominalPeriod;
+
+    anchored = false;
+    refSample = 0;
+    refNs = 0;
+
+    sw = sx = sy = sxx = sxy = 0;
+    intercept = 0;
+    scale = 0;
+
+    count = 0;
+    consecutiveRejects = 0;
+
+    accepted = 0;
+    rejected = 0;
+    restarts = 0;
+}
+
+void ClockSync::anchor(uint64_t sample, int64_t hostNs)
+{
+    anchored = true;
+    refSample = sample;
+    refNs = hostNs;
+
+    sw = 1;
+    sx = sy = sxx = sxy = 0;
+    intercept = 0;
+    period = nominalPeriod;
+    scale = 0;
+
+    count = 1;
+    consecutiveRejects = 0;
+    accepted++;
+}
+
+void ClockSync::observe(uint64_t sample, int64_t hostNs)
+{
+    if (!anchored)
+    {
+        anchor(sample, hostNs);
+        return;
+    }
+
+    const double dx = (double) (int64_t) (sample - refSample);
+    const double dy = (double) (hostNs - refNs) * 1e-9;
+    const double residual = dy - (intercept + period * dx);
+
+    if (fabs(residual) > RESTART_GATE)
+    {
+        restarts++;
+        anchor(sample, hostNs);
+        return;
+    }
+
+    const double gate = REJECT_FACTOR * scale > MIN_GATE ? REJECT_FACTOR * scale : MIN_GATE;
+
+    if (count >= MIN_POINTS && fabs(residual) > gate)
+    {
+        rejected++;
+
+        if (++consecutiveRejects >= MAX_REJECTS)
+        {
+            restarts++;
+            anchor(sample, hostNs);
+        }
+
+        return;
+    }
+
+    consecutiveRejects = 0;
+    accepted++;
+    count++;
+
+    // mean absolute residual, settling quickly at first
+    const double alpha = count < MIN_POINTS ? 1.0 / count : 1.0 / MIN_POINTS;
+    scale += (fabs(residual) - scale) * alpha;
+
+    sw = FORGET * sw + 1;
+    sx = FORGET * sx + dx;
+    sy = FORGET * sy + dy;
+    sxx = FORGET * sxx + dx * dx;
+    sxy = FORGET * sxy + dx * dy;
+
+    // move the origin to this point
+    sxx += -2 * dx * sx + dx * dx * sw;
+    sxy += -dx * sy - dy * sx + dx * dy * sw;
+    sx -= dx * sw;
+    sy -= dy * sw;
+
+    refSample = sample;
+    refNs = hostNs;
+
+    const double det = sw * sxx - sx * sx;
+
+    if (count >= MIN_POINTS && det > 0)
+        period = (sw * sxy - sx * sy) / det;
+
+    intercept = (sy - period * sx) / sw;
+}
+
+double ClockSync::toHostSeconds(uint64_t sample) const
+{
+    // whole seconds separately, so the fraction keeps full double precision
+    const int64_t seconds = refNs / 1000000000;
+    const double fraction = (double) (refNs - seconds * 1000000000) * 1e-9;
+
+    return (double) seconds + (fraction + intercept + period * (double) (int64_t) (sample - refSample));
+}
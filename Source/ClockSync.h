@@ -0,0 +1,129 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef CLOCKSYNC_H_DEFINED
+#define CLOCKSYNC_H_DEFINED
+
+#include <cstdint>
+
+namespace GeminiThreadNode {
+
+/**
+    Online mapping from the device sample counter to the host clock.
+
+    Every published packet contributes one point: the device sample number
+    of its first sample against its kernel receive time. Duplicates and
+    packets too late to publish are left out. An exponentially weighted least
+    squares line through recent points gives the host time of any sample, and
+    its slope follows the slow drift between the device oscillator and the
+    host clock. The sums are kept relative to the latest point, so they stay
+    well conditioned however long acquisition runs.
+
+    Scheduling and network delays make single packets arrive late, so points
+    far from the line (several times the typical residual) are rejected. A
+    long run of rejections, or a single huge one, means the relation itself
+    changed (device restart, host clock step) and the fit starts over.
+*/
+class ClockSync
+{
+public:
+    /** Constructor */
+    ClockSync();
+
+    /** Forgets all points; 'nominalRate' (Hz) is used until enough points are in */
+    void reset(double nominalRate);
+
+    /** Adds a packet whose first sample 'sample' was received at 'hostNs' (CLOCK_REALTIME, ns) */
+    void observe(uint64_t sample, int64_t hostNs);
+
+    /** Host time of device sample 'sample', in seconds since the epoch */
+    double toHostSeconds(uint64_t sample) const;
+
+    /** Host seconds per device sample */
+    double getSecondsPerSample() const { return period; }
+
+    /** True once the slope is estimated from data rather than the nominal rate */
+    bool isLocked() const { return count >= MIN_POINTS; }
+
+    /** Estimated device sample rate on the host clock, in Hz */
+    double getRate() const { return 1.0 / period; }
+
+    /** Deviation of the estimated rate from the nominal rate, in parts per million */
+    double getDriftPpm() const { return (nominalPeriod / period - 1.0) * 1e6; }
+
+    /** Typical distance of accepted points from the line, in microseconds */
+    double getJitterUs() const { return scale * 1e6; }
+
+    /** Points used by the fit */
+    uint64_t getAccepted() const { return accepted; }
+
+    /** Points rejected as outliers */
+    uint64_t getRejected() const { return rejected; }
+
+    /** Times the fit started over */
+    uint64_t getRestarts() const { return restarts; }
+
+private:
+    /** Forgetting factor per packet; about 4096 packets of memory */
+    static constexpr double FORGET = 1.0 - 1.0 / 4096.0;
+
+    /** Points before the slope is fitted rather than taken from the nominal rate */
+    static const int MIN_POINTS = 64;
+
+    /** Rejection threshold, in multiples of the typical residual */
+    static constexpr double REJECT_FACTOR = 8.0;
+
+    /** Residuals smaller than this are never rejected, in seconds */
+    static constexpr double MIN_GATE = 200e-6;
+
+    /** Residuals larger than this restart the fit immediately, in seconds */
+    static constexpr double RESTART_GATE = 1.0;
+
+    /** Consecutive rejections that restart the fit */
+    static const int MAX_REJECTS = 64;
+
+    void anchor(uint64_t sample, int64_t hostNs);
+
+    bool anchored;
+    uint64_t refSample;     // latest accepted point; the sums are relative to it
+    int64_t refNs;
+
+    // weighted sums of x = samples after refSample and y = seconds after refNs
+    double sw, sx, sy, sxx, sxy;
+
+    double intercept;       // host seconds after refNs of refSample
+    double period;
+    double nominalPeriod;
+    double scale;
+
+    int count;
+    int consecutiveRejects;
+
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t restarts;
+};
+
+}
+
+#endif
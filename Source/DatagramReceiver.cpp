@@ -0,0 +1,625 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ENTER_EXT_ARG) && defined(__NR_io_uring_setup)
+#define GEMINI_HAVE_IO_URING 1
+#endif
+#endif
+
+#include "DatagramReceiver.h"
+#include "Realtime.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const size_t CACHE_LINE = 64;
+
+    /** Control buffer space per datagram, enough for an SCM_TIMESTAMPNS and an SO_RXQ_OVFL message */
+    const size_t CONTROL_SIZE = CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t));
+
+    size_t roundUp(size_t value, size_t multiple)
+    {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    void enableControlMessages(int sockfd)
+    {
+        int one = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+        setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    }
+
+    int64_t realtimeNs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    /**
+        Returns the SCM_TIMESTAMPNS time from a control buffer, or 'fallback'
+        if there is none. The kernel only attaches the SO_RXQ_OVFL counter
+        once it is non-zero; if present it is written to 'drops'.
+    */
+    int64_t readControl(void* control, size_t controlLength, int64_t fallback, uint32_t& drops)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = controlLength;
+
+        int64_t timestampNs = fallback;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET)
+                continue;
+
+            if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                struct timespec stamp;
+                memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                timestampNs = (int64_t) stamp.tv_sec * 1000000000 + stamp.tv_nsec;
+            }
+            else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+            {
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            }
+        }
+
+        return timestampNs;
+    }
+}
+
+PacketSlotArray::PacketSlotArray(int numSlots, size_t slotSize)
+{
+    slotSize = roundUp(slotSize, CACHE_LINE);
+
+    storageSize = slotSize * numSlots;
+    storage = (uint8_t*) aligned_alloc(CACHE_LINE, storageSize);
+
+    slots.resize(numSlots);
+
+    for (int i = 0; i < numSlots; i++)
+    {
+        slots[i].data = storage + slotSize * i;
+        slots[i].capacity = (uint32_t) slotSize;
+        slots[i].length = 0;
+    }
+}
+
+PacketSlotArray::~PacketSlotArray()
+{
+    unlockMemory();
+    free(storage);
+}
+
+bool PacketSlotArray::lockMemory()
+{
+    if (!locked)
+        locked = Realtime::lockBuffer(storage, storageSize);
+
+    return locked;
+}
+
+void PacketSlotArray::unlockMemory()
+{
+    if (locked)
+        Realtime::unlockBuffer(storage, storageSize);
+
+    locked = false;
+}
+
+// ------------------------------------------------------------
+//                          recvmmsg
+// ------------------------------------------------------------
+
+namespace
+{
+
+class RecvmmsgReceiver : public DatagramReceiver
+{
+public:
+    RecvmmsgReceiver(int sockfd_, int maxBatch, int timeoutMs) : sockfd(sockfd_)
+    {
+        msgs.resize(maxBatch);
+        iovs.resize(maxBatch);
+        control.resize(maxBatch * CONTROL_SIZE / sizeof(uint64_t) + 1);
+
+        enableControlMessages(sockfd);
+
+        if (timeoutMs > 0)
+        {
+            // the timeout of recvmmsg itself is only checked between datagrams, so bound the wait on the socket
+            struct timeval tv;
+            tv.tv_sec = timeoutMs / 1000;
+            tv.tv_usec = (timeoutMs % 1000) * 1000;
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+            flags = MSG_WAITFORONE;
+        }
+        else
+        {
+            flags = MSG_DONTWAIT;
+        }
+    }
+
+    int receive(PacketSlot* slots, int maxPackets) override
+    {
+        if (maxPackets > (int) msgs.size())
+            maxPackets = (int) msgs.size();
+
+        for (int i = 0; i < maxPackets; i++)
+        {
+            iovs[i].iov_base = slots[i].data;
+            iovs[i].iov_len = slots[i].capacity;
+
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = (uint8_t*) control.data() + i * CONTROL_SIZE;
+            msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+
+        // block for the first datagram only, then take whatever else is queued
+        int n = recvmmsg(sockfd, msgs.data(), maxPackets, flags, nullptr);
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        const int64_t fallback = n > 0 ? realtimeNs() : 0;
+        uint32_t drops = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            slots[i].length = msgs[i].msg_len;
+            slots[i].timestampNs = readControl(msgs[i].msg_hdr.msg_control, msgs[i].msg_hdr.msg_controllen, fallback, drops);
+        }
+
+        if (drops > 0)
+            setKernelDrops(drops);
+
+        return n;
+    }
+
+    Backend getBackend() const override { return Backend::RECVMMSG; }
+
+    int getPollFd() const override { return sockfd; }
+
+private:
+    int sockfd;
+    int flags;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct iovec> iovs;
+    std::vector<uint64_t> control;   // uint64_t keeps the cmsg headers aligned
+};
+
+// ------------------------------------------------------------
+//                          io_uring
+// ------------------------------------------------------------
+
+#ifdef GEMINI_HAVE_IO_URING
+
+/**
+    Single multishot IORING_OP_RECVMSG armed on the socket, with the kernel
+    picking destination buffers from a registered provided-buffer ring.
+    Completed buffers are copied into the caller's slots and handed back to
+    the kernel straight away, so the ring never runs dry while the caller
+    holds on to its packets.
+
+    Each buffer starts with a struct io_uring_recvmsg_out, followed by the
+    control messages (the receive timestamp) and then the datagram.
+*/
+class IoUringReceiver : public DatagramReceiver
+{
+public:
+    IoUringReceiver(int sockfd_, int maxBatch, size_t maxPacketSize, int timeoutMs) : sockfd(sockfd_)
+    {
+        blocking = timeoutMs > 0;
+
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long) (timeoutMs % 1000) * 1000000;
+
+        waitArg.sigmask = 0;
+        waitArg.sigmask_sz = _NSIG / 8;
+        waitArg.pad = 0;
+        waitArg.ts = (uint64_t) &timeout;
+
+        numBuffers = 16;
+        while (numBuffers < (unsigned) maxBatch * 2)
+            numBuffers <<= 1;
+
+        bufferSize = (unsigned) roundUp(sizeof(struct io_uring_recvmsg_out) + CONTROL_SIZE + maxPacketSize, CACHE_LINE);
+
+        // only the lengths are read by the kernel for multishot recvmsg
+        memset(&recvMsg, 0, sizeof(recvMsg));
+        recvMsg.msg_controllen = CONTROL_SIZE;
+
+        enableControlMessages(sockfd);
+    }
+
+    ~IoUringReceiver()
+    {
+        if (ringFd >= 0)
+        {
+            if (bufRing != nullptr)
+            {
+                struct io_uring_buf_reg reg;
+                memset(&reg, 0, sizeof(reg));
+                reg.bgid = BUFFER_GROUP;
+                syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            }
+
+            close(ringFd);
+        }
+
+        if (bufRing != nullptr)
+            munmap(bufRing, bufRingSize);
+
+        if (sqes != nullptr)
+            munmap(sqes, sqesSize);
+
+        if (cqPtr != nullptr && cqPtr != sqPtr)
+            munmap(cqPtr, cqSize);
+
+        if (sqPtr != nullptr)
+            munmap(sqPtr, sqSize);
+
+        free(buffers);
+    }
+
+    bool initialize()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        // every datagram posts its own completion, so size the CQ for a full buffer ring
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = numBuffers * 2;
+
+        ringFd = (int) syscall(__NR_io_uring_setup, 8, &params);
+
+        if (ringFd < 0)
+            return false;
+
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+            return false;
+
+        sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqSize = cqSize = (sqSize > cqSize ? sqSize : cqSize);
+
+        sqPtr = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+
+        if (sqPtr == MAP_FAILED)
+        {
+            sqPtr = nullptr;
+            return false;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            cqPtr = sqPtr;
+        }
+        else
+        {
+            cqPtr = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+
+            if (cqPtr == MAP_FAILED)
+            {
+                cqPtr = nullptr;
+                return false;
+            }
+        }
+
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*) mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+        if (sqes == MAP_FAILED)
+        {
+            sqes = nullptr;
+            return false;
+        }
+
+        uint8_t* sq = (uint8_t*) sqPtr;
+        sqTail = (unsigned*) (sq + params.sq_off.tail);
+        sqMask = *(unsigned*) (sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*) (sq + params.sq_off.array);
+
+        uint8_t* cq = (uint8_t*) cqPtr;
+        cqHead = (unsigned*) (cq + params.cq_off.head);
+        cqTail = (unsigned*) (cq + params.cq_off.tail);
+        cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+        // provided buffer ring
+        bufRingSize = roundUp(numBuffers * sizeof(struct io_uring_buf), 4096);
+        bufRing = (struct io_uring_buf*) mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (bufRing == MAP_FAILED)
+        {
+            bufRing = nullptr;
+            return false;
+        }
+
+        // the ring tail overlays the reserved field of the first entry (struct io_uring_buf_ring
+        // is not usable from C++, where its flexible array member picks up an offset)
+        bufRingTail = &bufRing[0].resv;
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) bufRing;
+        reg.ring_entries = numBuffers;
+        reg.bgid = BUFFER_GROUP;
+
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            munmap(bufRing, bufRingSize);
+            bufRing = nullptr;
+            return false;
+        }
+
+        buffers = (uint8_t*) aligned_alloc(CACHE_LINE, (size_t) bufferSize * numBuffers);
+
+        for (unsigned i = 0; i < numBuffers; i++)
+            addBuffer((uint16_t) i);
+
+        publishBuffers();
+
+        // arm up front so the ring fd can be polled before the first receive()
+        return armRecv();
+    }
+
+    int receive(PacketSlot* slots, int maxPackets) override
+    {
+        while (true)
+        {
+            int count = 0;
+            int error = 0;
+
+            unsigned head = *cqHead;
+            const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            const int64_t fallback = head != tail ? realtimeNs() : 0;
+            uint32_t drops = 0;
+
+            while (head != tail && count < maxPackets)
+            {
+                const struct io_uring_cqe& cqe = cqes[head & cqMask];
+
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                {
+                    const uint16_t bid = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+                    if (cqe.res > 0)
+                    {
+                        uint8_t* buffer = buffers + (size_t) bid * bufferSize;
+                        const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*) buffer;
+                        uint8_t* control = buffer + sizeof(struct io_uring_recvmsg_out) + recvMsg.msg_namelen;
+                        const uint8_t* payload = control + recvMsg.msg_controllen;
+
+                        // payloadlen is the full datagram length, even if it was truncated
+                        const uint32_t received = (uint32_t) cqe.res - (uint32_t) (payload - buffer);
+                        uint32_t length = out->payloadlen < received ? out->payloadlen : received;
+
+                        if (length > slots[count].capacity)
+                            length = slots[count].capacity;
+
+                        memcpy(slots[count].data, payload, length);
+                        slots[count].length = length;
+                        slots[count].timestampNs = readControl(control, out->controllen, fallback, drops);
+                        count++;
+                    }
+
+                    addBuffer(bid);
+                }
+                else if (cqe.res < 0 && cqe.res != -ENOBUFS)
+                {
+                    error = -cqe.res;
+                }
+
+                // the multishot request terminated (e.g. ran out of buffers); re-arm on the next pass
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                    armed = false;
+
+                head++;
+            }
+
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            publishBuffers();
+
+            if (drops > 0)
+                setKernelDrops(drops);
+
+            // re-arm straight away, so a caller polling the ring fd is woken by the next datagram
+            if (!armed && !armRecv())
+                return -1;
+
+            if (count > 0)
+                return count;
+
+            if (error != 0)
+            {
+                errno = error;
+                return -1;
+            }
+
+            if (!blocking)
+                return 0;
+
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &waitArg, sizeof(waitArg)) < 0)
+                return (errno == ETIME || errno == EINTR) ? 0 : -1;
+        }
+    }
+
+    Backend getBackend() const override { return Backend::IO_URING; }
+
+    int getPollFd() const override { return ringFd; }
+
+private:
+    static const uint16_t BUFFER_GROUP = 0;
+
+    bool armRecv()
+    {
+        const unsigned tail = *sqTail;
+        const unsigned index = tail & sqMask;
+
+        struct io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t) &recvMsg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0) < 0)
+            return false;
+
+        armed = true;
+        return true;
+    }
+
+    void addBuffer(uint16_t bid)
+    {
+        struct io_uring_buf& buf = bufRing[(bufTail + pendingBuffers) & (numBuffers - 1)];
+        buf.addr = (uint64_t) (buffers + (size_t) bid * bufferSize);
+        buf.len = bufferSize;
+        buf.bid = bid;
+        pendingBuffers++;
+    }
+
+    void publishBuffers()
+    {
+        if (pendingBuffers == 0)
+            return;
+
+        bufTail = (uint16_t) (bufTail + pendingBuffers);
+        pendingBuffers = 0;
+        __atomic_store_n(bufRingTail, bufTail, __ATOMIC_RELEASE);
+    }
+
+    int sockfd;
+    int ringFd = -1;
+    bool armed = false;
+    bool blocking;
+    struct msghdr recvMsg;
+
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg waitArg;
+
+    void* sqPtr = nullptr;
+    void* cqPtr = nullptr;
+    size_t sqSize = 0;
+    size_t cqSize = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned* sqArray = nullptr;
+
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+
+    struct io_uring_buf* bufRing = nullptr;
+    uint16_t* bufRingTail = nullptr;
+    size_t bufRingSize = 0;
+    uint16_t bufTail = 0;
+    unsigned pendingBuffers = 0;
+
+    uint8_t* buffers = nullptr;
+    unsigned numBuffers;
+    unsigned bufferSize;
+};
+
+#endif
+
+}
+
+std::unique_ptr<DatagramReceiver> DatagramReceiver::create(Backend backend, int sockfd, int maxBatch, size_t maxPacketSize, int timeoutMs)
+{
+    switch (backend)
+    {
+    case Backend::RECVMMSG:
+        return std::make_unique<RecvmmsgReceiver>(sockfd, maxBatch, timeoutMs);
+
+    case Backend::IO_URING:
+    {
+#ifdef GEMINI_HAVE_IO_URING
+        std::unique_ptr<IoUringReceiver> receiver = std::make_unique<IoUringReceiver>(sockfd, maxBatch, maxPacketSize, timeoutMs);
+
+        if (receiver->initialize())
+            return receiver;
+#else
+        (void) maxPacketSize;
+#endif
+        return nullptr;
+    }
+    }
+
+    return nullptr;
+}
+
+bool DatagramReceiver::isSupported(Backend backend)
+{
+#ifdef GEMINI_HAVE_IO_URING
+    (void) backend;
+    return true;
+#else
+    return backend == Backend::RECVMMSG;
+#endif
+}
+
+const char* DatagramReceiver::getName(Backend backend)
+{
+    switch (backend)
+    {
+    case Backend::RECVMMSG:
+        return "recvmmsg";
+    case Backend::IO_URING:
+        return "io_uring";
+    }
+    return "unknown";
+}
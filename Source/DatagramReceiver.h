@@ -0,0 +1,140 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef DATAGRAMRECEIVER_H_DEFINED
+#define DATAGRAMRECEIVER_H_DEFINED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace GeminiThreadNode {
+
+/** A preallocated buffer holding one received datagram */
+struct PacketSlot
+{
+    uint8_t* data = nullptr;
+    uint32_t capacity = 0;
+    uint32_t length = 0;
+    int64_t timestampNs = 0;   // kernel receive time (CLOCK_REALTIME), or the time the receiver read it if the kernel gave none
+};
+
+/**
+    A fixed number of packet slots carved out of a single cache-line aligned
+    allocation. Slots are never reallocated after construction.
+*/
+class PacketSlotArray
+{
+public:
+    /** Constructor */
+    PacketSlotArray(int numSlots, size_t slotSize);
+
+    /** Destructor */
+    ~PacketSlotArray();
+
+    PacketSlot& operator[](int index) { return slots[index]; }
+    const PacketSlot& operator[](int index) const { return slots[index]; }
+
+    /** Returns a pointer to the first slot; slots are contiguous */
+    PacketSlot* data() { return slots.data(); }
+
+    /** Number of slots */
+    int size() const { return (int) slots.size(); }
+
+    /** Prefaults the slot storage and locks it in memory. Returns false, with errno set, if the lock was refused. */
+    bool lockMemory();
+
+    /** Undoes lockMemory() */
+    void unlockMemory();
+
+private:
+    std::vector<PacketSlot> slots;
+    uint8_t* storage;
+    size_t storageSize;
+    bool locked = false;
+
+    PacketSlotArray(const PacketSlotArray&) = delete;
+    PacketSlotArray& operator=(const PacketSlotArray&) = delete;
+};
+
+/**
+    Drains datagrams from a bound UDP socket in batches.
+
+    receive() waits until at least one datagram is available, then returns as
+    many as are ready (up to maxPackets) without further waiting, so a single
+    wakeup can service many 30-sample packets. The wait is bounded by the
+    timeout given at creation, so callers can poll for shutdown. A timeout of 0
+    makes receive() non-blocking, for callers that wait on getPollFd() with
+    epoll instead.
+
+    Receivers enable SO_TIMESTAMPNS on the socket and return each datagram's
+    kernel receive time with it. They also enable SO_RXQ_OVFL and keep the
+    latest count of datagrams the kernel dropped on the socket.
+*/
+class DatagramReceiver
+{
+public:
+    /** Available implementations */
+    enum class Backend
+    {
+        RECVMMSG = 0,
+        IO_URING = 1
+    };
+
+    /** Creates a receiver for 'sockfd'. Returns nullptr if the backend is unavailable on this system. */
+    static std::unique_ptr<DatagramReceiver> create(Backend backend, int sockfd, int maxBatch, size_t maxPacketSize, int timeoutMs);
+
+    /** Returns true if the backend was compiled in (it may still fail to initialize on older kernels) */
+    static bool isSupported(Backend backend);
+
+    /** Human-readable backend name */
+    static const char* getName(Backend backend);
+
+    /** Destructor */
+    virtual ~DatagramReceiver() { }
+
+    /** Copies up to maxPackets datagrams into 'slots'. Returns the number received, 0 on timeout, or -1 with errno set. */
+    virtual int receive(PacketSlot* slots, int maxPackets) = 0;
+
+    /** Returns the backend implemented by this receiver */
+    virtual Backend getBackend() const = 0;
+
+    /** File descriptor that becomes readable when receive() has datagrams to return */
+    virtual int getPollFd() const = 0;
+
+    /** Datagrams dropped by the kernel because the socket buffer was full, as last reported. Safe to call from any thread. */
+    uint32_t getKernelDrops() const { return kernelDrops.load(std::memory_order_relaxed); }
+
+protected:
+    /** Publishes the drop count from the last SO_RXQ_OVFL message */
+    void setKernelDrops(uint32_t drops) { kernelDrops.store(drops, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> kernelDrops { 0 };
+};
+
+}
+
+#endif
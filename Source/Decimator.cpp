@@ -0,0 +1,233 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "Decimator.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int VECTOR_CHANNELS = 8;
+    const size_t ARENA_ALIGNMENT = 64;
+    const int BRANCHES = Decimator::TAPS_PER_PHASE;
+
+    /** Zeroth-order modified Bessel function of the first kind, for the Kaiser window */
+    double besselI0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+
+        for (int k = 1; k < 50 && term > 1e-12 * sum; k++)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+
+        return sum;
+    }
+
+    // Tap-outer, channel-inner: each pending output row is read and
+    // written once per frame, and the frame itself stays in L1.
+
+    /** Accumulates channels [firstChannel, numChannels) of a frame into the pending outputs */
+    inline void accumulateChannels(const float* frame, const float* phaseTaps, int head, int firstChannel, const Decimator::State& state)
+    {
+        int row = head;
+
+        for (int j = 0; j < BRANCHES; j++)
+        {
+            float* pending = state.pending + (size_t) row * state.stride;
+            const float tap = phaseTaps[j];
+
+            for (int c = firstChannel; c < state.numChannels; c++)
+                pending[c] += tap * frame[c];
+
+            if (++row == BRANCHES)
+                row = 0;
+        }
+    }
+
+    void accumulateScalar(const float* frame, const float* phaseTaps, int head, const Decimator::State& state)
+    {
+        accumulateChannels(frame, phaseTaps, head, 0, state);
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    __attribute__((target("avx2,fma")))
+    void accumulateAVX2(const float* frame, const float* phaseTaps, int head, const Decimator::State& state)
+    {
+        const int vectorEnd = state.numChannels - state.numChannels % VECTOR_CHANNELS;
+        int row = head;
+
+        for (int j = 0; j < BRANCHES; j++)
+        {
+            float* pending = state.pending + (size_t) row * state.stride;
+            const __m256 tap = _mm256_set1_ps(phaseTaps[j]);
+
+            for (int c = 0; c < vectorEnd; c += VECTOR_CHANNELS)
+                _mm256_store_ps(pending + c, _mm256_fmadd_ps(tap, _mm256_loadu_ps(frame + c), _mm256_load_ps(pending + c)));
+
+            if (++row == BRANCHES)
+                row = 0;
+        }
+
+        accumulateChannels(frame, phaseTaps, head, vectorEnd, state);
+    }
+
+#endif
+}
+
+Decimator::Decimator()
+{
+    kernel = &accumulateScalar;
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        kernel = &accumulateAVX2;
+        instructionSet = "AVX2";
+    }
+#endif
+}
+
+Decimator::~Decimator()
+{
+    free(pending);
+}
+
+void Decimator::prepare(int numChannels_, int factor_)
+{
+    numChannels = numChannels_;
+    factor = std::max(factor_, 1);
+    phase = 0;
+    head = 0;
+    primed = false;
+
+    const int stride = (numChannels + VECTOR_CHANNELS - 1) / VECTOR_CHANNELS * VECTOR_CHANNELS;
+    const size_t bytes = (size_t) BRANCHES * std::max(stride, VECTOR_CHANNELS) * sizeof(float);
+
+    free(pending);
+    pending = (float*) aligned_alloc(ARENA_ALIGNMENT, bytes);
+    memset(pending, 0, bytes);
+
+    // Kaiser-windowed sinc with its cutoff at the output Nyquist frequency, unity gain at DC
+    const int numTaps = getNumTaps();
+    const double centre = (numTaps - 1) / 2.0;
+    const double cutoff = 0.5 / factor;
+    std::vector<double> prototype(numTaps);
+    double sum = 0;
+
+    for (int k = 0; k < numTaps; k++)
+    {
+        const double t = k - centre;
+        const double sinc = t == 0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+        const double r = numTaps > 1 ? t / centre : 0.0;
+        const double window = besselI0(KAISER_BETA * std::sqrt(std::max(0.0, 1.0 - r * r))) / besselI0(KAISER_BETA);
+
+        prototype[k] = sinc * window;
+        sum += prototype[k];
+    }
+
+    taps.assign((size_t) numTaps, 0.0f);
+
+    for (int p = 0; p < factor; p++)
+    {
+        for (int j = 0; j < BRANCHES; j++)
+            taps[(size_t) p * BRANCHES + j] = (float) (prototype[(size_t) p + (size_t) j * factor] / sum);
+    }
+
+    state.numChannels = numChannels;
+    state.stride = stride;
+    state.pending = pending;
+    state.taps = taps.data();
+}
+
+int Decimator::process(const float* frames, int numFrames, float* dest)
+{
+    if (!isEnabled() || numFrames <= 0)
+        return 0;
+
+    if (!primed)
+    {
+        prime(frames);
+        primed = true;
+    }
+
+    int outputs = 0;
+
+    for (int f = 0; f < numFrames; f++)
+    {
+        kernel(frames + (size_t) f * numChannels, taps.data() + (size_t) phase * BRANCHES, head, state);
+
+        if (phase > 0)
+        {
+            phase--;
+            continue;
+        }
+
+        // the head output has all its taps; its row becomes the newest pending output
+        float* row = pending + (size_t) head * state.stride;
+
+        memcpy(dest + (size_t) outputs * numChannels, row, sizeof(float) * numChannels);
+        memset(row, 0, sizeof(float) * state.stride);
+
+        outputs++;
+        head = head + 1 < BRANCHES ? head + 1 : 0;
+        phase = factor - 1;
+    }
+
+    return outputs;
+}
+
+void Decimator::prime(const float* frame)
+{
+    // pending output j would have had taps phase + j * factor + 1 onwards from the earlier frames
+    for (int j = 0; j < BRANCHES; j++)
+    {
+        double weight = 0;
+
+        for (int k = phase + j * factor + 1; k < getNumTaps(); k++)
+            weight += taps[(size_t) (k % factor) * BRANCHES + k / factor];
+
+        float* row = pending + (size_t) ((head + j) % BRANCHES) * state.stride;
+
+        for (int c = 0; c < numChannels; c++)
+            row[c] = (float) weight * frame[c];
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef DECIMATOR_H_DEFINED
+#define DECIMATOR_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace GeminiThreadNode {
+
+/**
+    Low-pass filters and decimates interleaved frames by an integer factor,
+    for the LFP stream published next to the broadband one.
+
+    The filter is a linear-phase FIR of TAPS_PER_PHASE taps per phase
+    (a Kaiser-windowed sinc with its cutoff at the output Nyquist
+    frequency), run in polyphase commutator form: every input frame is
+    multiplied into the TAPS_PER_PHASE pending outputs it contributes to,
+    each with the tap of its own phase, and the oldest pending output is
+    complete whenever a frame lands on phase 0. Only the decimated outputs
+    are ever computed, and no input history is kept. The pending outputs
+    are structure-of-arrays, one row per output padded to a whole vector,
+    so the kernel scales eight channels of a frame per instruction.
+
+    Outputs are delayed by the filter's group delay, getGroupDelay() input
+    frames, which the caller should take off their timestamps. process()
+    never allocates.
+*/
+class Decimator
+{
+public:
+    /** Taps per polyphase branch; with the transition band between 0.4 and 0.6 of the output rate this gives about 75 dB of alias rejection */
+    static const int TAPS_PER_PHASE = 24;
+
+    /** Kaiser window shape matching that rejection */
+    static constexpr double KAISER_BETA = 7.5;
+
+    /** Constructor */
+    Decimator();
+
+    /** Destructor */
+    ~Decimator();
+
+    /** Designs the filter and clears the pending outputs. A factor of 1 or less turns decimation off. Not real-time safe. */
+    void prepare(int numChannels, int factor);
+
+    /** True if prepare() was given a factor above 1 */
+    bool isEnabled() const { return factor > 1 && numChannels > 0; }
+
+    /** Decimation factor given to prepare() */
+    int getFactor() const { return factor; }
+
+    /** Length of the filter, in input frames */
+    int getNumTaps() const { return factor * TAPS_PER_PHASE; }
+
+    /** Delay of the outputs, in input frames */
+    double getGroupDelay() const { return (getNumTaps() - 1) / 2.0; }
+
+    /** Frames still to be fed before the next output is complete, counting the one that completes it: that output comes from frame getNextOutput() - 1 of the next call */
+    int getNextOutput() const { return phase + 1; }
+
+    /**
+        Feeds 'numFrames' interleaved frames and writes each output completed
+        on the way to 'dest', in order. Output k of the call completes on
+        input frame getNextOutput() - 1 + k * getFactor(). Returns the number
+        of outputs, at most numFrames / getFactor() + 1.
+    */
+    int process(const float* frames, int numFrames, float* dest);
+
+    /** Returns the name of the kernel's instruction set */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /** Pending outputs and the taps of each phase */
+    struct State
+    {
+        int numChannels = 0;
+        int stride = 0;
+        float* pending = nullptr;   // TAPS_PER_PHASE rows of 'stride' floats, row 'head' completing first
+        const float* taps = nullptr;
+    };
+
+    /** Signature of the kernel accumulating one frame into the pending outputs, starting at row 'head' with the taps of one phase */
+    typedef void (*AccumulateFn)(const float* frame, const float* phaseTaps, int head, const State& state);
+
+private:
+    /** Fills the pending outputs as if every frame before 'frame' had been equal to it */
+    void prime(const float* frame);
+
+    AccumulateFn kernel;
+    const char* instructionSet;
+
+    int numChannels = 0;
+    int factor = 1;
+    int phase = 0;      // frames after the next one before the head output completes
+    int head = 0;
+    bool primed = false;
+
+    // taps[p * TAPS_PER_PHASE + j] is tap p + j * factor of the prototype, so each phase is contiguous
+    std::vector<float> taps;
+
+    // one aligned block of pending outputs
+    float* pending = nullptr;
+    State state;
+};
+
+}
+
+#endif
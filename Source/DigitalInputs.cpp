@@ -0,0 +1,217 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "DigitalInputs.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int VECTOR_WORDS = 16;
+
+    inline uint16_t readWord(const uint8_t* words, int index)
+    {
+        return (uint16_t) (words[2 * index] | (words[2 * index + 1] << 8));
+    }
+
+    /** Words [first, numWords), following on from 'previous'. Returns the last word. */
+    inline uint16_t decodeWords(const uint8_t* words, int first, int numWords, uint16_t previous, DigitalInputs::TtlWord* dest,
+                                DigitalInputs::Edges& edges)
+    {
+        for (int i = first; i < numWords; i++)
+        {
+            const uint16_t word = readWord(words, i);
+            const uint16_t changed = word ^ previous;
+
+            edges.rising += (uint64_t) __builtin_popcount(changed & word);
+            edges.falling += (uint64_t) __builtin_popcount(changed & previous);
+            edges.lines |= changed;
+
+            dest[i] = word;
+            previous = word;
+        }
+
+        return previous;
+    }
+
+    void decodeScalar(const uint8_t* words, int numWords, uint16_t previous, DigitalInputs::TtlWord* dest, DigitalInputs::Edges& edges)
+    {
+        decodeWords(words, 0, numWords, previous, dest, edges);
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    /** Bits set in each byte of 'v' */
+    __attribute__((target("avx2")))
+    inline __m256i popcountBytes(__m256i v)
+    {
+        const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                               0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+        return _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble)),
+                               _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    }
+
+    // Each word is XORed with the one before it (the last word of the previous
+    // packet for the first) and the rising and falling bits are counted with a
+    // vector popcount, sixteen words at a time without a branch on the data.
+    // The last, partial block is loaded ending on the last word, with the
+    // lanes already counted masked off.
+    __attribute__((target("avx2")))
+    void decodeAVX2(const uint8_t* words, int numWords, uint16_t previous, DigitalInputs::TtlWord* dest, DigitalInputs::Edges& edges)
+    {
+        if (numWords < VECTOR_WORDS)
+        {
+            decodeWords(words, 0, numWords, previous, dest, edges);
+            return;
+        }
+
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i laneIndex = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+        __m256i risingSum = zero;
+        __m256i fallingSum = zero;
+        __m256i linesSeen = zero;
+
+        // the last block is moved back to end on the last word; its lanes already counted are masked off
+        for (int i = 0; i < numWords; i += VECTOR_WORDS)
+        {
+            const int first = i + VECTOR_WORDS <= numWords ? i : numWords - VECTOR_WORDS;
+            const __m256i current = _mm256_loadu_si256((const __m256i*) (words + 2 * first));
+            __m256i before;
+
+            if (first == 0)
+            {
+                // shift in the last word of the previous packet
+                const __m256i shifted = _mm256_alignr_epi8(current, _mm256_permute2x128_si256(current, current, 0x08), 14);
+                before = _mm256_insert_epi16(shifted, (short) previous, 0);
+            }
+            else
+            {
+                before = _mm256_loadu_si256((const __m256i*) (words + 2 * (first - 1)));
+            }
+
+            const __m256i fresh = _mm256_cmpgt_epi16(laneIndex, _mm256_set1_epi16((short) (i - first - 1)));
+            const __m256i changed = _mm256_and_si256(_mm256_xor_si256(current, before), fresh);
+
+            risingSum = _mm256_add_epi64(risingSum, _mm256_sad_epu8(popcountBytes(_mm256_and_si256(changed, current)), zero));
+            fallingSum = _mm256_add_epi64(fallingSum, _mm256_sad_epu8(popcountBytes(_mm256_andnot_si256(current, changed)), zero));
+            linesSeen = _mm256_or_si256(linesSeen, changed);
+
+            for (int k = 0; k < VECTOR_WORDS; k += 4)
+            {
+                const __m128i four = _mm_loadl_epi64((const __m128i*) (words + 2 * (first + k)));
+                _mm256_storeu_si256((__m256i*) (dest + first + k), _mm256_cvtepu16_epi64(four));
+            }
+        }
+
+        uint64_t sums[4];
+        uint16_t seen[VECTOR_WORDS];
+
+        _mm256_storeu_si256((__m256i*) sums, risingSum);
+        edges.rising += sums[0] + sums[1] + sums[2] + sums[3];
+
+        _mm256_storeu_si256((__m256i*) sums, fallingSum);
+        edges.falling += sums[0] + sums[1] + sums[2] + sums[3];
+
+        _mm256_storeu_si256((__m256i*) seen, linesSeen);
+
+        for (int k = 0; k < VECTOR_WORDS; k++)
+            edges.lines |= seen[k];
+    }
+
+#endif
+}
+
+DigitalInputs::DigitalInputs()
+{
+    kernel = &decodeScalar;
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel = &decodeAVX2;
+        instructionSet = "AVX2";
+    }
+#endif
+}
+
+void DigitalInputs::reset()
+{
+    state = 0;
+
+    packets.store(0);
+    rising.store(0);
+    falling.store(0);
+    lines.store(0);
+    lastState.store(0);
+}
+
+void DigitalInputs::decode(const uint8_t* words, int numWords, TtlWord* dest)
+{
+    if (numWords <= 0)
+        return;
+
+    Edges edges;
+    kernel(words, numWords, (uint16_t) state, dest, edges);
+
+    state = dest[numWords - 1];
+
+    // single writer, so plain stores keep the counters free of locked instructions
+    packets.store(packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    rising.store(rising.load(std::memory_order_relaxed) + edges.rising, std::memory_order_relaxed);
+    falling.store(falling.load(std::memory_order_relaxed) + edges.falling, std::memory_order_relaxed);
+    lines.store(lines.load(std::memory_order_relaxed) | edges.lines, std::memory_order_relaxed);
+    lastState.store(state, std::memory_order_relaxed);
+}
+
+void DigitalInputs::hold(int numWords, TtlWord* dest) const
+{
+    for (int i = 0; i < numWords; i++)
+        dest[i] = state;
+}
+
+std::string DigitalInputs::getDescription() const
+{
+    char text[192];
+    snprintf(text, sizeof(text), "packets=%llu lines=0x%04llx state=0x%04llx rising=%llu falling=%llu isa=%s",
+        (unsigned long long) packets.load(std::memory_order_relaxed),
+        (unsigned long long) lines.load(std::memory_order_relaxed),
+        (unsigned long long) lastState.load(std::memory_order_relaxed),
+        (unsigned long long) getRisingEdges(), (unsigned long long) getFallingEdges(), instructionSet);
+
+    return text;
+}
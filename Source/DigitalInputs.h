@@ -0,0 +1,103 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef DIGITALINPUTS_H_DEFINED
+#define DIGITALINPUTS_H_DEFINED
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace GeminiThreadNode {
+
+/**
+    Turns the digital input words carried by a packet (see GeminiPacket.h)
+    into the 64-bit TTL words DataBuffer::addToBuffer() takes, one per
+    frame, and counts the rising and falling edges of each line on the way.
+    The GUI finds the individual events itself by comparing consecutive
+    words.
+
+    Packets without digital inputs hold the last state. The counters are
+    written only by the acquisition thread and may be read from any.
+*/
+class DigitalInputs
+{
+public:
+    /** The GUI's 64-bit TTL word type (juce::uint64) */
+    typedef unsigned long long TtlWord;
+
+    /** Edge counts and lines seen toggling over some words */
+    struct Edges
+    {
+        uint64_t rising = 0;
+        uint64_t falling = 0;
+        uint64_t lines = 0;
+    };
+
+    /** Signature of a decoding kernel: widens 'numWords' little-endian words into 'dest', following on from 'previous' */
+    typedef void (*DecodeFn)(const uint8_t* words, int numWords, uint16_t previous, TtlWord* dest, Edges& edges);
+
+    /** Constructor */
+    DigitalInputs();
+
+    /** Clears the state and counters. Only call while stopped. */
+    void reset();
+
+    /** Widens a packet's 'numWords' digital input words into 'dest' and counts their edges */
+    void decode(const uint8_t* words, int numWords, TtlWord* dest);
+
+    /** Fills 'numWords' entries of 'dest' with the current state, for frames without digital inputs */
+    void hold(int numWords, TtlWord* dest) const;
+
+    /** State of the lines at the last decoded frame */
+    uint64_t getState() const { return state; }
+
+    /** Rising edges counted since reset(), over all lines */
+    uint64_t getRisingEdges() const { return rising.load(std::memory_order_relaxed); }
+
+    /** Falling edges counted since reset(), over all lines */
+    uint64_t getFallingEdges() const { return falling.load(std::memory_order_relaxed); }
+
+    /** Returns the name of the instruction set the kernel uses */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /** Returns the lines seen toggling, the state, the counters and the instruction set, for status messages */
+    std::string getDescription() const;
+
+private:
+    DecodeFn kernel;
+    const char* instructionSet;
+
+    uint64_t state = 0;
+
+    std::atomic<uint64_t> packets { 0 };
+    std::atomic<uint64_t> rising { 0 };
+    std::atomic<uint64_t> falling { 0 };
+    std::atomic<uint64_t> lines { 0 };
+    std::atomic<uint64_t> lastState { 0 };
+};
+
+}
+
+#endif
@@ -0,0 +1,1017 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "GeminiDevice.h"
+#include "Realtime.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    /** Alignment of the staging arena and of every buffer carved from it */
+    const size_t ARENA_ALIGNMENT = 64;
+
+    size_t alignUp(size_t bytes)
+    {
+        return (bytes + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    }
+
+    int64 clockNs(clockid_t clockId)
+    {
+        struct timespec now;
+        clock_gettime(clockId, &now);
+        return (int64) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+}
+
+GeminiDevice::GeminiDevice(int port_, DataBuffer* buffer_) : port(port_), buffer(buffer_)
+{
+    // a write holds at most STAGING_VALUES values, and so at most that many frames;
+    // gaps are filled a packet at a time. Decimating by two or more, the LFP
+    // outputs of a write fit in as many values again.
+    const size_t stagingBytes = alignUp(STAGING_VALUES * sizeof(float));
+    const size_t fillBytes = alignUp(GeminiPacket::MAX_PACKET_VALUES * sizeof(float));
+    const size_t wordBytes = alignUp(STAGING_VALUES * sizeof(int64));
+    arenaBytes = 2 * stagingBytes + fillBytes + 3 * wordBytes;
+
+    arena = (uint8_t*) aligned_alloc(ARENA_ALIGNMENT, arenaBytes);
+
+    // touch every page now rather than on the first packets
+    memset(arena, 0, arenaBytes);
+
+    convbuf = (float*) arena;
+    fillbuf = (float*) (arena + stagingBytes);
+    sampleNumbers = (int64*) (arena + stagingBytes + fillBytes);
+    timestamps = (double*) (arena + stagingBytes + fillBytes + wordBytes);
+    ttlEventWords = (uint64*) (arena + stagingBytes + fillBytes + 2 * wordBytes);
+    lfpbuf = (float*) (arena + stagingBytes + fillBytes + 3 * wordBytes);
+}
+
+GeminiDevice::~GeminiDevice()
+{
+    release();
+    closeSocket();
+    unlockMemory();
+    free(arena);
+}
+
+bool GeminiDevice::bindSocket(int numShards)
+{
+    probeMatches = 0;
+
+    return sockets.open(port, numShards < 1 ? 1 : numShards);
+}
+
+bool GeminiDevice::probeLayout()
+{
+    if (layout.detected)
+        return true;
+
+    // nothing is being decoded yet, so the conversion buffer doubles as the datagram buffer
+    uint8_t* datagram = (uint8_t*) convbuf;
+    GeminiPacket::Header packetHeader;
+
+    for (int i = 0; i < sockets.size(); i++)
+    {
+        ssize_t length;
+
+        while ((length = recv(sockets.getSocket(i), datagram, GeminiPacket::MAX_PACKET_SIZE, MSG_DONTWAIT)) >= 0)
+        {
+            if (GeminiPacket::parseHeader(datagram, (size_t) length, packetHeader) != GeminiPacket::ParseResult::OK
+                || packetHeader.num_channels == 0 || packetHeader.num_samples == 0)
+            {
+                probeMatches = 0;
+                continue;
+            }
+
+            if (probeMatches > 0
+                && probe.numChannels == packetHeader.num_channels
+                && probe.numSamples == packetHeader.num_samples
+                && probe.format == packetHeader.sample_format
+                && probe.digitalInputs == GeminiPacket::hasDigitalInputs(packetHeader))
+            {
+                probeMatches++;
+            }
+            else
+            {
+                probe.numChannels = packetHeader.num_channels;
+                probe.numSamples = packetHeader.num_samples;
+                probe.format = packetHeader.sample_format;
+                probe.digitalInputs = GeminiPacket::hasDigitalInputs(packetHeader);
+                probe.detected = true;
+                probeMatches = 1;
+            }
+
+            if (probeMatches >= LAYOUT_PROBE_PACKETS)
+            {
+                layout = probe;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+std::vector<int> GeminiDevice::getOutputChannels() const
+{
+    std::vector<int> outputs;
+
+    for (int channel : channelMap)
+    {
+        if (channel >= 0 && channel < layout.numChannels)
+            outputs.push_back(channel);
+    }
+
+    // the whole device in wire order needs no map
+    bool identity = (int) outputs.size() == layout.numChannels;
+
+    for (int i = 0; i < (int) outputs.size() && identity; i++)
+        identity = outputs[i] == i;
+
+    if (identity)
+        outputs.clear();
+
+    return outputs;
+}
+
+int GeminiDevice::getNumOutputs() const
+{
+    const std::vector<int> outputs = getOutputChannels();
+
+    return outputs.empty() ? layout.numChannels : (int) outputs.size();
+}
+
+String GeminiDevice::getLayoutStatus() const
+{
+    return "port=" + String(port)
+        + " channels=" + String(layout.numChannels)
+        + " published=" + String(getNumOutputs())
+        + " samples=" + String(layout.numSamples)
+        + " format=" + String(GeminiPacket::formatName(layout.format))
+        + " ttl=" + String(layout.digitalInputs ? "yes" : "no")
+        + " source=" + String(layout.detected ? "detected" : "configured");
+}
+
+void GeminiDevice::closeSocket()
+{
+    sockets.close();
+}
+
+void GeminiDevice::resizeBuffers(const Settings& settings, RingWaiter& waiter)
+{
+    num_channels = layout.numChannels;
+    num_samp = layout.numSamples;
+    outputChannels = getOutputChannels();
+    num_outputs = outputChannels.empty() ? num_channels : (int) outputChannels.size();
+
+    // leave room for the widest sample format and the digital input words so a format change never
+    // truncates datagrams; shard rings hold decoded float frames and the same words in the same space.
+    // Staging buffers come from the arena.
+    const size_t required_slot_size = GeminiPacket::HEADER_SIZE
+        + (size_t) num_channels * num_samp * sizeof(float)
+        + (size_t) num_samp * GeminiPacket::DIGITAL_WORD_SIZE;
+    const size_t numRings = (size_t) (settings.numShards < 1 ? 1 : settings.numShards);
+
+    if (rings.size() != numRings || rings[0]->getCapacity() < settings.ringSlots || slot_size != required_slot_size)
+    {
+        slot_size = required_slot_size;
+        rings.clear();
+
+        for (size_t i = 0; i < numRings; i++)
+            rings.push_back(std::make_unique<PacketRing>(settings.ringSlots, slot_size, &waiter));
+    }
+
+    shardHeads.resize(numRings);
+    shardSlots.resize(numRings);
+    shardAvailable.resize(numRings);
+    shardTaken.resize(numRings);
+}
+
+bool GeminiDevice::prepare(const Settings& settings, DatagramReceiver::Backend backend, int maxBatch)
+{
+    total_samples = 0;
+    digital.reset();
+
+    coalesceUs = settings.coalesceUs;
+    stagedFrames = 0;
+    stagedPackets = 0;
+    stagedDeadlineUs = -1;
+
+    error_flag = false;
+
+    decoder.setScaling(settings.dataScale, settings.dataOffset);
+
+    // the detected or configured format until a packet says otherwise
+    decoder.setChannelMap(outputChannels);
+    decoder.setLayout(layout.format, num_channels, num_samp);
+
+    reorder_depth = settings.reorderDepth;
+    reorder_hold_us = settings.reorderHoldUs;
+    reorder.prepare(reorder_depth, slot_size);
+    reorder.setMaxHold(reorder_hold_us);
+
+    sequence.reset();
+    sequence.setMaxGap((int64) (settings.sampleRate * MAX_CONCEAL_SECONDS));
+    concealer.setPolicy(settings.gapPolicy);
+    concealer.prepare(num_outputs);
+    clock.reset(settings.sampleRate);
+
+    monitor.prepare(num_outputs, num_samp, settings.sampleRate, settings.dataScale, settings.dataOffset);
+    monitor.setEnabled(settings.channelMonitor);
+
+    preprocessor.prepare(num_outputs, settings.sampleRate, settings.reference, settings.highpassHz);
+
+    decimator.prepare(num_outputs, lfpBuffer != nullptr ? settings.lfpFactor : 1);
+    lfp_samples = 0;
+
+    stats.reset();
+    lastStatsNs = clockNs(CLOCK_MONOTONIC);
+    lastStatsPackets = 0;
+    lastStatsBytes = 0;
+
+    mergeStarted = false;
+    mergeNext = 0;
+
+    for (auto& ring : rings)
+        ring->reset();
+
+    receivers.clear();
+    shardThreads.clear();
+    captures.clear();
+
+    if ((size_t) sockets.size() != rings.size())
+    {
+        LOGC("GeminiThread port ", port, " is bound with ", sockets.size(), " shard(s) but buffers were sized for ", (int) rings.size());
+        return false;
+    }
+
+    predecoded = isSharded();
+
+    busyPollUs = settings.busyPollUs;
+    kernelBusyPoll = busyPollUs > 0 && sockets.setBusyPoll(busyPollUs);
+
+    if (busyPollUs > 0 && !kernelBusyPoll)
+        LOGC("GeminiThread port ", port, ": SO_BUSY_POLL refused (", strerror(errno), "), busy polling in user space only");
+
+    receiveBufferKb = settings.receiveBufferKb;
+    effectiveReceiveBufferKb = 0;
+
+    if (receiveBufferKb > 0)
+    {
+        // report the smallest buffer any shard got
+        for (int i = 0; i < sockets.size(); i++)
+        {
+            const int granted = Realtime::setReceiveBuffer(sockets.getSocket(i), receiveBufferKb * 1024);
+
+            if (granted >= 0 && (i == 0 || granted / 1024 < effectiveReceiveBufferKb))
+                effectiveReceiveBufferKb = granted / 1024;
+        }
+
+        if (effectiveReceiveBufferKb < receiveBufferKb)
+            LOGC("GeminiThread port ", port, ": asked for a ", receiveBufferKb, " kB receive buffer, got ", effectiveReceiveBufferKb,
+                " kB (raise net.core.rmem_max or grant CAP_NET_ADMIN)");
+    }
+
+    if (settings.capturePrefix.isNotEmpty())
+        openCaptures(settings);
+
+    if (!predecoded)
+    {
+        // the receive thread waits on all unsharded devices at once
+        receivers.push_back(DatagramReceiver::create(backend, sockets.getSocket(0), maxBatch, slot_size, 0));
+        return receivers[0] != nullptr;
+    }
+
+    const int numCpus = (int) std::thread::hardware_concurrency();
+
+    for (int i = 0; i < sockets.size(); i++)
+    {
+        std::unique_ptr<DatagramReceiver> receiver = DatagramReceiver::create(backend, sockets.getSocket(i), maxBatch, slot_size, 0);
+
+        if (receiver == nullptr)
+        {
+            receivers.clear();
+            shardThreads.clear();
+            return false;
+        }
+
+        const int cpu = numCpus > 0 ? (settings.firstCpu + i) % numCpus : -1;
+
+        shardThreads.push_back(std::make_unique<ShardThread>(*receiver, *rings[i], maxBatch, cpu, settings.recvTimeoutMs));
+        shardThreads.back()->setLayout(num_channels, num_samp, settings.dataScale, settings.dataOffset);
+        shardThreads.back()->setChannelMap(outputChannels);
+        shardThreads.back()->setBusyPoll(busyPollUs);
+        shardThreads.back()->setPriority(settings.rtPriority);
+        shardThreads.back()->setCapture(i < (int) captures.size() ? captures[i].get() : nullptr);
+
+        receivers.push_back(std::move(receiver));
+    }
+
+    return true;
+}
+
+void GeminiDevice::openCaptures(const Settings& settings)
+{
+    for (int i = 0; i < sockets.size(); i++)
+    {
+        String prefix = settings.capturePrefix + "_" + String(port);
+
+        if (sockets.size() > 1)
+            prefix += "_shard" + String(i);
+
+        std::unique_ptr<PacketCapture> capture = std::make_unique<PacketCapture>();
+
+        if (!capture->open(prefix.toStdString(), port, i, (size_t) settings.captureSegmentMb << 20, settings.captureCompressor))
+        {
+            LOGC("GeminiThread could not start a raw capture at ", prefix, ": ", strerror(errno));
+            CoreServices::sendStatusMessage("GeminiThread: raw capture failed on port " + String(port) + ".");
+            captures.clear();
+            return;
+        }
+
+        captures.push_back(std::move(capture));
+    }
+}
+
+int GeminiDevice::startShards()
+{
+    int numPinned = 0;
+
+    for (auto& shard : shardThreads)
+    {
+        if (!shard->start())
+        {
+            stopShards();
+            return -1;
+        }
+
+        if (shard->isPinned())
+            numPinned++;
+    }
+
+    return numPinned;
+}
+
+void GeminiDevice::stopShards()
+{
+    for (auto& shard : shardThreads)
+        shard->stop();
+}
+
+void GeminiDevice::release()
+{
+    stopShards();
+
+    shardThreads.clear();
+    receivers.clear();
+
+    for (auto& capture : captures)
+        capture->close();
+
+    if (buffer != nullptr)
+        buffer->clear();
+
+    if (lfpBuffer != nullptr)
+        lfpBuffer->clear();
+}
+
+bool GeminiDevice::lockMemory()
+{
+    if (!arenaLocked)
+        arenaLocked = Realtime::lockBuffer(arena, arenaBytes);
+
+    bool locked = arenaLocked;
+
+    for (auto& ring : rings)
+        locked = ring->lockMemory() && locked;
+
+    return locked;
+}
+
+void GeminiDevice::unlockMemory()
+{
+    if (arenaLocked)
+        Realtime::unlockBuffer(arena, arenaBytes);
+
+    arenaLocked = false;
+
+    for (auto& ring : rings)
+        ring->unlockMemory();
+}
+
+bool GeminiDevice::isTuned() const
+{
+    if (receiveBufferKb > 0 && effectiveReceiveBufferKb < receiveBufferKb)
+        return false;
+
+    for (auto& shard : shardThreads)
+    {
+        if (!shard->isRealtime())
+            return false;
+    }
+
+    return true;
+}
+
+bool GeminiDevice::hasData() const
+{
+    for (auto& ring : rings)
+    {
+        if (ring->hasData())
+            return true;
+    }
+
+    return false;
+}
+
+int GeminiDevice::getShardError() const
+{
+    for (auto& shard : shardThreads)
+    {
+        if (shard->hasFailed())
+            return shard->getError();
+    }
+
+    return 0;
+}
+
+bool GeminiDevice::errorFlag() const
+{
+    if (error_flag)
+        return true;
+
+    for (auto& shard : shardThreads)
+    {
+        if (shard->getInvalidPackets() > 0)
+            return true;
+    }
+
+    return false;
+}
+
+int64 GeminiDevice::getNextDeadline() const
+{
+    const int64 reorderDeadline = reorder.getNextDeadline();
+
+    if (stagedFrames == 0)
+        return reorderDeadline;
+
+    return reorderDeadline < 0 ? stagedDeadlineUs : jmin(reorderDeadline, stagedDeadlineUs);
+}
+
+int GeminiDevice::update(int64 nowUs)
+{
+    updateUs = nowUs;
+
+    auto release = [this](const GeminiPacket::Header& packetHeader, const uint8_t* payload, int64_t receiveNs) {
+        handlePacket(packetHeader, payload, receiveNs);
+    };
+
+    int n;
+
+    if (predecoded)
+    {
+        n = mergeShards(nowUs);
+    }
+    else
+    {
+        PacketSlot* slots;
+        n = rings[0]->getReadableSlots(slots);
+
+        for (int i = 0; i < n; i++)
+            processPacket(slots[i], nowUs);
+
+        rings[0]->commitRead(n);
+    }
+
+    reorder.expire(nowUs, release);
+
+    if (stagedFrames > 0 && nowUs >= stagedDeadlineUs)
+        flushStaged();
+
+    stats.setSequenceTotals(sequence.getPacketsLost(),
+        reorder.getReordered(),
+        sequence.getDuplicates() + reorder.getDuplicates(),
+        sequence.getLatePackets() + reorder.getTooLate());
+
+    return n;
+}
+
+int GeminiDevice::mergeShards(int64 nowUs)
+{
+    auto release = [this](const GeminiPacket::Header& packetHeader, const uint8_t* payload, int64_t receiveNs) {
+        handlePacket(packetHeader, payload, receiveNs);
+    };
+
+    const int numShards = (int) rings.size();
+
+    // shard threads only publish validated packets, so the headers always parse
+    for (int i = 0; i < numShards; i++)
+    {
+        shardAvailable[i] = rings[i]->getReadableSlots(shardSlots[i]);
+        shardTaken[i] = 0;
+
+        if (shardAvailable[i] > 0)
+            GeminiPacket::parseHeader(shardSlots[i][0].data, shardSlots[i][0].length, shardHeads[i]);
+    }
+
+    int merged = 0;
+
+    while (true)
+    {
+        int best = -1;
+        int32_t bestDistance = 0;
+
+        for (int i = 0; i < numShards; i++)
+        {
+            if (shardTaken[i] == shardAvailable[i])
+                continue;
+
+            if (!mergeStarted)
+            {
+                mergeStarted = true;
+                mergeNext = shardHeads[i].packet_number;
+            }
+
+            const int32_t distance = (int32_t) (shardHeads[i].packet_number - mergeNext);
+
+            if (best < 0 || distance < bestDistance)
+            {
+                best = i;
+                bestDistance = distance;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        const PacketSlot& slot = shardSlots[best][shardTaken[best]];
+        const GeminiPacket::Header& head = shardHeads[best];
+
+        if (bestDistance >= 0)
+            mergeNext = head.packet_number + 1;
+
+        stats.addPacket(GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(head));
+
+        reorder.push(head, slot.data + GeminiPacket::HEADER_SIZE, slot.length - GeminiPacket::HEADER_SIZE, slot.timestampNs, nowUs, release);
+
+        merged++;
+
+        if (++shardTaken[best] < shardAvailable[best])
+        {
+            const PacketSlot& next = shardSlots[best][shardTaken[best]];
+            GeminiPacket::parseHeader(next.data, next.length, shardHeads[best]);
+        }
+    }
+
+    for (int i = 0; i < numShards; i++)
+        rings[i]->commitRead(shardTaken[i]);
+
+    return merged;
+}
+
+void GeminiDevice::processPacket(const PacketSlot& packet, int64 nowUs)
+{
+    GeminiPacket::ParseResult result = GeminiPacket::parseHeader(packet.data, packet.length, header);
+
+    if (result != GeminiPacket::ParseResult::OK)
+    {
+        LOGD("GeminiThread dropped packet on port ", port, ": ", GeminiPacket::describe(result));
+        stats.addInvalid();
+        error_flag = true;
+        return;
+    }
+
+    // packets may change format or shrink, but never outgrow the ring slots
+    if (header.num_channels != num_channels || header.num_samples > num_samp)
+    {
+        LOGD("GeminiThread dropped packet on port ", port, " with unexpected layout: ", header.num_channels, " channels x ", header.num_samples, " samples");
+        stats.addInvalid();
+        error_flag = true;
+        return;
+    }
+
+    stats.addPacket(packet.length);
+
+    reorder.push(header, packet.data + GeminiPacket::HEADER_SIZE, GeminiPacket::payloadSize(header), packet.timestampNs, nowUs,
+        [this](const GeminiPacket::Header& packetHeader, const uint8_t* payload, int64_t receiveNs) {
+            handlePacket(packetHeader, payload, receiveNs);
+        });
+}
+
+void GeminiDevice::handlePacket(const GeminiPacket::Header& packetHeader, const uint8_t* payload, int64_t receiveNs)
+{
+    SequenceTracker::Status status = sequence.update(packetHeader.sample_number, packetHeader.num_samples);
+
+    if (status == SequenceTracker::Status::DUPLICATE || status == SequenceTracker::Status::LATE)
+        return;
+
+    // only packets that are published feed the clock fit; a duplicate would pair a seen sample with a later receive time
+    clock.observe(packetHeader.sample_number, receiveNs);
+
+    const int numSamples = packetHeader.num_samples;
+
+    // a write holds one run of consecutive samples, so gaps and resyncs end it
+    if (stagedFrames > 0
+        && (status != SequenceTracker::Status::IN_ORDER
+            || (size_t) (stagedFrames + numSamples) * num_outputs > STAGING_VALUES
+            || stagedPackets == MAX_COALESCED_PACKETS))
+    {
+        flushStaged();
+    }
+
+    float* frames = convbuf + (size_t) stagedFrames * num_outputs;
+
+    if (predecoded)
+    {
+        // the shard threads time their own decoding
+        memcpy(frames, payload, sizeof(float) * num_outputs * numSamples);
+
+        if (monitor.isEnabled())
+            monitor.accumulate(frames, numSamples);
+    }
+    else
+    {
+        if (packetHeader.sample_format != decoder.getFormat() || numSamples != decoder.getNumSamples())
+        {
+            decoder.setLayout(packetHeader.sample_format, num_channels, numSamples);
+            LOGD("GeminiThread port ", port, " now decoding with ", decoder.getKernelName());
+        }
+
+        const int64 decodeStart = clockNs(CLOCK_MONOTONIC);
+
+        if (monitor.isEnabled())
+            decoder.decode(packetHeader, payload, frames, monitor);
+        else
+            decoder.decode(packetHeader, payload, frames);
+
+        stats.addDecodeTime(clockNs(CLOCK_MONOTONIC) - decodeStart);
+    }
+
+    if (status == SequenceTracker::Status::GAP)
+    {
+        concealGap(sequence.getSampleNumber() - sequence.getGapLength(),
+            packetHeader.sample_number - (uint64) sequence.getGapLength(),
+            sequence.getGapLength(),
+            frames);
+    }
+    else if (status == SequenceTracker::Status::RESYNC)
+    {
+        LOGD("GeminiThread device on port ", port, " sample counter jumped to ", (int64) packetHeader.sample_number, "; resynchronized");
+    }
+
+    // after any concealment, which publishes the held state through the same words
+    if (GeminiPacket::hasDigitalInputs(packetHeader))
+    {
+        const size_t samplesBytes = predecoded ? sizeof(float) * num_outputs * numSamples : GeminiPacket::samplesSize(packetHeader);
+        digital.decode(payload + samplesBytes, numSamples, ttlEventWords + stagedFrames);
+    }
+    else
+    {
+        digital.hold(numSamples, ttlEventWords + stagedFrames);
+    }
+
+    if (stagedFrames == 0)
+    {
+        stagedSampleNumber = sequence.getSampleNumber();
+        stagedDeviceSample = packetHeader.sample_number;
+        stagedDeadlineUs = updateUs + coalesceUs;
+    }
+
+    // the concealer interpolates raw samples; the filter sees them when a gap is filled
+    concealer.remember(frames + (numSamples - 1) * num_outputs);
+
+    if (preprocessor.isEnabled())
+        preprocessor.process(frames, numSamples);
+
+    stagedReceiveNs[stagedPackets++] = receiveNs;
+    stagedFrames += numSamples;
+
+    if (updateUs >= stagedDeadlineUs)
+        flushStaged();
+}
+
+void GeminiDevice::flushStaged()
+{
+    if (stagedFrames == 0)
+        return;
+
+    publish(convbuf, stagedSampleNumber, stagedDeviceSample, stagedFrames);
+
+    const int64 nowNs = clockNs(CLOCK_REALTIME);
+
+    for (int i = 0; i < stagedPackets; i++)
+        stats.addLatency((nowNs - stagedReceiveNs[i]) / 1000);
+
+    stagedFrames = 0;
+    stagedPackets = 0;
+    stagedDeadlineUs = -1;
+}
+
+void GeminiDevice::concealGap(int64 firstSampleNumber, uint64 firstDeviceSample, int64 length, const float* nextFrame)
+{
+    // published in packet-sized pieces, which always fit the arena
+    for (int64 offset = 0; offset < length; offset += num_samp)
+    {
+        const int count = (int) jmin((int64) num_samp, length - offset);
+
+        concealer.fill(fillbuf, offset, count, length, nextFrame);
+
+        if (preprocessor.isEnabled())
+            preprocessor.process(fillbuf, count);
+
+        digital.hold(count, ttlEventWords);
+        publish(fillbuf, firstSampleNumber + offset, firstDeviceSample + (uint64) offset, count);
+    }
+}
+
+void GeminiDevice::publish(float* data, int64 firstSampleNumber, uint64 firstDeviceSample, int count)
+{
+    const double period = clock.getSecondsPerSample();
+    double firstTimestamp = clock.toHostSeconds(firstDeviceSample);
+
+    // a refit can move the line back by more than a sample; never publish time going backwards
+    if (total_samples > 0 && firstTimestamp < lastTimestamp + period)
+        firstTimestamp = lastTimestamp + period;
+
+    for (int i = 0; i < count; i++) {
+        sampleNumbers[i] = firstSampleNumber + i;
+        timestamps[i] = firstTimestamp + period * i;
+    }
+
+    buffer->addToBuffer(data,
+        sampleNumbers,
+        timestamps,
+        ttlEventWords,
+        count,
+        1
+    );
+
+    stats.addWrite();
+
+    total_samples += count;
+    lastTimestamp = firstTimestamp + period * (count - 1);
+
+    if (decimator.isEnabled())
+        publishLfp(data, firstTimestamp, count);
+}
+
+void GeminiDevice::publishLfp(const float* data, double firstTimestamp, int count)
+{
+    const double period = clock.getSecondsPerSample();
+    const int factor = decimator.getFactor();
+    const int firstOutput = decimator.getNextOutput() - 1;
+
+    const int outputs = decimator.process(data, count, lfpbuf);
+
+    if (outputs == 0)
+        return;
+
+    // an output is complete on frame firstOutput + k * factor, and lags it by the group delay
+    const double delay = decimator.getGroupDelay() * period;
+
+    for (int k = 0; k < outputs; k++)
+    {
+        sampleNumbers[k] = lfp_samples + k;
+        timestamps[k] = firstTimestamp + period * (firstOutput + k * factor) - delay;
+        ttlEventWords[k] = digital.getState();
+    }
+
+    lfpBuffer->addToBuffer(lfpbuf,
+        sampleNumbers,
+        timestamps,
+        ttlEventWords,
+        outputs,
+        1
+    );
+
+    lfp_samples += outputs;
+}
+
+GeminiDevice::LiveStats GeminiDevice::getLiveStats()
+{
+    LiveStats live;
+
+    live.packets = stats.getPackets();
+    live.bytes = stats.getBytes();
+    live.lost = stats.getLost();
+    live.reordered = stats.getReordered();
+    live.duplicates = stats.getDuplicates();
+    live.late = stats.getLate();
+    live.invalid = stats.getInvalid();
+    live.writes = stats.getWrites();
+
+    stats.getDecodeTime().read(live.decodeNs);
+    stats.getLatency().read(live.latencyUs);
+
+    for (auto& shard : shardThreads)
+    {
+        live.invalid += shard->getInvalidPackets();
+        shard->getDecodeTime().read(live.decodeNs);
+    }
+
+    for (auto& ring : rings)
+        live.ringOverflows += ring->getOverflowCount();
+
+    for (auto& receiver : receivers)
+        live.kernelDrops += receiver->getKernelDrops();
+
+    for (auto& capture : captures)
+    {
+        live.captured += capture->getPackets();
+        live.captureDropped += capture->getDropped();
+    }
+
+    const int64 nowNs = clockNs(CLOCK_MONOTONIC);
+    const double elapsed = (nowNs - lastStatsNs) * 1e-9;
+
+    if (elapsed > 0 && live.packets >= lastStatsPackets)
+    {
+        live.packetsPerSecond = (live.packets - lastStatsPackets) / elapsed;
+        live.bytesPerSecond = (live.bytes - lastStatsBytes) / elapsed;
+    }
+
+    lastStatsNs = nowNs;
+    lastStatsPackets = live.packets;
+    lastStatsBytes = live.bytes;
+
+    return live;
+}
+
+String GeminiDevice::getRingStatus() const
+{
+    if (rings.size() == 0)
+        return "port=" + String(port) + " capacity=0";
+
+    int occupancy = 0;
+    int highWater = 0;
+    uint64 overflows = 0;
+    uint64 invalid = 0;
+
+    for (auto& ring : rings)
+    {
+        occupancy += ring->getOccupancy();
+        highWater = jmax(highWater, ring->getHighWater());
+        overflows += ring->getOverflowCount();
+    }
+
+    for (auto& shard : shardThreads)
+        invalid += shard->getInvalidPackets();
+
+    String status = "port=" + String(port)
+        + " capacity=" + String(rings[0]->getCapacity())
+        + " occupancy=" + String(occupancy)
+        + " high_water=" + String(highWater)
+        + " overflows=" + String((int64) overflows);
+
+    if (rings.size() > 1)
+        status += " shards=" + String((int) rings.size())
+            + " steered=" + String(sockets.isSteered() ? "yes" : "no")
+            + " shard_invalid=" + String((int64) invalid);
+
+    if (busyPollUs > 0)
+        status += " busy_poll_us=" + String(busyPollUs)
+            + " kernel_busy_poll=" + String(kernelBusyPoll ? "yes" : "no");
+
+    return status;
+}
+
+String GeminiDevice::getTuningStatus() const
+{
+    String status = "port=" + String(port);
+
+    if (receiveBufferKb > 0)
+        status += " rcvbuf_kb=" + String(effectiveReceiveBufferKb) + " requested_kb=" + String(receiveBufferKb);
+    else
+        status += " rcvbuf_kb=default";
+
+    for (size_t i = 0; i < shardThreads.size(); i++)
+        status += " shard" + String((int) i) + "=[" + String(shardThreads[i]->getSchedule()) + "]";
+
+    return status;
+}
+
+String GeminiDevice::getCaptureStatus() const
+{
+    if (captures.empty())
+        return "";
+
+    uint64 packets = 0;
+    uint64 bytes = 0;
+    uint64 dropped = 0;
+    int64 segments = 0;
+    int error = 0;
+
+    for (auto& capture : captures)
+    {
+        packets += capture->getPackets();
+        bytes += capture->getBytes();
+        dropped += capture->getDropped();
+        segments += capture->getSegments();
+
+        if (error == 0)
+            error = capture->getError();
+    }
+
+    String status = "port=" + String(port)
+        + " prefix=" + String(captures[0]->getPrefix())
+        + " segments=" + String(segments)
+        + " packets=" + String((int64) packets)
+        + " bytes=" + String((int64) bytes)
+        + " dropped=" + String((int64) dropped);
+
+    if (error != 0)
+        status += " error=" + String(strerror(error));
+
+    return status;
+}
+
+String GeminiDevice::getLossStatus() const
+{
+    return "port=" + String(port)
+        + " received=" + String((int64) sequence.getPacketsReceived())
+        + " lost=" + String((int64) sequence.getPacketsLost())
+        + " concealed_samples=" + String((int64) sequence.getSamplesConcealed())
+        + " duplicates=" + String((int64) sequence.getDuplicates())
+        + " late=" + String((int64) sequence.getLatePackets())
+        + " resyncs=" + String((int64) sequence.getResyncs())
+        + " policy=" + LossConcealer::getName(concealer.getPolicy());
+}
+
+String GeminiDevice::getReorderStatus() const
+{
+    return "port=" + String(port)
+        + " depth=" + String(reorder_depth)
+        + " hold_us=" + String(reorder_hold_us)
+        + " reordered=" + String((int64) reorder.getReordered())
+        + " skipped=" + String((int64) reorder.getSkipped())
+        + " too_late=" + String((int64) reorder.getTooLate())
+        + " duplicates=" + String((int64) reorder.getDuplicates())
+        + " high_water=" + String(reorder.getHighWater());
+}
+
+String GeminiDevice::getLfpStatus() const
+{
+    if (lfpBuffer == nullptr)
+        return "port=" + String(port) + " off";
+
+    if (!decimator.isEnabled())
+        return "port=" + String(port) + " starts with acquisition";
+
+    return "port=" + String(port)
+        + " factor=" + String(decimator.getFactor())
+        + " rate_hz=" + String(clock.getRate() / decimator.getFactor())
+        + " taps=" + String(decimator.getNumTaps())
+        + " delay_ms=" + String(1000.0 * decimator.getGroupDelay() * clock.getSecondsPerSample())
+        + " samples=" + String(lfp_samples)
+        + " isa=" + String(decimator.getInstructionSet());
+}
+
+String GeminiDevice::getPreprocessStatus() const
+{
+    return "port=" + String(port) + " " + String(preprocessor.getDescription());
+}
+
+String GeminiDevice::getDigitalStatus() const
+{
+    return "port=" + String(port) + " " + String(digital.getDescription());
+}
+
+String GeminiDevice::getClockStatus() const
+{
+    return "port=" + String(port)
+        + " locked=" + String(clock.isLocked() ? "yes" : "no")
+        + " rate_hz=" + String(clock.getRate())
+        + " drift_ppm=" + String(clock.getDriftPpm())
+        + " jitter_us=" + String(clock.getJitterUs())
+        + " accepted=" + String((int64) clock.getAccepted())
+        + " rejected=" + String((int64) clock.getRejected())
+        + " restarts=" + String((int64) clock.getRestarts());
+}
@@ -0,0 +1,421 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef GEMINIDEVICE_H_DEFINED
+#define GEMINIDEVICE_H_DEFINED
+
+#include <DataThreadHeaders.h>
+
+#include "ChannelMonitor.h"
+#include "ClockSync.h"
+#include "DatagramReceiver.h"
+#include "DigitalInputs.h"
+#include "Decimator.h"
+#include "GeminiPacket.h"
+#include "PacketCapture.h"
+#include "PacketDecoder.h"
+#include "PacketRing.h"
+#include "Preprocessor.h"
+#include "ReorderBuffer.h"
+#include "SequenceTracker.h"
+#include "ReceiveStats.h"
+#include "ShardThread.h"
+
+namespace GeminiThreadNode {
+
+/**
+    One Gemini headstage: its UDP socket and everything between its packet
+    ring and its DataBuffer.
+
+    Each device keeps its own reorder window, sequence tracker and sample
+    numbers, so loss or a counter restart on one headstage never shifts the
+    clock of another. All methods except the socket ones are called from the
+    acquisition thread, or while it is stopped.
+*/
+class GeminiDevice
+{
+public:
+    /** Longest gap, in seconds, that is concealed rather than resynchronized */
+    const float MAX_CONCEAL_SECONDS = 1.0f;
+
+    /** Values the staging block holds; coalesced packets are written before it overflows */
+    static constexpr size_t STAGING_VALUES = 2 * GeminiPacket::MAX_PACKET_VALUES;
+
+    /** Most packets coalesced into one DataBuffer write */
+    static constexpr int MAX_COALESCED_PACKETS = 64;
+
+    /** Consecutive packets that must agree before a layout is accepted as detected */
+    const int LAYOUT_PROBE_PACKETS = 3;
+
+    /** Channel count, samples per packet and sample format of a device's packets */
+    struct Layout
+    {
+        int numChannels = 0;
+        int numSamples = 0;
+        uint8_t format = GeminiPacket::INT16;
+        bool digitalInputs = false; // packets carry a digital input word per frame, so a TTL channel is registered
+        bool detected = false;      // false when taken from the configured parameters
+    };
+
+    /** Per-device acquisition settings, taken from the thread parameters */
+    struct Settings
+    {
+        float sampleRate;
+        float dataScale;
+        float dataOffset;
+        int ringSlots;
+        int reorderDepth;
+        int reorderHoldUs;
+        LossConcealer::Policy gapPolicy;
+        int numShards;
+        int firstCpu;
+        int recvTimeoutMs;
+        int busyPollUs;
+        String capturePrefix;       // empty when not capturing
+        int captureSegmentMb;
+        CaptureCompressor* captureCompressor;  // nullptr keeps segments raw
+        bool channelMonitor;
+        int coalesceUs;             // longest a decoded packet waits for others to share its write; 0 writes each packet
+        int rtPriority;             // SCHED_FIFO priority of the shard threads; 0 keeps default scheduling
+        int receiveBufferKb;        // SO_RCVBUF request; 0 keeps the system default
+        Preprocessor::Reference reference;
+        float highpassHz;           // 0 turns the high-pass off
+        int lfpFactor;              // decimation of the LFP stream; ignored without an LFP buffer
+    };
+
+    /** Constructor. Allocates the staging arena; the buffer is owned by the DataThread. */
+    GeminiDevice(int port, DataBuffer* buffer);
+
+    /** Destructor. Closes the socket and frees the arena. */
+    ~GeminiDevice();
+
+    /**
+        Creates the UDP socket(s) and binds them to the device port. With
+        several shards, each SO_REUSEPORT socket gets its own ShardThread that
+        also decodes, and update() merges the shard rings in packet-counter
+        order ahead of the reorder window.
+    */
+    bool bindSocket(int numShards);
+
+    /** Closes the sockets, if open */
+    void closeSocket();
+
+    /** Returns true while the socket is bound */
+    bool isBound() const { return sockets.size() > 0; }
+
+    /** Returns true if the device receives on more than one shard */
+    bool isSharded() const { return sockets.size() > 1; }
+
+    /** False if the shards share the port without packet-counter steering */
+    bool isSteered() const { return sockets.isSteered(); }
+
+    /** UDP port this device sends to */
+    int getPort() const { return port; }
+
+    /**
+        Sets the buffer the decimated LFP stream is written to, or nullptr for
+        none. Every write to the broadband buffer is then low-pass filtered and
+        decimated into it, with timestamps corrected for the filter's delay.
+        Only call while stopped.
+    */
+    void setLfpBuffer(DataBuffer* lfpBuffer_) { lfpBuffer = lfpBuffer_; }
+
+    /**
+        Sets the layout to receive, e.g. the configured one when nothing was
+        detected. Only call while stopped. The sample format and samples per
+        packet may still change during acquisition; a new channel count
+        changes the signal chain and needs a rebind.
+    */
+    void setLayout(const Layout& layout_) { layout = layout_; }
+
+    /** Layout in use: detected by probeLayout() or given to setLayout() */
+    const Layout& getLayout() const { return layout; }
+
+    /**
+        Publishes only these wire channels (0-based), in this order; empty
+        publishes all in wire order. The map is applied while decoding, so
+        everything after the decoder handles only the published channels.
+        Only call while stopped.
+    */
+    void setChannelMap(const std::vector<int>& wireChannels) { channelMap = wireChannels; }
+
+    /**
+        The wire channel behind each published channel, for the current
+        layout; map entries beyond its channel count are left out. Empty
+        when every channel is published in wire order.
+    */
+    std::vector<int> getOutputChannels() const;
+
+    /** Channels published per frame, for the current layout */
+    int getNumOutputs() const;
+
+    /** Wire channel (0-based) behind a published channel, as of the last resizeBuffers() */
+    int getWireChannel(int output) const { return outputChannels.empty() ? output : outputChannels[output]; }
+
+    /**
+        Reads whatever packets are queued on the bound sockets without
+        blocking, and adopts their layout once LAYOUT_PROBE_PACKETS
+        consecutive valid packets agree on it. Returns true once a layout
+        has been detected. Only call while bound and not acquiring; the
+        packets read are discarded.
+    */
+    bool probeLayout();
+
+    /** Returns the layout and where it came from, for status messages */
+    String getLayoutStatus() const;
+
+    /** Sizes the packet rings for the current layout. Not real-time safe. */
+    void resizeBuffers(const Settings& settings, RingWaiter& waiter);
+
+    /**
+        Resets all counters and creates the non-blocking receivers: one for
+        the shared receive thread, or one per shard with its ShardThread.
+        Also applies SO_BUSY_POLL to the sockets when busy polling is on, and
+        opens one raw capture per receiver when capturing. A capture that
+        cannot be opened is reported and skipped; it never stops acquisition.
+    */
+    bool prepare(const Settings& settings, DatagramReceiver::Backend backend, int maxBatch);
+
+    /** Starts the shard threads, if sharded. Returns the number pinned to their core, or -1 on failure. */
+    int startShards();
+
+    /** Stops the shard threads, if sharded */
+    void stopShards();
+
+    /** Drops the receivers, seals the captures and clears the buffer */
+    void release();
+
+    /** Prefaults and locks the arena and packet rings in memory. Returns false, with errno set, if any lock was refused. */
+    bool lockMemory();
+
+    /** Undoes lockMemory() */
+    void unlockMemory();
+
+    /** Returns false if a shard thread's priority or the requested receive buffer was refused */
+    bool isTuned() const;
+
+    /** Receiver of an unsharded device, created by prepare() */
+    DatagramReceiver& getReceiver() { return *receivers[0]; }
+
+    /** Ring of an unsharded device, created by resizeBuffers() */
+    PacketRing& getRing() { return *rings[0]; }
+
+    /** Raw capture of an unsharded device, or nullptr when not capturing */
+    PacketCapture* getCapture() { return captures.size() > 0 ? captures[0].get() : nullptr; }
+
+    /** Returns true if any ring holds packets waiting to be decoded */
+    bool hasData() const;
+
+    /** Returns the errno of the first shard thread that failed, or 0 */
+    int getShardError() const;
+
+    /** Time at which the next held out-of-order packet must be released, or coalesced samples written, or -1 */
+    int64 getNextDeadline() const;
+
+    /** Decodes and publishes everything in the ring, then releases expired packets and writes coalesced samples that are due. Returns the packets consumed. */
+    int update(int64 nowUs);
+
+    /** Returns true if invalid packets were received since prepare() */
+    bool errorFlag() const;
+
+    /** Returns the packet ring's capacity, occupancy, high-water mark and overflow count */
+    String getRingStatus() const;
+
+    /** Returns the packet loss counters kept by the sequence tracker */
+    String getLossStatus() const;
+
+    /** Returns the reorder window settings and counters */
+    String getReorderStatus() const;
+
+    /** Returns the sample clock estimate against the host clock */
+    String getClockStatus() const;
+
+    /** Returns the effective receive buffer size and shard thread scheduling */
+    String getTuningStatus() const;
+
+    /** Returns the LFP decimation factor, rate, filter length and delay, or "off" */
+    String getLfpStatus() const;
+
+    /** Returns the common reference and high-pass filter applied to the decoded samples */
+    String getPreprocessStatus() const;
+
+    /** Returns the digital input lines seen, their state and edge counts */
+    String getDigitalStatus() const;
+
+    /** Returns the raw capture file prefix and counters, or an empty string when not capturing */
+    String getCaptureStatus() const;
+
+    /** Copies the latest per-channel signal quality window. Returns false if none has completed. */
+    bool getChannelHealth(ChannelMonitor::Snapshot& snapshot) { return monitor.getSnapshot(snapshot); }
+
+    /** A consistent-enough copy of the live counters, for display */
+    struct LiveStats
+    {
+        uint64 packets = 0;
+        uint64 bytes = 0;
+        double packetsPerSecond = 0;
+        double bytesPerSecond = 0;
+        uint64 lost = 0;
+        uint64 reordered = 0;
+        uint64 duplicates = 0;
+        uint64 late = 0;
+        uint64 invalid = 0;
+        uint64 ringOverflows = 0;
+        uint64 kernelDrops = 0;
+        uint64 captured = 0;
+        uint64 captureDropped = 0;
+        uint64 writes = 0;
+        uint64_t decodeNs[Histogram::NUM_BUCKETS] = {};
+        uint64_t latencyUs[Histogram::NUM_BUCKETS] = {};
+    };
+
+    /**
+        Reads the live counters without disturbing acquisition. Rates cover
+        the interval since the previous call, so only the message thread
+        should call this.
+    */
+    LiveStats getLiveStats();
+
+private:
+
+    /** Validates a received datagram and passes it through the reorder window */
+    void processPacket(const PacketSlot& packet, int64 nowUs);
+
+    /** Opens one raw capture per socket, or none if any fails */
+    void openCaptures(const Settings& settings);
+
+    /** Passes the decoded packets waiting in the shard rings to the reorder window, lowest packet number first */
+    int mergeShards(int64 nowUs);
+
+    /** Decodes an in-order packet and adds its samples to the buffer */
+    void handlePacket(const GeminiPacket::Header& packetHeader, const uint8_t* payload, int64_t receiveNs);
+
+    /** Publishes synthesized samples for a gap of 'length' samples starting at 'firstSampleNumber' (device sample 'firstDeviceSample'), leading up to 'nextFrame' */
+    void concealGap(int64 firstSampleNumber, uint64 firstDeviceSample, int64 length, const float* nextFrame);
+
+    /**
+        Writes the samples waiting in the staging block, if any. Packets are
+        coalesced there until the oldest has waited coalesceUs, the block is
+        full, or the run of consecutive samples breaks.
+    */
+    void flushStaged();
+
+    /** Adds 'count' interleaved frames, with the TTL words already in ttlEventWords, to the buffer, numbered from 'firstSampleNumber' and timestamped from 'firstDeviceSample' */
+    void publish(float* data, int64 firstSampleNumber, uint64 firstDeviceSample, int count);
+
+    /** Decimates frames just published with timestamps from 'firstTimestamp', and adds whatever outputs they complete to the LFP buffer */
+    void publishLfp(const float* data, double firstTimestamp, int count);
+
+    // socket
+    const int port;
+    ShardGroup sockets;
+    std::vector<std::unique_ptr<DatagramReceiver>> receivers;
+    std::vector<std::unique_ptr<ShardThread>> shardThreads;
+    std::vector<std::unique_ptr<PacketCapture>> captures;
+
+    // layout
+    Layout layout;
+    Layout probe;
+    int probeMatches = 0;
+    int num_channels = 0;       // on the wire
+    int num_outputs = 0;        // published, after the channel map
+    std::vector<int> channelMap;
+    std::vector<int> outputChannels;
+    int num_samp = 0;
+    int max_samp = 0;
+    uint64 layoutChanges = 0;
+    int reorder_depth = 1;
+    int reorder_hold_us = 0;
+
+    // state vars
+    bool error_flag = false;
+    int64 total_samples = 0;
+    double lastTimestamp = 0;
+
+    // decoding
+    GeminiPacket::Header header;
+    PacketDecoder decoder;
+    ReorderBuffer reorder;
+    SequenceTracker sequence;
+    LossConcealer concealer;
+    ClockSync clock;
+    ChannelMonitor monitor;
+    Preprocessor preprocessor;  // runs on each packet as it is staged, concealed ones included, so its state follows the published signal
+    Decimator decimator;
+    DigitalInputs digital;      // flagged packets' words go straight into ttlEventWords; other frames hold the last state
+
+    // merge state, one entry per shard
+    std::vector<GeminiPacket::Header> shardHeads;
+    std::vector<PacketSlot*> shardSlots;
+    std::vector<int> shardAvailable;
+    std::vector<int> shardTaken;
+    bool mergeStarted = false;
+    uint32_t mergeNext = 0;
+    bool predecoded = false;
+
+    // live statistics; the rate window is only touched by getLiveStats()
+    ReceiveStats stats;
+    int64 lastStatsNs = 0;
+    uint64 lastStatsPackets = 0;
+    uint64 lastStatsBytes = 0;
+
+    // adaptive busy polling; the kernel may refuse SO_BUSY_POLL without CAP_NET_ADMIN
+    int busyPollUs = 0;
+    bool kernelBusyPoll = false;
+
+    // buffers; the LFP one is optional
+    DataBuffer* buffer;
+    DataBuffer* lfpBuffer = nullptr;
+    int64 lfp_samples = 0;
+    std::vector<std::unique_ptr<PacketRing>> rings;
+    size_t slot_size = 0;
+
+    // coalescing; staged frames are consecutive in sample number
+    int coalesceUs = 0;
+    int64 updateUs = 0;
+    int stagedFrames = 0;
+    int stagedPackets = 0;
+    int64 stagedSampleNumber = 0;
+    uint64 stagedDeviceSample = 0;
+    int64 stagedDeadlineUs = -1;
+    int64_t stagedReceiveNs[MAX_COALESCED_PACKETS];
+
+    // receive buffer asked for and granted, in kB; 0 when not asked
+    int receiveBufferKb = 0;
+    int effectiveReceiveBufferKb = 0;
+
+    // staging buffers, carved from one aligned block sized for the largest write, so layout changes never allocate
+    uint8_t* arena = nullptr;
+    size_t arenaBytes = 0;
+    bool arenaLocked = false;
+    float* convbuf = nullptr;
+    float* fillbuf = nullptr;
+    int64* sampleNumbers = nullptr;
+    double* timestamps = nullptr;
+    uint64* ttlEventWords = nullptr;  // parallel to the staged frames in convbuf
+    float* lfpbuf = nullptr;
+};
+
+}
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "GeminiPacket.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    inline uint16_t readLE16(const uint8_t* p)
+    {
+        return (uint16_t) (p[0] | (p[1] << 8));
+    }
+
+    inline uint32_t readLE32(const uint8_t* p)
+    {
+        return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    inline uint64_t readLE64(const uint8_t* p)
+    {
+        return (uint64_t) readLE32(p) | ((uint64_t) readLE32(p + 4) << 32);
+    }
+
+    inline void writeLE16(uint8_t* p, uint16_t v)
+    {
+        p[0] = (uint8_t) v;
+        p[1] = (uint8_t) (v >> 8);
+    }
+
+    inline void writeLE32(uint8_t* p, uint32_t v)
+    {
+        writeLE16(p, (uint16_t) v);
+        writeLE16(p + 2, (uint16_t) (v >> 16));
+    }
+
+    inline void writeLE64(uint8_t* p, uint64_t v)
+    {
+        writeLE32(p, (uint32_t) v);
+        writeLE32(p + 4, (uint32_t) (v >> 32));
+    }
+}
+
+size_t GeminiPacket::bytesPerSample(uint8_t format)
+{
+    switch (format)
+    {
+    case INT16:
+    case UINT16:
+        return 2;
+    case INT24:
+        return 3;
+    case FLOAT32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+const char* GeminiPacket::formatName(uint8_t format)
+{
+    switch (format)
+    {
+    case INT16:
+        return "int16";
+    case UINT16:
+        return "uint16";
+    case INT24:
+        return "int24";
+    case FLOAT32:
+        return "float32";
+    default:
+        return "unknown";
+    }
+}
+
+size_t GeminiPacket::payloadSize(const Header& header)
+{
+    return samplesSize(header) + (hasDigitalInputs(header) ? (size_t) header.num_samples * DIGITAL_WORD_SIZE : 0);
+}
+
+size_t GeminiPacket::samplesSize(const Header& header)
+{
+    return (size_t) header.num_channels * header.num_samples * bytesPerSample(header.sample_format);
+}
+
+GeminiPacket::ParseResult GeminiPacket::parseHeader(const uint8_t* data, size_t length, Header& header)
+{
+    if (length < HEADER_SIZE)
+        return ParseResult::TOO_SHORT;
+
+    if (readLE32(data) != MAGIC)
+        return ParseResult::BAD_MAGIC;
+
+    header.version = data[4];
+    header.sample_format = data[5];
+    header.num_channels = readLE16(data + 6);
+    header.num_samples = readLE16(data + 8);
+    header.flags = readLE16(data + 10);
+    header.packet_number = readLE32(data + PACKET_NUMBER_OFFSET);
+    header.sample_number = readLE64(data + 16);
+
+    if (header.version != VERSION)
+        return ParseResult::BAD_VERSION;
+
+    if (bytesPerSample(header.sample_format) == 0)
+        return ParseResult::BAD_FORMAT;
+
+    if (length < HEADER_SIZE + payloadSize(header))
+        return ParseResult::TRUNCATED;
+
+    return ParseResult::OK;
+}
+
+void GeminiPacket::writeHeader(const Header& header, uint8_t* data)
+{
+    writeLE32(data, MAGIC);
+    data[4] = header.version;
+    data[5] = header.sample_format;
+    writeLE16(data + 6, header.num_channels);
+    writeLE16(data + 8, header.num_samples);
+    writeLE16(data + 10, header.flags);
+    writeLE32(data + PACKET_NUMBER_OFFSET, header.packet_number);
+    writeLE64(data + 16, header.sample_number);
+}
+
+const char* GeminiPacket::describe(ParseResult result)
+{
+    switch (result)
+    {
+    case ParseResult::OK:
+        return "ok";
+    case ParseResult::TOO_SHORT:
+        return "datagram shorter than header";
+    case ParseResult::BAD_MAGIC:
+        return "invalid header magic";
+    case ParseResult::BAD_VERSION:
+        return "unsupported header version";
+    case ParseResult::BAD_FORMAT:
+        return "unsupported sample format";
+    case ParseResult::TRUNCATED:
+        return "payload truncated";
+    }
+    return "unknown";
+}
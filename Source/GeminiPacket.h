@@ -0,0 +1,136 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef GEMINIPACKET_H_DEFINED
+#define GEMINIPACKET_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+
+namespace GeminiThreadNode {
+
+/**
+    Wire format of a Gemini datagram.
+
+    Every datagram starts with a fixed 24-byte little-endian header, followed
+    by num_samples frames of num_channels samples each (sample-major, i.e. all
+    channels of the first sample, then all channels of the second, ...).
+
+        offset  size  field
+        0       4     magic ("GMNI")
+        4       1     version
+        5       1     sample format
+        6       2     number of channels
+        8       2     number of samples
+        10      2     flags
+        12      4     packet counter
+        16      8     device sample counter of the first sample
+
+    With FLAG_DIGITAL_INPUTS set, the samples are followed by num_samples
+    little-endian 16-bit words, the state of the digital input lines at
+    each frame (bit n = line n).
+*/
+namespace GeminiPacket {
+
+    const uint32_t MAGIC = 0x494E4D47; // "GMNI" read as little-endian
+    const uint8_t VERSION = 1;
+    const size_t HEADER_SIZE = 24;
+
+    /** Byte offset of the little-endian packet counter within the header */
+    const size_t PACKET_NUMBER_OFFSET = 12;
+
+    /** Largest datagram a device may send */
+    const size_t MAX_PACKET_SIZE = 65507;
+
+    /** Most values (channels x samples) a datagram can carry, at the narrowest sample format */
+    const size_t MAX_PACKET_VALUES = (MAX_PACKET_SIZE - HEADER_SIZE) / 2;
+
+    /** Header flag: a digital input word per frame follows the samples */
+    const uint16_t FLAG_DIGITAL_INPUTS = 0x0001;
+
+    /** Size in bytes of one digital input word */
+    const size_t DIGITAL_WORD_SIZE = 2;
+
+    /** Digital input lines a word carries */
+    const int NUM_DIGITAL_LINES = 16;
+
+    /** Encoding of the samples following the header */
+    enum SampleFormat : uint8_t
+    {
+        INT16 = 0,
+        UINT16 = 1,
+        INT24 = 2,      // packed, 3 bytes per sample
+        FLOAT32 = 3
+    };
+
+    /** Decoded packet header */
+    struct Header
+    {
+        uint8_t version = 0;
+        uint8_t sample_format = INT16;
+        uint16_t num_channels = 0;
+        uint16_t num_samples = 0;
+        uint16_t flags = 0;
+        uint32_t packet_number = 0;
+        uint64_t sample_number = 0;
+    };
+
+    /** Outcome of parsing a datagram */
+    enum class ParseResult
+    {
+        OK,
+        TOO_SHORT,
+        BAD_MAGIC,
+        BAD_VERSION,
+        BAD_FORMAT,
+        TRUNCATED
+    };
+
+    /** Returns the size in bytes of a single sample of the given format, or 0 if unknown */
+    size_t bytesPerSample(uint8_t format);
+
+    /** Returns the name of a sample format, for status messages */
+    const char* formatName(uint8_t format);
+
+    /** Returns the payload size implied by a header: the samples and, if flagged, the digital input words */
+    size_t payloadSize(const Header& header);
+
+    /** Returns the size of the samples alone, which is where the digital input words start */
+    size_t samplesSize(const Header& header);
+
+    /** True if the payload carries digital input words */
+    inline bool hasDigitalInputs(const Header& header) { return (header.flags & FLAG_DIGITAL_INPUTS) != 0; }
+
+    /** Parses and validates the header of a datagram of 'length' bytes */
+    ParseResult parseHeader(const uint8_t* data, size_t length, Header& header);
+
+    /** Writes a header into the first HEADER_SIZE bytes of 'data' */
+    void writeHeader(const Header& header, uint8_t* data);
+
+    /** Human-readable description of a parse result, for status messages */
+    const char* describe(ParseResult result);
+}
+
+}
+
+#endif
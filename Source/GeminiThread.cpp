@@ -25,17 +25,77 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
+#include <errno.h>
 
 
 #include "GeminiThread.h"
+#include "Realtime.h"
+
+#ifndef GEMINI_HEADLESS
 #include "GeminiThreadEditor.h"
+#endif
 
 using namespace GeminiThreadNode;
 
+namespace
+{
+    /** Monotonic time in microseconds, used for reorder hold deadlines */
+    int64 nowMicros()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /** Percentiles of a histogram as a JSON object, optionally with its non-empty buckets as [upper bound, count] pairs */
+    String histogramToJson(const uint64_t* counts, bool withBuckets)
+    {
+        String json = "{\"p50\":" + String((int64) Histogram::getPercentile(counts, 0.5))
+            + ",\"p90\":" + String((int64) Histogram::getPercentile(counts, 0.9))
+            + ",\"p99\":" + String((int64) Histogram::getPercentile(counts, 0.99))
+            + ",\"p999\":" + String((int64) Histogram::getPercentile(counts, 0.999))
+            + ",\"max\":" + String((int64) Histogram::getPercentile(counts, 1.0));
+
+        if (withBuckets)
+        {
+            StringArray buckets;
+
+            for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+            {
+                if (counts[i] > 0)
+                    buckets.add("[" + String((int64) Histogram::getUpperBound(i)) + "," + String((int64) counts[i]) + "]");
+            }
+
+            json += ",\"buckets\":[" + buckets.joinIntoString(",") + "]";
+        }
+
+        return json + "}";
+    }
+
+    /** True if a config message argument is OFF, in any case */
+    bool isOff(const String& token)
+    {
+        return token.toUpperCase() == "OFF";
+    }
+
+    /** A config message argument that is ON or a non-zero number */
+    bool parseSwitch(const String& token)
+    {
+        return token.getIntValue() != 0 || token.toUpperCase() == "ON";
+    }
+
+    /** A whole-number config message argument, clamped to [minValue, maxValue] */
+    int parseInt(const String& token, int minValue, int maxValue)
+    {
+        return jlimit(minValue, maxValue, token.getIntValue());
+    }
+
+    /** A config message argument, clamped to [minValue, maxValue]; OFF gives 0 */
+    float parseFloat(const String& token, float minValue, float maxValue)
+    {
+        return isOff(token) ? 0.0f : jlimit(minValue, maxValue, token.getFloatValue());
+    }
+}
+
 DataThread* GeminiThread::createDataThread(SourceNode *sn)
 {
     return new GeminiThread(sn);
@@ -43,116 +103,392 @@ DataThread* GeminiThread::createDataThread(SourceNode *sn)
 
 GeminiThread::GeminiThread(SourceNode* sn) : DataThread(sn)
 {
-    port = DEFAULT_PORT;
+    ports.add(DEFAULT_PORT);
     sample_rate = DEFAULT_SAMPLE_RATE;
     data_scale = DEFAULT_DATA_SCALE;
     data_offset = DEFAULT_DATA_OFFSET;
 
-    total_samples = 0;
     eventState = 0;
+    error_flag = false;
 
     num_channels = DEFAULT_NUM_CHANNELS;
     num_samp = DEFAULT_NUM_SAMPLES;
+    ring_slots = DEFAULT_RING_SLOTS;
+    reorder_depth = DEFAULT_REORDER_DEPTH;
+    reorder_hold_us = DEFAULT_REORDER_HOLD_US;
+    receive_shards = DEFAULT_SHARDS;
+    busy_poll_us = DEFAULT_BUSY_POLL_US;
+    capture_segment_mb = DEFAULT_CAPTURE_SEGMENT_MB;
+    coalesce_us = DEFAULT_COALESCE_US;
 
-    sourceBuffers.add(new DataBuffer(num_channels, DEFAULT_BUF_SIZE));
+    syncDevices();
 }
 
 std::unique_ptr<GenericEditor> GeminiThread::createEditor(SourceNode* sn)
 {
-
+#ifdef GEMINI_HEADLESS
+    (void) sn;
+    return nullptr;
+#else
     std::unique_ptr<GeminiThreadEditor> editor = std::make_unique<GeminiThreadEditor>(sn, this);
 
     return editor;
-
+#endif
 }
 
 GeminiThread::~GeminiThread()
 {
+    receiveThread.reset();
+    headstages.clear();
 }
 
-bool GeminiThread::connectSocket()
+bool GeminiThread::setPorts(const String& list)
 {
-    disconnectSocket();
+    StringArray tokens = StringArray::fromTokens(list, ", ", "");
+    Array<int> parsed;
+
+    for (const String& token : tokens)
+    {
+        if (token.trim().isEmpty())
+            continue;
+
+        const int port = token.getIntValue();
+
+        if (port <= MIN_PORT || port >= MAX_PORT || parsed.contains(port))
+            return false;
 
-    struct sockaddr_in servaddr;
+        parsed.add(port);
+    }
 
-    // Creating socket file descriptor
-    if ( (sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
-        LOGC("GeminiThread failed to connect");
-        CoreServices::sendStatusMessage("GeminiThread: Socket could not connect.");
-        connected = false;
+    if (parsed.size() == 0 || parsed.size() > MAX_DEVICES)
         return false;
+
+    ports = parsed;
+    return true;
+}
+
+String GeminiThread::getPortList() const
+{
+    String list;
+
+    for (int i = 0; i < ports.size(); i++)
+        list += (i > 0 ? "," : "") + String(ports[i]);
+
+    return list;
+}
+
+bool GeminiThread::setChannelMap(const String& list)
+{
+    Array<int> parsed;
+
+    if (list.trim().equalsIgnoreCase("ALL"))
+    {
+        channel_map = parsed;
+        return true;
+    }
+
+    StringArray tokens = StringArray::fromTokens(list, ", ", "");
+    std::vector<bool> seen(MAX_MAPPED_CHANNELS, false);
+
+    for (const String& token : tokens)
+    {
+        if (token.trim().isEmpty())
+            continue;
+
+        // a single channel or an ascending or descending range, 1-based
+        StringArray bounds = StringArray::fromTokens(token.trim(), "-", "");
+        const int first = bounds[0].getIntValue();
+        const int last = bounds.size() > 1 ? bounds[1].getIntValue() : first;
+
+        if (bounds.size() > 2 || token.trim() != (bounds.size() > 1 ? String(first) + "-" + String(last) : String(first))
+            || first < 1 || last < 1 || first > MAX_MAPPED_CHANNELS || last > MAX_MAPPED_CHANNELS)
+            return false;
+
+        const int step = last >= first ? 1 : -1;
+
+        for (int channel = first; ; channel += step)
+        {
+            if (seen[channel - 1])
+                return false;
+
+            seen[channel - 1] = true;
+            parsed.add(channel - 1);
+
+            if (channel == last)
+                break;
+        }
     }
 
-    memset(&servaddr, 0, sizeof(servaddr));
+    channel_map = parsed;
+    return true;
+}
+
+String GeminiThread::getChannelMapList() const
+{
+    if (channel_map.size() == 0)
+        return "ALL";
 
-    // Filling server information
-    servaddr.sin_family    = AF_INET; // IPv4
-    servaddr.sin_addr.s_addr = INADDR_ANY;
-    servaddr.sin_port = htons(DEFAULT_PORT);
+    String list;
 
-    // Bind the socket with the server address
-    if ( bind(sockfd, (const struct sockaddr *)&servaddr,
-            sizeof(servaddr)) < 0 )
+    for (int i = 0; i < channel_map.size(); )
     {
-        LOGC("GeminiThread failed to connect");
-        CoreServices::sendStatusMessage("GeminiThread: Socket could not connect.");
-        connected = false;
-        return false;
+        // runs of consecutive channels, either way, become ranges
+        int end = i;
+        const int step = i + 1 < channel_map.size() && channel_map[i + 1] == channel_map[i] - 1 ? -1 : 1;
+
+        while (end + 1 < channel_map.size() && channel_map[end + 1] == channel_map[end] + step)
+            end++;
+
+        list += (i > 0 ? "," : "") + String(channel_map[i] + 1);
+
+        if (end > i)
+            list += "-" + String(channel_map[end] + 1);
+
+        i = end + 1;
     }
 
-    LOGC("GeminiThread connected.");
-    CoreServices::sendStatusMessage("GeminiThread: Socket connected and ready to receive data.");
+    return list;
+}
+
+int GeminiThread::getWireChannel(int device, int channel) const
+{
+    if (device < 0 || device >= headstages.size())
+        return channel + 1;
+
+    return headstages[device]->getWireChannel(channel) + 1;
+}
+
+void GeminiThread::syncDevices()
+{
+    bool changed = headstages.size() != ports.size();
+
+    for (int i = 0; i < headstages.size() && !changed; i++)
+        changed = headstages[i]->getPort() != ports[i];
+
+    if (!changed)
+        return;
+
+    // sockets are bound per port, so a new list means rebinding
+    const bool wasConnected = connected;
+
+    disconnectSocket();
+    headstages.clear();
+
+    while (sourceBuffers.size() > ports.size())
+        sourceBuffers.removeLast();
+
+    while (sourceBuffers.size() < ports.size())
+        sourceBuffers.add(new DataBuffer(num_channels, DEFAULT_BUF_SIZE));
+
+    for (int i = 0; i < ports.size(); i++)
+        headstages.add(new GeminiDevice(ports[i], sourceBuffers[i]));
+
+    syncLfpBuffers();
+    applyLayouts(false, false);
+
+    if (wasConnected)
+        connectSocket();
+}
+
+void GeminiThread::syncLfpBuffers()
+{
+    lfp_factor = getLfpFactor();
+
+    const int numBuffers = headstages.size() * (lfp_factor > 1 ? 2 : 1);
+
+    while (sourceBuffers.size() > numBuffers)
+        sourceBuffers.removeLast();
+
+    while (sourceBuffers.size() < numBuffers)
+        sourceBuffers.add(new DataBuffer(num_channels, DEFAULT_BUF_SIZE));
+
+    for (int i = 0; i < headstages.size(); i++)
+        headstages[i]->setLfpBuffer(numBuffers > headstages.size() ? sourceBuffers[headstages.size() + i] : nullptr);
+}
+
+int GeminiThread::getLfpFactor() const
+{
+    if (lfp_rate <= 0 || sample_rate <= 0)
+        return 1;
+
+    return jmax(1, (int) std::lround(sample_rate / lfp_rate));
+}
+
+GeminiDevice::Settings GeminiThread::getDeviceSettings() const
+{
+    GeminiDevice::Settings settings;
+
+    settings.sampleRate = sample_rate;
+    settings.dataScale = data_scale;
+    settings.dataOffset = data_offset;
+    settings.ringSlots = ring_slots;
+    settings.reorderDepth = reorder_depth;
+    settings.reorderHoldUs = reorder_hold_us;
+    settings.gapPolicy = gap_policy;
+    settings.numShards = receive_shards;
+    settings.firstCpu = 0;
+    settings.recvTimeoutMs = RECV_TIMEOUT_MS;
+    settings.busyPollUs = busy_poll_us;
+    settings.captureSegmentMb = capture_segment_mb;
+    settings.captureCompressor = nullptr;
+    settings.channelMonitor = channel_monitor;
+    settings.coalesceUs = coalesce_us;
+    settings.rtPriority = rt_priority;
+    settings.receiveBufferKb = rcvbuf_kb;
+    settings.reference = common_reference;
+    settings.highpassHz = highpass_hz;
+    settings.lfpFactor = lfp_factor;
+
+    return settings;
+}
+
+bool GeminiThread::connectSocket()
+{
+    disconnectSocket();
+    syncDevices();
+
+    for (auto device : headstages)
+    {
+        if (!device->bindSocket(receive_shards))
+        {
+            LOGC("GeminiThread failed to bind port ", device->getPort(), ": ", strerror(errno));
+            CoreServices::sendStatusMessage("GeminiThread: Port " + String(device->getPort()) + " could not be bound.");
+            disconnectSocket();
+            return false;
+        }
+
+        if (device->isSharded() && !device->isSteered())
+            LOGC("GeminiThread could not attach the shard steering program on port ", device->getPort(), "; each sender will land on a single shard");
+    }
+
+    applyLayouts(true, true);
+
+    LOGC("GeminiThread connected on ports ", getPortList());
+    CoreServices::sendStatusMessage("GeminiThread: " + String(headstages.size()) + " socket(s) connected and ready to receive data.");
 
     connected = true;
     return true;
 }
 
+void GeminiThread::applyLayouts(bool restart, bool probe)
+{
+    GeminiDevice::Layout configured;
+    configured.numChannels = num_channels;
+    configured.numSamples = num_samp;
+    configured.digitalInputs = digital_inputs;
+
+    // a detected layout stands until the next restart, unless detection was turned off
+    for (auto device : headstages)
+    {
+        device->setChannelMap(mapped_channels);
+
+        if (restart || !layout_autodetect || !device->getLayout().detected)
+            device->setLayout(configured);
+    }
+
+    if (!probe || !layout_autodetect)
+        return;
+
+    // a single pass over whatever is queued, so the message thread never waits for packets
+    int pending = 0;
+
+    for (auto device : headstages)
+    {
+        if (!device->isBound() || device->getLayout().detected)
+            continue;
+
+        if (!device->probeLayout())
+        {
+            pending++;
+            continue;
+        }
+
+        const GeminiDevice::Layout& layout = device->getLayout();
+
+        LOGC("GeminiThread detected ", layout.numChannels, " channels x ", layout.numSamples, " samples of ",
+            GeminiPacket::formatName(layout.format), layout.digitalInputs ? " with digital inputs" : "", " on port ", device->getPort());
+    }
+
+    if (pending > 0)
+    {
+        LOGC("GeminiThread has no layout from ", pending, " port(s) yet; using the configured ", num_channels, " channels x ",
+            num_samp, " samples until a signal chain update after they start sending");
+        CoreServices::sendStatusMessage("GeminiThread: no data on " + String(pending) + " port(s); using the configured layout.");
+    }
+}
 
 void GeminiThread::disconnectSocket()
 {
-    if (sockfd != -1)
+    bool wasBound = false;
+
+    for (auto device : headstages)
     {
-        LOGD("Disconnecting socket.");
+        wasBound = wasBound || device->isBound();
+        device->closeSocket();
+    }
 
-        close(sockfd);
+    connected = false;
 
-        connected = false;
+    if (wasBound)
+    {
+        LOGD("Disconnecting sockets.");
 
-        CoreServices::sendStatusMessage("GeminiThread: Socket disconnected.");
+        CoreServices::sendStatusMessage("GeminiThread: Sockets disconnected.");
     }
 }
 
-bool GeminiThread::updateBuffer()
+bool GeminiThread::anyDeviceHasData() const
 {
-    int n;
-    socklen_t len;
-    struct sockaddr_in addr;
-    char buffer[DEFAULT_BUF_SIZE];
+    for (auto device : headstages)
+    {
+        if (device->hasData())
+            return true;
+    }
 
-    memset(&addr, 0, sizeof(addr));
-    len = sizeof(addr);  // len is value/result
+    return false;
+}
 
-    printf("Gemini buffer update\n");
+bool GeminiThread::updateBuffer()
+{
+    if (tuneAcquisition.load(std::memory_order_relaxed))
+        tuneAcquisitionThread();
 
-    n  = recvfrom(sockfd, (char *)buffer, DEFAULT_BUF_SIZE,
-            0, ( struct sockaddr *) &addr,
-            &len);
+    // don't sleep past the moment a held out-of-order packet has to be released
+    int waitUs = RING_WAIT_US;
 
-    printf("%d\n", n);
+    for (auto device : headstages)
+    {
+        const int64 deadline = device->getNextDeadline();
 
-    for (int i = 0; i < num_samp; i++) {
-        sampleNumbers.set(i, total_samples++);
-        ttlEventWords.set(i, eventState);
+        if (deadline >= 0)
+            waitUs = (int) jlimit((int64) 0, (int64) waitUs, deadline - nowMicros());
     }
 
-    sourceBuffers[0]->addToBuffer(convbuf.data(),
-        sampleNumbers.getRawDataPointer(),
-        timestamps.getRawDataPointer(),
-        ttlEventWords.getRawDataPointer(),
-        num_samp,
-        1
-    );
+    const bool ready = waiter.wait(waitUs, [this] { return anyDeviceHasData(); });
+
+    const int64 now = nowMicros();
+    int n = 0;
+
+    for (auto device : headstages)
+        n += device->update(now);
+
+    if (!ready)
+    {
+        int error = receiveThread->hasFailed() ? receiveThread->getError() : 0;
+
+        for (auto device : headstages)
+        {
+            if (error == 0)
+                error = device->getShardError();
+        }
+
+        if (error != 0)
+        {
+            LOGC("GeminiThread failed to read from socket: ", strerror(error));
+            error_flag = true;
+            return false;
+        }
+    }
 
     return true;
 }
@@ -166,11 +502,113 @@ bool GeminiThread::startAcquisition()
 {
     resizeBuffers();
 
-    total_samples = 0;
     eventState = 0;
 
     error_flag = false;
 
+    GeminiDevice::Settings settings = getDeviceSettings();
+    bool startedCompressor = false;
+
+    if (capture_dir.isNotEmpty())
+    {
+        // one set of files per acquisition, named after its start time
+        char started[32];
+        const time_t now = time(nullptr);
+        struct tm local;
+        strftime(started, sizeof(started), "%Y%m%d_%H%M%S", localtime_r(&now, &local));
+
+        settings.capturePrefix = capture_dir + "/gemini_" + String(started);
+
+        if (capture_compress)
+        {
+            startedCompressor = !compressor.isRunning();
+            compressor.start(CAPTURE_COMPRESS_THREADS);
+            settings.captureCompressor = &compressor;
+        }
+    }
+
+    receiveThread = std::make_unique<ReceiveThread>(DEFAULT_RECV_BATCH, RECV_TIMEOUT_MS);
+    receiveThread->setBusyPoll(busy_poll_us);
+    receiveThread->setScheduling(cpu_affinity >= 0 ? getCpu(0) : -1, rt_priority);
+
+    // shard threads keep their own cores, after the receive and acquisition threads when those are pinned
+    if (cpu_affinity >= 0)
+        settings.firstCpu = getCpu(2);
+
+    for (auto device : headstages)
+    {
+        if (!device->prepare(settings, receive_backend, DEFAULT_RECV_BATCH))
+        {
+            LOGC("GeminiThread could not start the ", DatagramReceiver::getName(receive_backend), " receiver; falling back to recvmmsg");
+            CoreServices::sendStatusMessage("GeminiThread: " + String(DatagramReceiver::getName(receive_backend)) + " unavailable, using recvmmsg.");
+
+            if (!device->prepare(settings, DatagramReceiver::Backend::RECVMMSG, DEFAULT_RECV_BATCH))
+            {
+                LOGC("GeminiThread could not start a receiver on port ", device->getPort());
+                abortStart(startedCompressor);
+                return false;
+            }
+        }
+
+        // shards of consecutive devices go to consecutive cores
+        settings.firstCpu += receive_shards;
+
+        if (!device->isSharded())
+            receiveThread->addSource(device->getReceiver(), device->getRing(), device->getCapture());
+    }
+
+    if (highpass_hz > 0 && highpass_hz >= sample_rate / 2)
+        LOGC("GeminiThread high-pass cutoff of ", highpass_hz, " Hz is at or above Nyquist for ", sample_rate, " Hz; not filtering");
+
+    if (common_reference != Preprocessor::Reference::NONE || highpass_hz > 0)
+        LOGC("GeminiThread preprocessing ", getPreprocessStatus());
+
+    // every buffer on the packet path exists by now
+    lockMemory();
+
+    if (!receiveThread->start())
+    {
+        LOGC("GeminiThread could not start the receive thread: ", strerror(receiveThread->getError()));
+        abortStart(startedCompressor);
+        return false;
+    }
+
+    for (auto device : headstages)
+    {
+        if (device->isSharded())
+        {
+            const int numPinned = device->startShards();
+
+            if (numPinned < 0)
+            {
+                LOGC("GeminiThread could not start the shard threads on port ", device->getPort());
+                abortStart(startedCompressor);
+                return false;
+            }
+
+            if (numPinned < receive_shards)
+                LOGC("GeminiThread pinned ", numPinned, " of ", receive_shards, " shard threads on port ", device->getPort());
+        }
+    }
+
+    bool tuned = receiveThread->isScheduled() && memoryLock != MemoryLock::REFUSED;
+
+    for (auto device : headstages)
+        tuned = device->isTuned() && tuned;
+
+    if (cpu_affinity >= 0 || rt_priority > 0 || lock_memory || rcvbuf_kb > 0)
+    {
+        LOGC("GeminiThread receive thread ", receiveThread->getSchedule());
+
+        for (auto device : headstages)
+            LOGC("GeminiThread tuning ", device->getTuningStatus());
+
+        if (!tuned)
+            CoreServices::sendStatusMessage("GeminiThread: some real-time settings were refused; see RT_STATUS.");
+    }
+
+    tuneAcquisition.store(true);
+
     startThread();
 
     return true;
@@ -183,12 +621,121 @@ bool GeminiThread::stopAcquisition()
         signalThreadShouldExit();
     }
 
+    stopReceiving();
+    waiter.notify();
+
     waitForThreadToExit(500);
 
-    sourceBuffers[0]->clear();
+    LOGC("GeminiThread ring ", getRingStatus());
+    LOGC("GeminiThread loss ", getLossStatus());
+    LOGC("GeminiThread reorder ", getReorderStatus());
+    LOGC("GeminiThread clock ", getClockStatus());
+
+    if (capture_dir.isNotEmpty())
+        LOGC("GeminiThread capture ", getCaptureStatus());
+
+    releaseAcquisition();
+
     return true;
 }
 
+void GeminiThread::stopReceiving()
+{
+    if (receiveThread != nullptr)
+        receiveThread->stop();
+
+    for (auto device : headstages)
+        device->stopShards();
+}
+
+void GeminiThread::releaseAcquisition()
+{
+    stopReceiving();
+    receiveThread.reset();
+
+    for (auto device : headstages)
+        device->release();
+
+    unlockMemory();
+}
+
+void GeminiThread::abortStart(bool startedCompressor)
+{
+    releaseAcquisition();
+
+    // segments sealed by release() are compressed before the workers exit
+    if (startedCompressor)
+        compressor.stop();
+
+    error_flag = true;
+}
+
+int GeminiThread::getCpu(int offset) const
+{
+    const int numCpus = (int) std::thread::hardware_concurrency();
+
+    return numCpus > 0 ? (cpu_affinity + offset) % numCpus : cpu_affinity + offset;
+}
+
+void GeminiThread::tuneAcquisitionThread()
+{
+    tuneAcquisition.store(false);
+
+    const pthread_t self = pthread_self();
+
+    if (cpu_affinity >= 0 && !Realtime::pinThread(self, getCpu(1)))
+        LOGC("GeminiThread could not pin the acquisition thread to core ", getCpu(1), ": ", strerror(errno));
+
+    // one below the receive threads, so they always get to drain the sockets first
+    if (rt_priority > 0 && !Realtime::setFifoPriority(self, jmax(1, rt_priority - 1)))
+        LOGC("GeminiThread could not give the acquisition thread SCHED_FIFO priority ", jmax(1, rt_priority - 1), ": ", strerror(errno),
+            " (needs CAP_SYS_NICE or RLIMIT_RTPRIO)");
+
+    const std::string schedule = Realtime::describeThread(self);
+
+    if (cpu_affinity >= 0 || rt_priority > 0)
+        LOGC("GeminiThread acquisition thread ", schedule);
+
+    std::lock_guard<std::mutex> lock(scheduleMutex);
+    acquisitionSchedule = schedule;
+}
+
+void GeminiThread::lockMemory()
+{
+    memoryLock = MemoryLock::OFF;
+
+    if (!lock_memory)
+        return;
+
+    if (Realtime::lockAllMemory())
+    {
+        memoryLock = MemoryLock::ALL;
+        return;
+    }
+
+    // without an unlimited RLIMIT_MEMLOCK only our own buffers are locked, within the limit
+    bool locked = true;
+
+    for (auto device : headstages)
+        locked = device->lockMemory() && locked;
+
+    memoryLock = locked ? MemoryLock::BUFFERS : MemoryLock::REFUSED;
+
+    if (!locked)
+        LOGC("GeminiThread could not lock its buffers in memory: ", strerror(errno), " (raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK)");
+}
+
+void GeminiThread::unlockMemory()
+{
+    if (memoryLock == MemoryLock::ALL)
+        Realtime::unlockAllMemory();
+
+    for (auto device : headstages)
+        device->unlockMemory();
+
+    memoryLock = MemoryLock::OFF;
+}
+
 
 void GeminiThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChannels,
     OwnedArray<EventChannel>* eventChannels,
@@ -197,25 +744,156 @@ void GeminiThread::updateSettings(OwnedArray<ContinuousChannel>* continuousChann
     OwnedArray<DeviceInfo>* devices,
     OwnedArray<ConfigurationObject>* configurationObjects)
 {
+    mapped_channels.assign(channel_map.begin(), channel_map.end());
+
+    syncDevices();
+    syncLfpBuffers();
+
+    // picks up the layout of devices that started sending since they were bound
+    applyLayouts(false, true);
+
+    continuousChannels->clear();
+    eventChannels->clear();
+    spikeChannels->clear();
+    sourceStreams->clear();
+    devices->clear();
+    configurationObjects->clear();
+
+    for (auto device : headstages)
+    {
+        const String port = String(device->getPort());
+
+        DeviceInfo::Settings deviceSettings {
+            "Gemini " + port,
+            "Gemini headstage streaming to UDP port " + port,
+            "gemini.device." + port,
+            port,
+            "Gemini"
+        };
+
+        devices->add(new DeviceInfo(deviceSettings));
+
+        DataStream::Settings streamSettings {
+            "Gemini-" + port,
+            "Continuous data from the Gemini headstage on UDP port " + port,
+            "gemini.stream." + port,
+            sample_rate
+        };
+
+        DataStream* stream = new DataStream(streamSettings);
+        sourceStreams->add(stream);
+
+        // the TTL words published with every frame carry the packets' digital inputs, if the layout has any
+        if (device->getLayout().digitalInputs)
+        {
+            EventChannel::Settings eventSettings {
+                EventChannel::Type::TTL,
+                "Gemini-" + port + " digital inputs",
+                "Digital input lines of the Gemini headstage on UDP port " + port,
+                "gemini.ttl",
+                stream,
+                GeminiPacket::NUM_DIGITAL_LINES
+            };
+
+            eventChannels->add(new EventChannel(eventSettings));
+        }
+
+        // with a channel map, only the mapped channels, in map order, keeping their wire numbers
+        const std::vector<int> outputs = device->getOutputChannels();
+        const int numOutputs = device->getNumOutputs();
+
+        if (outputs.size() > 0 && (int) outputs.size() < (int) mapped_channels.size())
+            LOGC("GeminiThread port ", port, " has ", device->getLayout().numChannels, " channels; skipping ",
+                (int) (mapped_channels.size() - outputs.size()), " mapped channel(s) beyond them");
+
+        for (int i = 0; i < numOutputs; i++)
+        {
+            const int ch = outputs.empty() ? i : outputs[i];
+
+            ContinuousChannel::Settings channelSettings {
+                ContinuousChannel::Type::ELECTRODE,
+                "CH" + String(ch + 1),
+                "Gemini electrode channel",
+                "gemini.continuous",
+                data_scale,
+                stream
+            };
+
+            continuousChannels->add(new ContinuousChannel(channelSettings));
+        }
+    }
+
+    if (lfp_factor <= 1)
+        return;
+
+    // streams follow sourceBuffers, so the LFP streams come after every broadband one
+    for (auto device : headstages)
+    {
+        const String port = String(device->getPort());
+
+        DataStream::Settings streamSettings {
+            "Gemini-" + port + "-LFP",
+            "Low-pass filtered, decimated copy of the Gemini headstage on UDP port " + port,
+            "gemini.stream." + port + ".lfp",
+            sample_rate / lfp_factor
+        };
+
+        DataStream* stream = new DataStream(streamSettings);
+        sourceStreams->add(stream);
+
+        const std::vector<int> outputs = device->getOutputChannels();
 
+        for (int i = 0; i < device->getNumOutputs(); i++)
+        {
+            const int ch = outputs.empty() ? i : outputs[i];
 
+            ContinuousChannel::Settings channelSettings {
+                ContinuousChannel::Type::ELECTRODE,
+                "LFP" + String(ch + 1),
+                "Gemini electrode channel, decimated",
+                "gemini.continuous.lfp",
+                data_scale,
+                stream
+            };
+
+            continuousChannels->add(new ContinuousChannel(channelSettings));
+        }
+    }
 }
 
 bool GeminiThread::errorFlag()
 {
-    return error_flag;
+    if (error_flag)
+        return true;
+
+    for (auto device : headstages)
+    {
+        if (device->errorFlag())
+            return true;
+    }
+
+    return false;
 }
 
 
 void GeminiThread::resizeBuffers()
 {
-    sourceBuffers[0]->resize(num_channels, DEFAULT_BUF_SIZE);
-    // read_buffer.resize(num_channels * num_samp * element_size + HEADER_SIZE);
-    convbuf.resize(num_channels * num_samp);
-    sampleNumbers.resize(num_samp);
-    timestamps.clear();
-    timestamps.insertMultiple(0, 0.0, num_samp);
-    ttlEventWords.resize(num_samp);
+    syncDevices();
+
+    // never probes: the channels registered by updateSettings() must still fit
+    applyLayouts(false, false);
+
+    const GeminiDevice::Settings settings = getDeviceSettings();
+
+    for (int i = 0; i < headstages.size(); i++)
+    {
+        sourceBuffers[i]->resize(headstages[i]->getNumOutputs(), DEFAULT_BUF_SIZE);
+        headstages[i]->resizeBuffers(settings, waiter);
+    }
+
+    // LFP buffers hold the same number of samples, and so cover 'factor' times as long
+    for (int i = headstages.size(); i < sourceBuffers.size(); i++)
+        sourceBuffers[i]->resize(headstages[i - headstages.size()]->getNumOutputs(), DEFAULT_BUF_SIZE);
 }
 
 void GeminiThread::handleBroadcastMessage(String msg)
@@ -226,6 +904,423 @@ void GeminiThread::handleBroadcastMessage(String msg)
 
 String GeminiThread::handleConfigMessage(String msg)
 {
+    StringArray tokens = StringArray::fromTokens(msg.trim(), " ", "");
+
+    if (tokens.size() == 0)
+        return "";
+
+    typedef String (*Handler)(GeminiThread& thread, const StringArray& tokens);
+
+    /** A config message: its name, the fewest arguments it takes, and the handler, which replies with the resulting value */
+    struct Command
+    {
+        const char* name;
+        int minArgs;
+        Handler handle;
+    };
+
+    static const Command commands[] = {
+        { "RING_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getRingStatus(); } },
+        { "LOSS_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getLossStatus(); } },
+        { "REORDER_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getReorderStatus(); } },
+        { "CLOCK_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getClockStatus(); } },
+        { "STATS", 0, [](GeminiThread& t, const StringArray&) { return t.getStatsJson(); } },
+        { "HEALTH", 0, [](GeminiThread& t, const StringArray&) { return t.getHealthJson(); } },
+        { "LFP_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getLfpStatus(); } },
+        { "TTL_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getDigitalStatus(); } },
+        { "PREPROCESS_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getPreprocessStatus(); } },
+        { "CAPTURE_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getCaptureStatus(); } },
+        { "LAYOUT_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getLayoutStatus(); } },
+        { "RT_STATUS", 0, [](GeminiThread& t, const StringArray&) { return t.getRealtimeStatus(); } },
+
+        // takes effect when acquisition starts
+        { "MONITOR", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.channel_monitor = parseSwitch(tokens[1]);
+            return "MONITOR " + String(t.channel_monitor ? 1 : 0);
+        } },
+
+        // takes effect when acquisition starts, e.g. "PREPROCESS MEDIAN 300"; a cutoff of 0 turns the high-pass off
+        { "PREPROCESS", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            for (Preprocessor::Reference reference : { Preprocessor::Reference::NONE, Preprocessor::Reference::MEAN, Preprocessor::Reference::MEDIAN })
+            {
+                if (tokens[1].equalsIgnoreCase(Preprocessor::getName(reference)))
+                    t.common_reference = reference;
+            }
+
+            if (tokens.size() > 2)
+                t.highpass_hz = parseFloat(tokens[2], t.MIN_HIGHPASS_HZ, t.MAX_HIGHPASS_HZ);
+
+            return "PREPROCESS " + String(Preprocessor::getName(t.common_reference)) + " " + String(t.highpass_hz);
+        } },
+
+        // changes the streams, so applies at the next signal chain update; OFF or 0 removes the LFP streams
+        { "LFP", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.lfp_rate = parseFloat(tokens[1], t.MIN_LFP_RATE, t.MAX_LFP_RATE);
+            return "LFP " + String(t.lfp_rate);
+        } },
+
+        // changes the channels, so applies at the next signal chain update; ALL publishes every channel
+        { "CHANNEL_MAP", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            StringArray list;
+
+            for (int i = 1; i < tokens.size(); i++)
+                list.add(tokens[i]);
+
+            // an invalid list leaves the map as it was, which the reply shows
+            if (!t.setChannelMap(list.joinIntoString(",")))
+                LOGC("GeminiThread ignored invalid channel map: ", list.joinIntoString(","));
+
+            return "CHANNEL_MAP " + t.getChannelMapList();
+        } },
+
+        // takes effect when acquisition starts; OFF stops capturing
+        { "CAPTURE", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.capture_dir = isOff(tokens[1]) ? String() : tokens[1];
+
+            if (tokens.size() > 2)
+                t.capture_segment_mb = parseInt(tokens[2], t.MIN_CAPTURE_SEGMENT_MB, t.MAX_CAPTURE_SEGMENT_MB);
+
+            if (tokens.size() > 3)
+                t.capture_compress = tokens[3].toUpperCase() == "COMPRESSED";
+
+            return "CAPTURE " + (t.capture_dir.isNotEmpty() ? t.capture_dir : String("OFF")) + " " + String(t.capture_segment_mb)
+                + (t.capture_compress ? " COMPRESSED" : " RAW");
+        } },
+
+        // AUTO detects the layout from the queued packets; '<channels> <samples> [TTL]' fixes it. Either applies at the next signal chain update.
+        { "LAYOUT", 0, [](GeminiThread& t, const StringArray& tokens)
+        {
+            if (tokens.size() == 2 && tokens[1].toUpperCase() == "AUTO")
+            {
+                t.layout_autodetect = true;
+            }
+            else if (tokens.size() < 3 || tokens.size() > 4 || tokens[1].getIntValue() <= 0 || tokens[2].getIntValue() <= 0)
+            {
+                // leaves the layout as it was
+                return String("ERROR usage: LAYOUT AUTO | LAYOUT <channels> <samples> [TTL]");
+            }
+            else
+            {
+                t.num_channels = parseInt(tokens[1], t.MIN_NUM_CHANNELS, (int) GeminiPacket::MAX_PACKET_VALUES);
+                t.num_samp = parseInt(tokens[2], t.MIN_NUM_SAMPLES, (int) GeminiPacket::MAX_PACKET_VALUES / t.num_channels);
+                t.digital_inputs = tokens.size() > 3 && tokens[3].toUpperCase() == "TTL";
+                t.layout_autodetect = false;
+            }
+
+            t.applyLayouts(t.connected, t.connected);
+
+            return "LAYOUT " + (t.layout_autodetect ? String("AUTO") : String(t.num_channels) + " " + String(t.num_samp) + (t.digital_inputs ? " TTL" : ""));
+        } },
+
+        { "REORDER", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.reorder_depth = parseInt(tokens[1], t.MIN_REORDER_DEPTH, t.MAX_REORDER_DEPTH);
+
+            if (tokens.size() > 2)
+                t.reorder_hold_us = parseInt(tokens[2], t.MIN_REORDER_HOLD_US, t.MAX_REORDER_HOLD_US);
+
+            return "REORDER " + String(t.reorder_depth) + " " + String(t.reorder_hold_us);
+        } },
+
+        // takes effect on the next resizeBuffers(), i.e. when acquisition starts
+        { "RING_SIZE", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.ring_slots = parseInt(tokens[1], t.MIN_RING_SLOTS, t.MAX_RING_SLOTS);
+            return "RING_SIZE " + String(t.ring_slots);
+        } },
+
+        // each shard is its own socket, so a bound device has to be rebound
+        { "SHARDS", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.receive_shards = parseInt(tokens[1], t.MIN_SHARDS, t.MAX_SHARDS);
+
+            if (t.connected)
+                t.connectSocket();
+
+            return "SHARDS " + String(t.receive_shards);
+        } },
+
+        // takes effect when acquisition starts; 0 turns busy polling off
+        { "BUSY_POLL", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.busy_poll_us = parseInt(tokens[1], t.MIN_BUSY_POLL_US, t.MAX_BUSY_POLL_US);
+            return "BUSY_POLL " + String(t.busy_poll_us);
+        } },
+
+        // takes effect when acquisition starts; OFF leaves thread placement to the scheduler
+        { "AFFINITY", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.cpu_affinity = isOff(tokens[1]) ? -1 : jmax(-1, tokens[1].getIntValue());
+            return "AFFINITY " + (t.cpu_affinity >= 0 ? String(t.cpu_affinity) : String("OFF"));
+        } },
+
+        // takes effect when acquisition starts; 0 keeps default scheduling
+        { "RT_PRIORITY", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.rt_priority = parseInt(tokens[1], t.MIN_RT_PRIORITY, t.MAX_RT_PRIORITY);
+            return "RT_PRIORITY " + String(t.rt_priority);
+        } },
+
+        // takes effect when acquisition starts
+        { "MLOCK", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.lock_memory = parseSwitch(tokens[1]);
+            return "MLOCK " + String(t.lock_memory ? 1 : 0);
+        } },
+
+        // takes effect when acquisition starts; 0 keeps the system default
+        { "RCVBUF", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.rcvbuf_kb = parseInt(tokens[1], t.MIN_RCVBUF_KB, t.MAX_RCVBUF_KB);
+            return "RCVBUF " + String(t.rcvbuf_kb);
+        } },
+
+        // takes effect when acquisition starts; 0 writes every packet to the DataBuffer as it is decoded
+        { "COALESCE", 1, [](GeminiThread& t, const StringArray& tokens)
+        {
+            t.coalesce_us = parseInt(tokens[1], t.MIN_COALESCE_US, t.MAX_COALESCE_US);
+            return "COALESCE " + String(t.coalesce_us);
+        } },
+    };
+
+    const String command = tokens[0].toUpperCase();
+
+    for (const Command& entry : commands)
+    {
+        if (command == entry.name && tokens.size() > entry.minArgs)
+            return entry.handle(*this, tokens);
+    }
 
     return "";
 }
+
+String GeminiThread::getStatsJson()
+{
+    StringArray devices;
+
+    for (auto device : headstages)
+    {
+        const GeminiDevice::LiveStats live = device->getLiveStats();
+
+        devices.add("{\"port\":" + String(device->getPort())
+            + ",\"packets\":" + String((int64) live.packets)
+            + ",\"bytes\":" + String((int64) live.bytes)
+            + ",\"packets_per_s\":" + String(live.packetsPerSecond, 1)
+            + ",\"bytes_per_s\":" + String(live.bytesPerSecond, 1)
+            + ",\"lost\":" + String((int64) live.lost)
+            + ",\"reordered\":" + String((int64) live.reordered)
+            + ",\"duplicates\":" + String((int64) live.duplicates)
+            + ",\"late\":" + String((int64) live.late)
+            + ",\"invalid\":" + String((int64) live.invalid)
+            + ",\"ring_overflows\":" + String((int64) live.ringOverflows)
+            + ",\"kernel_drops\":" + String((int64) live.kernelDrops)
+            + ",\"captured\":" + String((int64) live.captured)
+            + ",\"capture_dropped\":" + String((int64) live.captureDropped)
+            + ",\"writes\":" + String((int64) live.writes)
+            + ",\"decode_ns\":" + histogramToJson(live.decodeNs, true)
+            + ",\"latency_us\":" + histogramToJson(live.latencyUs, false)
+            + "}");
+    }
+
+    return "{\"devices\":[" + devices.joinIntoString(",") + "]}";
+}
+
+bool GeminiThread::getChannelHealth(int device, int& port, ChannelMonitor::Snapshot& snapshot)
+{
+    if (device < 0 || device >= headstages.size())
+        return false;
+
+    port = headstages[device]->getPort();
+
+    return headstages[device]->getChannelHealth(snapshot);
+}
+
+String GeminiThread::getHealthJson()
+{
+    StringArray devices;
+    ChannelMonitor::Snapshot snapshot;
+
+    for (auto device : headstages)
+    {
+        if (!device->getChannelHealth(snapshot))
+        {
+            devices.add("{\"port\":" + String(device->getPort()) + ",\"window\":0}");
+            continue;
+        }
+
+        StringArray channels, rms, line50, line60, minimum, maximum, clipped, status;
+
+        for (int c = 0; c < snapshot.numChannels; c++)
+        {
+            channels.add(String(device->getWireChannel(c) + 1));
+            rms.add(String(snapshot.rms[c], 2));
+            line50.add(String(snapshot.line50[c], 2));
+            line60.add(String(snapshot.line60[c], 2));
+            minimum.add(String(snapshot.minimum[c]));
+            maximum.add(String(snapshot.maximum[c]));
+            clipped.add(String((int64) snapshot.clipped[c]));
+            status.add("\"" + String(ChannelMonitor::getName(snapshot.status[c])) + "\"");
+        }
+
+        devices.add("{\"port\":" + String(device->getPort())
+            + ",\"window\":" + String((int64) snapshot.window)
+            + ",\"window_samples\":" + String(snapshot.windowSamples)
+            + ",\"median_rms\":" + String(snapshot.medianRms, 2)
+            + ",\"channels\":[" + channels.joinIntoString(",") + "]"
+            + ",\"rms\":[" + rms.joinIntoString(",") + "]"
+            + ",\"line50_rms\":" + (snapshot.lineValid[0] ? "[" + line50.joinIntoString(",") + "]" : String("null"))
+            + ",\"line60_rms\":" + (snapshot.lineValid[1] ? "[" + line60.joinIntoString(",") + "]" : String("null"))
+            + ",\"min\":[" + minimum.joinIntoString(",") + "]"
+            + ",\"max\":[" + maximum.joinIntoString(",") + "]"
+            + ",\"clipped\":[" + clipped.joinIntoString(",") + "]"
+            + ",\"status\":[" + status.joinIntoString(",") + "]"
+            + "}");
+    }
+
+    return "{\"devices\":[" + devices.joinIntoString(",") + "]}";
+}
+
+String GeminiThread::getStatsSummary()
+{
+    double packetsPerSecond = 0;
+    uint64 dropped = 0;
+    uint64_t latencyUs[Histogram::NUM_BUCKETS] = {};
+
+    for (auto device : headstages)
+    {
+        const GeminiDevice::LiveStats live = device->getLiveStats();
+
+        packetsPerSecond += live.packetsPerSecond;
+        dropped += live.lost + live.ringOverflows + live.kernelDrops;
+
+        for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+            latencyUs[i] += live.latencyUs[i];
+    }
+
+    return String((int) (packetsPerSecond + 0.5)) + " pkt/s\n"
+        + String((int64) dropped) + " drop, p99 " + String((int64) Histogram::getPercentile(latencyUs, 0.99)) + " us";
+}
+
+String GeminiThread::getLayoutStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getLayoutStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getRingStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getRingStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getLossStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getLossStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getReorderStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getReorderStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getRealtimeStatus()
+{
+    StringArray lines;
+
+    {
+        std::lock_guard<std::mutex> lock(scheduleMutex);
+        lines.add("acquisition " + (acquisitionSchedule.empty() ? String("not started") : String(acquisitionSchedule)));
+    }
+
+    if (receiveThread != nullptr)
+        lines.add("receive " + String(receiveThread->getSchedule()));
+
+    const char* lockNames[] = { "off", "all", "buffers", "refused" };
+    lines.add("memory lock=" + String(lockNames[(int) memoryLock]));
+
+    for (auto device : headstages)
+        lines.add(device->getTuningStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getCaptureStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+    {
+        const String status = device->getCaptureStatus();
+
+        if (status.isNotEmpty())
+            lines.add(status);
+    }
+
+    if (compressor.isRunning())
+        lines.add(String(compressor.getStatus()));
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getLfpStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getLfpStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getDigitalStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getDigitalStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getPreprocessStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getPreprocessStatus());
+
+    return lines.joinIntoString("\n");
+}
+
+String GeminiThread::getClockStatus() const
+{
+    StringArray lines;
+
+    for (auto device : headstages)
+        lines.add(device->getClockStatus());
+
+    return lines.joinIntoString("\n");
+}
@@ -26,6 +26,15 @@
 
 #include <DataThreadHeaders.h>
 
+#include "DatagramReceiver.h"
+#include "CaptureCompressor.h"
+#include "GeminiDevice.h"
+#include "GeminiPacket.h"
+#include "PacketRing.h"
+#include "Preprocessor.h"
+#include "ReceiveThread.h"
+#include "SequenceTracker.h"
+
 namespace GeminiThreadNode {
 
 class GeminiThread : public DataThread
@@ -41,6 +50,16 @@ public:
     const int DEFAULT_BUF_SIZE = 12000;
     const int DEFAULT_NUM_CHANNELS = 192;
     const int DEFAULT_NUM_SAMPLES = 30;
+    const int DEFAULT_RECV_BATCH = 32;
+    const int DEFAULT_RING_SLOTS = 256;
+    const int RECV_TIMEOUT_MS = 100;
+    const int RING_WAIT_US = 100000;
+    const int DEFAULT_REORDER_DEPTH = 8;
+    const int DEFAULT_REORDER_HOLD_US = 3000;
+    const int DEFAULT_SHARDS = 1;
+    const int DEFAULT_BUSY_POLL_US = 0;
+    const int DEFAULT_CAPTURE_SEGMENT_MB = 256;
+    const int DEFAULT_COALESCE_US = 0;
 
     /** Parameter limits */
     const float MIN_DATA_SCALE = 0.0f;
@@ -49,33 +68,109 @@ public:
     const float MAX_DATA_OFFSET = 65536;
     const float MIN_PORT = 1023;
     const float MAX_PORT = 65535;
+    const int MAX_DEVICES = 8;
+    const int MIN_NUM_CHANNELS = 1;
+    const int MIN_NUM_SAMPLES = 1;
     const float MIN_SAMPLE_RATE = 0;
     const float MAX_SAMPLE_RATE = 50000.0f;
+    const int MIN_RING_SLOTS = 16;
+    const int MAX_RING_SLOTS = 65536;
+    const int MIN_REORDER_DEPTH = 1;
+    const int MAX_REORDER_DEPTH = 64;
+    const int MIN_REORDER_HOLD_US = 0;
+    const int MAX_REORDER_HOLD_US = 1000000;
+    const int MIN_SHARDS = 1;
+    const int MAX_SHARDS = 16;
+    const int MIN_BUSY_POLL_US = 0;
+    const int MAX_BUSY_POLL_US = 1000;
+    const int MIN_CAPTURE_SEGMENT_MB = 1;
+    const int MAX_CAPTURE_SEGMENT_MB = 4096;
+    const int MIN_COALESCE_US = 0;
+    const int MAX_COALESCE_US = 50000;
+    const int MIN_RT_PRIORITY = 0;
+    const int MAX_RT_PRIORITY = 99;
+    const int MIN_RCVBUF_KB = 0;
+    const int MAX_RCVBUF_KB = 1 << 20;
+    const float MIN_HIGHPASS_HZ = 0.0f;
+    const float MAX_HIGHPASS_HZ = 10000.0f;
+    const float MIN_LFP_RATE = 0.0f;
+    const float MAX_LFP_RATE = 10000.0f;
+    const int MAX_MAPPED_CHANNELS = (int) GeminiPacket::MAX_PACKET_VALUES;
+
+    /** Workers compressing sealed capture segments */
+    const int CAPTURE_COMPRESS_THREADS = 2;
 
     // socket
-    int sockfd = -1;
+    DatagramReceiver::Backend receive_backend = DatagramReceiver::Backend::RECVMMSG;
+    std::unique_ptr<ReceiveThread> receiveThread;
 
     // label params
-    int port;
+    Array<int> ports;
     float sample_rate;
     float data_scale;
     float data_offset;
 
-    // internal params
+    // internal params; the layout is the fallback when none is detected
+    bool layout_autodetect = true;
     int num_channels;
     int num_samp;
+    bool digital_inputs = false;
+    int ring_slots;
+    LossConcealer::Policy gap_policy = LossConcealer::Policy::ZEROS;
+    int reorder_depth;
+    int reorder_hold_us;
+    int receive_shards;
+    int busy_poll_us;
+    int coalesce_us;
+
+    // raw capture; an empty directory turns it off
+    String capture_dir;
+    int capture_segment_mb;
+    bool capture_compress = false;
+
+    // per-channel signal quality, accumulated while decoding
+    bool channel_monitor = true;
+
+    // common reference and high-pass applied while decoding; both off by default
+    Preprocessor::Reference common_reference = Preprocessor::Reference::NONE;
+    float highpass_hz = 0.0f;
+
+    // decimated LFP stream next to each broadband one, at the sample rate divided
+    // by the nearest whole factor; 0 turns it off
+    float lfp_rate = 0.0f;
+    int lfp_factor = 1;     // of the LFP streams registered by the last updateSettings()
+
+    // wire channels (0-based) to publish, in this order; empty publishes every
+    // channel in wire order. Entries beyond a device's channel count are skipped.
+    Array<int> channel_map;
+    std::vector<int> mapped_channels;   // registered by the last updateSettings()
+
+    // real-time tuning, all off by default and each dropped when refused. With
+    // cpu_affinity >= 0 the receive thread runs on that core, the acquisition
+    // thread on the next and shard threads on the ones after.
+    int cpu_affinity = -1;
+    int rt_priority = 0;
+    bool lock_memory = false;
+    int rcvbuf_kb = 0;
 
     // state vars
     bool connected = false;
     bool error_flag;
-    int64 total_samples;
 
-    // buffers
-    std::vector<std::byte> read_buffer;
-    std::vector<float> convbuf;
-    Array<int64> sampleNumbers;
-    Array<double> timestamps;
-    Array<uint64> ttlEventWords;
+    // outlives acquisitions, so segments sealed at stop still get compressed
+    CaptureCompressor compressor;
+
+    // effective tuning, for RT_STATUS; the acquisition thread fills in its own schedule
+    enum class MemoryLock { OFF, ALL, BUFFERS, REFUSED };
+    MemoryLock memoryLock = MemoryLock::OFF;
+    std::atomic<bool> tuneAcquisition { false };
+    std::mutex scheduleMutex;
+    std::string acquisitionSchedule;
+
+    // one per bound port, in the same order as the first sourceBuffers and data
+    // streams; the LFP buffers and streams, when on, follow in the same order
+    OwnedArray<GeminiDevice> headstages;
+    RingWaiter waiter;
 
 
 
@@ -131,14 +226,126 @@ public:
     String handleConfigMessage(String msg) override;
 
 
-    /** Connects to the socket */
+    /** Binds one socket per configured port */
     bool connectSocket();
 
-    /** Disconnects the socket */
+    /** Closes all sockets */
     void disconnectSocket();
 
+    /** Sets the device ports from a comma-separated list. Returns false (and leaves the ports unchanged) if the list is invalid. */
+    bool setPorts(const String& list);
+
+    /** Returns the device ports as a comma-separated list */
+    String getPortList() const;
+
+    /**
+        Sets the channel map from a comma-separated list of 1-based wire
+        channels and ranges ("33-64,1-32"), in publishing order. "ALL" or an
+        empty list clears it. Returns false (and leaves the map unchanged) if
+        the list is invalid or repeats a channel. Applies at the next signal
+        chain update.
+    */
+    bool setChannelMap(const String& list);
+
+    /** Returns the channel map in the form setChannelMap() takes, with consecutive runs as ranges, or "ALL" */
+    String getChannelMapList() const;
+
+    /** Returns the 1-based wire channel behind a published channel of a device */
+    int getWireChannel(int device, int channel) const;
+
     /** Returns if any errors were thrown during acquisition, such as invalid headers or unable to read from socket */
     bool errorFlag();
+
+    /** Returns each device's channel count, samples per packet and sample format, and whether they were detected */
+    String getLayoutStatus() const;
+
+    /** Returns each device's packet ring capacity, occupancy, high-water mark and overflow count */
+    String getRingStatus() const;
+
+    /** Returns each device's packet loss counters */
+    String getLossStatus() const;
+
+    /** Returns each device's reorder window settings and counters */
+    String getReorderStatus() const;
+
+    /** Returns each device's sample clock estimate against the host clock */
+    String getClockStatus() const;
+
+    /** Returns each device's common reference and high-pass filter */
+    String getPreprocessStatus() const;
+
+    /** Returns each device's LFP decimation factor, rate and filter */
+    String getLfpStatus() const;
+
+    /** Returns each device's digital input lines, state and edge counts */
+    String getDigitalStatus() const;
+
+    /** Returns the scheduling of the acquisition, receive and shard threads, the memory lock and each device's receive buffer */
+    String getRealtimeStatus();
+
+    /** Returns each capturing device's raw capture files and counters */
+    String getCaptureStatus() const;
+
+    /** Returns the latest per-channel signal quality window of each device as JSON */
+    String getHealthJson();
+
+    /** Number of devices, one per configured port */
+    int getNumDevices() const { return headstages.size(); }
+
+    /** Copies the latest signal quality window of one device. Returns false if none is available. */
+    bool getChannelHealth(int device, int& port, ChannelMonitor::Snapshot& snapshot);
+
+    /** Returns each device's live counters, decode-time histogram and latency percentiles as JSON */
+    String getStatsJson();
+
+    /** Returns a two-line summary of the live counters for the editor */
+    String getStatsSummary();
+
+private:
+
+    /** Creates one device and DataBuffer per configured port, if the port list changed */
+    void syncDevices();
+
+    /** Applies lfp_rate: adds or removes the LFP buffers after the broadband ones and hands them to the devices. Only call while stopped. */
+    void syncLfpBuffers();
+
+    /** Factor the LFP stream is decimated by, or 1 when it is off */
+    int getLfpFactor() const;
+
+    /**
+        Gives every device without a detected layout the configured one;
+        with 'restart', every device. With 'probe', and autodetection on,
+        the bound devices still without one read the packets already queued
+        on their sockets, without waiting for more.
+    */
+    void applyLayouts(bool restart, bool probe);
+
+    /** Collects the current parameters for the devices */
+    GeminiDevice::Settings getDeviceSettings() const;
+
+    /** Core 'offset' places after cpu_affinity, wrapped to the cores present */
+    int getCpu(int offset) const;
+
+    /** Pins and prioritizes the calling acquisition thread as configured. Called once, from the first updateBuffer(). */
+    void tuneAcquisitionThread();
+
+    /** Stops the receive and shard threads. Safe to call more than once. */
+    void stopReceiving();
+
+    /** Stops receiving, then drops the receivers, closes the captures and unlocks memory. Shared by stopAcquisition() and a failed start. */
+    void releaseAcquisition();
+
+    /** Undoes a partial startAcquisition(), including compressor workers it started, and flags the error */
+    void abortStart(bool startedCompressor);
+
+    /** Locks the process or device buffers in memory, if configured, and records what was granted */
+    void lockMemory();
+
+    /** Undoes lockMemory() */
+    void unlockMemory();
+
+    /** Returns true if any device ring holds packets */
+    bool anyDeviceHasData() const;
 };
 
 }
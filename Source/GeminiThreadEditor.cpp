@@ -29,7 +29,7 @@ GeminiThreadEditor::GeminiThreadEditor(GenericProcessor* parentNode, GeminiThrea
 {
 	node = thread;
 
-	desiredWidth = 180;
+	desiredWidth = 370;
 
 	// Add bind button
     bindButton = new UtilityButton("BIND", Font("Small Text", 12, Font::bold));
@@ -48,13 +48,13 @@ GeminiThreadEditor::GeminiThreadEditor(GenericProcessor* parentNode, GeminiThrea
     addAndMakeVisible(closeButton);
 
     // Port
-    portLabel = new Label("Port", "Port");
+    portLabel = new Label("Port", "Port(s)");
     portLabel->setFont(Font("Small Text", 10, Font::plain));
     portLabel->setBounds(10, 63, 70, 8);
     portLabel->setColour(Label::textColourId, Colours::darkgrey);
     addAndMakeVisible(portLabel);
 
-    portInput = new Label("Port", String(node->port));
+    portInput = new Label("Port", node->getPortList());
     portInput->setFont(Font("Small Text", 10, Font::plain));
     portInput->setColour(Label::backgroundColourId, Colours::lightgrey);
     portInput->setEditable(true);
@@ -107,6 +107,49 @@ GeminiThreadEditor::GeminiThreadEditor(GenericProcessor* parentNode, GeminiThrea
     offsetInput->addListener(this);
     addAndMakeVisible(offsetInput);
 
+    // Receive backend
+    backendLabel = new Label("Receive", "Receive");
+    backendLabel->setFont(Font("Small Text", 10, Font::plain));
+    backendLabel->setBounds(180, 63, 85, 8);
+    backendLabel->setColour(Label::textColourId, Colours::darkgrey);
+    addAndMakeVisible(backendLabel);
+
+    backendSelector = new ComboBox("Receive backend");
+    backendSelector->addItem(DatagramReceiver::getName(DatagramReceiver::Backend::RECVMMSG), (int) DatagramReceiver::Backend::RECVMMSG + 1);
+    if (DatagramReceiver::isSupported(DatagramReceiver::Backend::IO_URING))
+        backendSelector->addItem(DatagramReceiver::getName(DatagramReceiver::Backend::IO_URING), (int) DatagramReceiver::Backend::IO_URING + 1);
+    backendSelector->setSelectedId((int) node->receive_backend + 1, dontSendNotification);
+    backendSelector->setBounds(185, 73, 75, 15);
+    backendSelector->addListener(this);
+    addAndMakeVisible(backendSelector);
+
+    // Gap concealment
+    gapLabel = new Label("Gap fill", "Gap fill");
+    gapLabel->setFont(Font("Small Text", 10, Font::plain));
+    gapLabel->setBounds(180, 98, 85, 8);
+    gapLabel->setColour(Label::textColourId, Colours::darkgrey);
+    addAndMakeVisible(gapLabel);
+
+    gapSelector = new ComboBox("Gap fill");
+    for (LossConcealer::Policy policy : { LossConcealer::Policy::ZEROS, LossConcealer::Policy::HOLD, LossConcealer::Policy::LINEAR })
+        gapSelector->addItem(LossConcealer::getName(policy), (int) policy + 1);
+    gapSelector->setSelectedId((int) node->gap_policy + 1, dontSendNotification);
+    gapSelector->setBounds(185, 108, 75, 15);
+    gapSelector->addListener(this);
+    addAndMakeVisible(gapSelector);
+
+    // Live statistics
+    statsLabel = new Label("Stats", "");
+    statsLabel->setFont(Font("Small Text", 9, Font::plain));
+    statsLabel->setBounds(180, 30, 85, 28);
+    statsLabel->setColour(Label::textColourId, Colours::darkgrey);
+    statsLabel->setJustificationType(Justification::topLeft);
+    addAndMakeVisible(statsLabel);
+
+    heatmap = new ChannelHeatmap(thread);
+    heatmap->setBounds(270, 30, 90, 95);
+    addAndMakeVisible(heatmap);
+
 }
 
 void GeminiThreadEditor::enableInputs()
@@ -139,7 +182,7 @@ void GeminiThreadEditor::buttonClicked(Button* button)
 {
     if (button == bindButton && !acquisitionIsActive)
     {
-        node->port = portInput->getText().getIntValue();
+        node->setPorts(portInput->getText());
 
         if (node->connectSocket())
         {
@@ -172,14 +215,13 @@ void GeminiThreadEditor::labelTextChanged(Label* label)
     }
     else if (label == portInput)
     {
-        int port = portInput->getText().getIntValue();
-
-        if (port > node->MIN_PORT && port < node->MAX_PORT)
+        // a comma-separated list binds one device per port
+        if (node->setPorts(portInput->getText()))
         {
-            node->port = port;
+            CoreServices::updateSignalChain(this);
         }
         else {
-            portInput->setText(String(node->port), dontSendNotification);
+            portInput->setText(node->getPortList(), dontSendNotification);
         }
     }
     else if (label == scaleInput)
@@ -209,15 +251,37 @@ void GeminiThreadEditor::labelTextChanged(Label* label)
     }
 }
 
+void GeminiThreadEditor::comboBoxChanged(ComboBox* comboBox)
+{
+    if (comboBox == backendSelector)
+    {
+        node->receive_backend = (DatagramReceiver::Backend) (backendSelector->getSelectedId() - 1);
+    }
+    else if (comboBox == gapSelector)
+    {
+        node->gap_policy = (LossConcealer::Policy) (gapSelector->getSelectedId() - 1);
+    }
+}
 
 void GeminiThreadEditor::startAcquisition()
 {
     closeButton->setEnabled(false);
     closeButton->setAlpha(0.2f);
+
+    backendSelector->setEnabled(false);
+    gapSelector->setEnabled(false);
+
+    startTimer(STATS_INTERVAL_MS);
 }
 
 void GeminiThreadEditor::stopAcquisition()
 {
+    stopTimer();
+    timerCallback();
+
+    backendSelector->setEnabled(true);
+    gapSelector->setEnabled(true);
+
     if (node->errorFlag())
     {
         node->disconnectSocket();
@@ -230,14 +294,43 @@ void GeminiThreadEditor::stopAcquisition()
     }
 }
 
+void GeminiThreadEditor::timerCallback()
+{
+    statsLabel->setText(node->getStatsSummary(), dontSendNotification);
+    heatmap->refresh();
+}
+
 void GeminiThreadEditor::saveCustomParametersToXml(XmlElement* xmlNode)
 {
     XmlElement* parameters = xmlNode->createNewChildElement("PARAMETERS");
 
-    parameters->setAttribute("port", portInput->getText());
+    parameters->setAttribute("port", node->getPortList());
     parameters->setAttribute("fs", sampleRateInput->getText());
     parameters->setAttribute("scale", scaleInput->getText());
     parameters->setAttribute("offset", offsetInput->getText());
+    parameters->setAttribute("backend", DatagramReceiver::getName(node->receive_backend));
+    parameters->setAttribute("gapfill", LossConcealer::getName(node->gap_policy));
+    parameters->setAttribute("reorder_depth", node->reorder_depth);
+    parameters->setAttribute("reorder_hold_us", node->reorder_hold_us);
+    parameters->setAttribute("shards", node->receive_shards);
+    parameters->setAttribute("busy_poll_us", node->busy_poll_us);
+    parameters->setAttribute("coalesce_us", node->coalesce_us);
+    parameters->setAttribute("cpu_affinity", node->cpu_affinity);
+    parameters->setAttribute("rt_priority", node->rt_priority);
+    parameters->setAttribute("lock_memory", node->lock_memory);
+    parameters->setAttribute("rcvbuf_kb", node->rcvbuf_kb);
+    parameters->setAttribute("capture_dir", node->capture_dir);
+    parameters->setAttribute("capture_segment_mb", node->capture_segment_mb);
+    parameters->setAttribute("capture_compress", node->capture_compress);
+    parameters->setAttribute("channel_monitor", node->channel_monitor);
+    parameters->setAttribute("common_reference", Preprocessor::getName(node->common_reference));
+    parameters->setAttribute("highpass_hz", node->highpass_hz);
+    parameters->setAttribute("lfp_rate", node->lfp_rate);
+    parameters->setAttribute("channel_map", node->getChannelMapList());
+    parameters->setAttribute("layout_autodetect", node->layout_autodetect);
+    parameters->setAttribute("num_channels", node->num_channels);
+    parameters->setAttribute("num_samples", node->num_samp);
+    parameters->setAttribute("digital_inputs", node->digital_inputs);
 }
 
 void GeminiThreadEditor::loadCustomParametersFromXml(XmlElement* xmlNode)
@@ -246,8 +339,8 @@ void GeminiThreadEditor::loadCustomParametersFromXml(XmlElement* xmlNode)
     {
         if (subNode->hasTagName("PARAMETERS"))
         {
-            portInput->setText(subNode->getStringAttribute("port", ""), dontSendNotification);
-            node->port = subNode->getIntAttribute("port", node->DEFAULT_PORT);
+            node->setPorts(subNode->getStringAttribute("port", String(node->DEFAULT_PORT)));
+            portInput->setText(node->getPortList(), dontSendNotification);
 
             sampleRateInput->setText(subNode->getStringAttribute("fs", ""), dontSendNotification);
             node->sample_rate = subNode->getDoubleAttribute("fs", node->DEFAULT_SAMPLE_RATE);
@@ -257,6 +350,161 @@ void GeminiThreadEditor::loadCustomParametersFromXml(XmlElement* xmlNode)
 
             offsetInput->setText(subNode->getStringAttribute("offset", ""), dontSendNotification);
             node->data_offset = subNode->getIntAttribute("offset", node->DEFAULT_DATA_OFFSET);
+
+            if (subNode->getStringAttribute("backend", "") == DatagramReceiver::getName(DatagramReceiver::Backend::IO_URING))
+                node->receive_backend = DatagramReceiver::Backend::IO_URING;
+            else
+                node->receive_backend = DatagramReceiver::Backend::RECVMMSG;
+
+            backendSelector->setSelectedId((int) node->receive_backend + 1, dontSendNotification);
+
+            String gapfill = subNode->getStringAttribute("gapfill", LossConcealer::getName(LossConcealer::Policy::ZEROS));
+
+            for (LossConcealer::Policy policy : { LossConcealer::Policy::ZEROS, LossConcealer::Policy::HOLD, LossConcealer::Policy::LINEAR })
+            {
+                if (gapfill == LossConcealer::getName(policy))
+                    node->gap_policy = policy;
+            }
+
+            gapSelector->setSelectedId((int) node->gap_policy + 1, dontSendNotification);
+
+            node->reorder_depth = jlimit(node->MIN_REORDER_DEPTH, node->MAX_REORDER_DEPTH, subNode->getIntAttribute("reorder_depth", node->DEFAULT_REORDER_DEPTH));
+            node->reorder_hold_us = jlimit(node->MIN_REORDER_HOLD_US, node->MAX_REORDER_HOLD_US, subNode->getIntAttribute("reorder_hold_us", node->DEFAULT_REORDER_HOLD_US));
+            node->receive_shards = jlimit(node->MIN_SHARDS, node->MAX_SHARDS, subNode->getIntAttribute("shards", node->DEFAULT_SHARDS));
+            node->busy_poll_us = jlimit(node->MIN_BUSY_POLL_US, node->MAX_BUSY_POLL_US, subNode->getIntAttribute("busy_poll_us", node->DEFAULT_BUSY_POLL_US));
+            node->coalesce_us = jlimit(node->MIN_COALESCE_US, node->MAX_COALESCE_US, subNode->getIntAttribute("coalesce_us", node->DEFAULT_COALESCE_US));
+            node->cpu_affinity = jmax(-1, subNode->getIntAttribute("cpu_affinity", -1));
+            node->rt_priority = jlimit(node->MIN_RT_PRIORITY, node->MAX_RT_PRIORITY, subNode->getIntAttribute("rt_priority", 0));
+            node->lock_memory = subNode->getBoolAttribute("lock_memory", false);
+            node->rcvbuf_kb = jlimit(node->MIN_RCVBUF_KB, node->MAX_RCVBUF_KB, subNode->getIntAttribute("rcvbuf_kb", 0));
+            node->capture_dir = subNode->getStringAttribute("capture_dir", "");
+            node->capture_segment_mb = jlimit(node->MIN_CAPTURE_SEGMENT_MB, node->MAX_CAPTURE_SEGMENT_MB, subNode->getIntAttribute("capture_segment_mb", node->DEFAULT_CAPTURE_SEGMENT_MB));
+            node->capture_compress = subNode->getBoolAttribute("capture_compress", false);
+            node->channel_monitor = subNode->getBoolAttribute("channel_monitor", true);
+            node->highpass_hz = jlimit(node->MIN_HIGHPASS_HZ, node->MAX_HIGHPASS_HZ, (float) subNode->getDoubleAttribute("highpass_hz", 0.0));
+            node->lfp_rate = jlimit(node->MIN_LFP_RATE, node->MAX_LFP_RATE, (float) subNode->getDoubleAttribute("lfp_rate", 0.0));
+            node->setChannelMap(subNode->getStringAttribute("channel_map", "ALL"));
+
+            String reference = subNode->getStringAttribute("common_reference", Preprocessor::getName(Preprocessor::Reference::NONE));
+
+            for (Preprocessor::Reference candidate : { Preprocessor::Reference::NONE, Preprocessor::Reference::MEAN, Preprocessor::Reference::MEDIAN })
+            {
+                if (reference == Preprocessor::getName(candidate))
+                    node->common_reference = candidate;
+            }
+            node->layout_autodetect = subNode->getBoolAttribute("layout_autodetect", true);
+            node->num_channels = jlimit(node->MIN_NUM_CHANNELS, (int) GeminiPacket::MAX_PACKET_VALUES, subNode->getIntAttribute("num_channels", node->DEFAULT_NUM_CHANNELS));
+            node->num_samp = jlimit(node->MIN_NUM_SAMPLES, (int) GeminiPacket::MAX_PACKET_VALUES / node->num_channels, subNode->getIntAttribute("num_samples", node->DEFAULT_NUM_SAMPLES));
+            node->digital_inputs = subNode->getBoolAttribute("digital_inputs", false);
         }
     }
 }
+
+ChannelHeatmap::ChannelHeatmap(GeminiThread* thread)
+    : node(thread)
+{
+}
+
+void ChannelHeatmap::refresh()
+{
+    const int numDevices = node->getNumDevices();
+
+    snapshots.resize(numDevices);
+    ports.resize(numDevices);
+    totalChannels = 0;
+
+    for (int d = 0; d < numDevices; d++)
+    {
+        if (!node->getChannelHealth(d, ports[d], snapshots[d]))
+            snapshots[d].numChannels = 0;
+
+        totalChannels += snapshots[d].numChannels;
+    }
+
+    repaint();
+}
+
+float ChannelHeatmap::getCellSize() const
+{
+    const int rows = jmax(1, (totalChannels + COLUMNS - 1) / COLUMNS);
+
+    return jmin((float) getWidth() / COLUMNS, (float) getHeight() / rows);
+}
+
+bool ChannelHeatmap::findCell(Point<int> position, int& device, int& channel) const
+{
+    const float cell = getCellSize();
+
+    if (cell <= 0 || position.x < 0 || position.y < 0)
+        return false;
+
+    const int column = (int) (position.x / cell);
+
+    if (column >= COLUMNS)
+        return false;
+
+    int index = (int) (position.y / cell) * COLUMNS + column;
+
+    for (device = 0; device < (int) snapshots.size(); device++)
+    {
+        if (index < snapshots[device].numChannels)
+        {
+            channel = index;
+            return true;
+        }
+
+        index -= snapshots[device].numChannels;
+    }
+
+    return false;
+}
+
+void ChannelHeatmap::paint(Graphics& g)
+{
+    const float cell = getCellSize();
+    int index = 0;
+
+    for (const auto& snapshot : snapshots)
+    {
+        for (int c = 0; c < snapshot.numChannels; c++, index++)
+        {
+            Colour colour;
+
+            switch (snapshot.status[c])
+            {
+            case ChannelMonitor::Status::FLAT:       colour = Colours::grey; break;
+            case ChannelMonitor::Status::CLIPPING:   colour = Colours::red; break;
+            case ChannelMonitor::Status::LINE_NOISE: colour = Colours::orange; break;
+            case ChannelMonitor::Status::NOISY:      colour = Colours::magenta; break;
+            default:                                 colour = Colours::limegreen; break;
+            }
+
+            g.setColour(colour);
+            g.fillRect((index % COLUMNS) * cell, (index / COLUMNS) * cell, cell - 1, cell - 1);
+        }
+    }
+
+    if (totalChannels == 0)
+    {
+        g.setColour(Colours::darkgrey);
+        g.setFont(Font("Small Text", 9, Font::plain));
+        g.drawText("no signal", 0, 0, getWidth(), getHeight(), Justification::centred);
+    }
+}
+
+String ChannelHeatmap::getTooltip()
+{
+    int device, channel;
+
+    if (!findCell(getMouseXYRelative(), device, channel))
+        return String();
+
+    const ChannelMonitor::Snapshot& snapshot = snapshots[device];
+
+    return "Port " + String(ports[device]) + " CH" + String(node->getWireChannel(device, channel)) + ": "
+        + ChannelMonitor::getName(snapshot.status[channel])
+        + ", RMS " + String(snapshot.rms[channel], 1)
+        + ", 50/60 Hz " + (snapshot.lineValid[0] ? String(snapshot.line50[channel], 1) : String("n/a"))
+        + "/" + (snapshot.lineValid[1] ? String(snapshot.line60[channel], 1) : String("n/a"));
+}
+
@@ -32,9 +32,51 @@
 
 namespace GeminiThreadNode {
 
+/**
+    Grid of one cell per channel across all devices, coloured by the
+    ChannelMonitor status of the last completed window.
+
+    Hovering a cell shows the port, channel, status and RMS.
+*/
+class ChannelHeatmap : public Component,
+                       public TooltipClient
+{
+public:
+    /** Constructor */
+    ChannelHeatmap(GeminiThread* thread);
+
+    /** Fetches the latest snapshot of every device and repaints */
+    void refresh();
+
+    /** Draws the grid */
+    void paint(Graphics& g) override;
+
+    /** Describes the channel under the mouse */
+    String getTooltip() override;
+
+private:
+
+    /** Cells per row */
+    const int COLUMNS = 16;
+
+    /** Returns the index into 'snapshots' and the channel of the cell at a point, or false */
+    bool findCell(Point<int> position, int& device, int& channel) const;
+
+    /** Returns the cell size in pixels */
+    float getCellSize() const;
+
+    GeminiThread* node;
+
+    std::vector<ChannelMonitor::Snapshot> snapshots;
+    std::vector<int> ports;
+    int totalChannels = 0;
+};
+
 class GeminiThreadEditor : public GenericEditor,
 						   public Label::Listener,
-                           public Button::Listener
+                           public Button::Listener,
+                           public ComboBox::Listener,
+                           public Timer
 {
 
 public:
@@ -50,12 +92,18 @@ public:
     /** Called when label is changed */
     void labelTextChanged(Label* label);
 
+    /** Called when a combo box selection changes */
+    void comboBoxChanged(ComboBox* comboBox);
+
     /** Called by processor graph in beginning of the acqusition, disables editor completly. */
     void startAcquisition();
 
     /** Called by processor graph at the end of the acqusition, reenables editor completly. */
     void stopAcquisition();
 
+    /** Refreshes the live statistics while acquiring */
+    void timerCallback() override;
+
     /** Called when configuration is saved. Adds editors config to xml. */
 	void saveCustomParametersToXml(XmlElement* xml) override;
 
@@ -65,6 +113,9 @@ public:
 
 private:
 
+    /** Refresh interval of the live statistics */
+    const int STATS_INTERVAL_MS = 1000;
+
     // Button that tries to connect to server
     ScopedPointer<UtilityButton> bindButton;
 
@@ -93,6 +144,20 @@ private:
     ScopedPointer<Label> offsetLabel;
     ScopedPointer<Label> offsetInput;
 
+    // Receive backend
+    ScopedPointer<Label> backendLabel;
+    ScopedPointer<ComboBox> backendSelector;
+
+    // Gap concealment
+    ScopedPointer<Label> gapLabel;
+    ScopedPointer<ComboBox> gapSelector;
+
+    // Live statistics
+    ScopedPointer<Label> statsLabel;
+
+    // Per-channel signal quality
+    ScopedPointer<ChannelHeatmap> heatmap;
+
     // Parent node
     GeminiThread *node;
 };
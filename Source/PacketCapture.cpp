@@ -0,0 +1,436 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "CaptureCompressor.h"
+#include "GeminiPacket.h"
+#include "PacketCapture.h"
+
+using namespace GeminiThreadNode;
+
+PacketCapture::PacketCapture()
+{
+}
+
+PacketCapture::~PacketCapture()
+{
+    close();
+}
+
+bool PacketCapture::open(const std::string& prefix_, int port_, int stream_, size_t segmentBytes_, CaptureCompressor* compressor_)
+{
+    close();
+
+    const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+
+    prefix = prefix_;
+    port = port_;
+    stream = stream_;
+    compressor = compressor_;
+    segmentBytes = segmentBytes_ > MIN_SEGMENT_BYTES ? segmentBytes_ : MIN_SEGMENT_BYTES;
+    segmentBytes = (segmentBytes + pageSize - 1) / pageSize * pageSize;
+
+    packets.store(0);
+    bytes.store(0);
+    dropped.store(0);
+    error.store(0);
+    lastSampleNumber = 0;
+    nextNumber = 0;
+
+    current = createSegment(nextNumber++);
+
+    if (current == nullptr)
+        return false;
+
+    active.store(current, std::memory_order_release);
+    segmentsStarted.store(1);
+
+    running.store(true);
+    writer = std::thread(&PacketCapture::run, this);
+
+    return true;
+}
+
+void PacketCapture::close()
+{
+    if (!writer.joinable())
+        return;
+
+    running.store(false);
+    wakeWriter.notify_one();
+    writer.join();
+
+    // both threads are stopped now
+    Segment* list = finished.exchange(nullptr);
+
+    while (list != nullptr)
+    {
+        Segment* next = list->next;
+        sealSegment(list);
+        list = next;
+    }
+
+    if (current != nullptr)
+        sealSegment(current);
+
+    current = nullptr;
+    active.store(nullptr);
+
+    // the spare was never written to
+    if (Segment* unused = spare.exchange(nullptr))
+    {
+        munmap(unused->base, unused->size);
+        ::close(unused->fd);
+        unlink(unused->path.c_str());
+        delete unused;
+    }
+}
+
+void PacketCapture::append(const PacketSlot* slots, int count)
+{
+    using namespace CaptureFile;
+
+    GeminiPacket::Header header;
+
+    for (int i = 0; i < count; i++)
+    {
+        const PacketSlot& packet = slots[i];
+        const size_t size = recordSize(packet.length);
+
+        Segment* segment = current;
+
+        if (segment->dataEnd + size + (segment->count + 1) * sizeof(IndexEntry) > segment->size)
+        {
+            segment = roll();
+
+            if (segment == nullptr)
+            {
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                continue;
+            }
+        }
+
+        RecordHeader record;
+        record.receiveNs = packet.timestampNs;
+        record.length = packet.length;
+        record.flags = 0;
+
+        if (GeminiPacket::parseHeader(packet.data, packet.length, header) == GeminiPacket::ParseResult::OK)
+            lastSampleNumber = header.sample_number;
+        else
+            record.flags |= FLAG_INVALID;
+
+        uint8_t* destination = segment->base + segment->dataEnd;
+        memcpy(destination, &record, sizeof(record));
+        memcpy(destination + sizeof(record), packet.data, packet.length);
+
+        IndexEntry entry;
+        entry.sampleNumber = lastSampleNumber;
+        entry.offset = segment->dataEnd;
+        memcpy(segment->base + segment->size - (segment->count + 1) * sizeof(IndexEntry), &entry, sizeof(entry));
+
+        segment->dataEnd += size;
+        segment->count++;
+
+        // keep the header current, so an interrupted capture is still readable
+        FileHeader* fileHeader = (FileHeader*) segment->base;
+        fileHeader->dataEnd = segment->dataEnd;
+        fileHeader->recordCount = segment->count;
+
+        segment->published.store(segment->dataEnd, std::memory_order_release);
+
+        packets.store(packets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytes.store(bytes.load(std::memory_order_relaxed) + packet.length, std::memory_order_relaxed);
+    }
+}
+
+PacketCapture::Segment* PacketCapture::roll()
+{
+    Segment* next = spare.exchange(nullptr, std::memory_order_acquire);
+
+    // the writer has not caught up; keep the full segment and drop
+    if (next == nullptr)
+        return nullptr;
+
+    Segment* full = current;
+
+    current = next;
+    active.store(next, std::memory_order_release);
+    segmentsStarted.store(segmentsStarted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    full->next = finished.load(std::memory_order_relaxed);
+
+    while (!finished.compare_exchange_weak(full->next, full, std::memory_order_release, std::memory_order_relaxed))
+        ;
+
+    wakeWriter.notify_one();
+
+    return next;
+}
+
+PacketCapture::Segment* PacketCapture::createSegment(uint32_t number)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%06u", number);
+
+    std::unique_ptr<Segment> segment = std::make_unique<Segment>();
+    segment->number = number;
+    segment->size = segmentBytes;
+    segment->path = prefix + suffix + CaptureFile::EXTENSION;
+
+    segment->fd = ::open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (segment->fd < 0)
+        return nullptr;
+
+    // reserve the blocks now, so a full disk shows up here rather than as SIGBUS in the receive thread
+    const int result = posix_fallocate(segment->fd, 0, (off_t) segment->size);
+
+    if (result != 0 && (result != EOPNOTSUPP || ftruncate(segment->fd, (off_t) segment->size) < 0))
+    {
+        errno = result != EOPNOTSUPP ? result : errno;
+        ::close(segment->fd);
+        unlink(segment->path.c_str());
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, segment->fd, 0);
+
+    if (mapping == MAP_FAILED)
+    {
+        ::close(segment->fd);
+        unlink(segment->path.c_str());
+        return nullptr;
+    }
+
+    segment->base = (uint8_t*) mapping;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    CaptureFile::FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CaptureFile::MAGIC, sizeof(header.magic));
+    header.version = CaptureFile::VERSION;
+    header.headerSize = sizeof(header);
+    header.port = (uint16_t) port;
+    header.stream = (uint16_t) stream;
+    header.segment = number;
+    header.createdNs = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    header.dataEnd = sizeof(header);
+
+    memcpy(segment->base, &header, sizeof(header));
+
+    segment->dataEnd = sizeof(header);
+    segment->published.store(segment->dataEnd);
+
+    return segment.release();
+}
+
+void PacketCapture::sealSegment(Segment* segment)
+{
+    using namespace CaptureFile;
+
+    // entries were written last-first at the end of the file; put them in record order after the data
+    std::vector<IndexEntry> index(segment->count);
+    const IndexEntry* backward = (const IndexEntry*) (segment->base + segment->size);
+
+    for (uint64_t i = 0; i < segment->count; i++)
+        memcpy(&index[i], backward - 1 - i, sizeof(IndexEntry));
+
+    if (segment->count > 0)
+        memcpy(segment->base + segment->dataEnd, index.data(), index.size() * sizeof(IndexEntry));
+
+    FileHeader* header = (FileHeader*) segment->base;
+    header->dataEnd = segment->dataEnd;
+    header->recordCount = segment->count;
+    header->indexOffset = segment->dataEnd;
+
+    const size_t sealedSize = segment->dataEnd + segment->count * sizeof(IndexEntry);
+
+    munmap(segment->base, segment->size);
+
+    if (ftruncate(segment->fd, (off_t) sealedSize) < 0 && error.load() == 0)
+        error.store(errno);
+
+    ::close(segment->fd);
+
+    if (compressor != nullptr)
+        compressor->enqueue(segment->path);
+
+    delete segment;
+}
+
+void PacketCapture::run()
+{
+    while (running.load(std::memory_order_relaxed))
+    {
+        Segment* list = finished.exchange(nullptr, std::memory_order_acquire);
+
+        while (list != nullptr)
+        {
+            Segment* next = list->next;
+            sealSegment(list);
+            list = next;
+        }
+
+        if (spare.load(std::memory_order_acquire) == nullptr)
+        {
+            Segment* segment = createSegment(nextNumber);
+
+            if (segment != nullptr)
+            {
+                nextNumber++;
+                spare.store(segment, std::memory_order_release);
+            }
+            else if (error.load() == 0)
+            {
+                error.store(errno);
+            }
+        }
+
+        // start writeback as the segment fills, so dirty pages never pile up
+        if (Segment* segment = active.load(std::memory_order_acquire))
+        {
+            const size_t published = segment->published.load(std::memory_order_acquire);
+
+            if (published >= segment->flushed + WRITEBACK_BYTES)
+            {
+                sync_file_range(segment->fd, (off_t) segment->flushed, (off_t) (published - segment->flushed), SYNC_FILE_RANGE_WRITE);
+                segment->flushed = published;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeWriter.wait_for(lock, std::chrono::milliseconds(WRITER_PERIOD_MS));
+    }
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const std::string& path)
+{
+    using namespace CaptureFile;
+
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+
+    if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(FileHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+        return false;
+
+    base = (uint8_t*) mapping;
+    fileSize = (size_t) info.st_size;
+    header = (const FileHeader*) base;
+    count = header->recordCount;
+
+    const size_t indexEnd = isSealed() ? header->indexOffset + count * sizeof(IndexEntry)
+                                       : header->dataEnd + count * sizeof(IndexEntry);
+
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION
+        || header->dataEnd > fileSize || indexEnd > fileSize)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (base != nullptr)
+        munmap(base, fileSize);
+
+    base = nullptr;
+    fileSize = 0;
+    header = nullptr;
+    count = 0;
+}
+
+const CaptureFile::IndexEntry& CaptureReader::getEntry(uint64_t index) const
+{
+    using namespace CaptureFile;
+
+    if (isSealed())
+        return ((const IndexEntry*) (base + header->indexOffset))[index];
+
+    return *((const IndexEntry*) (base + fileSize) - 1 - index);
+}
+
+const uint8_t* CaptureReader::getRecord(uint64_t index, CaptureFile::RecordHeader& record) const
+{
+    const uint64_t offset = getEntry(index).offset;
+
+    memcpy(&record, base + offset, sizeof(record));
+
+    return base + offset + sizeof(record);
+}
+
+uint64_t CaptureReader::findSample(uint64_t sampleNumber) const
+{
+    uint64_t low = 0;
+    uint64_t high = count;
+
+    while (low < high)
+    {
+        const uint64_t middle = low + (high - low) / 2;
+
+        if (getEntry(middle).sampleNumber < sampleNumber)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
@@ -0,0 +1,290 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef PACKETCAPTURE_H_DEFINED
+#define PACKETCAPTURE_H_DEFINED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "DatagramReceiver.h"
+
+namespace GeminiThreadNode {
+
+class CaptureCompressor;
+
+/**
+    On-disk format of a raw packet capture segment.
+
+    A segment is a preallocated file holding the datagrams of one receive
+    stream exactly as they came off the socket, each with its kernel receive
+    time. Records grow forward after the file header; while the segment is
+    being written, the index grows backward from the end of the file, one
+    entry per record, so both live in a single mapping. Sealing a segment
+    moves the index, in record order, to just after the last record and
+    trims the file.
+
+        offset        contents
+        0             FileHeader
+        64            RecordHeader + datagram, padded to 8 bytes, repeated
+        indexOffset   IndexEntry per record (sealed segments)
+        end - 16*n    IndexEntry per record, last record first (unsealed)
+
+    The index carries the device sample number of each datagram, so readers
+    can binary search a segment by sample number. Datagrams without a valid
+    header repeat the sample number of the previous record and are flagged.
+    All fields are little-endian.
+*/
+namespace CaptureFile {
+
+    const char MAGIC[8] = { 'G', 'M', 'N', 'I', 'C', 'A', 'P', '1' };
+    const uint32_t VERSION = 1;
+    const char* const EXTENSION = ".gcap";
+
+    /** Record flag: the datagram did not parse as a Gemini packet */
+    const uint32_t FLAG_INVALID = 1;
+
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint16_t port;
+        uint16_t stream;        // shard index, 0 when unsharded
+        uint32_t segment;       // sequence number of this file within the capture
+        int64_t createdNs;      // CLOCK_REALTIME
+        uint64_t dataEnd;       // end of the last complete record
+        uint64_t recordCount;
+        uint64_t indexOffset;   // 0 until the segment is sealed
+        uint64_t reserved;
+    };
+
+    struct RecordHeader
+    {
+        int64_t receiveNs;      // kernel receive time, CLOCK_REALTIME
+        uint32_t length;        // datagram bytes that follow
+        uint32_t flags;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t sampleNumber;
+        uint64_t offset;        // of the RecordHeader
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "capture file header must be 64 bytes");
+    static_assert(sizeof(RecordHeader) == 16, "capture record header must be 16 bytes");
+    static_assert(sizeof(IndexEntry) == 16, "capture index entry must be 16 bytes");
+
+    /** Bytes a datagram of 'length' bytes occupies in the data area */
+    inline size_t recordSize(uint32_t length) { return sizeof(RecordHeader) + (((size_t) length + 7) & ~(size_t) 7); }
+}
+
+/**
+    Appends every datagram of one receive stream to a series of capture
+    segments.
+
+    The receiving thread calls append() right after a batch lands, before it
+    is handed on, so capture adds one copy per packet to the receive thread
+    and nothing to the acquisition thread. The copy goes straight into a
+    shared file mapping that was preallocated and prefaulted by a background
+    writer thread; the receive thread never makes a system call for capture.
+
+    The writer thread keeps the next segment mapped and ready, starts
+    writeback of the current one as it fills, and seals and closes the
+    segments the receive thread has finished with. If the writer falls so
+    far behind that no spare segment is ready when the current one fills,
+    datagrams are counted as dropped rather than stalling the receive path.
+    Given a CaptureCompressor, sealed segments are handed to it to be
+    replaced by compressed ones.
+
+    append() must only be called from one thread at a time; counters may be
+    read from any thread.
+*/
+class PacketCapture
+{
+public:
+    /** Smallest segment open() accepts; a segment always has room for one largest datagram */
+    static constexpr size_t MIN_SEGMENT_BYTES = 1 << 20;
+
+    /** Constructor */
+    PacketCapture();
+
+    /** Destructor. Closes the capture. */
+    ~PacketCapture();
+
+    /**
+        Starts a capture named '<prefix>_<segment>.gcap' and maps the first
+        segment. Sealed segments go to 'compressor', if given. Returns
+        false, with errno set, if it could not be created.
+    */
+    bool open(const std::string& prefix, int port, int stream, size_t segmentBytes, CaptureCompressor* compressor = nullptr);
+
+    /** Seals the current segment and stops the writer. Only call once the receiving thread has stopped. */
+    void close();
+
+    /** True between a successful open() and close() */
+    bool isOpen() const { return writer.joinable(); }
+
+    /** Copies 'count' received datagrams into the current segment */
+    void append(const PacketSlot* slots, int count);
+
+    /** Datagrams written */
+    uint64_t getPackets() const { return packets.load(std::memory_order_relaxed); }
+
+    /** Datagram bytes written */
+    uint64_t getBytes() const { return bytes.load(std::memory_order_relaxed); }
+
+    /** Datagrams dropped because no segment was ready */
+    uint64_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+    /** Segments started so far */
+    uint32_t getSegments() const { return segmentsStarted.load(std::memory_order_relaxed); }
+
+    /** The errno of the first file error in the writer thread, or 0 */
+    int getError() const { return error.load(std::memory_order_relaxed); }
+
+    /** File name prefix given to open() */
+    const std::string& getPrefix() const { return prefix; }
+
+private:
+    /** The writer starts writeback of the current segment every this many bytes */
+    static constexpr size_t WRITEBACK_BYTES = 4 << 20;
+
+    /** Longest the writer sleeps between checks, in milliseconds */
+    static constexpr int WRITER_PERIOD_MS = 10;
+
+    struct Segment
+    {
+        int fd = -1;
+        uint8_t* base = nullptr;
+        size_t size = 0;
+        uint32_t number = 0;
+        std::string path;
+
+        // producer side
+        size_t dataEnd = 0;
+        uint64_t count = 0;
+
+        // read by the writer for incremental writeback
+        std::atomic<size_t> published { 0 };
+        size_t flushed = 0;
+
+        Segment* next = nullptr;
+    };
+
+    /** Creates, preallocates and maps segment 'number'. Returns nullptr on failure. */
+    Segment* createSegment(uint32_t number);
+
+    /** Moves the index after the records, trims the file and unmaps it */
+    void sealSegment(Segment* segment);
+
+    /** Hands the full current segment to the writer and takes the spare. Returns the new current segment, or nullptr. */
+    Segment* roll();
+
+    void run();
+
+    std::string prefix;
+    int port = 0;
+    int stream = 0;
+    size_t segmentBytes = 0;
+    CaptureCompressor* compressor = nullptr;
+
+    // owned by the receiving thread
+    Segment* current = nullptr;
+    uint64_t lastSampleNumber = 0;
+
+    // handed between the threads
+    std::atomic<Segment*> active { nullptr };
+    std::atomic<Segment*> spare { nullptr };
+    std::atomic<Segment*> finished { nullptr };
+    uint32_t nextNumber = 0;
+
+    std::thread writer;
+    std::atomic<bool> running { false };
+    std::mutex wakeMutex;
+    std::condition_variable wakeWriter;
+
+    std::atomic<uint64_t> packets { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> dropped { 0 };
+    std::atomic<uint32_t> segmentsStarted { 0 };
+    std::atomic<int> error { 0 };
+};
+
+/**
+    Read-only view of one capture segment, sealed or not.
+
+    Maps the whole file, so records are returned as pointers into it and
+    stay valid until the reader is closed or reopened.
+*/
+class CaptureReader
+{
+public:
+    /** Destructor */
+    ~CaptureReader();
+
+    /** Maps a segment file. Returns false if it is missing or not a capture segment. */
+    bool open(const std::string& path);
+
+    /** Unmaps the file */
+    void close();
+
+    /** The segment's file header */
+    const CaptureFile::FileHeader& getHeader() const { return *header; }
+
+    /** Records in the segment */
+    uint64_t size() const { return count; }
+
+    /** True if the writer sealed the segment; unsealed segments come from an interrupted capture */
+    bool isSealed() const { return header != nullptr && header->indexOffset != 0; }
+
+    /** Index entry of record 'index', in arrival order */
+    const CaptureFile::IndexEntry& getEntry(uint64_t index) const;
+
+    /** Reads record 'index'. Returns the datagram and fills in its record header. */
+    const uint8_t* getRecord(uint64_t index, CaptureFile::RecordHeader& record) const;
+
+    /**
+        Index of the first record whose sample number is not below
+        'sampleNumber', or size() if there is none. Out-of-order arrivals
+        make the index only nearly sorted, so callers wanting one exact
+        packet should also look a few records either side.
+    */
+    uint64_t findSample(uint64_t sampleNumber) const;
+
+private:
+    uint8_t* base = nullptr;
+    size_t fileSize = 0;
+    const CaptureFile::FileHeader* header = nullptr;
+    uint64_t count = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,591 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "PacketDecoder.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    // Samples arrive little-endian, which matches every host the plugin runs on.
+
+    // ------------------------------------------------------------
+    //                        sample formats
+    // ------------------------------------------------------------
+
+    struct Int16
+    {
+        static constexpr size_t BYTES = 2;
+        static constexpr size_t OVERREAD = 0;   // bytes past the last sample the vector load may touch
+
+        static inline float load(const uint8_t* p)
+        {
+            int16_t raw;
+            memcpy(&raw, p, sizeof(raw));
+            return (float) raw;
+        }
+    };
+
+    struct UInt16
+    {
+        static constexpr size_t BYTES = 2;
+        static constexpr size_t OVERREAD = 0;
+
+        static inline float load(const uint8_t* p)
+        {
+            uint16_t raw;
+            memcpy(&raw, p, sizeof(raw));
+            return (float) raw;
+        }
+    };
+
+    struct Int24
+    {
+        static constexpr size_t BYTES = 3;
+        static constexpr size_t OVERREAD = 8;
+
+        static inline float load(const uint8_t* p)
+        {
+            // assemble in the top three bytes, then shift down to sign-extend
+            const int32_t raw = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+            return (float) raw;
+        }
+    };
+
+    struct Float32
+    {
+        static constexpr size_t BYTES = 4;
+        static constexpr size_t OVERREAD = 0;
+
+        static inline float load(const uint8_t* p)
+        {
+            float raw;
+            memcpy(&raw, p, sizeof(raw));
+            return raw;
+        }
+    };
+
+    // ------------------------------------------------------------
+    //                       scalar kernels
+    // ------------------------------------------------------------
+
+    template <typename Format>
+    inline void convertScalar(const uint8_t* src, float* dest, size_t count, float scale, float bias)
+    {
+        for (size_t i = 0; i < count; i++)
+            dest[i] = Format::load(src + Format::BYTES * i) * scale + bias;
+    }
+
+    template <typename Format>
+    void convertGenericScalar(const uint8_t* src, float* dest, size_t count, float scale, float bias)
+    {
+        convertScalar<Format>(src, dest, count, scale, bias);
+    }
+
+    /** The count is a constant, so even the baseline build can vectorize this without a remainder loop */
+    template <typename Format, size_t COUNT>
+    void convertFixedScalar(const uint8_t* src, float* dest, size_t, float scale, float bias)
+    {
+        convertScalar<Format>(src, dest, COUNT, scale, bias);
+    }
+
+    template <typename Format>
+    void gatherScalar(const uint8_t* src, size_t frameBytes, int numFrames, const int32_t* offsets, int numOutputs,
+                      float* dest, float scale, float bias)
+    {
+        for (int f = 0; f < numFrames; f++, src += frameBytes, dest += numOutputs)
+        {
+            for (int j = 0; j < numOutputs; j++)
+                dest[j] = Format::load(src + offsets[j]) * scale + bias;
+        }
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    // ------------------------------------------------------------
+    //                         SSE2 kernel
+    // ------------------------------------------------------------
+
+    __attribute__((target("sse2")))
+    void convertInt16SSE2(const uint8_t* src, float* dest, size_t count, float scale, float bias)
+    {
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 vbias = _mm_set1_ps(bias);
+
+        size_t i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i raw = _mm_loadu_si128((const __m128i*) (src + 2 * i));
+
+            // sign-extend by placing each int16 in the high half of an int32 and shifting down
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16);
+
+            _mm_storeu_ps(dest + i, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), vscale), vbias));
+            _mm_storeu_ps(dest + i + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), vscale), vbias));
+        }
+
+        convertScalar<Int16>(src + 2 * i, dest + i, count - i, scale, bias);
+    }
+
+    // ------------------------------------------------------------
+    //                        AVX2 kernels
+    // ------------------------------------------------------------
+
+    /** Loads 8 samples as floats */
+    template <typename Format>
+    __m256 load8(const uint8_t* src);
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 load8<Int16>(const uint8_t* src)
+    {
+        return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) src)));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 load8<UInt16>(const uint8_t* src)
+    {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) src)));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 load8<Int24>(const uint8_t* src)
+    {
+        // 24 bytes used out of 32 loaded: samples 0-3 stay in the low half, samples 4-7 (bytes 12-23)
+        // move to the high half, then each lands in the top three bytes of its int32 to be sign-extended
+        const __m256i raw = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) src),
+            _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0));
+
+        const __m256i spread = _mm256_shuffle_epi8(raw, _mm256_setr_epi8(
+            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11));
+
+        return _mm256_cvtepi32_ps(_mm256_srai_epi32(spread, 8));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 load8<Float32>(const uint8_t* src)
+    {
+        return _mm256_loadu_ps((const float*) src);
+    }
+
+    template <typename Format>
+    __attribute__((target("avx2,fma"), always_inline))
+    inline void convertAVX2(const uint8_t* src, float* dest, size_t count, float scale, float bias)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        const __m256 vbias = _mm256_set1_ps(bias);
+
+        size_t i = 0;
+
+        // keep the last load inside the payload for formats that read past their 8 samples
+        for (; (i + 16) * Format::BYTES + Format::OVERREAD <= count * Format::BYTES; i += 16)
+        {
+            _mm256_storeu_ps(dest + i, _mm256_fmadd_ps(load8<Format>(src + Format::BYTES * i), vscale, vbias));
+            _mm256_storeu_ps(dest + i + 8, _mm256_fmadd_ps(load8<Format>(src + Format::BYTES * (i + 8)), vscale, vbias));
+        }
+
+        for (; (i + 8) * Format::BYTES + Format::OVERREAD <= count * Format::BYTES; i += 8)
+            _mm256_storeu_ps(dest + i, _mm256_fmadd_ps(load8<Format>(src + Format::BYTES * i), vscale, vbias));
+
+        convertScalar<Format>(src + Format::BYTES * i, dest + i, count - i, scale, bias);
+    }
+
+    template <typename Format>
+    __attribute__((target("avx2,fma")))
+    void convertGenericAVX2(const uint8_t* src, float* dest, size_t count, float scale, float bias)
+    {
+        convertAVX2<Format>(src, dest, count, scale, bias);
+    }
+
+    template <typename Format, size_t COUNT>
+    __attribute__((target("avx2,fma")))
+    void convertFixedAVX2(const uint8_t* src, float* dest, size_t, float scale, float bias)
+    {
+        convertAVX2<Format>(src, dest, COUNT, scale, bias);
+    }
+
+    /** Gathers the 8 samples at byte offsets 'offsets' of 'frame' as floats, reading 4 bytes at each */
+    template <typename Format>
+    __m256 gather8(const uint8_t* frame, __m256i offsets);
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 gather8<Int16>(const uint8_t* frame, __m256i offsets)
+    {
+        const __m256i raw = _mm256_i32gather_epi32((const int*) frame, offsets, 1);
+        return _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(raw, 16), 16));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 gather8<UInt16>(const uint8_t* frame, __m256i offsets)
+    {
+        const __m256i raw = _mm256_i32gather_epi32((const int*) frame, offsets, 1);
+        return _mm256_cvtepi32_ps(_mm256_and_si256(raw, _mm256_set1_epi32(0xFFFF)));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 gather8<Int24>(const uint8_t* frame, __m256i offsets)
+    {
+        const __m256i raw = _mm256_i32gather_epi32((const int*) frame, offsets, 1);
+        return _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(raw, 8), 8));
+    }
+
+    template <>
+    __attribute__((target("avx2"), always_inline))
+    inline __m256 gather8<Float32>(const uint8_t* frame, __m256i offsets)
+    {
+        return _mm256_i32gather_ps((const float*) frame, offsets, 1);
+    }
+
+    template <typename Format>
+    __attribute__((target("avx2,fma")))
+    void gatherAVX2(const uint8_t* src, size_t frameBytes, int numFrames, const int32_t* offsets, int numOutputs,
+                    float* dest, float scale, float bias)
+    {
+        const __m256 vscale = _mm256_set1_ps(scale);
+        const __m256 vbias = _mm256_set1_ps(bias);
+        const int vectorEnd = numOutputs - numOutputs % 8;
+
+        // a narrow sample is fetched with the bytes after it, which for the last frame may lie past the payload
+        const int vectorFrames = Format::BYTES < 4 ? numFrames - 1 : numFrames;
+
+        for (int f = 0; f < vectorFrames; f++)
+        {
+            const uint8_t* frame = src + frameBytes * f;
+            float* out = dest + (size_t) numOutputs * f;
+            int j = 0;
+
+            for (; j < vectorEnd; j += 8)
+            {
+                const __m256i at = _mm256_loadu_si256((const __m256i*) (offsets + j));
+                _mm256_storeu_ps(out + j, _mm256_fmadd_ps(gather8<Format>(frame, at), vscale, vbias));
+            }
+
+            for (; j < numOutputs; j++)
+                out[j] = Format::load(frame + offsets[j]) * scale + bias;
+        }
+
+        if (vectorFrames < numFrames)
+        {
+            gatherScalar<Format>(src + frameBytes * vectorFrames, frameBytes, numFrames - vectorFrames, offsets, numOutputs,
+                dest + (size_t) numOutputs * vectorFrames, scale, bias);
+        }
+    }
+
+#endif
+
+    // ------------------------------------------------------------
+    //                     specialized layouts
+    // ------------------------------------------------------------
+
+    struct LayoutKernel
+    {
+        uint8_t format;
+        int numChannels;
+        int numSamples;
+        PacketDecoder::ConvertFn scalar;
+        PacketDecoder::ConvertFn avx2;
+    };
+
+#ifdef GEMINI_X86_KERNELS
+#define GEMINI_AVX2_KERNEL(TYPE, COUNT) &convertFixedAVX2<TYPE, COUNT>
+#else
+#define GEMINI_AVX2_KERNEL(TYPE, COUNT) nullptr
+#endif
+
+#define GEMINI_LAYOUT(FORMAT, TYPE, CHANNELS, SAMPLES) \
+    { GeminiPacket::FORMAT, CHANNELS, SAMPLES, &convertFixedScalar<TYPE, CHANNELS * SAMPLES>, GEMINI_AVX2_KERNEL(TYPE, CHANNELS * SAMPLES) },
+
+#define GEMINI_LAYOUTS(FORMAT, TYPE) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 32, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 64, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 128, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 192, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 256, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 384, 30) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 192, 1) \
+    GEMINI_LAYOUT(FORMAT, TYPE, 192, 8)
+
+    /** The configurations Gemini headstages are run with */
+    const LayoutKernel LAYOUTS[] = {
+        GEMINI_LAYOUTS(INT16, Int16)
+        GEMINI_LAYOUTS(UINT16, UInt16)
+        GEMINI_LAYOUTS(INT24, Int24)
+        GEMINI_LAYOUTS(FLOAT32, Float32)
+    };
+
+#undef GEMINI_LAYOUTS
+#undef GEMINI_LAYOUT
+#undef GEMINI_AVX2_KERNEL
+}
+
+PacketDecoder::PacketDecoder()
+{
+    isa = InstructionSet::SCALAR;
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        isa = InstructionSet::AVX2;
+        instructionSet = "AVX2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        isa = InstructionSet::SSE2;
+        instructionSet = "SSE2";
+    }
+#endif
+
+    setScaling(1.0f, 0.0f);
+    setLayout(GeminiPacket::INT16, 0, 0);
+}
+
+void PacketDecoder::setScaling(float scale_, float offset)
+{
+    // (raw - offset) * scale folded into a single multiply-add
+    scale = scale_;
+    bias = -offset * scale_;
+}
+
+void PacketDecoder::setLayout(uint8_t format_, int numChannels, int numSamples)
+{
+    format = format_;
+    layoutChannels = numChannels;
+    layoutSamples = numSamples;
+    layoutCount = (size_t) numChannels * numSamples;
+    specialized = false;
+    layoutKernel = getGenericKernel(format);
+
+    for (const LayoutKernel& layout : LAYOUTS)
+    {
+        if (layout.format != format || layout.numChannels != numChannels || layout.numSamples != numSamples)
+            continue;
+
+        // an SSE2-only host gets the generic SSE2 int16 kernel rather than the baseline build of the layout
+        if (isa == InstructionSet::AVX2 && layout.avx2 != nullptr)
+            layoutKernel = layout.avx2;
+        else if (isa == InstructionSet::SCALAR || format != GeminiPacket::INT16)
+            layoutKernel = layout.scalar;
+        else
+            break;
+
+        specialized = true;
+        break;
+    }
+
+    if (isMapped())
+        updateGather();
+}
+
+void PacketDecoder::setChannelMap(const std::vector<int>& wireChannels)
+{
+    gatherChannels.assign(wireChannels.begin(), wireChannels.end());
+    gatherOffsets.resize(gatherChannels.size());
+    updateGather();
+}
+
+void PacketDecoder::updateGather()
+{
+    const size_t bytes = GeminiPacket::bytesPerSample(format);
+
+    for (size_t j = 0; j < gatherChannels.size(); j++)
+        gatherOffsets[j] = (int32_t) (gatherChannels[j] * bytes);
+
+    gatherKernel = getGatherKernel(format);
+    runKernel = getGenericKernel(format);
+
+    gatherRuns.clear();
+
+    for (size_t j = 0; j < gatherChannels.size(); j++)
+    {
+        if (j > 0 && gatherChannels[j] == gatherChannels[j - 1] + 1)
+            gatherRuns.back().length++;
+        else
+            gatherRuns.push_back({ (int32_t) j, gatherOffsets[j], 1 });
+    }
+
+    if (gatherRuns.size() * MIN_RUN_LENGTH > gatherChannels.size())
+        gatherRuns.clear();
+}
+
+PacketDecoder::GatherFn PacketDecoder::getGatherKernel(uint8_t format) const
+{
+#ifdef GEMINI_X86_KERNELS
+    if (isa == InstructionSet::AVX2)
+    {
+        switch (format)
+        {
+        case GeminiPacket::INT16:
+            return &gatherAVX2<Int16>;
+        case GeminiPacket::UINT16:
+            return &gatherAVX2<UInt16>;
+        case GeminiPacket::INT24:
+            return &gatherAVX2<Int24>;
+        case GeminiPacket::FLOAT32:
+            return &gatherAVX2<Float32>;
+        default:
+            return nullptr;
+        }
+    }
+#endif
+
+    // SSE2 has no gather
+    switch (format)
+    {
+    case GeminiPacket::INT16:
+        return &gatherScalar<Int16>;
+    case GeminiPacket::UINT16:
+        return &gatherScalar<UInt16>;
+    case GeminiPacket::INT24:
+        return &gatherScalar<Int24>;
+    case GeminiPacket::FLOAT32:
+        return &gatherScalar<Float32>;
+    default:
+        return nullptr;
+    }
+}
+
+PacketDecoder::ConvertFn PacketDecoder::getGenericKernel(uint8_t format) const
+{
+#ifdef GEMINI_X86_KERNELS
+    if (isa == InstructionSet::AVX2)
+    {
+        switch (format)
+        {
+        case GeminiPacket::INT16:
+            return &convertGenericAVX2<Int16>;
+        case GeminiPacket::UINT16:
+            return &convertGenericAVX2<UInt16>;
+        case GeminiPacket::INT24:
+            return &convertGenericAVX2<Int24>;
+        case GeminiPacket::FLOAT32:
+            return &convertGenericAVX2<Float32>;
+        default:
+            return nullptr;
+        }
+    }
+
+    if (isa == InstructionSet::SSE2 && format == GeminiPacket::INT16)
+        return &convertInt16SSE2;
+#endif
+
+    switch (format)
+    {
+    case GeminiPacket::INT16:
+        return &convertGenericScalar<Int16>;
+    case GeminiPacket::UINT16:
+        return &convertGenericScalar<UInt16>;
+    case GeminiPacket::INT24:
+        return &convertGenericScalar<Int24>;
+    case GeminiPacket::FLOAT32:
+        return &convertGenericScalar<Float32>;
+    default:
+        return nullptr;
+    }
+}
+
+std::string PacketDecoder::getKernelName() const
+{
+    if (isMapped())
+    {
+        const std::string method = gatherRuns.empty() ? " gather " : " " + std::to_string(gatherRuns.size()) + " runs ";
+
+        return std::string(GeminiPacket::formatName(format)) + method + std::to_string(gatherChannels.size())
+            + " of " + std::to_string(layoutChannels) + " " + instructionSet;
+    }
+
+    const std::string layout = specialized ? std::to_string(layoutChannels) + "x" + std::to_string(layoutSamples) : std::string("generic");
+
+    return std::string(GeminiPacket::formatName(format)) + " " + layout + " " + instructionSet;
+}
+
+void PacketDecoder::decode(const GeminiPacket::Header& header, const uint8_t* payload, float* dest) const
+{
+    if (isMapped())
+    {
+        const int numOutputs = (int) gatherChannels.size();
+
+        if (header.sample_format == format && !gatherRuns.empty() && runKernel != nullptr)
+        {
+            const size_t frameBytes = (size_t) header.num_channels * GeminiPacket::bytesPerSample(format);
+
+            for (int f = 0; f < header.num_samples; f++, payload += frameBytes, dest += numOutputs)
+            {
+                for (const Run& run : gatherRuns)
+                    runKernel(payload + run.offset, dest + run.output, (size_t) run.length, scale, bias);
+            }
+        }
+        else if (header.sample_format == format && gatherKernel != nullptr)
+        {
+            gatherKernel(payload, (size_t) header.num_channels * GeminiPacket::bytesPerSample(format), header.num_samples,
+                gatherOffsets.data(), numOutputs, dest, scale, bias);
+        }
+        else
+        {
+            memset(dest, 0, sizeof(float) * numOutputs * header.num_samples);
+        }
+
+        return;
+    }
+
+    const size_t count = (size_t) header.num_channels * header.num_samples;
+
+    // packets that do not match the negotiated layout still decode, just generically
+    ConvertFn kernel = header.sample_format == format && (count == layoutCount || !specialized)
+        ? layoutKernel
+        : getGenericKernel(header.sample_format);
+
+    if (kernel != nullptr)
+        kernel(payload, dest, count, scale, bias);
+}
+
+void PacketDecoder::decode(const GeminiPacket::Header& header, const uint8_t* payload, float* dest, ChannelMonitor& monitor) const
+{
+    // int16 is converted and accumulated in one pass; other formats, and mapped channels, take a second pass over the floats
+    if (header.sample_format == GeminiPacket::INT16 && !isMapped())
+    {
+        monitor.decodeInt16(payload, dest, header.num_samples, scale, bias);
+        return;
+    }
+
+    decode(header, payload, dest);
+    monitor.accumulate(dest, header.num_samples);
+}
@@ -0,0 +1,161 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef PACKETDECODER_H_DEFINED
+#define PACKETDECODER_H_DEFINED
+
+#include <string>
+#include <vector>
+
+#include "ChannelMonitor.h"
+#include "GeminiPacket.h"
+
+namespace GeminiThreadNode {
+
+/**
+    Converts the sample payload of a Gemini packet into floats.
+
+    Output is interleaved in the same sample-major order as the packet, which
+    is the layout DataBuffer::addToBuffer() expects with a chunk size of 1.
+    Each value is computed as (raw - offset) * scale in a single pass.
+
+    Conversion kernels are templates on the sample format (int16, uint16,
+    packed int24, float32). For the common layouts listed in
+    PacketDecoder.cpp they are also instantiated with the channel and
+    sample counts fixed, so the compiler can drop the tail handling and
+    unroll; any other layout uses the generic kernel of its format.
+    setLayout() picks the kernel, and the instruction set (AVX2, SSE2 or
+    scalar) is picked once at construction based on what the host CPU
+    supports. decode() never allocates.
+
+    With a channel map, only the mapped channels are converted, in map
+    order, so each output frame holds getNumOutputs() values. The byte
+    offset of every mapped channel within a frame is precomputed for the
+    sample format. Maps made of runs of consecutive channels (banks moved
+    around, or a subset of them) convert each run with the generic kernel;
+    scattered maps go through the gather kernels, which with AVX2 fetch
+    eight channels per gather instruction.
+*/
+class PacketDecoder
+{
+public:
+    /** Constructor */
+    PacketDecoder();
+
+    /** Sets the scale and offset applied to every sample */
+    void setScaling(float scale, float offset);
+
+    /** Picks the kernel for packets of this sample format and layout. Call again whenever they change. */
+    void setLayout(uint8_t format, int numChannels, int numSamples);
+
+    /** Sample format given to setLayout() */
+    uint8_t getFormat() const { return format; }
+
+    /** Samples per packet given to setLayout() */
+    int getNumSamples() const { return layoutSamples; }
+
+    /**
+        Converts only these wire channels (0-based), in this order; an empty
+        map converts every channel in wire order. Every entry must be below
+        the channel count of the packets decoded. Allocates, so call while
+        stopped; setLayout() keeps the map.
+    */
+    void setChannelMap(const std::vector<int>& wireChannels);
+
+    /** True if a channel map is set */
+    bool isMapped() const { return !gatherChannels.empty(); }
+
+    /** Values per decoded frame: the mapped channels, or the channels given to setLayout() */
+    int getNumOutputs() const { return isMapped() ? (int) gatherChannels.size() : layoutChannels; }
+
+    /**
+        Converts the payload of a validated packet into header.num_samples
+        frames of getNumOutputs() floats. With a channel map the packet must
+        be in the sample format given to setLayout(); others decode as zeros.
+    */
+    void decode(const GeminiPacket::Header& header, const uint8_t* payload, float* dest) const;
+
+    /** Same as decode(), also accumulating every sample into 'monitor' */
+    void decode(const GeminiPacket::Header& header, const uint8_t* payload, float* dest, ChannelMonitor& monitor) const;
+
+    /** Returns the name of the instruction set the kernels use */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /** Returns the format, layout (or "generic") and instruction set of the kernel picked by setLayout() */
+    std::string getKernelName() const;
+
+    /** Signature of a raw -> float conversion kernel */
+    typedef void (*ConvertFn)(const uint8_t* src, float* dest, size_t count, float scale, float bias);
+
+    /** Signature of a mapped conversion kernel: 'numOutputs' values per frame, from the byte offsets within each 'frameBytes' frame */
+    typedef void (*GatherFn)(const uint8_t* src, size_t frameBytes, int numFrames, const int32_t* offsets, int numOutputs,
+                             float* dest, float scale, float bias);
+
+private:
+    /** Returns the generic kernel for a sample format, or nullptr if it is unknown */
+    ConvertFn getGenericKernel(uint8_t format) const;
+
+    /** Returns the mapped kernel for a sample format, or nullptr if it is unknown */
+    GatherFn getGatherKernel(uint8_t format) const;
+
+    /** Recomputes the gather offsets, runs and kernels for the current format */
+    void updateGather();
+
+    /** Consecutive mapped channels, converted together */
+    struct Run
+    {
+        int32_t output;     // first output value of the run within a frame
+        int32_t offset;     // byte offset of its first channel within a frame
+        int32_t length;
+    };
+
+    enum class InstructionSet { SCALAR, SSE2, AVX2 };
+
+    InstructionSet isa;
+    const char* instructionSet;
+
+    // picked by setLayout()
+    uint8_t format = GeminiPacket::INT16;
+    int layoutChannels = 0;
+    int layoutSamples = 0;
+    size_t layoutCount = 0;
+    bool specialized = false;
+    ConvertFn layoutKernel = nullptr;
+
+    // channel map; the offsets follow the format
+    std::vector<int32_t> gatherChannels;
+    std::vector<int32_t> gatherOffsets;
+    GatherFn gatherKernel = nullptr;
+    std::vector<Run> gatherRuns;        // empty unless runs average MIN_RUN_LENGTH channels
+    ConvertFn runKernel = nullptr;
+
+    /** Average run length from which converting run by run beats gathering */
+    static const int MIN_RUN_LENGTH = 16;
+
+    float scale;
+    float bias;
+};
+
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "PacketRing.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    int roundUpToPowerOfTwo(int value)
+    {
+        int result = 1;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+}
+
+void RingWaiter::notifyIfWaiting()
+{
+    // pairs with the fence in wait(): either the consumer sees the new data,
+    // or we see that it is about to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (consumerWaiting.load(std::memory_order_relaxed))
+        notify();
+}
+
+void RingWaiter::notify()
+{
+    std::lock_guard<std::mutex> lock(waitMutex);
+    dataAvailable.notify_all();
+}
+
+PacketRing::PacketRing(int capacity_, size_t slotSize_, RingWaiter* sharedWaiter)
+    : slots(roundUpToPowerOfTwo(capacity_), slotSize_),
+      capacity(roundUpToPowerOfTwo(capacity_)),
+      mask((uint64_t) roundUpToPowerOfTwo(capacity_) - 1),
+      slotSize(slotSize_),
+      waiter(sharedWaiter != nullptr ? *sharedWaiter : ownWaiter)
+{
+}
+
+int PacketRing::getWritableSlots(PacketSlot*& first)
+{
+    const uint64_t write = writeIndex.load(std::memory_order_relaxed);
+
+    if (write - cachedReadIndex == (uint64_t) capacity)
+    {
+        cachedReadIndex = readIndex.load(std::memory_order_acquire);
+
+        if (write - cachedReadIndex == (uint64_t) capacity)
+            return 0;
+    }
+
+    const uint64_t free = (uint64_t) capacity - (write - cachedReadIndex);
+    const uint64_t untilWrap = (uint64_t) capacity - (write & mask);
+
+    first = slots.data() + (write & mask);
+    return (int) (free < untilWrap ? free : untilWrap);
+}
+
+void PacketRing::commitWrite(int count)
+{
+    const uint64_t write = writeIndex.load(std::memory_order_relaxed) + count;
+
+    writeIndex.store(write, std::memory_order_release);
+
+    waiter.notifyIfWaiting();
+}
+
+void PacketRing::addOverflow(int count)
+{
+    overflows.store(overflows.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
+
+int PacketRing::getReadableSlots(PacketSlot*& first)
+{
+    const uint64_t read = readIndex.load(std::memory_order_relaxed);
+
+    if (cachedWriteIndex == read)
+    {
+        cachedWriteIndex = writeIndex.load(std::memory_order_acquire);
+
+        if (cachedWriteIndex == read)
+            return 0;
+
+        // everything written since the last refresh is waiting now, so this is when the ring is fullest
+        const int occupancy = (int) (cachedWriteIndex - read);
+        if (occupancy > highWater.load(std::memory_order_relaxed))
+            highWater.store(occupancy, std::memory_order_relaxed);
+    }
+
+    const uint64_t available = cachedWriteIndex - read;
+    const uint64_t untilWrap = (uint64_t) capacity - (read & mask);
+
+    first = slots.data() + (read & mask);
+    return (int) (available < untilWrap ? available : untilWrap);
+}
+
+void PacketRing::commitRead(int count)
+{
+    readIndex.store(readIndex.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+bool PacketRing::hasData() const
+{
+    return writeIndex.load(std::memory_order_acquire) != readIndex.load(std::memory_order_relaxed);
+}
+
+bool PacketRing::waitForData(int timeoutUs)
+{
+    return waiter.wait(timeoutUs, [this] { return hasData(); });
+}
+
+void PacketRing::wakeConsumer()
+{
+    waiter.notify();
+}
+
+void PacketRing::reset()
+{
+    writeIndex.store(0);
+    readIndex.store(0);
+    cachedReadIndex = 0;
+    cachedWriteIndex = 0;
+    overflows.store(0);
+    highWater.store(0);
+}
+
+int PacketRing::getOccupancy() const
+{
+    // read first: the write index can only have moved further by the time we load it
+    const uint64_t read = readIndex.load(std::memory_order_acquire);
+    return (int) (writeIndex.load(std::memory_order_acquire) - read);
+}
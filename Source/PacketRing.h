@@ -0,0 +1,176 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef PACKETRING_H_DEFINED
+#define PACKETRING_H_DEFINED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "DatagramReceiver.h"
+
+namespace GeminiThreadNode {
+
+/**
+    Sleep / wake point for a consumer that drains one or more PacketRings.
+
+    Producers call notifyIfWaiting() after publishing, which only takes the
+    mutex when the consumer has announced that it is about to sleep. Several
+    rings can share one waiter, so a single thread can block until any of
+    them has data.
+*/
+class RingWaiter
+{
+public:
+    /** Blocks until 'ready' returns true or the timeout expires. Returns the last result of 'ready'. */
+    template <typename Predicate>
+    bool wait(int timeoutUs, Predicate&& ready)
+    {
+        if (ready())
+            return true;
+
+        std::unique_lock<std::mutex> lock(waitMutex);
+
+        consumerWaiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool result = dataAvailable.wait_for(lock, std::chrono::microseconds(timeoutUs), ready);
+
+        consumerWaiting.store(false, std::memory_order_relaxed);
+
+        return result;
+    }
+
+    /** Wakes the consumer if it is asleep in wait() */
+    void notifyIfWaiting();
+
+    /** Wakes the consumer unconditionally */
+    void notify();
+
+private:
+    alignas(64) std::atomic<bool> consumerWaiting { false };
+    std::mutex waitMutex;
+    std::condition_variable dataAvailable;
+};
+
+/**
+    Lock-free single-producer / single-consumer ring of preallocated packet slots.
+
+    The producer (the socket reader) asks for a run of contiguous free slots,
+    receives straight into them and commits; the consumer asks for a run of
+    filled slots, decodes them in place and releases them. Indices live on
+    separate cache lines so the two threads never share a line on the fast path.
+
+    The consumer can block in waitForData() when the ring is empty; the
+    producer only touches the condition variable when the consumer is
+    actually asleep. Rings constructed with a shared RingWaiter wake that
+    waiter instead of their own.
+*/
+class PacketRing
+{
+public:
+    /** Constructor. Capacity is rounded up to a power of two. */
+    PacketRing(int capacity, size_t slotSize, RingWaiter* sharedWaiter = nullptr);
+
+    // ---------------- producer ----------------
+
+    /** Returns the number of contiguous free slots, starting at 'first' */
+    int getWritableSlots(PacketSlot*& first);
+
+    /** Publishes 'count' slots previously obtained from getWritableSlots() */
+    void commitWrite(int count);
+
+    /** Records datagrams that had to be discarded because the ring was full */
+    void addOverflow(int count);
+
+    // ---------------- consumer ----------------
+
+    /** Returns the number of contiguous filled slots, starting at 'first' */
+    int getReadableSlots(PacketSlot*& first);
+
+    /** Returns 'count' slots to the producer */
+    void commitRead(int count);
+
+    /** Returns true if at least one slot is filled */
+    bool hasData() const;
+
+    /** Blocks until the ring is non-empty or the timeout expires. Returns true if data is available. */
+    bool waitForData(int timeoutUs);
+
+    /** Wakes a consumer blocked in waitForData(), or in the shared waiter */
+    void wakeConsumer();
+
+    // ---------------- either thread ----------------
+
+    /** Discards all packets and statistics. Only call while neither side is running. */
+    void reset();
+
+    /** Total number of slots */
+    int getCapacity() const { return capacity; }
+
+    /** Bytes available in each slot */
+    size_t getSlotSize() const { return slotSize; }
+
+    /** Prefaults the slots and locks them in memory. Returns false, with errno set, if the lock was refused. */
+    bool lockMemory() { return slots.lockMemory(); }
+
+    /** Undoes lockMemory() */
+    void unlockMemory() { slots.unlockMemory(); }
+
+    /** Number of filled slots right now */
+    int getOccupancy() const;
+
+    /** Largest occupancy the consumer has found waiting since the last reset */
+    int getHighWater() const { return highWater.load(std::memory_order_relaxed); }
+
+    /** Number of datagrams dropped because the ring was full */
+    uint64_t getOverflowCount() const { return overflows.load(std::memory_order_relaxed); }
+
+private:
+    PacketSlotArray slots;
+    const int capacity;
+    const uint64_t mask;
+    const size_t slotSize;
+
+    // producer-owned line
+    alignas(64) std::atomic<uint64_t> writeIndex { 0 };
+    uint64_t cachedReadIndex = 0;
+
+    // consumer-owned line; the high-water mark is taken from the consumer's fresh view of the write index
+    alignas(64) std::atomic<uint64_t> readIndex { 0 };
+    uint64_t cachedWriteIndex = 0;
+    std::atomic<int> highWater { 0 };
+
+    // statistics, written by the producer only
+    alignas(64) std::atomic<uint64_t> overflows { 0 };
+
+    // consumer sleep / wake
+    RingWaiter ownWaiter;
+    RingWaiter& waiter;
+};
+
+}
+
+#endif
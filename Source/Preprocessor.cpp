@@ -0,0 +1,364 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMINI_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#include "Preprocessor.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    using Reference = Preprocessor::Reference;
+
+    const int VECTOR_CHANNELS = 8;
+    const size_t ARENA_ALIGNMENT = 64;
+
+    // Frame-outer, channel-inner: the reference needs every channel of a
+    // frame before it can be subtracted, and walking a frame in order
+    // subtracts it while the frame is still in L1. The biquad state of even
+    // a few hundred channels fits in L1 alongside it. Each frame overwrites
+    // the older input and output with the new ones, then the two pairs of
+    // arrays swap roles, so the history is never copied.
+    //
+    // The biquad is direct form I with the numerator as b0 ((x - x1) - (x1 - x2)).
+    // Differences of neighbouring samples are exact, so a channel's DC offset
+    // cancels before anything is rounded; the transposed form would carry it
+    // through its state, where the low-frequency gain of about (fs / 2 pi fc)^2
+    // amplifies the rounding. Filtering first also keeps the offsets out of
+    // the median.
+
+    /** Makes the input and output just written the most recent ones */
+    inline void advanceHistory(Preprocessor::State& state)
+    {
+        std::swap(state.x1, state.x2);
+        std::swap(state.y1, state.y2);
+    }
+
+    /** Filters channels [firstChannel, numChannels) of one frame in place and returns their sum */
+    template <bool HIGHPASS>
+    inline float filterChannels(float* frame, int firstChannel, const Preprocessor::State& state)
+    {
+        float sum = 0;
+
+        for (int c = firstChannel; c < state.numChannels; c++)
+        {
+            float x = frame[c];
+
+            if constexpr (HIGHPASS)
+            {
+                const float y = state.b0 * ((x - state.x1[c]) - (state.x1[c] - state.x2[c])) - state.a1 * state.y1[c] - state.a2 * state.y2[c];
+                state.x2[c] = x;
+                state.y2[c] = y;
+                frame[c] = x = y;
+            }
+
+            sum += x;
+        }
+
+        return sum;
+    }
+
+    /** Median of a frame, averaging the two middle values of an even count */
+    inline float frameMedian(const float* frame, const Preprocessor::State& state)
+    {
+        const int n = state.numChannels;
+        float* scratch = state.scratch;
+        float* middle = scratch + n / 2;
+
+        memcpy(scratch, frame, sizeof(float) * n);
+        std::nth_element(scratch, middle, scratch + n);
+
+        if (n % 2 != 0)
+            return *middle;
+
+        return 0.5f * (*middle + *std::max_element(scratch, middle));
+    }
+
+    /** Value subtracted from every channel of a filtered frame whose channels sum to 'sum' */
+    template <Reference REFERENCE>
+    inline float frameReference(const float* frame, float sum, const Preprocessor::State& state)
+    {
+        if constexpr (REFERENCE == Reference::MEAN)
+            return sum / state.numChannels;
+        else if constexpr (REFERENCE == Reference::MEDIAN)
+            return frameMedian(frame, state);
+        else
+            return 0.0f;
+    }
+
+    template <bool HIGHPASS, Reference REFERENCE>
+    void processScalar(float* frames, int numSamples, Preprocessor::State& state)
+    {
+        const int n = state.numChannels;
+
+        for (int f = 0; f < numSamples; f++)
+        {
+            float* frame = frames + (size_t) f * n;
+            const float sum = filterChannels<HIGHPASS>(frame, 0, state);
+
+            if constexpr (HIGHPASS)
+                advanceHistory(state);
+
+            if constexpr (REFERENCE != Reference::NONE)
+            {
+                const float reference = frameReference<REFERENCE>(frame, sum, state);
+
+                for (int c = 0; c < n; c++)
+                    frame[c] -= reference;
+            }
+        }
+    }
+
+#ifdef GEMINI_X86_KERNELS
+
+    __attribute__((target("avx2,fma")))
+    inline float horizontalSum(__m256 v)
+    {
+        __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+        x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+        return _mm_cvtss_f32(x);
+    }
+
+    struct Coefficients
+    {
+        __m256 b0, a1, a2;
+    };
+
+    /** Filters (if HIGHPASS) eight channels of a frame in place and returns them */
+    template <bool HIGHPASS>
+    __attribute__((target("avx2,fma"), always_inline))
+    inline __m256 filterVector(float* frame, int c, const Coefficients& k, const Preprocessor::State& state)
+    {
+        const __m256 x = _mm256_loadu_ps(frame + c);
+
+        if constexpr (HIGHPASS)
+        {
+            const __m256 x1 = _mm256_load_ps(state.x1 + c);
+            const __m256 x2 = _mm256_load_ps(state.x2 + c);
+            const __m256 y1 = _mm256_load_ps(state.y1 + c);
+            const __m256 y2 = _mm256_load_ps(state.y2 + c);
+
+            // y = b0 ((x - x1) - (x1 - x2)) - a1 y1 - a2 y2
+            const __m256 d = _mm256_sub_ps(_mm256_sub_ps(x, x1), _mm256_sub_ps(x1, x2));
+            const __m256 y = _mm256_fnmadd_ps(k.a2, y2, _mm256_fnmadd_ps(k.a1, y1, _mm256_mul_ps(k.b0, d)));
+
+            _mm256_store_ps(state.x2 + c, x);
+            _mm256_store_ps(state.y2 + c, y);
+            _mm256_storeu_ps(frame + c, y);
+
+            return y;
+        }
+        else
+        {
+            return x;
+        }
+    }
+
+    template <bool HIGHPASS, Reference REFERENCE>
+    __attribute__((target("avx2,fma")))
+    void processAVX2(float* frames, int numSamples, Preprocessor::State& state)
+    {
+        const int n = state.numChannels;
+        const int vectorEnd = n - n % VECTOR_CHANNELS;
+        const int unrolledEnd = n - n % (4 * VECTOR_CHANNELS);
+
+        const Coefficients k = { _mm256_set1_ps(state.b0), _mm256_set1_ps(state.a1), _mm256_set1_ps(state.a2) };
+
+        for (int f = 0; f < numSamples; f++)
+        {
+            float* frame = frames + (size_t) f * n;
+
+            // four partial sums, so the mean is not one long chain of dependent adds
+            __m256 sum[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+            int c = 0;
+
+            for (; c < unrolledEnd; c += 4 * VECTOR_CHANNELS)
+            {
+                for (int u = 0; u < 4; u++)
+                    sum[u] = _mm256_add_ps(sum[u], filterVector<HIGHPASS>(frame, c + u * VECTOR_CHANNELS, k, state));
+            }
+
+            for (; c < vectorEnd; c += VECTOR_CHANNELS)
+                sum[0] = _mm256_add_ps(sum[0], filterVector<HIGHPASS>(frame, c, k, state));
+
+            sum[0] = _mm256_add_ps(_mm256_add_ps(sum[0], sum[1]), _mm256_add_ps(sum[2], sum[3]));
+
+            const float tail = filterChannels<HIGHPASS>(frame, vectorEnd, state);
+
+            if constexpr (HIGHPASS)
+                advanceHistory(state);
+
+            if constexpr (REFERENCE != Reference::NONE)
+            {
+                const float reference = frameReference<REFERENCE>(frame, horizontalSum(sum[0]) + tail, state);
+                const __m256 r = _mm256_set1_ps(reference);
+
+                for (c = 0; c < vectorEnd; c += VECTOR_CHANNELS)
+                    _mm256_storeu_ps(frame + c, _mm256_sub_ps(_mm256_loadu_ps(frame + c), r));
+
+                for (; c < n; c++)
+                    frame[c] -= reference;
+            }
+        }
+    }
+
+#endif
+}
+
+const char* Preprocessor::getName(Reference reference)
+{
+    switch (reference)
+    {
+    case Reference::NONE:
+        return "none";
+    case Reference::MEAN:
+        return "mean";
+    case Reference::MEDIAN:
+        return "median";
+    }
+
+    return "unknown";
+}
+
+Preprocessor::Preprocessor()
+{
+    instructionSet = "scalar";
+
+#ifdef GEMINI_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        avx2 = true;
+        instructionSet = "AVX2";
+    }
+#endif
+}
+
+Preprocessor::~Preprocessor()
+{
+    free(arena);
+}
+
+void Preprocessor::prepare(int numChannels, float sampleRate, Reference reference_, float highpassHz_)
+{
+    reference = reference_;
+    highpassHz = highpassHz_ > 0 && highpassHz_ < 0.5f * sampleRate ? highpassHz_ : 0.0f;
+    primed = false;
+
+    const int stride = (numChannels + VECTOR_CHANNELS - 1) / VECTOR_CHANNELS * VECTOR_CHANNELS;
+    const size_t bytes = 5 * (size_t) std::max(stride, VECTOR_CHANNELS) * sizeof(float);   // x1, x2, y1, y2, scratch
+
+    free(arena);
+    arena = (uint8_t*) aligned_alloc(ARENA_ALIGNMENT, bytes);
+    memset(arena, 0, bytes);
+
+    state.numChannels = numChannels;
+    state.x1 = (float*) arena;
+    state.x2 = state.x1 + stride;
+    state.y1 = state.x2 + stride;
+    state.y2 = state.y1 + stride;
+    state.scratch = state.y2 + stride;
+
+    // RBJ cookbook high-pass with Q = 1/sqrt(2), i.e. second-order Butterworth; b1 = -2 b0 and b2 = b0
+    if (highpassHz > 0)
+    {
+        const double omega = 2.0 * M_PI * highpassHz / sampleRate;
+        const double cosine = std::cos(omega);
+        const double alpha = std::sin(omega) / std::sqrt(2.0);
+        const double a0 = 1.0 + alpha;
+
+        state.b0 = (float) ((1.0 + cosine) / 2.0 / a0);
+        state.a1 = (float) (-2.0 * cosine / a0);
+        state.a2 = (float) ((1.0 - alpha) / a0);
+    }
+
+    // [high-pass][reference]; nothing to do without either
+    static const ProcessFn scalarKernels[2][3] = {
+        { nullptr, &processScalar<false, Reference::MEAN>, &processScalar<false, Reference::MEDIAN> },
+        { &processScalar<true, Reference::NONE>, &processScalar<true, Reference::MEAN>, &processScalar<true, Reference::MEDIAN> }
+    };
+
+    kernel = numChannels > 0 ? scalarKernels[highpassHz > 0][(int) reference] : nullptr;
+
+#ifdef GEMINI_X86_KERNELS
+    static const ProcessFn avx2Kernels[2][3] = {
+        { nullptr, &processAVX2<false, Reference::MEAN>, &processAVX2<false, Reference::MEDIAN> },
+        { &processAVX2<true, Reference::NONE>, &processAVX2<true, Reference::MEAN>, &processAVX2<true, Reference::MEDIAN> }
+    };
+
+    if (avx2 && kernel != nullptr)
+        kernel = avx2Kernels[highpassHz > 0][(int) reference];
+#endif
+}
+
+void Preprocessor::process(float* frames, int numSamples)
+{
+    if (kernel == nullptr || numSamples <= 0)
+        return;
+
+    if (!primed)
+    {
+        prime(frames);
+        primed = true;
+    }
+
+    kernel(frames, numSamples, state);
+}
+
+void Preprocessor::prime(const float* frame)
+{
+    // a constant input gives a zero output
+    for (int c = 0; c < state.numChannels; c++)
+    {
+        state.x1[c] = state.x2[c] = frame[c];
+        state.y1[c] = state.y2[c] = 0.0f;
+    }
+}
+
+std::string Preprocessor::getDescription() const
+{
+    if (!isEnabled())
+        return "off";
+
+    std::string description = std::string("reference=") + getName(reference);
+
+    if (highpassHz > 0)
+        description += " highpass_hz=" + std::to_string((int) std::lround(highpassHz));
+    else
+        description += " highpass_hz=off";
+
+    return description + " isa=" + instructionSet;
+}
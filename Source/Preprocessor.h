@@ -0,0 +1,115 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef PREPROCESSOR_H_DEFINED
+#define PREPROCESSOR_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace GeminiThreadNode {
+
+/**
+    Second-order Butterworth high-pass followed by a common mean or median
+    reference, applied in place to each decoded packet before it is staged,
+    while the samples are still in cache. The filter state is primed from
+    the first frame so channel offsets do not ring at the start.
+    process() never allocates.
+*/
+class Preprocessor
+{
+public:
+    /** What is subtracted from every channel of a frame */
+    enum class Reference : uint8_t
+    {
+        NONE,
+        MEAN,
+        MEDIAN
+    };
+
+    /** Name used in status messages and settings */
+    static const char* getName(Reference reference);
+
+    /** Constructor */
+    Preprocessor();
+
+    /** Destructor */
+    ~Preprocessor();
+
+    /**
+        Sizes the filter state and computes the coefficients. A cutoff of 0,
+        or one at or above half the sample rate, turns the high-pass off.
+        Not real-time safe.
+    */
+    void prepare(int numChannels, float sampleRate, Reference reference, float highpassHz);
+
+    /** True if process() changes the data */
+    bool isEnabled() const { return kernel != nullptr; }
+
+    /** Filters and references 'numSamples' interleaved frames in place */
+    void process(float* frames, int numSamples);
+
+    /** Returns the name of the kernel's instruction set */
+    const char* getInstructionSet() const { return instructionSet; }
+
+    /** Returns the reference, cutoff and instruction set, for status messages */
+    std::string getDescription() const;
+
+    /** Filter state and coefficients */
+    struct State
+    {
+        int numChannels = 0;
+        float* x1 = nullptr;        // last two inputs and outputs, 'stride' entries each; the kernels swap 1 and 2 after every frame
+        float* x2 = nullptr;
+        float* y1 = nullptr;
+        float* y2 = nullptr;
+        float* scratch = nullptr;   // a copy of the frame for the median
+        float b0 = 0, a1 = 0, a2 = 0;
+    };
+
+    /** Signature of a fused filter-and-reference kernel */
+    typedef void (*ProcessFn)(float* frames, int numSamples, State& state);
+
+private:
+    /** Sets the filter state to its steady state for a constant input equal to 'frame' */
+    void prime(const float* frame);
+
+    const char* instructionSet;
+    bool avx2 = false;
+
+    ProcessFn kernel = nullptr;
+    Reference reference = Reference::NONE;
+    float highpassHz = 0;
+    bool primed = false;
+
+    // one aligned block holding the filter state and the scratch frame
+    uint8_t* arena = nullptr;
+    State state;
+};
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "Realtime.h"
+
+using namespace GeminiThreadNode;
+
+bool Realtime::pinThread(pthread_t thread, int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    const int result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+
+    errno = result;
+    return result == 0;
+}
+
+bool Realtime::setFifoPriority(pthread_t thread, int priority)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    const int result = pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+    errno = result;
+    return result == 0;
+}
+
+std::string Realtime::describeThread(pthread_t thread)
+{
+    std::string description = "cpu=";
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+
+    if (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) == 1)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &cpus))
+            {
+                description += std::to_string(cpu);
+                break;
+            }
+        }
+    }
+    else
+    {
+        description += "any";
+    }
+
+    int policy = SCHED_OTHER;
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+
+    if (pthread_getschedparam(thread, &policy, &param) != 0)
+        return description;
+
+    if (policy == SCHED_FIFO)
+        description += " policy=fifo priority=" + std::to_string(param.sched_priority);
+    else if (policy == SCHED_RR)
+        description += " policy=rr priority=" + std::to_string(param.sched_priority);
+    else
+        description += " policy=other";
+
+    return description;
+}
+
+bool Realtime::lockAllMemory()
+{
+    struct rlimit limit;
+
+    // with a finite limit, MCL_FUTURE would turn later allocations anywhere in the GUI into failures
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur != RLIM_INFINITY)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+void Realtime::unlockAllMemory()
+{
+    munlockall();
+}
+
+bool Realtime::lockBuffer(void* data, size_t bytes)
+{
+    if (data == nullptr || bytes == 0)
+        return true;
+
+    // fault every page in now, so the lock never has to and the packet path never does
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    volatile uint8_t* bytePtr = (volatile uint8_t*) data;
+
+    for (size_t offset = 0; offset < bytes; offset += (size_t) pageSize)
+        bytePtr[offset] = bytePtr[offset];
+
+    return mlock(data, bytes) == 0;
+}
+
+void Realtime::unlockBuffer(void* data, size_t bytes)
+{
+    if (data != nullptr && bytes > 0)
+        munlock(data, bytes);
+}
+
+int Realtime::setReceiveBuffer(int sockfd, int bytes)
+{
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) != 0
+        && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) != 0)
+    {
+        return -1;
+    }
+
+    int effective = 0;
+    socklen_t length = sizeof(effective);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &effective, &length) != 0)
+        return -1;
+
+    // the kernel doubles the request to cover its own bookkeeping
+    return effective / 2;
+}
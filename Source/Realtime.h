@@ -0,0 +1,81 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+#ifndef REALTIME_H_DEFINED
+#define REALTIME_H_DEFINED
+
+#include <cstddef>
+#include <string>
+
+#include <pthread.h>
+
+namespace GeminiThreadNode {
+
+/**
+    Opt-in scheduling and memory settings for the threads on the packet
+    path, each of which degrades to a no-op when the process lacks the
+    privilege for it.
+
+    SCHED_FIFO needs CAP_SYS_NICE or an RLIMIT_RTPRIO of at least the
+    requested priority; pinning only fails for cores outside the process's
+    cpuset. Locking memory tries mlockall() when RLIMIT_MEMLOCK is unlimited
+    (so locking future pages can never make an allocation in the GUI fail),
+    and otherwise leaves callers to mlock() their own prefaulted buffers
+    within the limit. SO_RCVBUFFORCE needs CAP_NET_ADMIN; without it the
+    request is capped at net.core.rmem_max.
+*/
+namespace Realtime {
+
+    /** Pins a thread to one core. Returns false, with errno set, if refused. */
+    bool pinThread(pthread_t thread, int cpu);
+
+    /** Moves a thread to SCHED_FIFO at 'priority' (1-99). Returns false, with errno set, if refused. */
+    bool setFifoPriority(pthread_t thread, int priority);
+
+    /** A thread's scheduling as the kernel reports it, e.g. "cpu=2 policy=fifo priority=80" */
+    std::string describeThread(pthread_t thread);
+
+    /** Locks every current and future page of the process, if RLIMIT_MEMLOCK is unlimited. Returns false, with errno set, otherwise. */
+    bool lockAllMemory();
+
+    /** Undoes lockAllMemory() */
+    void unlockAllMemory();
+
+    /** Writes every page of a buffer, then locks it. Returns false, with errno set, if the lock was refused. */
+    bool lockBuffer(void* data, size_t bytes);
+
+    /** Undoes lockBuffer() */
+    void unlockBuffer(void* data, size_t bytes);
+
+    /**
+        Asks for a socket receive buffer of 'bytes', past net.core.rmem_max
+        if allowed. Returns the usable size the kernel then reports (half
+        its bookkeeping figure), or -1 with errno set.
+    */
+    int setReceiveBuffer(int sockfd, int bytes);
+}
+
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "ReceiveStats.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    /** Buckets per power of two, as a shift */
+    const int SUB_BITS = 2;
+    const int SUB_BUCKETS = 1 << SUB_BITS;
+
+    /** Values from here on share the last bucket */
+    const uint64_t MAX_VALUE = ((uint64_t) 1 << 32) - 1;
+}
+
+void Histogram::reset()
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        buckets[i].store(0, std::memory_order_relaxed);
+}
+
+void Histogram::read(uint64_t* counts) const
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        counts[i] += buckets[i].load(std::memory_order_relaxed);
+}
+
+int Histogram::getBucket(uint64_t value)
+{
+    if (value > MAX_VALUE)
+        value = MAX_VALUE;
+
+    if (value < SUB_BUCKETS)
+        return (int) value;
+
+    const int msb = 63 - __builtin_clzll(value);
+    const int sub = (int) (value >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::getUpperBound(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return (uint64_t) bucket;
+
+    if (bucket >= getBucket(MAX_VALUE))
+        return MAX_VALUE;
+
+    // the first value of the next bucket, minus one
+    const int next = bucket + 1;
+    const int msb = next / SUB_BUCKETS + SUB_BITS - 1;
+    const uint64_t sub = (uint64_t) (next % SUB_BUCKETS);
+
+    return ((SUB_BUCKETS + sub) << (msb - SUB_BITS)) - 1;
+}
+
+uint64_t Histogram::getPercentile(const uint64_t* counts, double fraction)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        total += counts[i];
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (fraction * (double) total + 0.5);
+
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += counts[i];
+
+        if (seen >= rank)
+            return getUpperBound(i);
+    }
+
+    return getUpperBound(NUM_BUCKETS - 1);
+}
+
+void ReceiveStats::reset()
+{
+    packets.store(0, std::memory_order_relaxed);
+    bytes.store(0, std::memory_order_relaxed);
+    invalid.store(0, std::memory_order_relaxed);
+    lost.store(0, std::memory_order_relaxed);
+    reordered.store(0, std::memory_order_relaxed);
+    duplicates.store(0, std::memory_order_relaxed);
+    late.store(0, std::memory_order_relaxed);
+    writes.store(0, std::memory_order_relaxed);
+
+    decodeNs.reset();
+    latencyUs.reset();
+}
@@ -0,0 +1,145 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef RECEIVESTATS_H_DEFINED
+#define RECEIVESTATS_H_DEFINED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace GeminiThreadNode {
+
+/**
+    Log-linear histogram of non-negative integers (durations), safe to fill
+    from one thread while another reads it.
+
+    Each power of two is split into 4 buckets, so a reported percentile is
+    within 25% of the true value; values of 2^32 and above share the last
+    bucket. add() is a single relaxed atomic increment.
+*/
+class Histogram
+{
+public:
+    static const int NUM_BUCKETS = 128;
+
+    /** Constructor */
+    Histogram() { reset(); }
+
+    /** Clears all counts. Not safe against a concurrent add(). */
+    void reset();
+
+    /** Counts one value */
+    void add(uint64_t value) { buckets[getBucket(value)].fetch_add(1, std::memory_order_relaxed); }
+
+    /** Adds the current counts to 'counts', which has NUM_BUCKETS entries */
+    void read(uint64_t* counts) const;
+
+    /** Bucket that 'value' falls into */
+    static int getBucket(uint64_t value);
+
+    /** Largest value counted in 'bucket' */
+    static uint64_t getUpperBound(int bucket);
+
+    /** Upper bound of the bucket holding the given fraction (0-1) of 'counts', or 0 if empty */
+    static uint64_t getPercentile(const uint64_t* counts, double fraction);
+
+private:
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+};
+
+/**
+    Live counters of one device, written by the thread that releases its
+    packets and read by the message thread at any time.
+
+    Everything on the packet path is a relaxed atomic increment (or, for the
+    counters owned by the SequenceTracker and ReorderBuffer, a relaxed store
+    of their totals once per update), so reading never blocks acquisition.
+    Values read together may be a few packets apart.
+*/
+class ReceiveStats
+{
+public:
+    /** Clears all counters. Call while acquisition is stopped. */
+    void reset();
+
+    /** Counts a valid packet of 'bytes' bytes on the wire */
+    void addPacket(size_t bytes)
+    {
+        packets.fetch_add(1, std::memory_order_relaxed);
+        this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /** Counts a packet dropped because its header or layout was invalid */
+    void addInvalid() { invalid.fetch_add(1, std::memory_order_relaxed); }
+
+    /** Counts one DataBuffer write */
+    void addWrite() { writes.fetch_add(1, std::memory_order_relaxed); }
+
+    /** Records the time spent decoding one packet */
+    void addDecodeTime(int64_t nanoseconds) { decodeNs.add(nanoseconds > 0 ? (uint64_t) nanoseconds : 0); }
+
+    /** Records the time from kernel receive to publication in the DataBuffer */
+    void addLatency(int64_t microseconds) { latencyUs.add(microseconds > 0 ? (uint64_t) microseconds : 0); }
+
+    /** Mirrors the totals kept by the sequence tracker and reorder window */
+    void setSequenceTotals(uint64_t lostPackets, uint64_t reorderedPackets, uint64_t duplicatePackets, uint64_t latePackets)
+    {
+        lost.store(lostPackets, std::memory_order_relaxed);
+        reordered.store(reorderedPackets, std::memory_order_relaxed);
+        duplicates.store(duplicatePackets, std::memory_order_relaxed);
+        late.store(latePackets, std::memory_order_relaxed);
+    }
+
+    uint64_t getPackets() const { return packets.load(std::memory_order_relaxed); }
+    uint64_t getBytes() const { return bytes.load(std::memory_order_relaxed); }
+    uint64_t getInvalid() const { return invalid.load(std::memory_order_relaxed); }
+    uint64_t getLost() const { return lost.load(std::memory_order_relaxed); }
+    uint64_t getReordered() const { return reordered.load(std::memory_order_relaxed); }
+    uint64_t getDuplicates() const { return duplicates.load(std::memory_order_relaxed); }
+    uint64_t getLate() const { return late.load(std::memory_order_relaxed); }
+    uint64_t getWrites() const { return writes.load(std::memory_order_relaxed); }
+
+    /** Decode time per packet, in nanoseconds */
+    const Histogram& getDecodeTime() const { return decodeNs; }
+
+    /** Receive-to-publish latency per packet, in microseconds */
+    const Histogram& getLatency() const { return latencyUs; }
+
+private:
+    std::atomic<uint64_t> packets { 0 };
+    std::atomic<uint64_t> bytes { 0 };
+    std::atomic<uint64_t> invalid { 0 };
+    std::atomic<uint64_t> lost { 0 };
+    std::atomic<uint64_t> reordered { 0 };
+    std::atomic<uint64_t> duplicates { 0 };
+    std::atomic<uint64_t> late { 0 };
+    std::atomic<uint64_t> writes { 0 };
+
+    Histogram decodeNs;
+    Histogram latencyUs;
+};
+
+}
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <errno.h>
+
+#include "ReceiveThread.h"
+#include "Realtime.h"
+
+using namespace GeminiThreadNode;
+
+ReceiveThread::ReceiveThread(int maxBatch_, int pollTimeoutMs_)
+    : maxBatch(maxBatch_),
+      pollTimeoutMs(pollTimeoutMs_)
+{
+}
+
+ReceiveThread::~ReceiveThread()
+{
+    stop();
+}
+
+void ReceiveThread::addSource(DatagramReceiver& receiver, PacketRing& ring, PacketCapture* capture)
+{
+    sources.push_back({ &receiver, &ring, capture });
+}
+
+void ReceiveThread::clearSources()
+{
+    stop();
+    sources.clear();
+}
+
+bool ReceiveThread::start()
+{
+    stop();
+
+    failed.store(false);
+    error.store(0);
+
+    if (!poller.open())
+    {
+        error.store(errno);
+        failed.store(true);
+        return false;
+    }
+
+    poller.setBusyPoll(busyPollUs);
+
+    size_t scratchSize = 0;
+
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+        if (!poller.add(sources[i].receiver->getPollFd(), (uint32_t) i))
+        {
+            error.store(errno);
+            failed.store(true);
+            poller.close();
+            return false;
+        }
+
+        if (sources[i].ring->getSlotSize() > scratchSize)
+            scratchSize = sources[i].ring->getSlotSize();
+    }
+
+    if (scratch == nullptr || scratch->size() < maxBatch || (size_t) (*scratch)[0].capacity < scratchSize)
+        scratch = std::make_unique<PacketSlotArray>(maxBatch, scratchSize);
+
+    running.store(true);
+    thread = std::thread(&ReceiveThread::run, this);
+
+    // both fall back to default scheduling; the caller reports what was refused
+    scheduled = true;
+
+    if (cpu >= 0 && !Realtime::pinThread(thread.native_handle(), cpu))
+        scheduled = false;
+
+    if (priority > 0 && !Realtime::setFifoPriority(thread.native_handle(), priority))
+        scheduled = false;
+
+    schedule = Realtime::describeThread(thread.native_handle());
+
+    return true;
+}
+
+void ReceiveThread::stop()
+{
+    running.store(false);
+    poller.wake();
+
+    if (thread.joinable())
+        thread.join();
+
+    poller.close();
+}
+
+void ReceiveThread::run()
+{
+    std::vector<uint32_t> ready(sources.size() > 0 ? sources.size() : 1);
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        const int n = poller.wait(ready.data(), (int) ready.size(), pollTimeoutMs);
+
+        if (n < 0)
+        {
+            fail(errno);
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (!service(sources[ready[i]]))
+                return;
+        }
+    }
+}
+
+bool ReceiveThread::service(Source& source)
+{
+    PacketSlot* slots;
+    int available = source.ring->getWritableSlots(slots);
+
+    const bool overflowing = (available == 0);
+
+    if (overflowing)
+    {
+        slots = scratch->data();
+        available = scratch->size();
+    }
+
+    const int n = source.receiver->receive(slots, available < maxBatch ? available : maxBatch);
+
+    if (n < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return true;
+
+        fail(errno);
+        source.ring->wakeConsumer();
+        return false;
+    }
+
+    if (n == 0)
+        return true;
+
+    if (source.capture != nullptr)
+        source.capture->append(slots, n);
+
+    if (overflowing)
+        source.ring->addOverflow(n);
+    else
+        source.ring->commitWrite(n);
+
+    return true;
+}
+
+void ReceiveThread::fail(int errorNumber)
+{
+    error.store(errorNumber, std::memory_order_relaxed);
+    failed.store(true, std::memory_order_release);
+}
@@ -0,0 +1,133 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef RECEIVETHREAD_H_DEFINED
+#define RECEIVETHREAD_H_DEFINED
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DatagramReceiver.h"
+#include "PacketCapture.h"
+#include "PacketRing.h"
+#include "SocketPoller.h"
+
+namespace GeminiThreadNode {
+
+/**
+    Pulls datagrams off every device socket as fast as they arrive and hands
+    them to the acquisition thread through one PacketRing per device. It does
+    nothing else, so a stall in decoding or in DataBuffer::addToBuffer() no
+    longer leaves packets sitting in the kernel queue.
+
+    All sources are serviced by one thread blocked in a SocketPoller; each
+    receiver must be non-blocking (created with a timeout of 0) and is read
+    once per readiness notification, up to a batch. stop() wakes the poller
+    through its eventfd, so the thread exits at once rather than after the
+    poll timeout.
+
+    When a ring is full the datagrams are still drained (into a scratch
+    batch) and counted as ring overflows, so the loss shows up in our own
+    statistics instead of as silent kernel drops.
+
+    A source may also have a PacketCapture, which gets every datagram read
+    from it, including the ones that overflowed the ring.
+*/
+class ReceiveThread
+{
+public:
+    /** Constructor */
+    ReceiveThread(int maxBatch, int pollTimeoutMs);
+
+    /** Destructor. Stops the thread if it is still running. */
+    ~ReceiveThread();
+
+    /** Adds a receiver, the ring it feeds and optionally a capture of its datagrams. Only call while stopped. */
+    void addSource(DatagramReceiver& receiver, PacketRing& ring, PacketCapture* capture = nullptr);
+
+    /** Removes all sources. Only call while stopped. */
+    void clearSources();
+
+    /** Sets the adaptive busy-poll budget used from the next start(); 0 disables it */
+    void setBusyPoll(int microseconds) { busyPollUs = microseconds; }
+
+    /** Sets the core to pin to (-1 for none) and the SCHED_FIFO priority (0 for none) used from the next start() */
+    void setScheduling(int cpu_, int priority_) { cpu = cpu_; priority = priority_; }
+
+    /** Starts receiving. Returns false if the poll set could not be created. */
+    bool start();
+
+    /** Asks the thread to stop and waits for it to exit */
+    void stop();
+
+    /** Returns true if the thread stopped because of a socket error */
+    bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+
+    /** The errno of the socket error, if any */
+    int getError() const { return error.load(std::memory_order_relaxed); }
+
+    /** Scheduling the thread got at start(), as Realtime::describeThread() reports it */
+    const std::string& getSchedule() const { return schedule; }
+
+    /** False if the core or priority set by setScheduling() was refused at start() */
+    bool isScheduled() const { return scheduled; }
+
+private:
+    struct Source
+    {
+        DatagramReceiver* receiver;
+        PacketRing* ring;
+        PacketCapture* capture;
+    };
+
+    void run();
+
+    /** Reads one batch from a ready source. Returns false on a socket error. */
+    bool service(Source& source);
+
+    void fail(int errorNumber);
+
+    const int maxBatch;
+    const int pollTimeoutMs;
+    int busyPollUs = 0;
+    int cpu = -1;
+    int priority = 0;
+    std::string schedule;
+    bool scheduled = true;
+
+    std::vector<Source> sources;
+    std::unique_ptr<PacketSlotArray> scratch;
+    SocketPoller poller;
+
+    std::thread thread;
+    std::atomic<bool> running { false };
+    std::atomic<bool> failed { false };
+    std::atomic<int> error { 0 };
+};
+
+}
+
+#endif
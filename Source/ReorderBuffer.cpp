@@ -0,0 +1,85 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include "ReorderBuffer.h"
+
+using namespace GeminiThreadNode;
+
+void ReorderBuffer::prepare(int depth_, size_t slotSize)
+{
+    depth = depth_ < 1 ? 1 : depth_;
+
+    capacity = 1;
+    while (capacity < depth)
+        capacity <<= 1;
+
+    mask = (uint32_t) capacity - 1;
+
+    if (depth > 1)
+    {
+        slots = std::make_unique<PacketSlotArray>(capacity, slotSize);
+        entries.assign(capacity, Entry());
+
+        for (int i = 0; i < capacity; i++)
+            entries[i].slot = &(*slots)[i];
+    }
+    else
+    {
+        slots.reset();
+        entries.clear();
+    }
+
+    reset();
+}
+
+void ReorderBuffer::reset()
+{
+    for (Entry& entry : entries)
+        entry.occupied = false;
+
+    started = false;
+    next = 0;
+    held = 0;
+
+    reordered = 0;
+    skipped = 0;
+    tooLate = 0;
+    duplicates = 0;
+    highWater = 0;
+}
+
+int64_t ReorderBuffer::getNextDeadline() const
+{
+    if (held == 0)
+        return -1;
+
+    int64_t oldest = INT64_MAX;
+
+    for (const Entry& entry : entries)
+    {
+        if (entry.occupied && entry.arrivalUs < oldest)
+            oldest = entry.arrivalUs;
+    }
+
+    return oldest + maxHoldUs;
+}
@@ -0,0 +1,268 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef REORDERBUFFER_H_DEFINED
+#define REORDERBUFFER_H_DEFINED
+
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "DatagramReceiver.h"
+#include "GeminiPacket.h"
+
+namespace GeminiThreadNode {
+
+/**
+    Bounded reorder window keyed on the header packet counter.
+
+    A packet carrying the next expected number is released straight away
+    without being copied, so in-order traffic sees no added latency. A packet
+    from further ahead is copied into one of 'depth' preallocated slots and
+    held until the missing packets turn up, until the window has to move on
+    to make room, or until it has been held for the maximum hold time. In the
+    latter two cases the missing packets are skipped (they become gaps for the
+    SequenceTracker to conceal), and if they arrive afterwards they are dropped
+    as too late.
+
+    Released packets are passed to a callback of the form
+        void (const GeminiPacket::Header& header, const uint8_t* payload, int64_t receiveNs)
+    where receiveNs is the receive time the packet was offered with.
+    A depth of 1 disables reordering.
+*/
+class ReorderBuffer
+{
+public:
+    /** Allocates the held-packet storage. Not real-time safe. */
+    void prepare(int depth, size_t slotSize);
+
+    /** Sets how long a packet may wait for its predecessors, in microseconds */
+    void setMaxHold(int64_t microseconds) { maxHoldUs = microseconds; }
+
+    /** Drops all held packets and statistics */
+    void reset();
+
+    /** Window depth, in packets */
+    int getDepth() const { return depth; }
+
+    /** Offers a validated packet, received at 'receiveNs', that reached the window at 'nowUs' */
+    template <typename Callback>
+    void push(const GeminiPacket::Header& header, const uint8_t* payload, size_t payloadSize, int64_t receiveNs, int64_t nowUs, Callback&& release)
+    {
+        if (depth <= 1)
+        {
+            release(header, payload, receiveNs);
+            return;
+        }
+
+        if (!started)
+        {
+            started = true;
+            next = header.packet_number;
+        }
+
+        int32_t distance = (int32_t) (header.packet_number - next);
+
+        if (distance < -MAX_LATENESS)
+        {
+            // the counter went backwards (device restart): flush and follow it
+            advanceTo(next + (uint32_t) capacity + 1, release);
+            next = header.packet_number;
+            distance = 0;
+        }
+        else if (distance < 0)
+        {
+            tooLate++;
+            return;
+        }
+
+        if (distance >= depth)
+        {
+            advanceTo(header.packet_number - (uint32_t) depth + 1, release);
+            drain(release);
+            distance = (int32_t) (header.packet_number - next);
+        }
+
+        if (distance == 0)
+        {
+            release(header, payload, receiveNs);
+            next++;
+            drain(release);
+            return;
+        }
+
+        Entry& entry = entries[header.packet_number & mask];
+
+        if (entry.occupied)
+        {
+            duplicates++;
+            return;
+        }
+
+        entry.header = header;
+        entry.length = payloadSize;
+        entry.receiveNs = receiveNs;
+        entry.arrivalUs = nowUs;
+        entry.occupied = true;
+        memcpy(entry.slot->data, payload, payloadSize);
+
+        held++;
+        reordered++;
+
+        if (held > highWater)
+            highWater = held;
+    }
+
+    /** Releases packets whose maximum hold time has passed, skipping the packets they were waiting for */
+    template <typename Callback>
+    void expire(int64_t nowUs, Callback&& release)
+    {
+        while (held > 0)
+        {
+            const Entry* oldest = nullptr;
+
+            for (int i = 0; i < capacity; i++)
+            {
+                if (entries[i].occupied && (oldest == nullptr || entries[i].arrivalUs < oldest->arrivalUs))
+                    oldest = &entries[i];
+            }
+
+            if (nowUs - oldest->arrivalUs < maxHoldUs)
+                return;
+
+            advanceTo(oldest->header.packet_number, release);
+            drain(release);
+        }
+    }
+
+    /** Time at which the next held packet expires, or -1 if nothing is held */
+    int64_t getNextDeadline() const;
+
+    /** Packets that had to be held because they arrived ahead of a predecessor */
+    uint64_t getReordered() const { return reordered; }
+
+    /** Missing packets the window gave up waiting for */
+    uint64_t getSkipped() const { return skipped; }
+
+    /** Packets that arrived after the window had already moved past them */
+    uint64_t getTooLate() const { return tooLate; }
+
+    /** Repeated packets within the window */
+    uint64_t getDuplicates() const { return duplicates; }
+
+    /** Most packets held at once */
+    int getHighWater() const { return highWater; }
+
+private:
+    /** Packets further behind the window than this are taken as a counter reset rather than as late */
+    static const int32_t MAX_LATENESS = 1024;
+
+    struct Entry
+    {
+        GeminiPacket::Header header;
+        PacketSlot* slot = nullptr;
+        size_t length = 0;
+        int64_t receiveNs = 0;
+        int64_t arrivalUs = 0;
+        bool occupied = false;
+    };
+
+    /** Releases held packets in order, starting at 'next', until the first missing one */
+    template <typename Callback>
+    void drain(Callback&& release)
+    {
+        while (held > 0)
+        {
+            Entry& entry = entries[next & mask];
+
+            if (!entry.occupied || entry.header.packet_number != next)
+                return;
+
+            releaseEntry(entry, release);
+            next++;
+        }
+    }
+
+    /** Moves the window start to 'target', releasing held packets before it and skipping missing ones */
+    template <typename Callback>
+    void advanceTo(uint32_t target, Callback&& release)
+    {
+        int32_t distance = (int32_t) (target - next);
+
+        if (distance > capacity)
+        {
+            // counter jump: flush everything in order and re-anchor
+            for (int i = 0; i < capacity && held > 0; i++)
+            {
+                Entry& entry = entries[(next + i) & mask];
+
+                if (entry.occupied)
+                    releaseEntry(entry, release);
+            }
+
+            next = target;
+            return;
+        }
+
+        for (; distance > 0; distance--, next++)
+        {
+            Entry& entry = entries[next & mask];
+
+            if (entry.occupied && entry.header.packet_number == next)
+                releaseEntry(entry, release);
+            else
+                skipped++;
+        }
+    }
+
+    template <typename Callback>
+    void releaseEntry(Entry& entry, Callback&& release)
+    {
+        release(entry.header, (const uint8_t*) entry.slot->data, entry.receiveNs);
+        entry.occupied = false;
+        held--;
+    }
+
+    int depth = 1;
+    int capacity = 1;
+    uint32_t mask = 0;
+    int64_t maxHoldUs = 0;
+
+    std::unique_ptr<PacketSlotArray> slots;
+    std::vector<Entry> entries;
+
+    bool started = false;
+    uint32_t next = 0;
+    int held = 0;
+
+    uint64_t reordered = 0;
+    uint64_t skipped = 0;
+    uint64_t tooLate = 0;
+    uint64_t duplicates = 0;
+    int highWater = 0;
+};
+
+}
+
+#endif
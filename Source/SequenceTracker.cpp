@@ -0,0 +1,177 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <string.h>
+
+#include "SequenceTracker.h"
+
+using namespace GeminiThreadNode;
+
+SequenceTracker::SequenceTracker()
+{
+    maxGap = 30000;
+    reset();
+}
+
+void SequenceTracker::reset()
+{
+    anchored = false;
+    expected = 0;
+    deviceToPublished = 0;
+
+    gapLength = 0;
+    sampleNumber = 0;
+
+    concealedStart = 0;
+    concealedEnd = 0;
+
+    packetsReceived = 0;
+    packetsLost = 0;
+    samplesConcealed = 0;
+    duplicates = 0;
+    latePackets = 0;
+    resyncs = 0;
+}
+
+SequenceTracker::Status SequenceTracker::update(uint64_t firstSample, int count)
+{
+    gapLength = 0;
+
+    if (!anchored)
+    {
+        anchored = true;
+        deviceToPublished = -(int64_t) firstSample;
+        expected = firstSample + count;
+        sampleNumber = 0;
+        packetsReceived++;
+        return Status::FIRST;
+    }
+
+    // signed distance copes with counter wrap-around
+    const int64_t delta = (int64_t) (firstSample - expected);
+
+    if (delta == 0)
+    {
+        sampleNumber = (int64_t) firstSample + deviceToPublished;
+        expected = firstSample + count;
+        packetsReceived++;
+        return Status::IN_ORDER;
+    }
+
+    if (delta > 0 && delta <= maxGap)
+    {
+        gapLength = delta;
+        concealedStart = expected;
+        concealedEnd = firstSample;
+
+        samplesConcealed += (uint64_t) delta;
+        packetsLost += (uint64_t) ((delta + count - 1) / count);
+
+        sampleNumber = (int64_t) firstSample + deviceToPublished;
+        expected = firstSample + count;
+        packetsReceived++;
+        return Status::GAP;
+    }
+
+    if (delta < 0 && -delta <= maxGap)
+    {
+        if ((int64_t) (firstSample - concealedStart) >= 0 && (int64_t) (firstSample - concealedEnd) < 0)
+        {
+            latePackets++;
+            return Status::LATE;
+        }
+
+        duplicates++;
+        return Status::DUPLICATE;
+    }
+
+    // too far either way to be loss or reordering: the device counter jumped
+    const int64_t nextPublished = (int64_t) expected + deviceToPublished;
+    deviceToPublished = nextPublished - (int64_t) firstSample;
+
+    sampleNumber = nextPublished;
+    expected = firstSample + count;
+    concealedStart = concealedEnd = 0;
+
+    resyncs++;
+    packetsReceived++;
+    return Status::RESYNC;
+}
+
+const char* LossConcealer::getName(Policy policy)
+{
+    switch (policy)
+    {
+    case Policy::ZEROS:
+        return "zeros";
+    case Policy::HOLD:
+        return "hold";
+    case Policy::LINEAR:
+        return "linear";
+    }
+    return "unknown";
+}
+
+void LossConcealer::prepare(int numChannels_)
+{
+    numChannels = numChannels_;
+    lastFrame.assign(numChannels, 0.0f);
+}
+
+void LossConcealer::remember(const float* frame)
+{
+    if (policy != Policy::ZEROS)
+        memcpy(lastFrame.data(), frame, sizeof(float) * numChannels);
+}
+
+void LossConcealer::fill(float* dest, int64_t offset, int count, int64_t gapLength, const float* nextFrame) const
+{
+    const float* prev = lastFrame.data();
+
+    switch (policy)
+    {
+    case Policy::ZEROS:
+        memset(dest, 0, sizeof(float) * numChannels * count);
+        break;
+
+    case Policy::HOLD:
+        for (int i = 0; i < count; i++)
+            memcpy(dest + i * numChannels, prev, sizeof(float) * numChannels);
+        break;
+
+    case Policy::LINEAR:
+    {
+        const float step = 1.0f / (float) (gapLength + 1);
+
+        for (int i = 0; i < count; i++)
+        {
+            const float t = (float) (offset + i + 1) * step;
+            float* out = dest + i * numChannels;
+
+            for (int ch = 0; ch < numChannels; ch++)
+                out[ch] = prev[ch] + (nextFrame[ch] - prev[ch]) * t;
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,159 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef SEQUENCETRACKER_H_DEFINED
+#define SEQUENCETRACKER_H_DEFINED
+
+#include <cstdint>
+#include <vector>
+
+namespace GeminiThreadNode {
+
+/**
+    Follows the device sample counter carried in every packet header and maps
+    it onto the continuous sample numbers published to the DataBuffer.
+
+    Each packet is classified as in order, following a gap (some packets were
+    lost), or a duplicate / late arrival that must be dropped. Gaps longer than
+    the configured maximum (e.g. after a device restart) are not concealed;
+    instead the mapping is re-anchored so published sample numbers stay
+    contiguous, and the event is counted as a resync.
+*/
+class SequenceTracker
+{
+public:
+    /** Classification of a packet */
+    enum class Status
+    {
+        FIRST,
+        IN_ORDER,
+        GAP,
+        DUPLICATE,
+        LATE,
+        RESYNC
+    };
+
+    /** Constructor */
+    SequenceTracker();
+
+    /** Forgets all history; the next packet re-anchors the sample numbers at 0 */
+    void reset();
+
+    /** Sets the longest gap, in samples, that will be concealed */
+    void setMaxGap(int64_t samples) { maxGap = samples; }
+
+    /** Classifies a packet covering device samples [firstSample, firstSample + count) */
+    Status update(uint64_t firstSample, int count);
+
+    /** Number of missing samples before the packet last classified as GAP */
+    int64_t getGapLength() const { return gapLength; }
+
+    /** Published sample number of the first sample of the packet last passed to update() */
+    int64_t getSampleNumber() const { return sampleNumber; }
+
+    /** Packets accepted (in order, after a gap, or after a resync) */
+    uint64_t getPacketsReceived() const { return packetsReceived; }
+
+    /** Estimated packets lost, from the size of concealed gaps */
+    uint64_t getPacketsLost() const { return packetsLost; }
+
+    /** Samples synthesized to fill gaps */
+    uint64_t getSamplesConcealed() const { return samplesConcealed; }
+
+    /** Packets dropped because they repeated samples already published */
+    uint64_t getDuplicates() const { return duplicates; }
+
+    /** Packets dropped because they arrived after their gap had been concealed */
+    uint64_t getLatePackets() const { return latePackets; }
+
+    /** Times the sample mapping had to be re-anchored */
+    uint64_t getResyncs() const { return resyncs; }
+
+private:
+    bool anchored;
+    uint64_t expected;   // next device sample we expect
+    int64_t deviceToPublished;
+    int64_t maxGap;
+
+    int64_t gapLength;
+    int64_t sampleNumber;
+
+    // most recently concealed device sample range, to tell late packets from duplicates
+    uint64_t concealedStart;
+    uint64_t concealedEnd;
+
+    uint64_t packetsReceived;
+    uint64_t packetsLost;
+    uint64_t samplesConcealed;
+    uint64_t duplicates;
+    uint64_t latePackets;
+    uint64_t resyncs;
+};
+
+/**
+    Synthesizes the samples of a concealed gap.
+
+    ZEROS writes silence, HOLD repeats the last received frame, and LINEAR
+    ramps each channel from the last frame before the gap to the first frame
+    after it. The gap can be filled in several calls (so it can be published
+    through a fixed-size buffer); all loops run across channels, which are
+    contiguous in the interleaved layout.
+*/
+class LossConcealer
+{
+public:
+    /** Fill policies */
+    enum class Policy
+    {
+        ZEROS = 0,
+        HOLD = 1,
+        LINEAR = 2
+    };
+
+    /** Human-readable policy name */
+    static const char* getName(Policy policy);
+
+    /** Sizes the internal frame storage. Not real-time safe. */
+    void prepare(int numChannels);
+
+    /** Selects the fill policy */
+    void setPolicy(Policy policy_) { policy = policy_; }
+
+    /** Returns the active fill policy */
+    Policy getPolicy() const { return policy; }
+
+    /** Stores the last frame of a published packet, if the policy needs it */
+    void remember(const float* frame);
+
+    /** Writes frames [offset, offset + count) of a gap of gapLength frames, given the first frame after the gap */
+    void fill(float* dest, int64_t offset, int count, int64_t gapLength, const float* nextFrame) const;
+
+private:
+    Policy policy = Policy::ZEROS;
+    int numChannels = 0;
+    std::vector<float> lastFrame;
+};
+
+}
+
+#endif
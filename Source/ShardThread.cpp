@@ -0,0 +1,298 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+#include "ShardThread.h"
+#include "Realtime.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    int64_t monotonicNs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    /**
+        Reuseport programs see the packet from the start of the UDP payload and
+        return the index of the socket to deliver to, in bind order. Absolute
+        loads are big-endian, so the low 16 bits of the counter are assembled
+        from single bytes before taking the remainder.
+    */
+    bool attachSteering(int sockfd, unsigned count)
+    {
+
+        struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, GeminiPacket::PACKET_NUMBER_OFFSET + 1),
+            BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+            BPF_STMT(BPF_MISC | BPF_TAX, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, GeminiPacket::PACKET_NUMBER_OFFSET),
+            BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+            BPF_STMT(BPF_RET | BPF_A, 0),
+        };
+
+        struct sock_fprog program;
+        program.len = sizeof(code) / sizeof(code[0]);
+        program.filter = code;
+
+        return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+    }
+}
+
+ShardGroup::~ShardGroup()
+{
+    close();
+}
+
+bool ShardGroup::open(int port, int count)
+{
+    close();
+
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port = htons(port);
+
+    for (int i = 0; i < count; i++)
+    {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sockfd < 0)
+        {
+            close();
+            return false;
+        }
+
+        sockets.push_back(sockfd);
+
+        int one = 1;
+
+        if (count > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        {
+            const int savedErrno = errno;
+            close();
+            errno = savedErrno;
+            return false;
+        }
+
+        if (bind(sockfd, (const struct sockaddr*) &servaddr, sizeof(servaddr)) < 0)
+        {
+            const int savedErrno = errno;
+            close();
+            errno = savedErrno;
+            return false;
+        }
+    }
+
+    // the program applies to the whole group, so attaching it to one socket is enough
+    steered = count > 1 && attachSteering(sockets[0], (unsigned) count);
+
+    return true;
+}
+
+bool ShardGroup::setBusyPoll(int microseconds)
+{
+    bool accepted = true;
+
+    for (int sockfd : sockets)
+    {
+        if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) < 0)
+            accepted = false;
+    }
+
+    return accepted;
+}
+
+void ShardGroup::close()
+{
+    for (int sockfd : sockets)
+        ::close(sockfd);
+
+    sockets.clear();
+    steered = false;
+}
+
+ShardThread::ShardThread(DatagramReceiver& receiver_, PacketRing& ring_, int maxBatch_, int cpu_, int pollTimeoutMs_)
+    : receiver(receiver_),
+      ring(ring_),
+      maxBatch(maxBatch_),
+      cpu(cpu_),
+      pollTimeoutMs(pollTimeoutMs_),
+      scratch(maxBatch_, ring_.getSlotSize())
+{
+}
+
+ShardThread::~ShardThread()
+{
+    stop();
+}
+
+void ShardThread::setLayout(int numChannels_, int numSamples_, float scale, float offset)
+{
+    numChannels = numChannels_;
+    numSamples = numSamples_;
+    decoder.setScaling(scale, offset);
+    decoder.setLayout(GeminiPacket::INT16, numChannels, numSamples);
+}
+
+bool ShardThread::start()
+{
+    stop();
+
+    failed.store(false);
+    error.store(0);
+    invalid.store(0);
+    decodeTime.reset();
+
+    if (!poller.open() || !poller.add(receiver.getPollFd(), 0))
+    {
+        error.store(errno);
+        failed.store(true);
+        poller.close();
+        return false;
+    }
+
+    poller.setBusyPoll(busyPollUs);
+    running.store(true);
+
+    thread = std::thread(&ShardThread::run, this);
+
+    pinned.store(cpu >= 0 && Realtime::pinThread(thread.native_handle(), cpu));
+
+    realtime = priority <= 0 || Realtime::setFifoPriority(thread.native_handle(), priority);
+
+    schedule = Realtime::describeThread(thread.native_handle());
+
+    return true;
+}
+
+void ShardThread::stop()
+{
+    running.store(false);
+    poller.wake();
+
+    if (thread.joinable())
+        thread.join();
+
+    poller.close();
+}
+
+void ShardThread::run()
+{
+    GeminiPacket::Header header;
+
+    uint32_t ready;
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        int n = poller.wait(&ready, 1, pollTimeoutMs);
+
+        if (n > 0)
+            n = receiver.receive(scratch.data(), maxBatch);
+
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+
+            error.store(errno, std::memory_order_relaxed);
+            failed.store(true, std::memory_order_release);
+            ring.wakeConsumer();
+            return;
+        }
+
+        if (n > 0 && capture != nullptr)
+            capture->append(scratch.data(), n);
+
+        PacketSlot* slots = nullptr;
+        int writable = 0;
+        int written = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            const PacketSlot& packet = scratch[i];
+
+            if (GeminiPacket::parseHeader(packet.data, packet.length, header) != GeminiPacket::ParseResult::OK
+                || header.num_channels != numChannels || header.num_samples > numSamples)
+            {
+                invalid.store(invalid.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                continue;
+            }
+
+            if (written == writable)
+            {
+                if (written > 0)
+                    ring.commitWrite(written);
+
+                written = 0;
+                writable = ring.getWritableSlots(slots);
+
+                if (writable == 0)
+                {
+                    ring.addOverflow(1);
+                    continue;
+                }
+            }
+
+            PacketSlot& slot = slots[written++];
+
+            if (header.sample_format != decoder.getFormat() || header.num_samples != decoder.getNumSamples())
+                decoder.setLayout(header.sample_format, numChannels, header.num_samples);
+
+            const int64_t decodeStart = monotonicNs();
+
+            const size_t floatBytes = (size_t) decoder.getNumOutputs() * header.num_samples * sizeof(float);
+
+            memcpy(slot.data, packet.data, GeminiPacket::HEADER_SIZE);
+            decoder.decode(header, packet.data + GeminiPacket::HEADER_SIZE, (float*) (slot.data + GeminiPacket::HEADER_SIZE));
+
+            // digital input words go through as they are, after the floats
+            const size_t digitalBytes = GeminiPacket::payloadSize(header) - GeminiPacket::samplesSize(header);
+
+            if (digitalBytes > 0)
+            {
+                memcpy(slot.data + GeminiPacket::HEADER_SIZE + floatBytes,
+                    packet.data + GeminiPacket::HEADER_SIZE + GeminiPacket::samplesSize(header), digitalBytes);
+            }
+
+            decodeTime.add((uint64_t) (monotonicNs() - decodeStart));
+            slot.length = (uint32_t) (GeminiPacket::HEADER_SIZE + floatBytes + digitalBytes);
+            slot.timestampNs = packet.timestampNs;
+        }
+
+        if (written > 0)
+            ring.commitWrite(written);
+    }
+}
@@ -0,0 +1,187 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef SHARDTHREAD_H_DEFINED
+#define SHARDTHREAD_H_DEFINED
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DatagramReceiver.h"
+#include "GeminiPacket.h"
+#include "PacketCapture.h"
+#include "PacketDecoder.h"
+#include "PacketRing.h"
+#include "ReceiveStats.h"
+#include "SocketPoller.h"
+
+namespace GeminiThreadNode {
+
+/**
+    The sockets of one device port.
+
+    With a single shard this is an ordinary bound UDP socket. With more, every
+    socket is bound to the same port with SO_REUSEPORT and a classic BPF
+    program is attached to the group that picks the socket from the low bits
+    of the header packet counter, so consecutive packets are dealt round-robin
+    across the shards. Without the program the kernel would hash on the
+    4-tuple and put a device's whole stream on one shard.
+
+    Sockets are opened non-blocking; readers wait for them with a
+    SocketPoller.
+*/
+class ShardGroup
+{
+public:
+    /** Destructor. Closes all sockets. */
+    ~ShardGroup();
+
+    /** Opens and binds 'count' sockets on 'port'. Returns false, with errno set, on failure. */
+    bool open(int port, int count);
+
+    /** Closes all sockets */
+    void close();
+
+    /** Number of open sockets */
+    int size() const { return (int) sockets.size(); }
+
+    /** Socket of shard 'index' */
+    int getSocket(int index) const { return sockets[index]; }
+
+    /** False if the steering program could not be attached */
+    bool isSteered() const { return steered; }
+
+    /**
+        Sets SO_BUSY_POLL on every socket, so non-blocking reads poll the
+        device queue for up to 'microseconds' before returning empty. Returns
+        false if the kernel refused (raising it needs CAP_NET_ADMIN).
+    */
+    bool setBusyPoll(int microseconds);
+
+private:
+    std::vector<int> sockets;
+    bool steered = false;
+};
+
+/**
+    Receive and decode worker for one shard.
+
+    Each worker owns one socket of a ShardGroup, optionally pinned to a core,
+    and does everything up to and including the int16 -> float conversion,
+    so decoding scales with the number of shards. Packets that fail
+    validation are counted and dropped here.
+
+    Slots published to the ring hold the original 24-byte header followed by
+    the decoded float frames (only the mapped channels, with a channel map)
+    and, if flagged, the packet's digital input words unchanged. The
+    acquisition thread merges the shard rings back into packet order.
+
+    The worker sleeps in a SocketPoller, so stop() wakes it at once.
+*/
+class ShardThread
+{
+public:
+    /** Constructor. The receiver must be non-blocking (created with a timeout of 0). */
+    ShardThread(DatagramReceiver& receiver, PacketRing& ring, int maxBatch, int cpu, int pollTimeoutMs);
+
+    /** Destructor. Stops the thread if it is still running. */
+    ~ShardThread();
+
+    /** Sets the channel count and most samples per packet to accept, and the scaling to decode with. Only call while stopped. */
+    void setLayout(int numChannels, int numSamples, float scale, float offset);
+
+    /** Decodes only these wire channels, in this order; empty decodes all. Only call while stopped, after setLayout(). */
+    void setChannelMap(const std::vector<int>& wireChannels) { decoder.setChannelMap(wireChannels); }
+
+    /** Sets the adaptive busy-poll budget used from the next start(); 0 disables it */
+    void setBusyPoll(int microseconds) { busyPollUs = microseconds; }
+
+    /** Sets the SCHED_FIFO priority used from the next start(); 0 keeps default scheduling */
+    void setPriority(int priority_) { priority = priority_; }
+
+    /** Gives every received datagram to 'capture' before it is decoded; nullptr stops capturing. Only call while stopped. */
+    void setCapture(PacketCapture* capture_) { capture = capture_; }
+
+    /** Starts receiving. Returns false if the poll set could not be created. */
+    bool start();
+
+    /** Asks the thread to stop and waits for it to exit */
+    void stop();
+
+    /** Returns true if the thread stopped because of a socket error */
+    bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+
+    /** The errno of the socket error, if any */
+    int getError() const { return error.load(std::memory_order_relaxed); }
+
+    /** Returns false if the thread could not be pinned to its core */
+    bool isPinned() const { return pinned.load(std::memory_order_relaxed); }
+
+    /** Scheduling the thread got at start(), as Realtime::describeThread() reports it */
+    const std::string& getSchedule() const { return schedule; }
+
+    /** False if the priority set by setPriority() was refused at start() */
+    bool isRealtime() const { return realtime; }
+
+    /** Packets dropped because their header or layout was invalid */
+    uint64_t getInvalidPackets() const { return invalid.load(std::memory_order_relaxed); }
+
+    /** Decode time per packet, in nanoseconds. Safe to read while running. */
+    const Histogram& getDecodeTime() const { return decodeTime; }
+
+private:
+    void run();
+
+    DatagramReceiver& receiver;
+    PacketRing& ring;
+    const int maxBatch;
+    const int cpu;
+    const int pollTimeoutMs;
+    int busyPollUs = 0;
+    int priority = 0;
+    std::string schedule;
+    bool realtime = true;
+    PacketCapture* capture = nullptr;
+
+    int numChannels = 0;
+    int numSamples = 0;
+
+    PacketDecoder decoder;
+    PacketSlotArray scratch;
+    SocketPoller poller;
+
+    std::thread thread;
+    std::atomic<bool> running { false };
+    std::atomic<bool> failed { false };
+    std::atomic<bool> pinned { false };
+    std::atomic<int> error { 0 };
+    std::atomic<uint64_t> invalid { 0 };
+    Histogram decodeTime;
+};
+
+}
+
+#endif
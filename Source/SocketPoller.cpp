@@ -0,0 +1,175 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "SocketPoller.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    /** Tag of the wake eventfd; never handed out by add() */
+    const uint64_t WAKE_TAG = ~(uint64_t) 0;
+
+    int64_t monotonicUs()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    }
+}
+
+SocketPoller::~SocketPoller()
+{
+    close();
+}
+
+bool SocketPoller::open()
+{
+    close();
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epollFd < 0)
+        return false;
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (wakeFd < 0)
+    {
+        close();
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_TAG;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0)
+    {
+        close();
+        return false;
+    }
+
+    events.resize(2);
+
+    return true;
+}
+
+void SocketPoller::close()
+{
+    if (wakeFd >= 0)
+        ::close(wakeFd);
+
+    if (epollFd >= 0)
+        ::close(epollFd);
+
+    wakeFd = -1;
+    epollFd = -1;
+    events.clear();
+}
+
+bool SocketPoller::add(int fd, uint32_t tag)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        return false;
+
+    events.resize(events.size() + 1);
+    return true;
+}
+
+void SocketPoller::setBusyPoll(int microseconds)
+{
+    busyPollUs = microseconds > 0 ? microseconds : 0;
+    spinBudgetUs = busyPollUs;
+}
+
+int SocketPoller::wait(uint32_t* ready, int maxReady, int timeoutMs)
+{
+    if (spinBudgetUs > 0)
+    {
+        const int64_t deadline = monotonicUs() + spinBudgetUs;
+
+        do
+        {
+            const int n = epoll_wait(epollFd, events.data(), (int) events.size(), 0);
+
+            if (n != 0)
+            {
+                spinBudgetUs = busyPollUs;
+                return n < 0 ? -1 : collect(n, ready, maxReady);
+            }
+        }
+        while (monotonicUs() < deadline);
+
+        spinBudgetUs /= 2;
+    }
+
+    const int n = epoll_wait(epollFd, events.data(), (int) events.size(), timeoutMs);
+
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    const int count = collect(n, ready, maxReady);
+
+    // traffic resumed after a quiet spell: start spinning again
+    if (count > 0)
+        spinBudgetUs = busyPollUs;
+
+    return count;
+}
+
+int SocketPoller::collect(int count, uint32_t* ready, int maxReady)
+{
+    int numReady = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].data.u64 == WAKE_TAG)
+        {
+            uint64_t value;
+            while (read(wakeFd, &value, sizeof(value)) > 0) {}
+        }
+        else if (numReady < maxReady)
+        {
+            ready[numReady++] = (uint32_t) events[i].data.u64;
+        }
+    }
+
+    return numReady;
+}
+
+void SocketPoller::wake()
+{
+    const uint64_t one = 1;
+
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {}
+}
@@ -0,0 +1,88 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef SOCKETPOLLER_H_DEFINED
+#define SOCKETPOLLER_H_DEFINED
+
+#include <cstdint>
+#include <vector>
+
+#include <sys/epoll.h>
+
+namespace GeminiThreadNode {
+
+/**
+    epoll set of non-blocking receive descriptors plus an eventfd, so a
+    thread blocked in wait() can be woken at once by another thread calling
+    wake() (e.g. from stopAcquisition()) instead of waiting out its timeout.
+
+    With busy polling enabled, wait() first spins on the set without
+    sleeping, which saves the wakeup latency while packets are flowing. The
+    spin budget adapts: it is restored whenever a spin finds data or traffic
+    resumes after a sleep, and halves on every spin that finds nothing, so an
+    idle device stops costing a core within a few waits.
+*/
+class SocketPoller
+{
+public:
+    /** Destructor */
+    ~SocketPoller();
+
+    /** Creates the epoll set and the wake eventfd. Returns false, with errno set, on failure. */
+    bool open();
+
+    /** Closes all descriptors */
+    void close();
+
+    /** Adds a readable descriptor, reported by wait() as 'tag' */
+    bool add(int fd, uint32_t tag);
+
+    /** Enables adaptive busy polling of up to 'microseconds' per wait; 0 disables it */
+    void setBusyPoll(int microseconds);
+
+    /**
+        Waits until descriptors are readable, wake() is called or the timeout
+        expires. Writes the tags of the ready descriptors to 'ready' and
+        returns their number (0 on timeout or wake), or -1 with errno set.
+    */
+    int wait(uint32_t* ready, int maxReady, int timeoutMs);
+
+    /** Wakes the thread in wait(). Safe to call from any thread. */
+    void wake();
+
+private:
+    /** Collects the ready tags from 'count' events, draining the eventfd if it fired */
+    int collect(int count, uint32_t* ready, int maxReady);
+
+    int epollFd = -1;
+    int wakeFd = -1;
+
+    int busyPollUs = 0;
+    int spinBudgetUs = 0;
+
+    std::vector<struct epoll_event> events;
+};
+
+}
+
+#endif
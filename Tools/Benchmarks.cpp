@@ -0,0 +1,832 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+/**
+    Microbenchmarks of the per-packet work of the plugin, swept over channel
+    counts and samples per packet.
+
+    DataBuffer::addToBuffer() lives in the GUI, so BM_Publish measures a model
+    of it instead: building the sample number, timestamp and TTL arrays the
+    way GeminiDevice::publish() does, followed by the per-channel,
+    per-sample copy addToBuffer() performs for a chunk size of 1. The receive
+    benchmarks run a sender thread against the real receivers over loopback.
+
+    Results go to gemini_benchmarks.json (Google Benchmark JSON) unless
+    --benchmark_out is given; all other --benchmark_* flags work as usual.
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "CaptureCompressor.h"
+#include "ChannelMonitor.h"
+#include "ClockSync.h"
+#include "DatagramReceiver.h"
+#include "Decimator.h"
+#include "DigitalInputs.h"
+#include "GeminiPacket.h"
+#include "PacketDecoder.h"
+#include "PacketRing.h"
+#include "Preprocessor.h"
+#include "ReorderBuffer.h"
+#include "SequenceTracker.h"
+#include "ShardThread.h"
+#include "SocketPoller.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int RECEIVE_PORT = 51091;
+
+    /** Samples held by the modelled DataBuffer */
+    const int BUFFER_SAMPLES = 12000;
+
+    /** A valid datagram of the given layout with a ramp as samples */
+    std::vector<uint8_t> makePacket(int numChannels, int numSamples, uint32_t packetNumber = 0)
+    {
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = GeminiPacket::INT16;
+        header.num_channels = (uint16_t) numChannels;
+        header.num_samples = (uint16_t) numSamples;
+        header.packet_number = packetNumber;
+        header.sample_number = (uint64_t) packetNumber * numSamples;
+
+        std::vector<uint8_t> packet(GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(header));
+        GeminiPacket::writeHeader(header, packet.data());
+
+        for (size_t i = GeminiPacket::HEADER_SIZE; i < packet.size(); i++)
+            packet[i] = (uint8_t) i;
+
+        return packet;
+    }
+
+    void setPacketCounters(benchmark::State& state, int numChannels, int numSamples, size_t packetSize)
+    {
+        state.SetItemsProcessed(state.iterations() * (int64_t) numChannels * numSamples);
+        state.SetBytesProcessed(state.iterations() * (int64_t) packetSize);
+        state.counters["packets_per_s"] = benchmark::Counter((double) state.iterations(), benchmark::Counter::kIsRate);
+    }
+
+    /** Channel counts x samples per packet */
+    void layoutSweep(benchmark::internal::Benchmark* benchmark)
+    {
+        for (int channels : { 32, 64, 192, 384, 1024 })
+        {
+            for (int samples : { 1, 8, 30 })
+            {
+                if (GeminiPacket::HEADER_SIZE + (size_t) channels * samples * 2 <= GeminiPacket::MAX_PACKET_SIZE)
+                    benchmark->Args({ channels, samples });
+            }
+        }
+
+        benchmark->ArgNames({ "channels", "samples" });
+    }
+
+    // ------------------------------------------------------------
+    //                          decoding
+    // ------------------------------------------------------------
+
+    void BM_ParseHeader(benchmark::State& state)
+    {
+        const std::vector<uint8_t> packet = makePacket(192, 30);
+        GeminiPacket::Header header;
+
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(GeminiPacket::parseHeader(packet.data(), packet.size(), header));
+            benchmark::ClobberMemory();
+        }
+    }
+    BENCHMARK(BM_ParseHeader);
+
+    /** Header parse and int16 -> float conversion into convbuf, as in GeminiDevice::handlePacket() */
+    void BM_Decode(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        const std::vector<uint8_t> packet = makePacket(numChannels, numSamples);
+        std::vector<float> convbuf((size_t) numChannels * numSamples);
+
+        PacketDecoder decoder;
+        decoder.setScaling(0.195f, 32768.0f);
+        decoder.setLayout(GeminiPacket::INT16, numChannels, numSamples);
+
+        GeminiPacket::Header header;
+
+        for (auto _ : state)
+        {
+            GeminiPacket::parseHeader(packet.data(), packet.size(), header);
+            decoder.decode(header, packet.data() + GeminiPacket::HEADER_SIZE, convbuf.data());
+            benchmark::DoNotOptimize(convbuf.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, packet.size());
+        state.SetLabel(decoder.getKernelName());
+    }
+    BENCHMARK(BM_Decode)->Apply(layoutSweep);
+
+    /** Payload conversion of a 192 x 30 packet per sample format, with the layout kernel and with the generic one */
+    void BM_DecodeFormat(benchmark::State& state)
+    {
+        const uint8_t format = (uint8_t) state.range(0);
+        const bool specialized = state.range(1) != 0;
+        const int numChannels = 192;
+        const int numSamples = 30;
+
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = format;
+        header.num_channels = (uint16_t) numChannels;
+        header.num_samples = (uint16_t) numSamples;
+
+        std::vector<uint8_t> payload(GeminiPacket::payloadSize(header));
+
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = (uint8_t) (i * 7);
+
+        std::vector<float> convbuf((size_t) numChannels * numSamples);
+
+        PacketDecoder decoder;
+        decoder.setScaling(0.195f, 32768.0f);
+
+        // a layout with no kernel of its own falls back to the generic one
+        decoder.setLayout(format, specialized ? numChannels : numChannels + 1, numSamples);
+
+        for (auto _ : state)
+        {
+            decoder.decode(header, payload.data(), convbuf.data());
+            benchmark::DoNotOptimize(convbuf.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, GeminiPacket::HEADER_SIZE + payload.size());
+        state.SetLabel(decoder.getKernelName());
+    }
+    BENCHMARK(BM_DecodeFormat)->ArgsProduct({ { GeminiPacket::INT16, GeminiPacket::UINT16, GeminiPacket::INT24, GeminiPacket::FLOAT32 }, { 0, 1 } })
+        ->ArgNames({ "format", "specialized" });
+
+    /**
+        BM_DecodeFormat through a channel map picking 'outputs' of the 192
+        channels: spread out and in reverse order (gathered), or the first
+        'outputs' with their two halves swapped (converted as two runs)
+    */
+    void BM_DecodeMapped(benchmark::State& state)
+    {
+        const uint8_t format = (uint8_t) state.range(0);
+        const int numOutputs = (int) state.range(1);
+        const bool blocks = state.range(2) != 0;
+        const int numChannels = 192;
+        const int numSamples = 30;
+
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = format;
+        header.num_channels = (uint16_t) numChannels;
+        header.num_samples = (uint16_t) numSamples;
+
+        std::vector<uint8_t> payload(GeminiPacket::payloadSize(header));
+
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = (uint8_t) (i * 7);
+
+        std::vector<int> channelMap;
+
+        for (int i = 0; i < numOutputs; i++)
+        {
+            if (blocks)
+                channelMap.push_back((i + numOutputs / 2) % numOutputs);
+            else
+                channelMap.push_back((numOutputs - 1 - i) * numChannels / numOutputs);
+        }
+
+        std::vector<float> convbuf((size_t) numOutputs * numSamples);
+
+        PacketDecoder decoder;
+        decoder.setScaling(0.195f, 32768.0f);
+        decoder.setChannelMap(channelMap);
+        decoder.setLayout(format, numChannels, numSamples);
+
+        for (auto _ : state)
+        {
+            decoder.decode(header, payload.data(), convbuf.data());
+            benchmark::DoNotOptimize(convbuf.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numOutputs, numSamples, GeminiPacket::HEADER_SIZE + payload.size());
+        state.SetLabel(decoder.getKernelName());
+    }
+    BENCHMARK(BM_DecodeMapped)->ArgsProduct({ { GeminiPacket::INT16, GeminiPacket::UINT16, GeminiPacket::INT24, GeminiPacket::FLOAT32 }, { 16, 64, 192 }, { 0, 1 } })
+        ->ArgNames({ "format", "outputs", "blocks" });
+
+    /** BM_Decode with the channel monitor accumulating in the same pass */
+    void BM_DecodeMonitored(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        const std::vector<uint8_t> packet = makePacket(numChannels, numSamples);
+        std::vector<float> convbuf((size_t) numChannels * numSamples);
+
+        PacketDecoder decoder;
+        decoder.setScaling(0.195f, 32768.0f);
+
+        ChannelMonitor monitor;
+        monitor.prepare(numChannels, numSamples, 30000.0f, 0.195f, 32768.0f);
+
+        GeminiPacket::Header header;
+
+        for (auto _ : state)
+        {
+            GeminiPacket::parseHeader(packet.data(), packet.size(), header);
+            decoder.decode(header, packet.data() + GeminiPacket::HEADER_SIZE, convbuf.data(), monitor);
+            benchmark::DoNotOptimize(convbuf.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, packet.size());
+        state.SetLabel(monitor.getInstructionSet());
+    }
+    BENCHMARK(BM_DecodeMonitored)->Apply(layoutSweep);
+
+    /** Decoding followed by the 300 Hz high-pass and a common reference, as GeminiDevice runs them; compare with BM_Decode */
+    void BM_DecodePreprocessed(benchmark::State& state, Preprocessor::Reference reference)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        const std::vector<uint8_t> packet = makePacket(numChannels, numSamples);
+        std::vector<float> convbuf((size_t) numChannels * numSamples);
+
+        PacketDecoder decoder;
+        decoder.setScaling(0.195f, 32768.0f);
+        decoder.setLayout(GeminiPacket::INT16, numChannels, numSamples);
+
+        Preprocessor preprocessor;
+        preprocessor.prepare(numChannels, 30000.0f, reference, 300.0f);
+
+        GeminiPacket::Header header;
+
+        for (auto _ : state)
+        {
+            GeminiPacket::parseHeader(packet.data(), packet.size(), header);
+            decoder.decode(header, packet.data() + GeminiPacket::HEADER_SIZE, convbuf.data());
+            preprocessor.process(convbuf.data(), numSamples);
+            benchmark::DoNotOptimize(convbuf.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, packet.size());
+        state.SetLabel(preprocessor.getDescription());
+    }
+    BENCHMARK_CAPTURE(BM_DecodePreprocessed, highpass, Preprocessor::Reference::NONE)->Apply(layoutSweep);
+    BENCHMARK_CAPTURE(BM_DecodePreprocessed, mean, Preprocessor::Reference::MEAN)->Apply(layoutSweep);
+    BENCHMARK_CAPTURE(BM_DecodePreprocessed, median, Preprocessor::Reference::MEDIAN)->Apply(layoutSweep);
+
+    /** One packet's frames through the LFP decimator, 30 kHz down to 1.5 kHz */
+    void BM_Decimate(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+        const int factor = 20;
+
+        std::vector<float> frames((size_t) numChannels * numSamples);
+
+        for (size_t i = 0; i < frames.size(); i++)
+            frames[i] = (float) std::sin(0.001 * (double) i);
+
+        std::vector<float> outputs((size_t) numChannels * (numSamples / factor + 1));
+
+        Decimator decimator;
+        decimator.prepare(numChannels, factor);
+
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(decimator.process(frames.data(), numSamples, outputs.data()));
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * numChannels * numSamples);
+        state.SetLabel(std::string(decimator.getInstructionSet()) + " " + std::to_string(decimator.getNumTaps()) + " taps");
+    }
+    BENCHMARK(BM_Decimate)->Apply(layoutSweep);
+
+    /** A packet's digital input words widened into TTL words, with a line toggling every few samples */
+    void BM_DecodeDigital(benchmark::State& state)
+    {
+        const int numSamples = (int) state.range(0);
+
+        std::vector<uint8_t> words((size_t) numSamples * GeminiPacket::DIGITAL_WORD_SIZE);
+
+        for (int i = 0; i < numSamples; i++)
+            words[2 * i] = (uint8_t) (i / 3);
+
+        std::vector<DigitalInputs::TtlWord> ttl(numSamples);
+
+        DigitalInputs digital;
+
+        for (auto _ : state)
+        {
+            digital.decode(words.data(), numSamples, ttl.data());
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * numSamples);
+        state.SetLabel(digital.getInstructionSet());
+    }
+    BENCHMARK(BM_DecodeDigital)->ArgName("samples")->Arg(1)->Arg(8)->Arg(30)->Arg(250);
+
+    // ------------------------------------------------------------
+    //                     capture compression
+    // ------------------------------------------------------------
+
+    /** A packet of band-limited noise of about 'sigma' counts, closer to recorded data than makePacket() */
+    std::vector<uint8_t> makeNoisePacket(int numChannels, int numSamples, int sigma)
+    {
+        std::vector<uint8_t> packet = makePacket(numChannels, numSamples);
+        uint32_t state = 12345;
+        std::vector<int> level(numChannels, 0);
+
+        for (int f = 0; f < numSamples; f++)
+        {
+            for (int c = 0; c < numChannels; c++)
+            {
+                // sum of uniforms, leaking toward zero
+                int noise = 0;
+
+                for (int k = 0; k < 4; k++)
+                {
+                    state = state * 1664525 + 1013904223;
+                    noise += (int) (state >> 24) - 128;
+                }
+
+                level[c] = level[c] * 3 / 4 + noise * sigma / 148;
+
+                const int16_t sample = (int16_t) level[c];
+                memcpy(packet.data() + GeminiPacket::HEADER_SIZE + 2 * ((size_t) f * numChannels + c), &sample, sizeof(sample));
+            }
+        }
+
+        return packet;
+    }
+
+    /** FrameCodec encoding of one payload, as the compression workers do per record */
+    void BM_CaptureEncode(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        const std::vector<uint8_t> packet = makeNoisePacket(numChannels, numSamples, 50);
+        std::vector<uint8_t> encoded(FrameCodec::maxEncodedSize(numChannels, numSamples));
+
+        FrameCodec codec;
+        size_t size = 0;
+
+        for (auto _ : state)
+        {
+            codec.reset(numChannels);
+            size = codec.encode(packet.data() + GeminiPacket::HEADER_SIZE, numSamples, encoded.data());
+            benchmark::DoNotOptimize(encoded.data());
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, packet.size());
+        state.counters["ratio"] = (double) (packet.size() - GeminiPacket::HEADER_SIZE) / size;
+        state.SetLabel(codec.getInstructionSet());
+    }
+    BENCHMARK(BM_CaptureEncode)->Apply(layoutSweep);
+
+    /** FrameCodec decoding of one payload, as replay does per record */
+    void BM_CaptureDecode(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        std::vector<uint8_t> packet = makeNoisePacket(numChannels, numSamples, 50);
+        std::vector<uint8_t> encoded(FrameCodec::maxEncodedSize(numChannels, numSamples));
+
+        FrameCodec codec;
+        codec.reset(numChannels);
+        const size_t size = codec.encode(packet.data() + GeminiPacket::HEADER_SIZE, numSamples, encoded.data());
+
+        for (auto _ : state)
+        {
+            codec.reset(numChannels);
+            benchmark::DoNotOptimize(codec.decode(encoded.data(), size, numSamples, packet.data() + GeminiPacket::HEADER_SIZE));
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, packet.size());
+        state.SetLabel(codec.getInstructionSet());
+    }
+    BENCHMARK(BM_CaptureDecode)->Apply(layoutSweep);
+
+    // ------------------------------------------------------------
+    //                         publishing
+    // ------------------------------------------------------------
+
+    /** Sample number, timestamp and TTL word arrays for one packet, as in GeminiDevice::publish() */
+    void BM_SampleArrays(benchmark::State& state)
+    {
+        const int numSamples = (int) state.range(0);
+
+        std::vector<int64_t> sampleNumbers(numSamples);
+        std::vector<double> timestamps(numSamples);
+        std::vector<uint64_t> ttlEventWords(numSamples);
+
+        ClockSync clock;
+        clock.reset(30000.0);
+
+        int64_t sampleNumber = 0;
+        const uint64_t eventState = 0;
+
+        for (auto _ : state)
+        {
+            const double firstTimestamp = clock.toHostSeconds((uint64_t) sampleNumber);
+            const double period = clock.getSecondsPerSample();
+
+            for (int i = 0; i < numSamples; i++)
+            {
+                sampleNumbers[i] = sampleNumber + i;
+                timestamps[i] = firstTimestamp + period * i;
+                ttlEventWords[i] = eventState;
+            }
+
+            sampleNumber += numSamples;
+
+            benchmark::DoNotOptimize(sampleNumbers.data());
+            benchmark::DoNotOptimize(timestamps.data());
+            benchmark::DoNotOptimize(ttlEventWords.data());
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * numSamples);
+    }
+    BENCHMARK(BM_SampleArrays)->Arg(1)->Arg(8)->Arg(30)->ArgName("samples");
+
+    /** The sample arrays plus the channel-major copy DataBuffer::addToBuffer() makes of sample-major data */
+    void BM_Publish(benchmark::State& state)
+    {
+        const int numChannels = (int) state.range(0);
+        const int numSamples = (int) state.range(1);
+
+        std::vector<float> convbuf((size_t) numChannels * numSamples, 1.0f);
+        std::vector<std::vector<float>> channels(numChannels, std::vector<float>(BUFFER_SAMPLES));
+
+        std::vector<int64_t> sampleNumbers(BUFFER_SAMPLES);
+        std::vector<double> timestamps(BUFFER_SAMPLES);
+        std::vector<uint64_t> ttlEventWords(BUFFER_SAMPLES);
+
+        ClockSync clock;
+        clock.reset(30000.0);
+
+        int64_t sampleNumber = 0;
+        int writeIndex = 0;
+
+        for (auto _ : state)
+        {
+            if (writeIndex + numSamples > BUFFER_SAMPLES)
+                writeIndex = 0;
+
+            const double firstTimestamp = clock.toHostSeconds((uint64_t) sampleNumber);
+            const double period = clock.getSecondsPerSample();
+
+            for (int i = 0; i < numSamples; i++)
+            {
+                sampleNumbers[writeIndex + i] = sampleNumber + i;
+                timestamps[writeIndex + i] = firstTimestamp + period * i;
+                ttlEventWords[writeIndex + i] = 0;
+            }
+
+            // one copy per (channel, sample), as addToBuffer() does for a chunk size of 1
+            for (int i = 0; i < numSamples; i++)
+            {
+                for (int ch = 0; ch < numChannels; ch++)
+                    memcpy(&channels[ch][writeIndex + i], &convbuf[(size_t) i * numChannels + ch], sizeof(float));
+            }
+
+            sampleNumber += numSamples;
+            writeIndex += numSamples;
+
+            benchmark::ClobberMemory();
+        }
+
+        setPacketCounters(state, numChannels, numSamples, convbuf.size() * sizeof(float));
+    }
+    BENCHMARK(BM_Publish)->Apply(layoutSweep);
+
+    /**
+        BM_Publish with 'packets' packets decoded back to back and written
+        together, as the COALESCE setting does. The mutex stands in for the
+        synchronization addToBuffer() takes once per write.
+    */
+    void BM_PublishCoalesced(benchmark::State& state)
+    {
+        const int numChannels = 192;
+        const int numSamples = (int) state.range(0);
+        const int numPackets = (int) state.range(1);
+        const int numFrames = numSamples * numPackets;
+
+        std::vector<float> staging((size_t) numChannels * numFrames, 1.0f);
+        std::vector<std::vector<float>> channels(numChannels, std::vector<float>(BUFFER_SAMPLES));
+
+        std::vector<int64_t> sampleNumbers(BUFFER_SAMPLES);
+        std::vector<double> timestamps(BUFFER_SAMPLES);
+        std::vector<uint64_t> ttlEventWords(BUFFER_SAMPLES);
+        std::mutex bufferLock;
+
+        ClockSync clock;
+        clock.reset(30000.0);
+
+        int64_t sampleNumber = 0;
+        int writeIndex = 0;
+
+        for (auto _ : state)
+        {
+            if (writeIndex + numFrames > BUFFER_SAMPLES)
+                writeIndex = 0;
+
+            const double firstTimestamp = clock.toHostSeconds((uint64_t) sampleNumber);
+            const double period = clock.getSecondsPerSample();
+
+            for (int i = 0; i < numFrames; i++)
+            {
+                sampleNumbers[writeIndex + i] = sampleNumber + i;
+                timestamps[writeIndex + i] = firstTimestamp + period * i;
+                ttlEventWords[writeIndex + i] = 0;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(bufferLock);
+
+                for (int i = 0; i < numFrames; i++)
+                {
+                    for (int ch = 0; ch < numChannels; ch++)
+                        memcpy(&channels[ch][writeIndex + i], &staging[(size_t) i * numChannels + ch], sizeof(float));
+                }
+            }
+
+            sampleNumber += numFrames;
+            writeIndex += numFrames;
+
+            benchmark::ClobberMemory();
+        }
+
+        state.SetItemsProcessed(state.iterations() * (int64_t) numChannels * numFrames);
+        state.counters["packets_per_s"] = benchmark::Counter((double) state.iterations() * numPackets, benchmark::Counter::kIsRate);
+    }
+    BENCHMARK(BM_PublishCoalesced)->ArgsProduct({ { 1, 30 }, { 1, 4, 16 } })->ArgNames({ "samples", "packets" });
+
+    // ------------------------------------------------------------
+    //                     sequencing and rings
+    // ------------------------------------------------------------
+
+    /** In-order packets through the reorder window and sequence tracker */
+    void BM_Sequence(benchmark::State& state)
+    {
+        const int depth = (int) state.range(0);
+        const int numSamples = 30;
+
+        std::vector<uint8_t> packet = makePacket(192, numSamples);
+        GeminiPacket::Header header;
+        GeminiPacket::parseHeader(packet.data(), packet.size(), header);
+
+        ReorderBuffer reorder;
+        reorder.prepare(depth, packet.size());
+        reorder.setMaxHold(3000);
+
+        SequenceTracker sequence;
+        sequence.reset();
+        sequence.setMaxGap(30000);
+
+        int64_t released = 0;
+
+        auto release = [&](const GeminiPacket::Header& packetHeader, const uint8_t*, int64_t) {
+            sequence.update(packetHeader.sample_number, packetHeader.num_samples);
+            released++;
+        };
+
+        for (auto _ : state)
+        {
+            reorder.push(header, packet.data() + GeminiPacket::HEADER_SIZE, packet.size() - GeminiPacket::HEADER_SIZE, 0, 0, release);
+
+            header.packet_number++;
+            header.sample_number += numSamples;
+        }
+
+        benchmark::DoNotOptimize(released);
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_Sequence)->Arg(1)->Arg(8)->ArgName("depth");
+
+    /** Batched hand-off through a PacketRing on one thread (no contention) */
+    void BM_RingRoundTrip(benchmark::State& state)
+    {
+        const int batch = (int) state.range(0);
+
+        PacketRing ring(256, GeminiPacket::HEADER_SIZE + 192 * 30 * 2);
+
+        for (auto _ : state)
+        {
+            PacketSlot* slots;
+            const int writable = ring.getWritableSlots(slots);
+            const int n = writable < batch ? writable : batch;
+
+            for (int i = 0; i < n; i++)
+                slots[i].length = 24;
+
+            ring.commitWrite(n);
+
+            const int readable = ring.getReadableSlots(slots);
+            benchmark::DoNotOptimize(slots);
+            ring.commitRead(readable);
+        }
+
+        state.SetItemsProcessed(state.iterations() * batch);
+    }
+    BENCHMARK(BM_RingRoundTrip)->Arg(1)->Arg(8)->Arg(32)->ArgName("batch");
+
+    // ------------------------------------------------------------
+    //                          receiving
+    // ------------------------------------------------------------
+
+    /**
+        Datagrams per second through DatagramReceiver over loopback, with a
+        sender thread keeping the socket queue full. Arguments are the backend
+        and the receive batch size.
+    */
+    void BM_Receive(benchmark::State& state)
+    {
+        const DatagramReceiver::Backend backend = (DatagramReceiver::Backend) state.range(0);
+        const int batch = (int) state.range(1);
+        const int numChannels = 192;
+        const int numSamples = 30;
+
+        ShardGroup group;
+
+        if (!group.open(RECEIVE_PORT, 1))
+        {
+            state.SkipWithError("could not bind the loopback port");
+            return;
+        }
+
+        const int bufferSize = 8 << 20;
+        setsockopt(group.getSocket(0), SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+        const std::vector<uint8_t> packet = makePacket(numChannels, numSamples);
+
+        std::unique_ptr<DatagramReceiver> receiver = DatagramReceiver::create(backend, group.getSocket(0), batch, packet.size(), 0);
+
+        if (receiver == nullptr)
+        {
+            state.SkipWithError("backend unavailable");
+            return;
+        }
+
+        SocketPoller poller;
+
+        if (!poller.open() || !poller.add(receiver->getPollFd(), 0))
+        {
+            state.SkipWithError("could not create the poll set");
+            return;
+        }
+
+        std::atomic<bool> stopSending { false };
+
+        std::thread sender([&] {
+            int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+            struct sockaddr_in dest;
+            memset(&dest, 0, sizeof(dest));
+            dest.sin_family = AF_INET;
+            dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            dest.sin_port = htons(RECEIVE_PORT);
+
+            while (!stopSending.load(std::memory_order_relaxed))
+                sendto(sockfd, packet.data(), packet.size(), 0, (const struct sockaddr*) &dest, sizeof(dest));
+
+            close(sockfd);
+        });
+
+        PacketSlotArray slots(batch, packet.size());
+        int64_t received = 0;
+        int64_t calls = 0;
+        uint32_t ready;
+
+        for (auto _ : state)
+        {
+            int n = 0;
+
+            while (n == 0)
+            {
+                if (poller.wait(&ready, 1, 100) < 0)
+                    break;
+
+                n = receiver->receive(slots.data(), batch);
+            }
+
+            if (n < 0)
+            {
+                state.SkipWithError("receive failed");
+                break;
+            }
+
+            received += n;
+            calls++;
+        }
+
+        stopSending.store(true);
+        sender.join();
+
+        state.SetItemsProcessed(received);
+        state.SetBytesProcessed(received * (int64_t) packet.size());
+        state.counters["packets_per_call"] = calls > 0 ? (double) received / calls : 0.0;
+        state.SetLabel(DatagramReceiver::getName(backend));
+    }
+
+    void receiveSweep(benchmark::internal::Benchmark* benchmark)
+    {
+        for (DatagramReceiver::Backend backend : { DatagramReceiver::Backend::RECVMMSG, DatagramReceiver::Backend::IO_URING })
+        {
+            if (!DatagramReceiver::isSupported(backend))
+                continue;
+
+            for (int batch : { 1, 8, 32, 64 })
+                benchmark->Args({ (int) backend, batch });
+        }
+
+        benchmark->ArgNames({ "backend", "batch" });
+    }
+    BENCHMARK(BM_Receive)->Apply(receiveSweep)->UseRealTime();
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<char*> args(argv, argv + argc);
+
+    bool hasOutput = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--benchmark_out=", 16) == 0)
+            hasOutput = true;
+    }
+
+    std::string out = "--benchmark_out=gemini_benchmarks.json";
+    std::string format = "--benchmark_out_format=json";
+
+    if (!hasOutput)
+    {
+        args.push_back(&out[0]);
+        args.push_back(&format[0]);
+    }
+
+    int numArgs = (int) args.size();
+
+    benchmark::Initialize(&numArgs, args.data());
+
+    if (benchmark::ReportUnrecognizedArguments(numArgs, args.data()))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
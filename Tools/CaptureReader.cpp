@@ -0,0 +1,426 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+/**
+    Inspects capture segments written by the plugin's CAPTURE option, raw
+    (.gcap) or compressed (.gcapz).
+
+    For each segment prints the stream it came from, whether it was sealed,
+    the record count, the sample number and receive time ranges, and the
+    packet counter gaps and invalid datagrams inside it. With --from it also
+    seeks through the index to the first packet at or after that device
+    sample number and lists --count records from there.
+
+    With --compress it instead writes the compressed form of each raw
+    segment next to it, decodes it again, checks every record against the
+    raw segment and reports the compression ratio and coding speeds.
+
+    Usage: gemini_capture_reader [--from SAMPLE] [--count N] [--compress] SEGMENT...
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "CaptureCompressor.h"
+#include "GeminiPacket.h"
+#include "PacketCapture.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    /** Gap, ordering and validity counts over a segment's records, in arrival order */
+    struct Counters
+    {
+        uint64_t invalid = 0;
+        uint64_t gaps = 0;
+        uint64_t missing = 0;
+        uint64_t backwards = 0;
+        bool started = false;
+        uint32_t expected = 0;
+
+        void add(const CaptureFile::RecordHeader& record, const uint8_t* datagram)
+        {
+            GeminiPacket::Header packet;
+
+            if ((record.flags & CaptureFile::FLAG_INVALID) != 0
+                || GeminiPacket::parseHeader(datagram, record.length, packet) != GeminiPacket::ParseResult::OK)
+            {
+                invalid++;
+                return;
+            }
+
+            const int32_t ahead = (int32_t) (packet.packet_number - expected);
+
+            if (started && ahead > 0)
+            {
+                gaps++;
+                missing += (uint64_t) ahead;
+            }
+            else if (started && ahead < 0)
+            {
+                backwards++;
+            }
+
+            if (!started || ahead >= 0)
+                expected = packet.packet_number + 1;
+
+            started = true;
+        }
+
+        void print() const
+        {
+            printf("  %llu packet counter gaps (%llu packets), %llu out of order, %llu invalid\n",
+                (unsigned long long) gaps, (unsigned long long) missing,
+                (unsigned long long) backwards, (unsigned long long) invalid);
+        }
+    };
+
+    void printRecord(uint64_t i, const CaptureFile::RecordHeader& record, const uint8_t* datagram)
+    {
+        GeminiPacket::Header packet;
+
+        if (GeminiPacket::parseHeader(datagram, record.length, packet) == GeminiPacket::ParseResult::OK)
+            printf("  %-10llu %-20lld %-8u %-10u %llu\n", (unsigned long long) i, (long long) record.receiveNs,
+                record.length, packet.packet_number, (unsigned long long) packet.sample_number);
+        else
+            printf("  %-10llu %-20lld %-8u invalid\n", (unsigned long long) i, (long long) record.receiveNs, record.length);
+    }
+
+    void printListHeader()
+    {
+        printf("  %-10s %-20s %-8s %-10s %s\n", "record", "receive_ns", "bytes", "packet", "sample");
+    }
+
+    // ------------------------------------------------------------
+    //                        raw segments
+    // ------------------------------------------------------------
+
+    void summarize(const CaptureReader& reader)
+    {
+        const CaptureFile::FileHeader& header = reader.getHeader();
+
+        printf("  port %u stream %u segment %u, %s, %llu records, %llu bytes of records\n",
+            header.port, header.stream, header.segment, reader.isSealed() ? "sealed" : "NOT sealed (interrupted capture)",
+            (unsigned long long) reader.size(), (unsigned long long) (header.dataEnd - sizeof(header)));
+
+        if (reader.size() == 0)
+            return;
+
+        CaptureFile::RecordHeader first, last;
+        reader.getRecord(0, first);
+        reader.getRecord(reader.size() - 1, last);
+
+        printf("  samples %llu .. %llu, received over %.3f s\n",
+            (unsigned long long) reader.getEntry(0).sampleNumber,
+            (unsigned long long) reader.getEntry(reader.size() - 1).sampleNumber,
+            (last.receiveNs - first.receiveNs) * 1e-9);
+
+        Counters counters;
+
+        for (uint64_t i = 0; i < reader.size(); i++)
+        {
+            CaptureFile::RecordHeader record;
+            const uint8_t* datagram = reader.getRecord(i, record);
+            counters.add(record, datagram);
+        }
+
+        counters.print();
+    }
+
+    void list(const CaptureReader& reader, uint64_t from, uint64_t count)
+    {
+        const uint64_t start = reader.findSample(from);
+
+        printListHeader();
+
+        for (uint64_t i = start; i < reader.size() && i < start + count; i++)
+        {
+            CaptureFile::RecordHeader record;
+            const uint8_t* datagram = reader.getRecord(i, record);
+            printRecord(i, record, datagram);
+        }
+    }
+
+    // ------------------------------------------------------------
+    //                     compressed segments
+    // ------------------------------------------------------------
+
+    bool summarize(CompressedReader& reader)
+    {
+        const CompressedFile::FileHeader& header = reader.getHeader();
+
+        printf("  port %u stream %u segment %u, compressed, %llu records in %llu chunks, %llu bytes of datagrams, ratio %.2f\n",
+            header.port, header.stream, header.segment,
+            (unsigned long long) reader.size(), (unsigned long long) reader.getChunkCount(),
+            (unsigned long long) header.rawBytes,
+            (double) header.rawBytes / (header.chunkIndexOffset + header.chunkCount * sizeof(CompressedFile::ChunkEntry)));
+
+        Counters counters;
+        CompressedReader::Chunk chunk;
+        CaptureFile::RecordHeader first = {}, last = {};
+        uint64_t firstSample = 0, lastSample = 0;
+
+        for (uint64_t c = 0; c < reader.getChunkCount(); c++)
+        {
+            if (!reader.readChunk(c, chunk))
+            {
+                printf("  chunk %llu is damaged\n", (unsigned long long) c);
+                return false;
+            }
+
+            for (size_t i = 0; i < chunk.size(); i++)
+            {
+                CaptureFile::RecordHeader record;
+                const uint8_t* datagram = chunk.getRecord(i, record);
+                counters.add(record, datagram);
+
+                if (c == 0 && i == 0)
+                {
+                    first = record;
+                    firstSample = chunk.index[i].sampleNumber;
+                }
+
+                last = record;
+                lastSample = chunk.index[i].sampleNumber;
+            }
+        }
+
+        if (reader.size() > 0)
+            printf("  samples %llu .. %llu, received over %.3f s\n",
+                (unsigned long long) firstSample, (unsigned long long) lastSample, (last.receiveNs - first.receiveNs) * 1e-9);
+
+        counters.print();
+
+        return true;
+    }
+
+    void list(CompressedReader& reader, uint64_t from, uint64_t count)
+    {
+        CompressedReader::Chunk chunk;
+
+        printListHeader();
+
+        // only the chunks from the one holding 'from' are decoded
+        for (uint64_t c = reader.findChunk(from); c < reader.getChunkCount() && count > 0; c++)
+        {
+            if (!reader.readChunk(c, chunk))
+                return;
+
+            for (size_t i = 0; i < chunk.size() && count > 0; i++)
+            {
+                if (chunk.index[i].sampleNumber < from)
+                    continue;
+
+                CaptureFile::RecordHeader record;
+                const uint8_t* datagram = chunk.getRecord(i, record);
+                printRecord(chunk.firstRecord + i, record, datagram);
+                count--;
+            }
+        }
+    }
+
+    /** Compresses a raw segment, decodes the result and compares every record. Returns false on any mismatch. */
+    bool compressAndVerify(const std::string& path)
+    {
+        using Clock = std::chrono::steady_clock;
+
+        std::string outPath = path;
+        const size_t extension = outPath.rfind(CaptureFile::EXTENSION);
+
+        if (extension != std::string::npos)
+            outPath.erase(extension);
+
+        outPath += CompressedFile::EXTENSION;
+
+        CaptureCompressor::Result result;
+        const Clock::time_point encodeStart = Clock::now();
+
+        if (!CaptureCompressor::compressFile(path, outPath, &result))
+        {
+            fprintf(stderr, "%s: could not compress: %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        const double encodeSeconds = std::chrono::duration<double>(Clock::now() - encodeStart).count();
+
+        CaptureReader raw;
+        CompressedReader compressed;
+
+        if (!raw.open(path) || !compressed.open(outPath))
+        {
+            fprintf(stderr, "%s: could not reopen the segments\n", path.c_str());
+            return false;
+        }
+
+        CompressedReader::Chunk chunk;
+        double decodeSeconds = 0;
+        uint64_t checked = 0;
+
+        for (uint64_t c = 0; c < compressed.getChunkCount(); c++)
+        {
+            const Clock::time_point decodeStart = Clock::now();
+            const bool decoded = compressed.readChunk(c, chunk);
+            decodeSeconds += std::chrono::duration<double>(Clock::now() - decodeStart).count();
+
+            if (!decoded)
+            {
+                fprintf(stderr, "%s: chunk %llu does not decode\n", outPath.c_str(), (unsigned long long) c);
+                return false;
+            }
+
+            for (size_t i = 0; i < chunk.size(); i++, checked++)
+            {
+                CaptureFile::RecordHeader expected, actual;
+                const uint8_t* want = raw.getRecord(checked, expected);
+                const uint8_t* got = chunk.getRecord(i, actual);
+
+                if (expected.receiveNs != actual.receiveNs || expected.length != actual.length || expected.flags != actual.flags
+                    || memcmp(want, got, expected.length) != 0 || raw.getEntry(checked).sampleNumber != chunk.index[i].sampleNumber)
+                {
+                    fprintf(stderr, "%s: record %llu differs after decoding\n", outPath.c_str(), (unsigned long long) checked);
+                    return false;
+                }
+            }
+        }
+
+        if (checked != raw.size())
+        {
+            fprintf(stderr, "%s: %llu of %llu records decoded\n", outPath.c_str(), (unsigned long long) checked, (unsigned long long) raw.size());
+            return false;
+        }
+
+        CaptureFile::RecordHeader first, last;
+        double seconds = 0;
+
+        if (raw.size() > 1)
+        {
+            raw.getRecord(0, first);
+            raw.getRecord(raw.size() - 1, last);
+            seconds = (last.receiveNs - first.receiveNs) * 1e-9;
+        }
+
+        printf("%s\n  %llu records verified, %llu -> %llu bytes, ratio %.2f, %s\n",
+            outPath.c_str(), (unsigned long long) checked, (unsigned long long) result.rawBytes,
+            (unsigned long long) result.storedBytes, (double) result.rawBytes / result.storedBytes, compressed.getInstructionSet());
+        printf("  encode %.0f MB/s, decode %.0f MB/s", result.rawBytes / encodeSeconds / 1e6, result.rawBytes / decodeSeconds / 1e6);
+
+        if (seconds > 0)
+            printf(", decode %.0fx real time", seconds / decodeSeconds);
+
+        printf("\n");
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bool listing = false;
+    bool compress = false;
+    uint64_t from = 0;
+    uint64_t count = 20;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+
+        if (arg == "--from" && i + 1 < argc)
+        {
+            listing = true;
+            from = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--count" && i + 1 < argc)
+        {
+            count = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--compress")
+        {
+            compress = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            paths.clear();
+            break;
+        }
+        else
+        {
+            paths.push_back(arg);
+        }
+    }
+
+    if (paths.empty())
+    {
+        fprintf(stderr, "usage: %s [--from SAMPLE] [--count N] [--compress] SEGMENT...\n", argv[0]);
+        return 1;
+    }
+
+    int failures = 0;
+
+    for (const std::string& path : paths)
+    {
+        if (compress)
+        {
+            failures += compressAndVerify(path) ? 0 : 1;
+            continue;
+        }
+
+        CompressedReader compressed;
+
+        if (compressed.open(path))
+        {
+            printf("%s\n", path.c_str());
+
+            if (!summarize(compressed))
+                failures++;
+
+            if (listing)
+                list(compressed, from, count);
+
+            continue;
+        }
+
+        CaptureReader reader;
+
+        if (!reader.open(path))
+        {
+            fprintf(stderr, "%s: not a readable capture segment\n", path.c_str());
+            failures++;
+            continue;
+        }
+
+        printf("%s\n", path.c_str());
+        summarize(reader);
+
+        if (listing)
+            list(reader, from, count);
+    }
+
+    return failures > 0 ? 1 : 0;
+}
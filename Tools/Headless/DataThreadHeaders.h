@@ -0,0 +1,566 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef HEADLESS_DATATHREADHEADERS_H_DEFINED
+#define HEADLESS_DATATHREADHEADERS_H_DEFINED
+
+/**
+    Minimal stand-ins for the parts of the Open Ephys GUI and JUCE that the
+    plugin's acquisition code uses, so GeminiThread and GeminiDevice can be
+    built and driven without the GUI (see Tools/SoakTest.cpp).
+
+    Only the members the plugin calls are provided, with the same names and
+    semantics; anything else is deliberately missing so that new uses show
+    up as build errors here rather than as silent differences. Code that
+    needs the editor is compiled out with GEMINI_HEADLESS.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+typedef int8_t int8;
+typedef uint8_t uint8;
+typedef int16_t int16;
+typedef uint16_t uint16;
+typedef int32_t int32;
+typedef uint32_t uint32;
+typedef long long int64;
+typedef unsigned long long uint64;
+
+// ------------------------------------------------------------
+//                         JUCE core
+// ------------------------------------------------------------
+
+template <typename Type>
+Type jmin(Type a, Type b) { return b < a ? b : a; }
+
+template <typename Type>
+Type jmax(Type a, Type b) { return a < b ? b : a; }
+
+template <typename Type>
+Type jlimit(Type lowerLimit, Type upperLimit, Type value)
+{
+    return value < lowerLimit ? lowerLimit : (upperLimit < value ? upperLimit : value);
+}
+
+class String : public std::string
+{
+public:
+    String() { }
+    String(const char* text) : std::string(text) { }
+    String(const std::string& text) : std::string(text) { }
+
+    explicit String(int number) : std::string(std::to_string(number)) { }
+    explicit String(unsigned number) : std::string(std::to_string(number)) { }
+    explicit String(long number) : std::string(std::to_string(number)) { }
+    explicit String(int64 number) : std::string(std::to_string(number)) { }
+    explicit String(uint64 number) : std::string(std::to_string(number)) { }
+    explicit String(float number) : std::string(format(number, -1)) { }
+    explicit String(double number) : std::string(format(number, -1)) { }
+    String(double number, int numberOfDecimalPlaces) : std::string(format(number, numberOfDecimalPlaces)) { }
+
+    bool isEmpty() const { return empty(); }
+    bool isNotEmpty() const { return !empty(); }
+    std::string toStdString() const { return *this; }
+
+    int getIntValue() const { return atoi(c_str()); }
+    float getFloatValue() const { return (float) atof(c_str()); }
+    double getDoubleValue() const { return atof(c_str()); }
+
+    String trim() const
+    {
+        const size_t first = find_first_not_of(" \t\r\n");
+
+        if (first == npos)
+            return String();
+
+        return substr(first, find_last_not_of(" \t\r\n") - first + 1);
+    }
+
+    String toUpperCase() const
+    {
+        String result(*this);
+
+        for (char& c : result)
+            c = (char) toupper((unsigned char) c);
+
+        return result;
+    }
+
+    bool equalsIgnoreCase(const String& other) const { return toUpperCase() == other.toUpperCase(); }
+    bool startsWith(const String& prefix) const { return compare(0, prefix.size(), prefix) == 0; }
+    bool containsChar(char c) const { return find(c) != npos; }
+    const char* toRawUTF8() const { return c_str(); }
+
+    String operator+(const String& other) const { return String(static_cast<const std::string&>(*this) + other); }
+    String operator+(const char* other) const { return String(static_cast<const std::string&>(*this) + other); }
+
+private:
+    static std::string format(double number, int numberOfDecimalPlaces)
+    {
+        std::ostringstream stream;
+
+        if (numberOfDecimalPlaces >= 0)
+            stream << std::fixed << std::setprecision(numberOfDecimalPlaces);
+
+        stream << number;
+        return stream.str();
+    }
+};
+
+inline String operator+(const char* text, const String& string) { return String(text + static_cast<const std::string&>(string)); }
+
+class StringArray
+{
+public:
+    static StringArray fromTokens(const String& text, const char* breakCharacters, const char* /*quoteCharacters*/)
+    {
+        StringArray tokens;
+        String token;
+
+        for (char c : text)
+        {
+            if (strchr(breakCharacters, c) != nullptr)
+            {
+                tokens.add(token);
+                token.clear();
+            }
+            else
+            {
+                token += c;
+            }
+        }
+
+        tokens.add(token);
+        return tokens;
+    }
+
+    void add(const String& string) { strings.push_back(string); }
+    int size() const { return (int) strings.size(); }
+
+    const String& operator[](int index) const
+    {
+        static const String empty;
+        return index >= 0 && index < size() ? strings[index] : empty;
+    }
+
+    String joinIntoString(const char* separator) const
+    {
+        String result;
+
+        for (int i = 0; i < size(); i++)
+            result += (i > 0 ? String(separator) : String()) + strings[i];
+
+        return result;
+    }
+
+    std::vector<String>::const_iterator begin() const { return strings.begin(); }
+    std::vector<String>::const_iterator end() const { return strings.end(); }
+
+private:
+    std::vector<String> strings;
+};
+
+template <typename ElementType>
+class Array
+{
+public:
+    void add(ElementType element) { elements.push_back(element); }
+    void set(int index, ElementType element)
+    {
+        if (index >= (int) elements.size())
+            elements.resize(index + 1);
+
+        elements[index] = element;
+    }
+
+    void insertMultiple(int index, ElementType element, int count)
+    {
+        if (index < 0 || index > size())
+            index = size();
+
+        elements.insert(elements.begin() + index, count, element);
+    }
+
+    void resize(int size) { elements.resize(size); }
+    void clear() { elements.clear(); }
+    void clearQuick() { elements.clear(); }
+    void ensureStorageAllocated(int size) { elements.reserve(size); }
+
+    int size() const { return (int) elements.size(); }
+    bool contains(ElementType element) const { return std::find(elements.begin(), elements.end(), element) != elements.end(); }
+
+    ElementType operator[](int index) const { return index >= 0 && index < size() ? elements[index] : ElementType(); }
+    ElementType& getReference(int index) { return elements[index]; }
+    ElementType* getRawDataPointer() { return elements.data(); }
+
+    ElementType* begin() { return elements.data(); }
+    ElementType* end() { return elements.data() + elements.size(); }
+    const ElementType* begin() const { return elements.data(); }
+    const ElementType* end() const { return elements.data() + elements.size(); }
+
+private:
+    std::vector<ElementType> elements;
+};
+
+template <typename ObjectClass>
+class OwnedArray
+{
+public:
+    ObjectClass* add(ObjectClass* object)
+    {
+        objects.emplace_back(object);
+        return object;
+    }
+
+    int size() const { return (int) objects.size(); }
+    ObjectClass* operator[](int index) const { return index >= 0 && index < size() ? objects[index].get() : nullptr; }
+
+    void remove(int index) { objects.erase(objects.begin() + index); }
+    void removeLast(int count = 1)
+    {
+        while (count-- > 0 && !objects.empty())
+            objects.pop_back();
+    }
+
+    void clear() { objects.clear(); }
+
+    /** Iterates over the raw pointers, like juce::OwnedArray */
+    class Iterator
+    {
+    public:
+        explicit Iterator(typename std::vector<std::unique_ptr<ObjectClass>>::const_iterator position_) : position(position_) { }
+        ObjectClass* operator*() const { return position->get(); }
+        Iterator& operator++() { ++position; return *this; }
+        bool operator!=(const Iterator& other) const { return position != other.position; }
+
+    private:
+        typename std::vector<std::unique_ptr<ObjectClass>>::const_iterator position;
+    };
+
+    Iterator begin() const { return Iterator(objects.begin()); }
+    Iterator end() const { return Iterator(objects.end()); }
+
+private:
+    std::vector<std::unique_ptr<ObjectClass>> objects;
+};
+
+/** std::thread with juce::Thread's start/exit protocol */
+class Thread
+{
+public:
+    explicit Thread(const String& threadName_) : threadName(threadName_) { }
+    virtual ~Thread() { stopThread(); }
+
+    virtual void run() = 0;
+
+    void startThread()
+    {
+        stopThread();
+        shouldExit.store(false);
+        running.store(true);
+        thread = std::thread([this] { run(); running.store(false); });
+    }
+
+    void signalThreadShouldExit() { shouldExit.store(true); }
+    bool threadShouldExit() const { return shouldExit.load(); }
+    bool isThreadRunning() const { return running.load(); }
+
+    /** Joins the thread; the stand-in waits indefinitely, as a timeout would leak it */
+    bool waitForThreadToExit(int /*timeOutMilliseconds*/)
+    {
+        if (thread.joinable())
+            thread.join();
+
+        return true;
+    }
+
+private:
+    void stopThread()
+    {
+        signalThreadShouldExit();
+        waitForThreadToExit(-1);
+    }
+
+    String threadName;
+    std::thread thread;
+    std::atomic<bool> shouldExit { false };
+    std::atomic<bool> running { false };
+};
+
+// ------------------------------------------------------------
+//                        Open Ephys GUI
+// ------------------------------------------------------------
+
+template <typename... Args>
+void headlessLog(Args&&... args)
+{
+    static std::mutex logMutex;
+
+    std::ostringstream line;
+    (line << ... << args);
+
+    std::lock_guard<std::mutex> lock(logMutex);
+    fprintf(stderr, "%s\n", line.str().c_str());
+}
+
+#define LOGC(...) headlessLog(__VA_ARGS__)
+#define LOGD(...) headlessLog(__VA_ARGS__)
+#define LOGE(...) headlessLog(__VA_ARGS__)
+
+namespace CoreServices
+{
+    inline void sendStatusMessage(const String& message) { headlessLog("[status] ", message); }
+    inline void updateSignalChain(void*) { }
+}
+
+class GenericProcessor { };
+class SourceNode : public GenericProcessor { };
+class GenericEditor { public: virtual ~GenericEditor() { } };
+class ConfigurationObject { };
+
+class DeviceInfo
+{
+public:
+    struct Settings
+    {
+        String name;
+        String description;
+        String identifier;
+        String serial_number;
+        String manufacturer;
+    };
+
+    explicit DeviceInfo(Settings settings_) : settings(settings_) { }
+
+    Settings settings;
+};
+
+class DataStream
+{
+public:
+    struct Settings
+    {
+        String name;
+        String description;
+        String identifier;
+        float sample_rate;
+    };
+
+    explicit DataStream(Settings settings_) : settings(settings_) { }
+
+    float getSampleRate() const { return settings.sample_rate; }
+    String getName() const { return settings.name; }
+
+    Settings settings;
+};
+
+class ContinuousChannel
+{
+public:
+    enum class Type { ELECTRODE, AUX, ADC };
+
+    struct Settings
+    {
+        Type type;
+        String name;
+        String description;
+        String identifier;
+        float bitVolts;
+        DataStream* stream;
+    };
+
+    explicit ContinuousChannel(Settings settings_) : settings(settings_) { }
+
+    Settings settings;
+};
+
+class EventChannel
+{
+public:
+    enum class Type { TTL, TEXT };
+
+    struct Settings
+    {
+        Type type;
+        String name;
+        String description;
+        String identifier;
+        DataStream* stream;
+        int maxTTLBits = 64;
+    };
+
+    explicit EventChannel(Settings settings_) : settings(settings_) { }
+
+    Settings settings;
+};
+
+class SpikeChannel
+{
+public:
+    enum class Type { SINGLE, STEREOTRODE, TETRODE };
+
+    struct Settings
+    {
+        Type type;
+        String name;
+        String description;
+        String identifier;
+        DataStream* stream;
+        Array<const ContinuousChannel*> sourceChannels;
+    };
+
+    explicit SpikeChannel(Settings settings_) : settings(settings_) { }
+
+    Settings settings;
+};
+
+/**
+    Stand-in for the GUI's DataBuffer. addToBuffer() does the same
+    channel-major copy into a circular buffer that the real one does, then
+    treats the data as consumed at once (there is no audio callback), and
+    keeps running totals a harness can read from another thread:
+    samples, sample-number discontinuities and timestamp reversals.
+*/
+class DataBuffer
+{
+public:
+    DataBuffer(int numChannels_, int bufferSize_) { resize(numChannels_, bufferSize_); }
+
+    void resize(int numChannels_, int bufferSize_)
+    {
+        numChannels = numChannels_;
+        bufferSize = bufferSize_;
+        samples.assign((size_t) numChannels * bufferSize, 0.0f);
+        writeIndex = 0;
+    }
+
+    void clear()
+    {
+        writeIndex = 0;
+        started = false;
+    }
+
+    int addToBuffer(float* data, int64* sampleNumbers, double* timestamps, uint64* /*eventCodes*/, int numItems, int chunkSize = 1)
+    {
+        for (int i = 0; i < numItems; i += chunkSize)
+        {
+            for (int ch = 0; ch < numChannels; ch++)
+                samples[(size_t) ch * bufferSize + writeIndex] = data[(size_t) i * numChannels + ch];
+
+            writeIndex = (writeIndex + 1) % bufferSize;
+        }
+
+        if (numItems > 0)
+        {
+            if (started && sampleNumbers[0] != lastSampleNumber + 1)
+                discontinuities.fetch_add(1, std::memory_order_relaxed);
+
+            if (started && timestamps[0] < lastTimestamp)
+                timestampReversals.fetch_add(1, std::memory_order_relaxed);
+
+            started = true;
+            lastSampleNumber = sampleNumbers[numItems - 1];
+            lastTimestamp = timestamps[numItems - 1];
+            totalSamples.fetch_add((uint64) numItems, std::memory_order_relaxed);
+        }
+
+        return numItems;
+    }
+
+    int getNumSamples() const { return 0; }
+
+    uint64 getTotalSamples() const { return totalSamples.load(std::memory_order_relaxed); }
+    uint64 getDiscontinuities() const { return discontinuities.load(std::memory_order_relaxed); }
+    uint64 getTimestampReversals() const { return timestampReversals.load(std::memory_order_relaxed); }
+
+private:
+    int numChannels = 0;
+    int bufferSize = 0;
+    std::vector<float> samples;
+    int writeIndex = 0;
+
+    bool started = false;
+    int64 lastSampleNumber = 0;
+    double lastTimestamp = 0;
+
+    std::atomic<uint64> totalSamples { 0 };
+    std::atomic<uint64> discontinuities { 0 };
+    std::atomic<uint64> timestampReversals { 0 };
+};
+
+class DataThread : public Thread
+{
+public:
+    explicit DataThread(SourceNode* sn_) : Thread("Data Thread"), sn(sn_) { }
+
+    virtual bool updateBuffer() = 0;
+    virtual bool foundInputSource() = 0;
+    virtual bool startAcquisition() = 0;
+    virtual bool stopAcquisition() = 0;
+
+    virtual void updateSettings(OwnedArray<ContinuousChannel>* continuousChannels,
+        OwnedArray<EventChannel>* eventChannels,
+        OwnedArray<SpikeChannel>* spikeChannels,
+        OwnedArray<DataStream>* sourceStreams,
+        OwnedArray<DeviceInfo>* devices,
+        OwnedArray<ConfigurationObject>* configurationObjects) = 0;
+
+    virtual void resizeBuffers() { }
+    virtual std::unique_ptr<GenericEditor> createEditor(SourceNode*) { return nullptr; }
+    virtual void handleBroadcastMessage(String) { }
+    virtual String handleConfigMessage(String) { return ""; }
+
+    /** As in the GUI: keep calling updateBuffer() until asked to exit or it fails */
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            if (!updateBuffer())
+                signalThreadShouldExit();
+        }
+    }
+
+    /** Headless only: the buffers the plugin publishes to, for the harness to inspect */
+    const OwnedArray<DataBuffer>& getSourceBuffers() const { return sourceBuffers; }
+
+protected:
+    SourceNode* sn;
+    uint64 eventState = 0;
+    OwnedArray<DataBuffer> sourceBuffers;
+};
+
+#endif
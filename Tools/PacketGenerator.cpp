@@ -0,0 +1,518 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+/**
+    Device simulator: streams Gemini-format datagrams to a UDP port, paced at
+    the configured sample rate, so the plugin can be driven without hardware.
+
+    The samples come from a sine (one phase per channel), Gaussian noise or a
+    raw recording (little-endian int16 frames with the same channel count),
+    replayed in a loop. Sine and noise are precomputed for one second, so the
+    sine frequency is rounded to a whole number of cycles per second.
+    --format sends them as int16 (the default), uint16 (offset by 32768),
+    packed int24 (scaled by 256) or float32 samples.
+
+    Impairments, applied per packet with the given probabilities:
+      --loss P              the packet is not sent
+      --reorder P           the packet is held back behind the next
+                            --reorder-distance packets
+      --duplicate P         the packet is sent twice
+      --burst N             packets leave in groups of N at the group's due
+                            time instead of one by one (same average rate)
+
+    --ttl HZ adds digital input words to every packet: a binary counter
+    stepping at twice HZ, so line 0 is a square wave at HZ, line 1 at half
+    that, and so on.
+
+    --max-rate 1 drops the pacing and sends as fast as sendmmsg() allows, to
+    find the throughput ceiling of the receive path.
+
+    Usage: gemini_packet_generator [--host A] [--port N] [--channels N]
+               [--samples N] [--rate HZ] [--format int16|uint16|int24|float32]
+               [--waveform sine|noise|file]
+               [--file PATH] [--frequency HZ] [--amplitude COUNTS]
+               [--loss P] [--reorder P] [--reorder-distance N]
+               [--duplicate P] [--burst N] [--max-rate 0|1]
+               [--first-packet N] [--seconds S] [--seed N] [--ttl HZ]
+*/
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GeminiPacket.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    /** Most datagrams handed to one sendmmsg() call */
+    const int MAX_BATCH = 64;
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        int port = 51002;
+        int channels = 192;
+        int samples = 30;
+        double rate = 30000.0;
+        uint8_t format = GeminiPacket::INT16;
+        std::string waveform = "sine";
+        std::string file;
+        double frequency = 10.0;
+        double amplitude = 1000.0;
+        double loss = 0.0;
+        double reorder = 0.0;
+        int reorderDistance = 3;
+        double duplicate = 0.0;
+        int burst = 1;
+        bool maxRate = false;
+        uint32_t firstPacket = 0;
+        double seconds = 0.0;
+        unsigned seed = 1;
+        double ttlHz = 0.0;
+    };
+
+    struct Counters
+    {
+        uint64_t generated = 0;
+        uint64_t sent = 0;
+        uint64_t bytes = 0;
+        uint64_t dropped = 0;
+        uint64_t reordered = 0;
+        uint64_t duplicated = 0;
+        uint64_t sendErrors = 0;
+    };
+
+    std::atomic<bool> interrupted { false };
+
+    void onInterrupt(int)
+    {
+        interrupted.store(true);
+    }
+
+    /** Returns the sample format called 'name', or an invalid one */
+    uint8_t parseFormat(const std::string& name)
+    {
+        for (uint8_t format : { GeminiPacket::INT16, GeminiPacket::UINT16, GeminiPacket::INT24, GeminiPacket::FLOAT32 })
+        {
+            if (name == GeminiPacket::formatName(format))
+                return format;
+        }
+
+        return 0xFF;
+    }
+
+    bool parseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            const std::string name = argv[i];
+            const char* value = argv[i + 1];
+
+            if (name == "--host")
+                options.host = value;
+            else if (name == "--port")
+                options.port = atoi(value);
+            else if (name == "--channels")
+                options.channels = atoi(value);
+            else if (name == "--samples")
+                options.samples = atoi(value);
+            else if (name == "--rate")
+                options.rate = atof(value);
+            else if (name == "--format")
+                options.format = parseFormat(value);
+            else if (name == "--waveform")
+                options.waveform = value;
+            else if (name == "--file")
+                options.file = value;
+            else if (name == "--frequency")
+                options.frequency = atof(value);
+            else if (name == "--amplitude")
+                options.amplitude = atof(value);
+            else if (name == "--loss")
+                options.loss = atof(value);
+            else if (name == "--reorder")
+                options.reorder = atof(value);
+            else if (name == "--reorder-distance")
+                options.reorderDistance = atoi(value);
+            else if (name == "--duplicate")
+                options.duplicate = atof(value);
+            else if (name == "--burst")
+                options.burst = atoi(value);
+            else if (name == "--max-rate")
+                options.maxRate = atoi(value) != 0;
+            else if (name == "--first-packet")
+                options.firstPacket = (uint32_t) strtoul(value, nullptr, 0);
+            else if (name == "--seconds")
+                options.seconds = atof(value);
+            else if (name == "--seed")
+                options.seed = (unsigned) atoi(value);
+            else if (name == "--ttl")
+                options.ttlHz = atof(value);
+            else
+                return false;
+        }
+
+        if (options.waveform == "file" && options.file.empty())
+            return false;
+
+        return (argc % 2) == 1 && options.channels > 0 && options.samples > 0 && options.rate > 0
+            && options.burst > 0 && options.reorderDistance > 0
+            && (options.waveform == "sine" || options.waveform == "noise" || options.waveform == "file")
+            && GeminiPacket::bytesPerSample(options.format) > 0
+            && options.ttlHz >= 0
+            && GeminiPacket::HEADER_SIZE + (size_t) options.channels * options.samples * GeminiPacket::bytesPerSample(options.format)
+                + (options.ttlHz > 0 ? (size_t) options.samples * GeminiPacket::DIGITAL_WORD_SIZE : 0) <= GeminiPacket::MAX_PACKET_SIZE;
+    }
+
+    /** Fills 'frames' with the interleaved frames the generator cycles through. Returns false if the file cannot be used. */
+    bool buildWaveform(const Options& options, std::vector<int16_t>& frames)
+    {
+        if (options.waveform == "file")
+        {
+            FILE* input = fopen(options.file.c_str(), "rb");
+
+            if (input == nullptr)
+            {
+                perror(options.file.c_str());
+                return false;
+            }
+
+            uint8_t bytes[2];
+
+            while (fread(bytes, 1, 2, input) == 2)
+                frames.push_back((int16_t) (bytes[0] | (bytes[1] << 8)));
+
+            fclose(input);
+
+            const size_t frameSize = (size_t) options.channels;
+
+            if (frames.size() < frameSize)
+            {
+                fprintf(stderr, "%s: shorter than one %d-channel frame\n", options.file.c_str(), options.channels);
+                return false;
+            }
+
+            frames.resize(frames.size() / frameSize * frameSize);
+            return true;
+        }
+
+        const size_t numFrames = (size_t) std::lround(options.rate);
+        const double cycles = std::round(options.frequency);
+        const double pi = 3.14159265358979323846;
+
+        std::mt19937 generator(options.seed);
+        std::normal_distribution<double> noise(0.0, options.amplitude);
+
+        frames.resize(numFrames * options.channels);
+
+        for (size_t i = 0; i < numFrames; i++)
+        {
+            for (int ch = 0; ch < options.channels; ch++)
+            {
+                double value;
+
+                if (options.waveform == "sine")
+                    value = options.amplitude * std::sin(2.0 * pi * (cycles * i / numFrames + (double) ch / options.channels));
+                else
+                    value = noise(generator);
+
+                frames[i * options.channels + ch] = (int16_t) std::max(-32768.0, std::min(32767.0, std::round(value)));
+            }
+        }
+
+        return true;
+    }
+
+    /** Writes packet 'index' (header, samples and any digital inputs) into 'packet' */
+    void buildPacket(const Options& options, const std::vector<int16_t>& frames, uint64_t index, std::vector<uint8_t>& packet)
+    {
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = options.format;
+        header.num_channels = (uint16_t) options.channels;
+        header.num_samples = (uint16_t) options.samples;
+        header.flags = options.ttlHz > 0 ? GeminiPacket::FLAG_DIGITAL_INPUTS : 0;
+        header.packet_number = options.firstPacket + (uint32_t) index;
+        header.sample_number = index * options.samples;
+
+        packet.resize(GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(header));
+        GeminiPacket::writeHeader(header, packet.data());
+
+        const size_t numFrames = frames.size() / options.channels;
+        uint8_t* out = packet.data() + GeminiPacket::HEADER_SIZE;
+
+        for (int s = 0; s < options.samples; s++)
+        {
+            const int16_t* frame = frames.data() + ((index * options.samples + s) % numFrames) * options.channels;
+
+            for (int ch = 0; ch < options.channels; ch++)
+            {
+                uint32_t value;
+
+                switch (options.format)
+                {
+                case GeminiPacket::UINT16:
+                    value = (uint32_t) (frame[ch] + 32768);
+                    break;
+                case GeminiPacket::INT24:
+                    value = (uint32_t) frame[ch] * 256;
+                    break;
+                case GeminiPacket::FLOAT32:
+                {
+                    const float sample = frame[ch];
+                    memcpy(&value, &sample, sizeof(value));
+                    break;
+                }
+                default:
+                    value = (uint16_t) frame[ch];
+                    break;
+                }
+
+                for (size_t b = 0; b < GeminiPacket::bytesPerSample(options.format); b++)
+                    *out++ = (uint8_t) (value >> (8 * b));
+            }
+        }
+
+        if (options.ttlHz <= 0)
+            return;
+
+        for (int s = 0; s < options.samples; s++)
+        {
+            const uint16_t word = (uint16_t) (uint64_t) ((header.sample_number + s) * 2.0 * options.ttlHz / options.rate);
+
+            *out++ = (uint8_t) word;
+            *out++ = (uint8_t) (word >> 8);
+        }
+    }
+
+    /** Sends 'count' packets in one call, retrying the remainder after a partial send */
+    void sendBatch(int sockfd, const struct sockaddr_in& dest, std::vector<std::vector<uint8_t>>& batch, int count, Counters& counters)
+    {
+        struct mmsghdr msgs[MAX_BATCH];
+        struct iovec iovs[MAX_BATCH];
+
+        for (int i = 0; i < count; i++)
+        {
+            iovs[i].iov_base = batch[i].data();
+            iovs[i].iov_len = batch[i].size();
+
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = (void*) &dest;
+            msgs[i].msg_hdr.msg_namelen = sizeof(dest);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int done = 0;
+
+        while (done < count)
+        {
+            const int n = sendmmsg(sockfd, msgs + done, (unsigned) (count - done), 0);
+
+            if (n <= 0)
+            {
+                // skip the datagram the kernel refused (e.g. ECONNREFUSED from a closed port) and carry on
+                counters.sendErrors++;
+                done++;
+                continue;
+            }
+
+            for (int i = done; i < done + n; i++)
+                counters.bytes += batch[i].size();
+
+            counters.sent += n;
+            done += n;
+        }
+    }
+
+    void printProgress(const Counters& counters, double elapsed)
+    {
+        fprintf(stderr, "%8.1f s %12llu sent %10llu dropped %10llu reordered %10llu duplicated %12.0f packets/s %8.1f MB/s\n",
+            elapsed, (unsigned long long) counters.sent, (unsigned long long) counters.dropped,
+            (unsigned long long) counters.reordered, (unsigned long long) counters.duplicated,
+            elapsed > 0 ? counters.sent / elapsed : 0.0, elapsed > 0 ? counters.bytes / elapsed / 1e6 : 0.0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--host A] [--port N] [--channels N] [--samples N] [--rate HZ]\n"
+            "    [--format int16|uint16|int24|float32]\n"
+            "    [--waveform sine|noise|file] [--file PATH] [--frequency HZ] [--amplitude COUNTS]\n"
+            "    [--loss P] [--reorder P] [--reorder-distance N] [--duplicate P] [--burst N]\n"
+            "    [--max-rate 0|1] [--first-packet N] [--seconds S] [--seed N] [--ttl HZ]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<int16_t> frames;
+
+    if (!buildWaveform(options, frames))
+        return 1;
+
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(options.port);
+
+    if (inet_pton(AF_INET, options.host.c_str(), &dest.sin_addr) != 1)
+    {
+        fprintf(stderr, "%s: not an IPv4 address\n", options.host.c_str());
+        return 1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+
+    signal(SIGINT, onInterrupt);
+    signal(SIGTERM, onInterrupt);
+
+    printf("%d channels x %d samples per packet at %.0f Hz to %s:%d, %s%s\n",
+        options.channels, options.samples, options.rate, options.host.c_str(), options.port,
+        options.waveform.c_str(), options.maxRate ? ", max rate" : "");
+    fflush(stdout);
+
+    std::mt19937 generator(options.seed);
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    // packets held back for reordering, with the generated index after which they go out
+    std::deque<std::pair<uint64_t, std::vector<uint8_t>>> held;
+
+    std::vector<std::vector<uint8_t>> batch(MAX_BATCH);
+    int batchSize = 0;
+
+    Counters counters;
+
+    auto queue = [&](const std::vector<uint8_t>& packet) {
+        if (batchSize == MAX_BATCH)
+        {
+            sendBatch(sockfd, dest, batch, batchSize, counters);
+            batchSize = 0;
+        }
+
+        batch[batchSize++] = packet;
+    };
+
+    const double packetPeriod = options.samples / options.rate;
+    const auto start = std::chrono::steady_clock::now();
+    auto nextReport = start + std::chrono::seconds(1);
+
+    std::vector<uint8_t> packet;
+
+    for (uint64_t index = 0; !interrupted.load(); index++)
+    {
+        if (!options.maxRate && index % options.burst == 0)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(index * packetPeriod)));
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - start).count();
+
+        if (options.seconds > 0 && elapsed >= options.seconds)
+            break;
+
+        if (now >= nextReport)
+        {
+            printProgress(counters, elapsed);
+            nextReport += std::chrono::seconds(1);
+        }
+
+        buildPacket(options, frames, index, packet);
+        counters.generated++;
+
+        if (options.loss > 0 && chance(generator) < options.loss)
+        {
+            counters.dropped++;
+        }
+        else if (options.reorder > 0 && chance(generator) < options.reorder)
+        {
+            counters.reordered++;
+            held.emplace_back(index + options.reorderDistance, packet);
+        }
+        else
+        {
+            queue(packet);
+
+            if (options.duplicate > 0 && chance(generator) < options.duplicate)
+            {
+                counters.duplicated++;
+                queue(packet);
+            }
+        }
+
+        while (!held.empty() && held.front().first <= index)
+        {
+            queue(held.front().second);
+            held.pop_front();
+        }
+
+        // a paced group leaves together, at its due time
+        if (!options.maxRate && (index + 1) % options.burst == 0 && batchSize > 0)
+        {
+            sendBatch(sockfd, dest, batch, batchSize, counters);
+            batchSize = 0;
+        }
+    }
+
+    for (auto& late : held)
+        queue(late.second);
+
+    if (batchSize > 0)
+        sendBatch(sockfd, dest, batch, batchSize, counters);
+
+    printProgress(counters, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    if (counters.sendErrors > 0)
+        fprintf(stderr, "%llu send errors\n", (unsigned long long) counters.sendErrors);
+
+    close(sockfd);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/**
+    Checks that PacketRing's high-water mark follows the real backlog: it
+    stays near the batch size when the ring is drained as fast as it is
+    filled, in lockstep and from a paced producer thread, and reaches the
+    capacity when the consumer stalls. Exits with status 1 on failure.
+
+    Usage: gemini_ring_test
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "PacketRing.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    const int CAPACITY = 1024;
+    const size_t SLOT_SIZE = 64;
+
+    /** Commits up to 'count' slots; returns the number committed */
+    int produce(PacketRing& ring, int count)
+    {
+        int written = 0;
+
+        while (written < count)
+        {
+            PacketSlot* first;
+            const int n = std::min(ring.getWritableSlots(first), count - written);
+
+            if (n == 0)
+                break;
+
+            ring.commitWrite(n);
+            written += n;
+        }
+
+        return written;
+    }
+
+    /** Releases every filled slot; returns the number released */
+    int drain(PacketRing& ring)
+    {
+        int read = 0;
+        PacketSlot* first;
+        int n;
+
+        while ((n = ring.getReadableSlots(first)) > 0)
+        {
+            ring.commitRead(n);
+            read += n;
+        }
+
+        return read;
+    }
+
+    bool check(const char* name, bool passed, int highWater)
+    {
+        printf("%s %s high_water=%d capacity=%d\n", passed ? "PASS" : "FAIL", name, highWater, CAPACITY);
+        return passed;
+    }
+
+    /** Batches of four, each drained before the next */
+    bool testLockstep()
+    {
+        const int batch = 4;
+        PacketRing ring(CAPACITY, SLOT_SIZE);
+
+        for (int i = 0; i < 100 * CAPACITY / batch; i++)
+        {
+            produce(ring, batch);
+            drain(ring);
+        }
+
+        return check("lockstep", ring.getHighWater() == batch, ring.getHighWater());
+    }
+
+    /** One slot every 20 us from another thread, drained as it arrives */
+    bool testPaced()
+    {
+        PacketRing ring(CAPACITY, SLOT_SIZE);
+        std::atomic<bool> done { false };
+
+        std::thread producer([&]
+        {
+            auto next = std::chrono::steady_clock::now();
+
+            for (int i = 0; i < 10000; i++)
+            {
+                next += std::chrono::microseconds(20);
+                std::this_thread::sleep_until(next);
+                produce(ring, 1);
+            }
+
+            done.store(true);
+            ring.wakeConsumer();
+        });
+
+        while (!done.load() || ring.hasData())
+        {
+            ring.waitForData(1000);
+            drain(ring);
+        }
+
+        producer.join();
+
+        // a quarter of the ring is 5 ms of packets; only a stalled consumer gets there
+        return check("paced", ring.getHighWater() < CAPACITY / 4, ring.getHighWater());
+    }
+
+    /** Filled to capacity before the consumer runs */
+    bool testStalled()
+    {
+        PacketRing ring(CAPACITY, SLOT_SIZE);
+
+        const int written = produce(ring, 2 * CAPACITY);
+        ring.addOverflow(2 * CAPACITY - written);
+        drain(ring);
+
+        return check("stalled", ring.getHighWater() == CAPACITY && ring.getOverflowCount() == (uint64_t) CAPACITY, ring.getHighWater());
+    }
+}
+
+int main()
+{
+    bool passed = testLockstep();
+    passed = testPaced() && passed;
+    passed = testStalled() && passed;
+
+    return passed ? 0 : 1;
+}
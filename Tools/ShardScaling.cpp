@@ -0,0 +1,300 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/**
+    Measures how receive + decode throughput scales with the number of
+    SO_REUSEPORT shards. Sender threads blast Gemini packets at a loopback
+    port for a fixed time; for each shard count the same ShardGroup and
+    ShardThread machinery the plugin uses receives and decodes them, and a
+    consumer drains the shard rings.
+
+    Usage: gemini_shard_scaling [--port N] [--channels N] [--samples N]
+                                [--max-shards N] [--senders N] [--seconds S]
+                                [--busy-poll US]
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DatagramReceiver.h"
+#include "GeminiPacket.h"
+#include "PacketRing.h"
+#include "ShardThread.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    struct Options
+    {
+        int port = 51090;
+        int channels = 1024;
+        int samples = 8;
+        int maxShards = (int) std::thread::hardware_concurrency();
+        int senders = 2;
+        double seconds = 2.0;
+        int busyPollUs = 0;
+    };
+
+    struct Result
+    {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        uint64_t overflows = 0;
+        uint64_t busiestShard = 0;
+        uint64_t quietestShard = 0;
+        double elapsed = 0;
+        bool steered = false;
+    };
+
+    bool parseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            const std::string name = argv[i];
+            const char* value = argv[i + 1];
+
+            if (name == "--port")
+                options.port = atoi(value);
+            else if (name == "--channels")
+                options.channels = atoi(value);
+            else if (name == "--samples")
+                options.samples = atoi(value);
+            else if (name == "--max-shards")
+                options.maxShards = atoi(value);
+            else if (name == "--senders")
+                options.senders = atoi(value);
+            else if (name == "--seconds")
+                options.seconds = atof(value);
+            else if (name == "--busy-poll")
+                options.busyPollUs = atoi(value);
+            else
+                return false;
+        }
+
+        if (options.maxShards < 1)
+            options.maxShards = 1;
+
+        return (argc % 2) == 1 && options.channels > 0 && options.samples > 0 && options.senders > 0
+            && GeminiPacket::HEADER_SIZE + (size_t) options.channels * options.samples * 2 <= GeminiPacket::MAX_PACKET_SIZE;
+    }
+
+    /** Sends packets numbered first, first + stride, ... until 'stop' is set */
+    uint64_t sendPackets(const Options& options, uint32_t first, uint32_t stride, const std::atomic<bool>& stop)
+    {
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        struct sockaddr_in dest;
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        dest.sin_port = htons(options.port);
+
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = GeminiPacket::INT16;
+        header.num_channels = (uint16_t) options.channels;
+        header.num_samples = (uint16_t) options.samples;
+        header.flags = 0;
+
+        std::vector<uint8_t> packet(GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(header));
+
+        for (size_t i = GeminiPacket::HEADER_SIZE; i < packet.size(); i++)
+            packet[i] = (uint8_t) i;
+
+        uint64_t sent = 0;
+
+        for (uint32_t number = first; !stop.load(std::memory_order_relaxed); number += stride)
+        {
+            header.packet_number = number;
+            header.sample_number = (uint64_t) number * options.samples;
+            GeminiPacket::writeHeader(header, packet.data());
+
+            if (sendto(sockfd, packet.data(), packet.size(), 0, (const struct sockaddr*) &dest, sizeof(dest)) > 0)
+                sent++;
+        }
+
+        close(sockfd);
+        return sent;
+    }
+
+    bool runShards(const Options& options, int numShards, Result& result)
+    {
+        const size_t slotSize = GeminiPacket::HEADER_SIZE + (size_t) options.channels * options.samples * sizeof(float);
+        const int numCpus = (int) std::thread::hardware_concurrency();
+
+        ShardGroup group;
+
+        if (!group.open(options.port, numShards))
+        {
+            perror("bind");
+            return false;
+        }
+
+        result.steered = group.isSteered();
+
+        RingWaiter waiter;
+        std::vector<std::unique_ptr<PacketRing>> rings;
+        std::vector<std::unique_ptr<DatagramReceiver>> receivers;
+        std::vector<std::unique_ptr<ShardThread>> shards;
+
+        for (int i = 0; i < numShards; i++)
+        {
+            const int size = 8 << 20;
+            setsockopt(group.getSocket(i), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+            rings.push_back(std::make_unique<PacketRing>(1024, slotSize, &waiter));
+            receivers.push_back(DatagramReceiver::create(DatagramReceiver::Backend::RECVMMSG, group.getSocket(i), 32, slotSize, 0));
+
+            // leave core 0 for the senders and the consumer where possible
+            shards.push_back(std::make_unique<ShardThread>(*receivers.back(), *rings.back(), 32, numCpus > 1 ? 1 + i % (numCpus - 1) : -1, 50));
+            shards.back()->setLayout(options.channels, options.samples, 0.195f, 0.0f);
+            shards.back()->setBusyPoll(options.busyPollUs);
+
+            if (!shards.back()->start())
+            {
+                perror("poll");
+                return false;
+            }
+        }
+
+        if (options.busyPollUs > 0)
+            group.setBusyPoll(options.busyPollUs);
+
+        std::atomic<bool> stopSending { false };
+        std::vector<std::thread> senders;
+        std::vector<uint64_t> sent(options.senders, 0);
+        std::vector<uint64_t> perShard(numShards, 0);
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto end = start + std::chrono::duration<double>(options.seconds);
+
+        for (int i = 0; i < options.senders; i++)
+            senders.emplace_back([&, i] { sent[i] = sendPackets(options, (uint32_t) i, (uint32_t) options.senders, stopSending); });
+
+        // drain until the senders stop, then until the shards go quiet
+        auto lastData = std::chrono::steady_clock::now();
+
+        while (true)
+        {
+            const auto now = std::chrono::steady_clock::now();
+
+            if (now >= end)
+                stopSending.store(true);
+
+            if (now >= end && now - lastData > std::chrono::milliseconds(200))
+                break;
+
+            waiter.wait(10000, [&] {
+                for (auto& ring : rings)
+                    if (ring->hasData())
+                        return true;
+                return false;
+            });
+
+            for (int i = 0; i < numShards; i++)
+            {
+                PacketSlot* slots;
+                const int n = rings[i]->getReadableSlots(slots);
+
+                if (n > 0)
+                {
+                    result.received += n;
+                    perShard[i] += n;
+                    rings[i]->commitRead(n);
+                    lastData = std::chrono::steady_clock::now();
+                }
+            }
+        }
+
+        result.elapsed = std::chrono::duration<double>(lastData - start).count();
+
+        for (auto& sender : senders)
+            sender.join();
+
+        for (uint64_t count : sent)
+            result.sent += count;
+
+        result.quietestShard = perShard[0];
+
+        for (int i = 0; i < numShards; i++)
+        {
+            shards[i]->stop();
+            result.overflows += rings[i]->getOverflowCount();
+            result.busiestShard = std::max(result.busiestShard, perShard[i]);
+            result.quietestShard = std::min(result.quietestShard, perShard[i]);
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--port N] [--channels N] [--samples N] [--max-shards N] [--senders N] [--seconds S] [--busy-poll US]\n", argv[0]);
+        return 1;
+    }
+
+    const double packetBytes = (double) GeminiPacket::HEADER_SIZE + 2.0 * options.channels * options.samples;
+
+    printf("%d channels x %d samples per packet, %d sender(s), %.1f s per run\n",
+        options.channels, options.samples, options.senders, options.seconds);
+    printf("%6s %8s %12s %12s %10s %14s %8s %8s\n", "shards", "steered", "sent", "received", "loss %", "packets/s", "MB/s", "balance");
+
+    for (int numShards = 1; numShards <= options.maxShards; numShards *= 2)
+    {
+        Result result;
+
+        if (!runShards(options, numShards, result))
+            return 1;
+
+        const double rate = result.elapsed > 0 ? result.received / result.elapsed : 0;
+        const double loss = result.sent > 0 ? 100.0 * (1.0 - (double) result.received / result.sent) : 0;
+
+        // quietest / busiest shard: 1.0 means packets were spread evenly
+        const double balance = result.busiestShard > 0 ? (double) result.quietestShard / result.busiestShard : 0;
+
+        printf("%6d %8s %12llu %12llu %10.2f %14.0f %8.1f %8.2f\n",
+            numShards, numShards > 1 ? (result.steered ? "yes" : "no") : "-",
+            (unsigned long long) result.sent, (unsigned long long) result.received,
+            loss, rate, rate * packetBytes / 1e6, balance);
+    }
+
+    return 0;
+}
@@ -0,0 +1,542 @@
+/*
+ ------------------------------------------------------------------
+
+ This file is part of the Open Ephys GUI
+ Copyright (C) 2022 Open Ephys
+
+ ------------------------------------------------------------------
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+
+/**
+    Headless soak test of the whole acquisition path.
+
+    Builds GeminiThread and GeminiDevice against the stand-ins in
+    Tools/Headless and drives them as the GUI would (connect, updateSettings,
+    startAcquisition, stopAcquisition), while one paced sender thread per
+    port streams Gemini packets over loopback. Runs for as long as asked and
+    reports, every interval and at the end:
+
+      - published samples/s per device against the nominal rate
+      - packets lost, as sequence gaps seen by the plugin
+      - receive-to-publish latency percentiles, from the plugin's own
+        histogram, for the interval and overall
+      - CPU used by the plugin threads (process CPU minus the senders),
+        in cores and in microseconds per channel-second
+
+    --capture DIR turns on the plugin's raw packet capture into DIR, to
+    measure what capturing costs at the same load. --coalesce US has the
+    plugin write packets to the DataBuffer in groups held for up to US
+    microseconds (COALESCE config message). --cpu, --rt-priority, --mlock
+    and --rcvbuf-kb set the plugin's AFFINITY, RT_PRIORITY, MLOCK and
+    RCVBUF config messages; the effective settings (RT_STATUS) are printed
+    after startup. --reference none|mean|median and --highpass HZ turn on
+    the in-decode common reference and high-pass filter (PREPROCESS), to
+    measure what they cost per channel. --lfp HZ adds the decimated LFP
+    streams (LFP config message); their rate is reported at the end and
+    their buffers are checked for discontinuities with the others.
+    --ttl HZ has the senders add digital input words, a binary counter
+    stepping at twice HZ, and prints the state and edge counts the plugin
+    decoded from them (TTL_STATUS). --channel-map LIST publishes only the
+    listed 1-based channels, in that order (CHANNEL_MAP config message);
+    CPU per channel stays per channel received.
+
+    With --max-loss-ppm and/or --max-p99-us the exit status is 2 if the run
+    ends outside those limits, so the harness can gate a rig upgrade.
+
+    Usage: gemini_soak_test [--ports N[,N...]] [--channels N] [--samples N]
+               [--rate HZ] [--shards N] [--backend recvmmsg|io_uring]
+               [--seconds S | --hours H] [--interval S] [--loss P]
+               [--reorder P] [--max-loss-ppm X] [--max-p99-us X]
+               [--capture DIR] [--coalesce US] [--cpu N] [--rt-priority N]
+               [--mlock 0|1] [--rcvbuf-kb KB] [--reference none|mean|median]
+               [--highpass HZ] [--lfp HZ] [--ttl HZ]
+               [--channel-map LIST]
+*/
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GeminiPacket.h"
+#include "GeminiThread.h"
+#include "ReceiveStats.h"
+
+using namespace GeminiThreadNode;
+
+namespace
+{
+    struct Options
+    {
+        std::string ports = "51200";
+        int channels = 192;
+        int samples = 30;
+        double rate = 30000.0;
+        int shards = 1;
+        DatagramReceiver::Backend backend = DatagramReceiver::Backend::RECVMMSG;
+        double seconds = 60.0;
+        double interval = 10.0;
+        double loss = 0.0;
+        double reorder = 0.0;
+        double maxLossPpm = -1.0;
+        double maxP99Us = -1.0;
+        std::string capture;
+        int coalesceUs = 0;
+        int cpu = -1;
+        int rtPriority = 0;
+        bool lockMemory = false;
+        int rcvbufKb = 0;
+        std::string reference = "none";
+        double highpassHz = 0.0;
+        double lfpRate = 0.0;
+        double ttlHz = 0.0;
+        std::string channelMap = "ALL";
+    };
+
+    /** What the harness remembers between reports */
+    struct Snapshot
+    {
+        double elapsed = 0;
+        double pluginCpu = 0;
+        uint64_t samples = 0;
+        uint64_t lfpSamples = 0;
+        uint64_t packets = 0;
+        uint64_t lost = 0;
+        uint64_t latencyUs[Histogram::NUM_BUCKETS] = {};
+    };
+
+    std::atomic<bool> interrupted { false };
+
+    void onInterrupt(int)
+    {
+        interrupted.store(true);
+    }
+
+    bool parseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            const std::string name = argv[i];
+            const char* value = argv[i + 1];
+
+            if (name == "--ports")
+                options.ports = value;
+            else if (name == "--channels")
+                options.channels = atoi(value);
+            else if (name == "--samples")
+                options.samples = atoi(value);
+            else if (name == "--rate")
+                options.rate = atof(value);
+            else if (name == "--shards")
+                options.shards = atoi(value);
+            else if (name == "--backend" && std::string(value) == "io_uring")
+                options.backend = DatagramReceiver::Backend::IO_URING;
+            else if (name == "--backend" && std::string(value) == "recvmmsg")
+                options.backend = DatagramReceiver::Backend::RECVMMSG;
+            else if (name == "--seconds")
+                options.seconds = atof(value);
+            else if (name == "--hours")
+                options.seconds = atof(value) * 3600.0;
+            else if (name == "--interval")
+                options.interval = atof(value);
+            else if (name == "--loss")
+                options.loss = atof(value);
+            else if (name == "--reorder")
+                options.reorder = atof(value);
+            else if (name == "--max-loss-ppm")
+                options.maxLossPpm = atof(value);
+            else if (name == "--max-p99-us")
+                options.maxP99Us = atof(value);
+            else if (name == "--capture")
+                options.capture = value;
+            else if (name == "--coalesce")
+                options.coalesceUs = atoi(value);
+            else if (name == "--cpu")
+                options.cpu = atoi(value);
+            else if (name == "--rt-priority")
+                options.rtPriority = atoi(value);
+            else if (name == "--mlock")
+                options.lockMemory = atoi(value) != 0;
+            else if (name == "--rcvbuf-kb")
+                options.rcvbufKb = atoi(value);
+            else if (name == "--reference")
+                options.reference = value;
+            else if (name == "--highpass")
+                options.highpassHz = atof(value);
+            else if (name == "--lfp")
+                options.lfpRate = atof(value);
+            else if (name == "--ttl")
+                options.ttlHz = atof(value);
+            else if (name == "--channel-map")
+                options.channelMap = value;
+            else
+                return false;
+        }
+
+        return (argc % 2) == 1 && options.channels > 0 && options.samples > 0 && options.rate > 0
+            && options.seconds > 0 && options.interval > 0
+            && GeminiPacket::HEADER_SIZE + (size_t) options.channels * options.samples * 2 <= GeminiPacket::MAX_PACKET_SIZE;
+    }
+
+    double cpuSeconds(clockid_t clockId)
+    {
+        struct timespec now;
+        clock_gettime(clockId, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+    /**
+        Streams packets to one port at the nominal rate until 'stop' is set,
+        dropping and swapping packets with the given probabilities. Leaves the
+        CPU time it used in 'cpu'.
+    */
+    void sendPackets(const Options& options, int port, unsigned seed, const std::atomic<bool>& stop, std::atomic<double>& cpu)
+    {
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        struct sockaddr_in dest;
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        dest.sin_port = htons(port);
+
+        GeminiPacket::Header header;
+        header.version = GeminiPacket::VERSION;
+        header.sample_format = GeminiPacket::INT16;
+        header.num_channels = (uint16_t) options.channels;
+        header.num_samples = (uint16_t) options.samples;
+        header.flags = options.ttlHz > 0 ? GeminiPacket::FLAG_DIGITAL_INPUTS : 0;
+
+        std::vector<uint8_t> packet(GeminiPacket::HEADER_SIZE + GeminiPacket::payloadSize(header));
+        std::vector<uint8_t> held;
+
+        for (size_t i = GeminiPacket::HEADER_SIZE; i < packet.size(); i++)
+            packet[i] = (uint8_t) (i * 7);
+
+        uint8_t* words = packet.data() + GeminiPacket::HEADER_SIZE + GeminiPacket::samplesSize(header);
+
+        std::mt19937 generator(seed);
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+        const double packetPeriod = options.samples / options.rate;
+        const auto start = std::chrono::steady_clock::now();
+
+        for (uint64_t index = 0; !stop.load(std::memory_order_relaxed); index++)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(index * packetPeriod)));
+
+            header.packet_number = (uint32_t) index;
+            header.sample_number = index * options.samples;
+            GeminiPacket::writeHeader(header, packet.data());
+
+            for (int s = 0; options.ttlHz > 0 && s < options.samples; s++)
+            {
+                const uint16_t word = (uint16_t) (uint64_t) ((header.sample_number + s) * 2.0 * options.ttlHz / options.rate);
+
+                words[2 * s] = (uint8_t) word;
+                words[2 * s + 1] = (uint8_t) (word >> 8);
+            }
+
+            if (options.loss > 0 && chance(generator) < options.loss)
+                continue;
+
+            if (held.empty() && options.reorder > 0 && chance(generator) < options.reorder)
+            {
+                held = packet;
+                continue;
+            }
+
+            sendto(sockfd, packet.data(), packet.size(), 0, (const struct sockaddr*) &dest, sizeof(dest));
+
+            if (!held.empty())
+            {
+                sendto(sockfd, held.data(), held.size(), 0, (const struct sockaddr*) &dest, sizeof(dest));
+                held.clear();
+            }
+
+            cpu.store(cpuSeconds(CLOCK_THREAD_CPUTIME_ID), std::memory_order_relaxed);
+        }
+
+        close(sockfd);
+    }
+
+    Snapshot takeSnapshot(GeminiThread& thread, double elapsed, double pluginCpu)
+    {
+        Snapshot snapshot;
+        snapshot.elapsed = elapsed;
+        snapshot.pluginCpu = pluginCpu;
+
+        // the broadband buffers come first, one per device, then the LFP ones
+        const OwnedArray<DataBuffer>& buffers = thread.getSourceBuffers();
+
+        for (int i = 0; i < buffers.size(); i++)
+        {
+            if (i < thread.headstages.size())
+                snapshot.samples += buffers[i]->getTotalSamples();
+            else
+                snapshot.lfpSamples += buffers[i]->getTotalSamples();
+        }
+
+        for (auto device : thread.headstages)
+        {
+            const GeminiDevice::LiveStats live = device->getLiveStats();
+
+            snapshot.packets += live.packets;
+            snapshot.lost += live.lost;
+
+            for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+                snapshot.latencyUs[i] += live.latencyUs[i];
+        }
+
+        return snapshot;
+    }
+
+    /** Prints the change from 'previous' to 'current' */
+    void printReport(const char* label, const Options& options, int numDevices, const Snapshot& previous, const Snapshot& current)
+    {
+        const double elapsed = current.elapsed - previous.elapsed;
+
+        if (elapsed <= 0)
+            return;
+
+        uint64_t latencyUs[Histogram::NUM_BUCKETS];
+
+        for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+            latencyUs[i] = current.latencyUs[i] - previous.latencyUs[i];
+
+        const uint64_t packets = current.packets - previous.packets;
+        const uint64_t lost = current.lost - previous.lost;
+        const double samplesPerSecond = (current.samples - previous.samples) / elapsed / numDevices;
+        const double cores = (current.pluginCpu - previous.pluginCpu) / elapsed;
+
+        printf("%-8s %9.0f s %12.0f samples/s %7.3f %% of nominal %10llu lost %10.1f ppm   latency us p50 %6llu p99 %6llu p999 %6llu   cpu %5.3f cores %7.3f us/ch/s\n",
+            label, current.elapsed, samplesPerSecond, 100.0 * samplesPerSecond / options.rate,
+            (unsigned long long) lost, packets + lost > 0 ? 1e6 * lost / (double) (packets + lost) : 0.0,
+            (unsigned long long) Histogram::getPercentile(latencyUs, 0.5),
+            (unsigned long long) Histogram::getPercentile(latencyUs, 0.99),
+            (unsigned long long) Histogram::getPercentile(latencyUs, 0.999),
+            cores, 1e6 * cores / ((double) options.channels * numDevices));
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!parseOptions(argc, argv, options))
+    {
+        fprintf(stderr, "usage: %s [--ports N[,N...]] [--channels N] [--samples N] [--rate HZ] [--shards N]\n"
+            "    [--backend recvmmsg|io_uring] [--seconds S | --hours H] [--interval S]\n"
+            "    [--loss P] [--reorder P] [--max-loss-ppm X] [--max-p99-us X] [--capture DIR]\n"
+            "    [--coalesce US] [--cpu N] [--rt-priority N] [--mlock 0|1] [--rcvbuf-kb KB]\n"
+            "    [--reference none|mean|median] [--highpass HZ] [--lfp HZ] [--ttl HZ]\n"
+            "    [--channel-map LIST]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, onInterrupt);
+    signal(SIGTERM, onInterrupt);
+
+    GeminiThread thread(nullptr);
+
+    if (!thread.setPorts(options.ports))
+    {
+        fprintf(stderr, "invalid port list: %s\n", options.ports.c_str());
+        return 1;
+    }
+
+    thread.num_channels = options.channels;
+    thread.num_samp = options.samples;
+    thread.digital_inputs = options.ttlHz > 0;
+    thread.sample_rate = (float) options.rate;
+    thread.receive_backend = options.backend;
+    thread.handleConfigMessage("SHARDS " + String(options.shards));
+
+    if (!options.capture.empty())
+        thread.handleConfigMessage("CAPTURE " + String(options.capture));
+
+    thread.handleConfigMessage("COALESCE " + String(options.coalesceUs));
+    thread.handleConfigMessage("AFFINITY " + String(options.cpu));
+    thread.handleConfigMessage("RT_PRIORITY " + String(options.rtPriority));
+    thread.handleConfigMessage("MLOCK " + String(options.lockMemory ? 1 : 0));
+    thread.handleConfigMessage("RCVBUF " + String(options.rcvbufKb));
+    thread.handleConfigMessage("PREPROCESS " + String(options.reference) + " " + String(options.highpassHz));
+    thread.handleConfigMessage("LFP " + String(options.lfpRate));
+
+    if (!thread.setChannelMap(options.channelMap))
+    {
+        fprintf(stderr, "invalid channel map: %s\n", options.channelMap.c_str());
+        return 1;
+    }
+
+    if (!thread.connectSocket())
+        return 1;
+
+    OwnedArray<ContinuousChannel> continuousChannels;
+    OwnedArray<EventChannel> eventChannels;
+    OwnedArray<SpikeChannel> spikeChannels;
+    OwnedArray<DataStream> sourceStreams;
+    OwnedArray<DeviceInfo> devices;
+    OwnedArray<ConfigurationObject> configurationObjects;
+
+    thread.updateSettings(&continuousChannels, &eventChannels, &spikeChannels, &sourceStreams, &devices, &configurationObjects);
+
+    const int numDevices = thread.headstages.size();
+    int publishedChannels = 0;
+
+    for (auto device : thread.headstages)
+        publishedChannels += device->getNumOutputs();
+
+    printf("%d device(s) x %d channels x %d samples per packet at %.0f Hz, %d shard(s), %s, %.0f s, %d channel(s) published\n",
+        numDevices, options.channels, options.samples, options.rate, options.shards,
+        DatagramReceiver::getName(options.backend), options.seconds, publishedChannels);
+    fflush(stdout);
+
+    if (!thread.startAcquisition())
+    {
+        fprintf(stderr, "startAcquisition() failed\n");
+        return 1;
+    }
+
+    std::atomic<bool> stopSending { false };
+    std::vector<std::atomic<double>> senderCpu(numDevices);
+    std::vector<std::thread> senders;
+
+    for (int i = 0; i < numDevices; i++)
+    {
+        senderCpu[i].store(0.0);
+        senders.emplace_back(sendPackets, std::cref(options), thread.headstages[i]->getPort(), (unsigned) (i + 1),
+            std::cref(stopSending), std::ref(senderCpu[i]));
+    }
+
+    auto pluginCpu = [&]() {
+        double senders = 0;
+
+        for (auto& cpu : senderCpu)
+            senders += cpu.load(std::memory_order_relaxed);
+
+        return cpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - senders;
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    auto secondsSince = [&start]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    const Snapshot first = takeSnapshot(thread, 0.0, pluginCpu());
+    Snapshot previous = first;
+    bool failed = false;
+
+    while (!interrupted.load() && secondsSince() < options.seconds)
+    {
+        const double nextReport = std::min(previous.elapsed + options.interval, options.seconds);
+
+        while (!interrupted.load() && secondsSince() < nextReport && thread.isThreadRunning())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+
+        if (!thread.isThreadRunning())
+        {
+            fprintf(stderr, "acquisition thread stopped: updateBuffer() failed\n");
+            failed = true;
+            break;
+        }
+
+        const Snapshot current = takeSnapshot(thread, secondsSince(), pluginCpu());
+        printReport("interval", options, numDevices, previous, current);
+        previous = current;
+    }
+
+    const double sendingSeconds = secondsSince();
+    stopSending.store(true);
+
+    for (auto& sender : senders)
+        sender.join();
+
+    // let the reorder window and rings drain before stopping
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const Snapshot last = takeSnapshot(thread, sendingSeconds, pluginCpu());
+    printReport("total", options, numDevices, first, last);
+
+    if (last.lfpSamples > 0)
+    {
+        printf("lfp %.1f samples/s per device\n%s\n", (last.lfpSamples - first.lfpSamples) / (last.elapsed - first.elapsed) / numDevices,
+            thread.handleConfigMessage("LFP_STATUS").toRawUTF8());
+    }
+
+    if (options.ttlHz > 0)
+        printf("ttl %d event channel(s)\n%s\n", eventChannels.size(), thread.handleConfigMessage("TTL_STATUS").toRawUTF8());
+
+    uint64_t discontinuities = 0;
+    uint64_t reversals = 0;
+
+    for (auto buffer : thread.getSourceBuffers())
+    {
+        discontinuities += buffer->getDiscontinuities();
+        reversals += buffer->getTimestampReversals();
+    }
+
+    printf("sample number discontinuities %llu, timestamp reversals %llu\n",
+        (unsigned long long) discontinuities, (unsigned long long) reversals);
+    printf("%s\n", thread.getStatsJson().c_str());
+    printf("%s\n", thread.handleConfigMessage("RT_STATUS").toRawUTF8());
+
+    thread.stopAcquisition();
+    thread.disconnectSocket();
+
+    const double lossPpm = last.packets + last.lost > 0 ? 1e6 * last.lost / (double) (last.packets + last.lost) : 0.0;
+    const uint64_t p99 = Histogram::getPercentile(last.latencyUs, 0.99);
+
+    if (options.maxLossPpm >= 0 && lossPpm > options.maxLossPpm)
+    {
+        printf("FAIL: loss %.1f ppm exceeds %.1f ppm\n", lossPpm, options.maxLossPpm);
+        failed = true;
+    }
+
+    if (options.maxP99Us >= 0 && p99 > options.maxP99Us)
+    {
+        printf("FAIL: p99 latency %llu us exceeds %.0f us\n", (unsigned long long) p99, options.maxP99Us);
+        failed = true;
+    }
+
+    if (discontinuities > 0 || reversals > 0)
+    {
+        printf("FAIL: published sample numbers or timestamps were not continuous\n");
+        failed = true;
+    }
+
+    if (!failed)
+        printf("PASS\n");
+
+    return failed ? 2 : 0;
+}